@@ -92,6 +92,9 @@ libarchive_src_files := libarchive/archive_acl.c \
 						libarchive/archive_read_support_format_zip.c \
 						libarchive/archive_string.c \
 						libarchive/archive_string_sprintf.c \
+						libarchive/archive_tar_index.c \
+						libarchive/archive_tempfile.c \
+						libarchive/archive_thread_pool.c \
 						libarchive/archive_util.c \
 						libarchive/archive_virtual.c \
 						libarchive/archive_write.c \
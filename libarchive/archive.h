@@ -548,6 +548,16 @@ __LA_DECL int archive_read_next_header(struct archive *,
 __LA_DECL int archive_read_next_header2(struct archive *,
 		     struct archive_entry *);
 
+/*
+ * Position the reader so that the next archive_read_next_header()
+ * returns the named entry, using the format's own index instead of
+ * walking every header.  Returns ARCHIVE_FAILED if the format has no
+ * index or the entry does not exist.  Currently supported by the
+ * seekable Zip, 7-Zip and ISO9660 readers, and by the tar reader when
+ * it has been given an index with the "index" option.
+ */
+__LA_DECL int archive_read_seek_entry(struct archive *, const char *);
+
 /*
  * Retrieve the byte offset in UNCOMPRESSED data where last-read
  * header started.
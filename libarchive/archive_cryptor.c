@@ -140,14 +140,14 @@ aes_ctr_init(archive_crypto_ctx *ctx, const uint8_t *key, size_t key_len)
 	ctx->key_len = key_len;
 	memcpy(ctx->key, key, key_len);
 	memset(ctx->nonce, 0, sizeof(ctx->nonce));
-	ctx->encr_pos = AES_BLOCK_SIZE;
+	ctx->encr_pos = sizeof(ctx->encr_buf);
 	r = CCCryptorCreateWithMode(kCCEncrypt, kCCModeECB, kCCAlgorithmAES,
 	    ccNoPadding, NULL, key, key_len, NULL, 0, 0, 0, &ctx->ctx);
 	return (r == kCCSuccess)? 0: -1;
 }
 
 static int
-aes_ctr_encrypt_counter(archive_crypto_ctx *ctx)
+aes_ctr_encrypt_counters(archive_crypto_ctx *ctx)
 {
 	CCCryptorRef ref = ctx->ctx;
 	CCCryptorStatus r;
@@ -155,8 +155,8 @@ aes_ctr_encrypt_counter(archive_crypto_ctx *ctx)
 	r = CCCryptorReset(ref, NULL);
 	if (r != kCCSuccess)
 		return -1;
-	r = CCCryptorUpdate(ref, ctx->nonce, AES_BLOCK_SIZE, ctx->encr_buf,
-	    AES_BLOCK_SIZE, NULL);
+	r = CCCryptorUpdate(ref, ctx->ctr_buf, sizeof(ctx->ctr_buf),
+	    ctx->encr_buf, sizeof(ctx->encr_buf), NULL);
 	return (r == kCCSuccess)? 0: -1;
 }
 
@@ -236,20 +236,20 @@ aes_ctr_init(archive_crypto_ctx *ctx, const uint8_t *key, size_t key_len)
 	ctx->hKey = hKey;
 	ctx->keyObj = keyObj;
 	ctx->keyObj_len = keyObj_len;
-	ctx->encr_pos = AES_BLOCK_SIZE;
+	ctx->encr_pos = sizeof(ctx->encr_buf);
 
 	return 0;
 }
 
 static int
-aes_ctr_encrypt_counter(archive_crypto_ctx *ctx)
+aes_ctr_encrypt_counters(archive_crypto_ctx *ctx)
 {
 	NTSTATUS status;
 	ULONG result;
 
-	status = BCryptEncrypt(ctx->hKey, (PUCHAR)ctx->nonce, AES_BLOCK_SIZE,
-		NULL, NULL, 0, (PUCHAR)ctx->encr_buf, AES_BLOCK_SIZE,
-		&result, 0);
+	status = BCryptEncrypt(ctx->hKey, (PUCHAR)ctx->ctr_buf,
+		sizeof(ctx->ctr_buf), NULL, NULL, 0, (PUCHAR)ctx->encr_buf,
+		sizeof(ctx->encr_buf), &result, 0);
 	return BCRYPT_SUCCESS(status) ? 0 : -1;
 }
 
@@ -277,16 +277,18 @@ aes_ctr_init(archive_crypto_ctx *ctx, const uint8_t *key, size_t key_len)
 	ctx->key_len = key_len;
 	memcpy(ctx->key, key, key_len);
 	memset(ctx->nonce, 0, sizeof(ctx->nonce));
-	ctx->encr_pos = AES_BLOCK_SIZE;
+	ctx->encr_pos = sizeof(ctx->encr_buf);
+	/* The key schedule only depends on the key; expand it once. */
 	memset(&ctx->ctx, 0, sizeof(ctx->ctx));
+	aes_set_encrypt_key(&ctx->ctx, ctx->key_len, ctx->key);
 	return 0;
 }
 
 static int
-aes_ctr_encrypt_counter(archive_crypto_ctx *ctx)
+aes_ctr_encrypt_counters(archive_crypto_ctx *ctx)
 {
-	aes_set_encrypt_key(&ctx->ctx, ctx->key_len, ctx->key);
-	aes_encrypt(&ctx->ctx, AES_BLOCK_SIZE, ctx->encr_buf, ctx->nonce);
+	aes_encrypt(&ctx->ctx, sizeof(ctx->ctr_buf), ctx->encr_buf,
+	    ctx->ctr_buf);
 	return 0;
 }
 
@@ -313,23 +315,26 @@ aes_ctr_init(archive_crypto_ctx *ctx, const uint8_t *key, size_t key_len)
 	ctx->key_len = key_len;
 	memcpy(ctx->key, key, key_len);
 	memset(ctx->nonce, 0, sizeof(ctx->nonce));
-	ctx->encr_pos = AES_BLOCK_SIZE;
+	ctx->encr_pos = sizeof(ctx->encr_buf);
 	EVP_CIPHER_CTX_init(&ctx->ctx);
+	/* ECB keeps no chaining state, so one initialization serves
+	 * every counter block. */
+	if (EVP_EncryptInit_ex(&ctx->ctx, ctx->type, NULL, ctx->key,
+	    NULL) == 0)
+		return -1;
+	EVP_CIPHER_CTX_set_padding(&ctx->ctx, 0);
 	return 0;
 }
 
 static int
-aes_ctr_encrypt_counter(archive_crypto_ctx *ctx)
+aes_ctr_encrypt_counters(archive_crypto_ctx *ctx)
 {
 	int outl = 0;
 	int r;
 
-	r = EVP_EncryptInit_ex(&ctx->ctx, ctx->type, NULL, ctx->key, NULL);
-	if (r == 0)
-		return -1;
-	r = EVP_EncryptUpdate(&ctx->ctx, ctx->encr_buf, &outl, ctx->nonce,
-	    AES_BLOCK_SIZE);
-	if (r == 0 || outl != AES_BLOCK_SIZE)
+	r = EVP_EncryptUpdate(&ctx->ctx, ctx->encr_buf, &outl, ctx->ctr_buf,
+	    sizeof(ctx->ctr_buf));
+	if (r == 0 || outl != (int)sizeof(ctx->encr_buf))
 		return -1;
 	return 0;
 }
@@ -357,7 +362,7 @@ aes_ctr_init(archive_crypto_ctx *ctx, const uint8_t *key, size_t key_len)
 }
 
 static int
-aes_ctr_encrypt_counter(archive_crypto_ctx *ctx)
+aes_ctr_encrypt_counters(archive_crypto_ctx *ctx)
 {
 	(void)ctx; /* UNUSED */
 	return -1;
@@ -382,7 +387,7 @@ aes_ctr_update(archive_crypto_ctx *ctx, const uint8_t * const in,
 	(void)in_len; /* UNUSED */
 	(void)out; /* UNUSED */
 	(void)out_len; /* UNUSED */
-	aes_ctr_encrypt_counter(ctx); /* UNUSED */ /* Fix unused function warning */
+	aes_ctr_encrypt_counters(ctx); /* UNUSED */ /* Fix unused function warning */
 	return -1;
 }
 
@@ -399,34 +404,43 @@ aes_ctr_increase_counter(archive_crypto_ctx *ctx)
 	}
 }
 
+/*
+ * Produce the key stream for the next AES_CTR_BATCH_BLOCKS counter
+ * values with a single call into the crypto library.
+ */
+static int
+aes_ctr_fill_keystream(archive_crypto_ctx *ctx)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(ctx->ctr_buf); i += AES_BLOCK_SIZE) {
+		aes_ctr_increase_counter(ctx);
+		memcpy(ctx->ctr_buf + i, ctx->nonce, AES_BLOCK_SIZE);
+	}
+	return aes_ctr_encrypt_counters(ctx);
+}
+
 static int
 aes_ctr_update(archive_crypto_ctx *ctx, const uint8_t * const in,
     size_t in_len, uint8_t * const out, size_t *out_len)
 {
-	uint8_t *const ebuf = ctx->encr_buf;
+	const uint8_t *const ebuf = ctx->encr_buf;
 	unsigned pos = ctx->encr_pos;
 	unsigned max = (unsigned)((in_len < *out_len)? in_len: *out_len);
-	unsigned i;
+	unsigned i, j, n;
 
-	for (i = 0; i < max; ) {
-		if (pos == AES_BLOCK_SIZE) {
-			aes_ctr_increase_counter(ctx);
-			if (aes_ctr_encrypt_counter(ctx) != 0)
+	for (i = 0; i < max; i += n) {
+		if (pos == sizeof(ctx->encr_buf)) {
+			if (aes_ctr_fill_keystream(ctx) != 0)
 				return -1;
-			while (max -i >= AES_BLOCK_SIZE) {
-				for (pos = 0; pos < AES_BLOCK_SIZE; pos++)
-					out[i+pos] = in[i+pos] ^ ebuf[pos];
-				i += AES_BLOCK_SIZE;
-				aes_ctr_increase_counter(ctx);
-				if (aes_ctr_encrypt_counter(ctx) != 0)
-					return -1;
-			}
 			pos = 0;
-			if (i >= max)
-				break;
 		}
-		out[i] = in[i] ^ ebuf[pos++];
-		i++;
+		n = (unsigned)sizeof(ctx->encr_buf) - pos;
+		if (n > max - i)
+			n = max - i;
+		for (j = 0; j < n; j++)
+			out[i + j] = in[i + j] ^ ebuf[pos + j];
+		pos += n;
 	}
 	ctx->encr_pos = pos;
 	*out_len = i;
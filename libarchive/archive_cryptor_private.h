@@ -41,6 +41,13 @@
  */
 int __libarchive_cryptor_build_hack(void);
 
+/*
+ * Number of counter blocks encrypted per call into the crypto library.
+ * Handing the library several blocks at once lets it pipeline them
+ * (AES-NI and friends) instead of paying a call per 16 bytes.
+ */
+#define AES_CTR_BATCH_BLOCKS	16
+
 #ifdef __APPLE__
 # include <AvailabilityMacros.h>
 # if MAC_OS_X_VERSION_MAX_ALLOWED >= 1080
@@ -59,7 +66,8 @@ typedef struct {
 	uint8_t		key[AES_MAX_KEY_SIZE];
 	unsigned	key_len;
 	uint8_t		nonce[AES_BLOCK_SIZE];
-	uint8_t		encr_buf[AES_BLOCK_SIZE];
+	uint8_t		ctr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
+	uint8_t		encr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
 	unsigned	encr_pos;
 } archive_crypto_ctx;
 
@@ -79,7 +87,8 @@ typedef struct {
 	PBYTE		keyObj;
 	DWORD		keyObj_len;
 	uint8_t		nonce[AES_BLOCK_SIZE];
-	uint8_t		encr_buf[AES_BLOCK_SIZE];
+	uint8_t		ctr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
+	uint8_t		encr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
 	unsigned	encr_pos;
 } archive_crypto_ctx;
 
@@ -94,7 +103,8 @@ typedef struct {
 	uint8_t		key[AES_MAX_KEY_SIZE];
 	unsigned	key_len;
 	uint8_t		nonce[AES_BLOCK_SIZE];
-	uint8_t		encr_buf[AES_BLOCK_SIZE];
+	uint8_t		ctr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
+	uint8_t		encr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
 	unsigned	encr_pos;
 } archive_crypto_ctx;
 
@@ -109,7 +119,8 @@ typedef struct {
 	uint8_t		key[AES_MAX_KEY_SIZE];
 	unsigned	key_len;
 	uint8_t		nonce[AES_BLOCK_SIZE];
-	uint8_t		encr_buf[AES_BLOCK_SIZE];
+	uint8_t		ctr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
+	uint8_t		encr_buf[AES_BLOCK_SIZE * AES_CTR_BATCH_BLOCKS];
 	unsigned	encr_pos;
 } archive_crypto_ctx;
 
@@ -171,14 +171,72 @@ archive_entry_clear(struct archive_entry *entry)
 	return entry;
 }
 
+/*
+ * Empty a string without giving up its buffers.
+ */
+static void
+mstring_reset(struct archive_mstring *aes)
+{
+	archive_string_empty(&(aes->aes_mbs));
+	archive_string_empty(&(aes->aes_utf8));
+	archive_wstring_empty(&(aes->aes_wcs));
+	archive_string_empty(&(aes->aes_mbs_in_locale));
+	aes->aes_set = 0;
+}
+
+/*
+ * Like archive_entry_clear(), but the text fields keep the buffers
+ * they have already grown.  An entry that belongs to archive 'a'
+ * stays associated with it so that charset conversions reuse the
+ * archive's converters; any other entry is detached, as it would be
+ * by archive_entry_clear(), since its archive may already be gone.
+ * Readers reset the same entry before every header; with this,
+ * filling it in and converting its names does not touch the heap once
+ * the buffers are large enough.  The converted forms of each name are
+ * still cached only until the next reset.
+ */
+void
+__archive_entry_reset(struct archive_entry *entry, struct archive *a)
+{
+	void *st = entry->stat;
+	struct archive_mstring fflags_text = entry->ae_fflags_text;
+	struct archive_mstring gname = entry->ae_gname;
+	struct archive_mstring hardlink = entry->ae_hardlink;
+	struct archive_mstring pathname = entry->ae_pathname;
+	struct archive_mstring sourcepath = entry->ae_sourcepath;
+	struct archive_mstring symlink = entry->ae_symlink;
+	struct archive_mstring uname = entry->ae_uname;
+
+	archive_entry_copy_mac_metadata(entry, NULL, 0);
+	archive_acl_clear(&entry->acl);
+	archive_entry_xattr_clear(entry);
+	archive_entry_sparse_clear(entry);
+	if (entry->archive != a)
+		a = NULL;
+	memset(entry, 0, sizeof(*entry));
+
+	entry->archive = a;
+	entry->stat = st;	/* stat_valid is now 0. */
+	mstring_reset(&fflags_text);
+	entry->ae_fflags_text = fflags_text;
+	mstring_reset(&gname);
+	entry->ae_gname = gname;
+	mstring_reset(&hardlink);
+	entry->ae_hardlink = hardlink;
+	mstring_reset(&pathname);
+	entry->ae_pathname = pathname;
+	mstring_reset(&sourcepath);
+	entry->ae_sourcepath = sourcepath;
+	mstring_reset(&symlink);
+	entry->ae_symlink = symlink;
+	mstring_reset(&uname);
+	entry->ae_uname = uname;
+}
+
 struct archive_entry *
 archive_entry_clone(struct archive_entry *entry)
 {
 	struct archive_entry *entry2;
-	struct ae_xattr *xp;
-	struct ae_sparse *sp;
-	size_t s;
-	const void *p;
 
 	/* Allocate new structure and copy over all of the fields. */
 	/* TODO: Should we copy the archive over?  Or require a new archive
@@ -186,7 +244,27 @@ archive_entry_clone(struct archive_entry *entry)
 	entry2 = archive_entry_new2(entry->archive);
 	if (entry2 == NULL)
 		return (NULL);
+	__archive_entry_copy(entry2, entry);
+	return (entry2);
+}
+
+/*
+ * Copy all of the fields of 'entry' over those of 'entry2'.  Unlike
+ * archive_entry_clear() followed by a fresh copy, this keeps the
+ * string buffers 'entry2' already owns, so a writer can reuse one
+ * scratch entry for every header without allocating each time.
+ */
+void
+__archive_entry_copy(struct archive_entry *entry2,
+    struct archive_entry *entry)
+{
+	struct ae_xattr *xp;
+	struct ae_sparse *sp;
+	size_t s;
+	const void *p;
+
 	entry2->ae_stat = entry->ae_stat;
+	entry2->stat_valid = 0;
 	entry2->ae_fflags_set = entry->ae_fflags_set;
 	entry2->ae_fflags_clear = entry->ae_fflags_clear;
 
@@ -212,6 +290,7 @@ archive_entry_clone(struct archive_entry *entry)
 	archive_entry_copy_mac_metadata(entry2, p, s);
 
 	/* Copy xattr data over. */
+	archive_entry_xattr_clear(entry2);
 	xp = entry->xattr_head;
 	while (xp != NULL) {
 		archive_entry_xattr_add_entry(entry2,
@@ -220,14 +299,13 @@ archive_entry_clone(struct archive_entry *entry)
 	}
 
 	/* Copy sparse data over. */
+	archive_entry_sparse_clear(entry2);
 	sp = entry->sparse_head;
 	while (sp != NULL) {
 		archive_entry_sparse_add_entry(entry2,
 		    sp->offset, sp->length);
 		sp = sp->next;
 	}
-
-	return (entry2);
 }
 
 void
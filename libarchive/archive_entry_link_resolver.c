@@ -42,12 +42,15 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_entry_link_resolver.c 201100 200
 
 #include "archive.h"
 #include "archive_entry.h"
+#include "archive_private.h"
 
 /*
  * This is mostly a pretty straightforward hash table implementation.
- * The only interesting bit is the different strategies used to
- * match up links.  These strategies match those used by various
- * archiving formats:
+ * The table holds the entries themselves and is searched with linear
+ * probing, so that trees with millions of hardlinks do not need a
+ * separate allocation for each one.  The only interesting bit is the
+ * different strategies used to match up links.  These strategies
+ * match those used by various archiving formats:
  *   tar - content stored with first link, remainder refer back to it.
  *       This requires us to match each subsequent link up with the
  *       first appearance.
@@ -68,19 +71,21 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_entry_link_resolver.c 201100 200
 #define	links_cache_initial_size 1024
 
 struct links_entry {
-	struct links_entry	*next;
-	struct links_entry	*previous;
-	struct archive_entry	*canonical;
+	struct archive_entry	*canonical; /* NULL if the slot is empty */
 	struct archive_entry	*entry;
-	size_t			 hash;
+	int64_t			 ino;
+	dev_t			 dev;
 	unsigned int		 links; /* # links not yet seen */
 };
 
 struct archive_entry_linkresolver {
-	struct links_entry	**buckets;
-	struct links_entry	 *spare;
+	struct links_entry	 *buckets;
+	struct links_entry	  spare;
 	unsigned long		  number_entries;
 	size_t			  number_buckets;
+	/* Where next_entry() carries on looking. */
+	size_t			  next_bucket;
+	int			  next_mode;
 	int			  strategy;
 };
 
@@ -90,11 +95,14 @@ struct archive_entry_linkresolver {
 
 static struct links_entry *find_entry(struct archive_entry_linkresolver *,
 		    struct archive_entry *);
-static void grow_hash(struct archive_entry_linkresolver *);
+static void free_spare(struct archive_entry_linkresolver *);
+static size_t hash_links(dev_t, int64_t);
 static struct links_entry *insert_entry(struct archive_entry_linkresolver *,
 		    struct archive_entry *);
 static struct links_entry *next_entry(struct archive_entry_linkresolver *,
     int);
+static void remove_entry(struct archive_entry_linkresolver *, size_t);
+static void resize_hash(struct archive_entry_linkresolver *, size_t);
 
 struct archive_entry_linkresolver *
 archive_entry_linkresolver_new(void)
@@ -262,49 +270,42 @@ find_entry(struct archive_entry_linkresolver *res,
     struct archive_entry *entry)
 {
 	struct links_entry	*le;
-	size_t			 hash, bucket;
+	size_t			 bucket, mask;
 	dev_t			 dev;
 	int64_t			 ino;
 
 	/* Free a held entry. */
-	if (res->spare != NULL) {
-		archive_entry_free(res->spare->canonical);
-		archive_entry_free(res->spare->entry);
-		free(res->spare);
-		res->spare = NULL;
-	}
+	free_spare(res);
 
 	dev = archive_entry_dev(entry);
 	ino = archive_entry_ino64(entry);
-	hash = (size_t)(dev ^ ino);
 
 	/* Try to locate this entry in the links cache. */
-	bucket = hash & (res->number_buckets - 1);
-	for (le = res->buckets[bucket]; le != NULL; le = le->next) {
-		if (le->hash == hash
-		    && dev == archive_entry_dev(le->canonical)
-		    && ino == archive_entry_ino64(le->canonical)) {
-			/*
-			 * Decrement link count each time and release
-			 * the entry if it hits zero.  This saves
-			 * memory and is necessary for detecting
-			 * missed links.
-			 */
-			--le->links;
-			if (le->links > 0)
-				return (le);
-			/* Remove it from this hash bucket. */
-			if (le->previous != NULL)
-				le->previous->next = le->next;
-			if (le->next != NULL)
-				le->next->previous = le->previous;
-			if (res->buckets[bucket] == le)
-				res->buckets[bucket] = le->next;
-			res->number_entries--;
-			/* Defer freeing this entry. */
-			res->spare = le;
+	mask = res->number_buckets - 1;
+	for (bucket = hash_links(dev, ino) & mask;
+	    res->buckets[bucket].canonical != NULL;
+	    bucket = (bucket + 1) & mask) {
+		le = &res->buckets[bucket];
+		if (le->dev != dev || le->ino != ino)
+			continue;
+		/*
+		 * Decrement link count each time and release
+		 * the entry if it hits zero.  This saves
+		 * memory and is necessary for detecting
+		 * missed links.
+		 */
+		--le->links;
+		if (le->links > 0)
 			return (le);
-		}
+		/* Remove it from the links cache, deferring freeing it. */
+		res->spare = *le;
+		remove_entry(res, bucket);
+		res->next_bucket = 0;
+		/* Give back the memory of link sets that are done with. */
+		if (res->number_buckets > links_cache_initial_size &&
+		    res->number_entries < res->number_buckets / 8)
+			resize_hash(res, res->number_buckets / 2);
+		return (&res->spare);
 	}
 	return (NULL);
 }
@@ -316,35 +317,37 @@ next_entry(struct archive_entry_linkresolver *res, int mode)
 	size_t			 bucket;
 
 	/* Free a held entry. */
-	if (res->spare != NULL) {
-		archive_entry_free(res->spare->canonical);
-		archive_entry_free(res->spare->entry);
-		free(res->spare);
-		res->spare = NULL;
+	free_spare(res);
+
+	/*
+	 * Carry on from where the last call left off, since callers
+	 * take entries out one after another until there are none.
+	 */
+	if (mode != res->next_mode) {
+		res->next_mode = mode;
+		res->next_bucket = 0;
 	}
 
-	/* Look for next non-empty bucket in the links cache. */
-	for (bucket = 0; bucket < res->number_buckets; bucket++) {
-		for (le = res->buckets[bucket]; le != NULL; le = le->next) {
-			if (le->entry != NULL &&
-			    (mode & NEXT_ENTRY_DEFERRED) == 0)
-				continue;
-			if (le->entry == NULL &&
-			    (mode & NEXT_ENTRY_PARTIAL) == 0)
-				continue;
-			/* Remove it from this hash bucket. */
-			if (le->next != NULL)
-				le->next->previous = le->previous;
-			if (le->previous != NULL)
-				le->previous->next = le->next;
-			else
-				res->buckets[bucket] = le->next;
-			res->number_entries--;
-			/* Defer freeing this entry. */
-			res->spare = le;
-			return (le);
-		}
+	/* Look for next wanted entry in the links cache. */
+	for (bucket = res->next_bucket; bucket < res->number_buckets;
+	    bucket++) {
+		le = &res->buckets[bucket];
+		if (le->canonical == NULL)
+			continue;
+		if (le->entry != NULL &&
+		    (mode & NEXT_ENTRY_DEFERRED) == 0)
+			continue;
+		if (le->entry == NULL &&
+		    (mode & NEXT_ENTRY_PARTIAL) == 0)
+			continue;
+		/* Remove it from the links cache, deferring freeing it. */
+		res->spare = *le;
+		remove_entry(res, bucket);
+		/* Another entry may have been moved into this bucket. */
+		res->next_bucket = bucket;
+		return (&res->spare);
 	}
+	res->next_bucket = bucket;
 	return (NULL);
 }
 
@@ -353,68 +356,125 @@ insert_entry(struct archive_entry_linkresolver *res,
     struct archive_entry *entry)
 {
 	struct links_entry *le;
-	size_t hash, bucket;
-
-	/* Add this entry to the links cache. */
-	le = calloc(1, sizeof(struct links_entry));
-	if (le == NULL)
-		return (NULL);
-	le->canonical = archive_entry_clone(entry);
+	struct archive_entry *canonical;
+	size_t bucket, mask;
 
 	/* If the links cache is getting too full, enlarge the hash table. */
-	if (res->number_entries > res->number_buckets * 2)
-		grow_hash(res);
+	if (res->number_entries >= res->number_buckets / 4 * 3)
+		resize_hash(res, res->number_buckets * 2);
+	/* There must always be an empty bucket to end a search. */
+	if (res->number_entries + 1 >= res->number_buckets)
+		return (NULL);
 
-	hash = (size_t)(archive_entry_dev(entry) ^ archive_entry_ino64(entry));
-	bucket = hash & (res->number_buckets - 1);
+	canonical = archive_entry_clone(entry);
+	if (canonical == NULL)
+		return (NULL);
 
-	/* If we could allocate the entry, record it. */
-	if (res->buckets[bucket] != NULL)
-		res->buckets[bucket]->previous = le;
-	res->number_entries++;
-	le->next = res->buckets[bucket];
-	le->previous = NULL;
-	res->buckets[bucket] = le;
-	le->hash = hash;
+	/* Add this entry to the links cache. */
+	mask = res->number_buckets - 1;
+	for (bucket = hash_links(archive_entry_dev(entry),
+	    archive_entry_ino64(entry)) & mask;
+	    res->buckets[bucket].canonical != NULL;
+	    bucket = (bucket + 1) & mask)
+		continue;
+	le = &res->buckets[bucket];
+	le->canonical = canonical;
+	le->entry = NULL;
+	le->dev = archive_entry_dev(entry);
+	le->ino = archive_entry_ino64(entry);
 	le->links = archive_entry_nlink(entry) - 1;
+	res->number_entries++;
+	res->next_bucket = 0;
 	return (le);
 }
 
+/*
+ * Empty a bucket, then move back any entries after it that would
+ * no longer be found past the empty bucket.
+ */
+static void
+remove_entry(struct archive_entry_linkresolver *res, size_t bucket)
+{
+	struct links_entry *le;
+	size_t mask, next, home;
+
+	mask = res->number_buckets - 1;
+	res->number_entries--;
+	next = bucket;
+	for (;;) {
+		res->buckets[bucket].canonical = NULL;
+		res->buckets[bucket].entry = NULL;
+		for (;;) {
+			next = (next + 1) & mask;
+			le = &res->buckets[next];
+			if (le->canonical == NULL)
+				return;
+			home = hash_links(le->dev, le->ino) & mask;
+			/* Move it unless it hashes to after the empty
+			 * bucket. */
+			if (((next - home) & mask) >= ((next - bucket) & mask))
+				break;
+		}
+		res->buckets[bucket] = *le;
+		bucket = next;
+	}
+}
+
 static void
-grow_hash(struct archive_entry_linkresolver *res)
+resize_hash(struct archive_entry_linkresolver *res, size_t new_size)
 {
-	struct links_entry *le, **new_buckets;
-	size_t new_size;
-	size_t i, bucket;
+	struct links_entry *new_buckets;
+	size_t i, bucket, mask;
 
-	/* Try to enlarge the bucket list. */
-	new_size = res->number_buckets * 2;
-	if (new_size < res->number_buckets)
+	if (new_size < res->number_entries + 1)
 		return;
-	new_buckets = calloc(new_size, sizeof(struct links_entry *));
-
+	new_buckets = calloc(new_size, sizeof(new_buckets[0]));
 	if (new_buckets == NULL)
 		return;
 
+	mask = new_size - 1;
 	for (i = 0; i < res->number_buckets; i++) {
-		while (res->buckets[i] != NULL) {
-			/* Remove entry from old bucket. */
-			le = res->buckets[i];
-			res->buckets[i] = le->next;
-
-			/* Add entry to new bucket. */
-			bucket = le->hash & (new_size - 1);
-
-			if (new_buckets[bucket] != NULL)
-				new_buckets[bucket]->previous = le;
-			le->next = new_buckets[bucket];
-			le->previous = NULL;
-			new_buckets[bucket] = le;
-		}
+		if (res->buckets[i].canonical == NULL)
+			continue;
+		for (bucket = hash_links(res->buckets[i].dev,
+		    res->buckets[i].ino) & mask;
+		    new_buckets[bucket].canonical != NULL;
+		    bucket = (bucket + 1) & mask)
+			continue;
+		new_buckets[bucket] = res->buckets[i];
 	}
 	free(res->buckets);
 	res->buckets = new_buckets;
 	res->number_buckets = new_size;
+	res->next_bucket = 0;
+}
+
+/*
+ * The table is indexed by the low bits of this, so mix in all the
+ * bits of the device and inode numbers.
+ */
+static size_t
+hash_links(dev_t dev, int64_t ino)
+{
+	uint64_t h;
+
+	h = (uint64_t)ino ^
+	    ((uint64_t)dev * ARCHIVE_LITERAL_ULL(0x9e3779b97f4a7c15));
+	h ^= h >> 33;
+	h *= ARCHIVE_LITERAL_ULL(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= ARCHIVE_LITERAL_ULL(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return ((size_t)h);
+}
+
+static void
+free_spare(struct archive_entry_linkresolver *res)
+{
+	archive_entry_free(res->spare.canonical);
+	archive_entry_free(res->spare.entry);
+	res->spare.canonical = NULL;
+	res->spare.entry = NULL;
 }
 
 struct archive_entry *
@@ -424,14 +484,6 @@ archive_entry_partial_links(struct archive_entry_linkresolver *res,
 	struct archive_entry	*e;
 	struct links_entry	*le;
 
-	/* Free a held entry. */
-	if (res->spare != NULL) {
-		archive_entry_free(res->spare->canonical);
-		archive_entry_free(res->spare->entry);
-		free(res->spare);
-		res->spare = NULL;
-	}
-
 	le = next_entry(res, NEXT_ENTRY_PARTIAL);
 	if (le != NULL) {
 		e = le->canonical;
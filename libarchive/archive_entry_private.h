@@ -178,4 +178,9 @@ struct archive_entry {
 	char		 strmode[12];
 };
 
+/* Copy every field of the second entry into the first one. */
+void	__archive_entry_copy(struct archive_entry *, struct archive_entry *);
+/* Clear an entry for reuse by the given archive, keeping its buffers. */
+void	__archive_entry_reset(struct archive_entry *, struct archive *);
+
 #endif /* ARCHIVE_ENTRY_PRIVATE_H_INCLUDED */
@@ -83,6 +83,40 @@ struct id_array {
 	int64_t			*ids;
 };
 
+/*
+ * Exclusion patterns sorted out so that a pathname can be tested
+ * against a long list of them without trying each one in turn.
+ */
+struct match_name {
+	struct archive_rb_node	 node;
+	const char		*name;
+	size_t			 len;
+};
+
+struct match_pattern {
+	struct match_pattern	*next;
+	const char		*pattern;
+};
+
+struct match_set {
+	/* The number of exclusions this was built from. */
+	int			 count;
+	/* Patterns with no wildcards and no '/', which match a whole
+	 * path element. */
+	struct archive_rb_tree	 names;
+	/* The same following a leading '*', which match the end of
+	 * a path element; their lengths are kept in ascending order. */
+	struct archive_rb_tree	 suffixes;
+	size_t			*suffix_lens;
+	int			 suffix_len_count;
+	/* All other patterns, listed by the character a path element
+	 * has to start with for them to match; the last list holds
+	 * the patterns that can match anywhere. */
+	struct match_pattern	*patterns[257];
+	struct match_name	*name_nodes;
+	struct match_pattern	*pattern_nodes;
+};
+
 #define PATTERN_IS_SET		1
 #define TIME_IS_SET		2
 #define ID_IS_SET		4
@@ -98,6 +132,7 @@ struct archive_match {
 	 */
 	struct match_list	 exclusions;
 	struct match_list	 inclusions;
+	struct match_set	*exclusion_set;
 
 	/*
 	 * Matching time stamps.
@@ -165,6 +200,9 @@ static int	match_owner_name_mbs(struct archive_match *,
 static int	match_owner_name_wcs(struct archive_match *,
 		    struct match_list *, const wchar_t *);
 #endif
+static int	match_set_build(struct archive_match *);
+static int	match_set_excluded(struct match_set *, const char *);
+static void	match_set_free(struct match_set *);
 static int	match_path_exclusion(struct archive_match *,
 		    struct match *, int, const void *);
 static int	match_path_inclusion(struct archive_match *,
@@ -195,6 +233,14 @@ static const struct archive_rb_tree_ops rb_ops_wcs = {
 	cmp_node_wcs, cmp_key_wcs
 };
 
+static int	cmp_node_name(const struct archive_rb_node *,
+		    const struct archive_rb_node *);
+static int	cmp_key_name(const struct archive_rb_node *, const void *);
+
+static const struct archive_rb_tree_ops rb_ops_name = {
+	cmp_node_name, cmp_key_name
+};
+
 /*
  * The matching logic here needs to be re-thought.  I started out to
  * try to mimic gtar's matching logic, but it's not entirely
@@ -248,6 +294,7 @@ archive_match_free(struct archive *_a)
 	a = (struct archive_match *)_a;
 	match_list_free(&(a->inclusions));
 	match_list_free(&(a->exclusions));
+	match_set_free(a->exclusion_set);
 	entry_list_free(&(a->exclusion_entry_list));
 	free(a->inclusion_uids.ids);
 	free(a->inclusion_gids.ids);
@@ -710,11 +757,23 @@ path_excluded(struct archive_match *a, int mbs, const void *pathname)
 	}
 
 	/* Exclusions take priority */
-	for (match = a->exclusions.first; match != NULL;
-	    match = match->next){
-		r = match_path_exclusion(a, match, mbs, pathname);
-		if (r)
-			return (r);
+	if (mbs && pathname != NULL && a->exclusions.count > 0) {
+		if (a->exclusion_set == NULL ||
+		    a->exclusion_set->count != a->exclusions.count) {
+			r = match_set_build(a);
+			if (r < 0)
+				return (r);
+		}
+		if (match_set_excluded(a->exclusion_set,
+		    (const char *)pathname))
+			return (1);
+	} else {
+		for (match = a->exclusions.first; match != NULL;
+		    match = match->next){
+			r = match_path_exclusion(a, match, mbs, pathname);
+			if (r)
+				return (r);
+		}
 	}
 
 	/* It's not excluded and we found an inclusion above, so it's
@@ -773,6 +832,166 @@ match_path_exclusion(struct archive_match *a, struct match *m,
 	return (0);
 }
 
+/*
+ * Sort the exclusion patterns out into a match_set.
+ *
+ * Since exclusions are not anchored at either end, a pattern with no
+ * wildcards and no '/' matches exactly when it equals one of the path
+ * elements, and '*' followed by such a pattern matches exactly when
+ * a path element ends with it.  Those are looked up by name.  The
+ * others still go through archive_pathmatch(), but only when a path
+ * element starts with the character they start with.
+ */
+static int
+match_set_build(struct archive_match *a)
+{
+	struct match_set *set;
+	struct match *m;
+	struct match_name *mn;
+	struct match_pattern *mp;
+	const char *p, *q;
+	size_t len;
+	int i, j, r;
+
+	match_set_free(a->exclusion_set);
+	a->exclusion_set = set = calloc(1, sizeof(*set));
+	if (set == NULL)
+		return (error_nomem(a));
+	__archive_rb_tree_init(&(set->names), &rb_ops_name);
+	__archive_rb_tree_init(&(set->suffixes), &rb_ops_name);
+	set->name_nodes = calloc(a->exclusions.count,
+	    sizeof(*set->name_nodes));
+	set->pattern_nodes = calloc(a->exclusions.count,
+	    sizeof(*set->pattern_nodes));
+	set->suffix_lens = calloc(a->exclusions.count,
+	    sizeof(*set->suffix_lens));
+	if (set->name_nodes == NULL || set->pattern_nodes == NULL ||
+	    set->suffix_lens == NULL) {
+		match_set_free(set);
+		a->exclusion_set = NULL;
+		return (error_nomem(a));
+	}
+	mn = set->name_nodes;
+	mp = set->pattern_nodes;
+	for (m = a->exclusions.first; m != NULL; m = m->next) {
+		r = archive_mstring_get_mbs(&(a->archive), &(m->pattern), &p);
+		if (r != 0) {
+			if (errno == ENOMEM) {
+				match_set_free(set);
+				a->exclusion_set = NULL;
+				return (error_nomem(a));
+			}
+			/* This pattern never matches. */
+			continue;
+		}
+		q = p;
+		if (q != NULL)
+			while (*q == '*')
+				q++;
+		if (q != NULL && *q != '\0' && *q != '^' &&
+		    strcmp(q, ".") != 0 && strpbrk(q, "*?[\\/") == NULL &&
+		    q[strlen(q) - 1] != '$') {
+			mn->name = q;
+			mn->len = strlen(q);
+			if (q == p) {
+				__archive_rb_tree_insert_node(&(set->names),
+				    &(mn->node));
+			} else if (__archive_rb_tree_insert_node(
+			    &(set->suffixes), &(mn->node))) {
+				len = mn->len;
+				for (i = 0; i < set->suffix_len_count &&
+				    set->suffix_lens[i] < len; i++)
+					continue;
+				if (i == set->suffix_len_count ||
+				    set->suffix_lens[i] != len) {
+					for (j = set->suffix_len_count; j > i;
+					    j--)
+						set->suffix_lens[j] =
+						    set->suffix_lens[j - 1];
+					set->suffix_lens[i] = len;
+					set->suffix_len_count++;
+				}
+			}
+			mn++;
+			continue;
+		}
+		mp->pattern = p;
+		if (p == NULL || *p == '\0' || strchr("*?[\\^/$", *p) != NULL ||
+		    (p[0] == '.' && p[1] == '/'))
+			i = 256;
+		else
+			i = (unsigned char)*p;
+		mp->next = set->patterns[i];
+		set->patterns[i] = mp;
+		mp++;
+	}
+	set->count = a->exclusions.count;
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Test if a pathname is matched by any pattern in a match_set.
+ */
+static int
+match_set_excluded(struct match_set *set, const char *pn)
+{
+	const int flag = PATHMATCH_NO_ANCHOR_START | PATHMATCH_NO_ANCHOR_END;
+	struct match_name key;
+	struct match_pattern *mp;
+	const char *b, *e;
+	unsigned char first[256];
+	char seen[256];
+	int i, nfirst;
+
+	memset(seen, 0, sizeof(seen));
+	nfirst = 0;
+	for (b = pn; ; b = e + 1) {
+		e = strchr(b, '/');
+		if (e == NULL)
+			e = b + strlen(b);
+		key.name = b;
+		key.len = e - b;
+		if (key.len > 0) {
+			if (__archive_rb_tree_find_node(&(set->names), &key))
+				return (1);
+			for (i = 0; i < set->suffix_len_count &&
+			    set->suffix_lens[i] <= (size_t)(e - b); i++) {
+				key.len = set->suffix_lens[i];
+				key.name = e - key.len;
+				if (__archive_rb_tree_find_node(
+				    &(set->suffixes), &key))
+					return (1);
+			}
+		}
+		if (!seen[(unsigned char)*b]) {
+			seen[(unsigned char)*b] = 1;
+			first[nfirst++] = (unsigned char)*b;
+		}
+		if (*e == '\0')
+			break;
+	}
+	for (i = 0; i < nfirst; i++) {
+		for (mp = set->patterns[first[i]]; mp != NULL; mp = mp->next)
+			if (archive_pathmatch(mp->pattern, pn, flag))
+				return (1);
+	}
+	for (mp = set->patterns[256]; mp != NULL; mp = mp->next)
+		if (archive_pathmatch(mp->pattern, pn, flag))
+			return (1);
+	return (0);
+}
+
+static void
+match_set_free(struct match_set *set)
+{
+	if (set == NULL)
+		return;
+	free(set->name_nodes);
+	free(set->pattern_nodes);
+	free(set->suffix_lens);
+	free(set);
+}
+
 /*
  * Again, mimic gtar:  inclusions are always anchored (have to match
  * the beginning of the path) even though exclusions are not anchored.
@@ -1301,6 +1520,24 @@ cmp_key_mbs(const struct archive_rb_node *n, const void *key)
 	return (strcmp(p, (const char *)key));
 }
 
+static int
+cmp_node_name(const struct archive_rb_node *n1,
+    const struct archive_rb_node *n2)
+{
+	const struct match_name *m1 = (const struct match_name *)n1;
+	const struct match_name *m2 = (const struct match_name *)n2;
+
+	if (m1->len != m2->len)
+		return (m1->len < m2->len ? -1 : 1);
+	return (memcmp(m1->name, m2->name, m1->len));
+}
+
+static int
+cmp_key_name(const struct archive_rb_node *n, const void *key)
+{
+	return (cmp_node_name(n, (const struct archive_rb_node *)key));
+}
+
 static int
 cmp_node_wcs(const struct archive_rb_node *n1,
     const struct archive_rb_node *n2)
@@ -27,6 +27,9 @@
 #include "archive_platform.h"
 __FBSDID("$FreeBSD$");
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -36,6 +39,43 @@ __FBSDID("$FreeBSD$");
 
 #include "archive_pathmatch.h"
 
+/*
+ * For each '*' in a pattern, the earliest place in the string from
+ * which the rest of the pattern is known not to match anywhere.  A
+ * '*' can be reached many times while backtracking, but whether the
+ * rest matches at a given place does not depend on how it got there,
+ * so there is no need to try the same places again.  Otherwise
+ * patterns such as "*a*a*a*a*b" take exponential time.
+ *
+ * The table has room for every '*' in the pattern; only patterns
+ * with many of them need it allocated.
+ */
+#define PM_STARS	16
+struct pm_star {
+	const void	*p;
+	const void	*fail;
+};
+struct pm_state {
+	size_t		 count;
+	size_t		 size;
+	struct pm_star	*stars;
+};
+
+/*
+ * Whether a pattern can only start matching where its first character
+ * is.  A leading "./" is ignored, so it does not count.
+ */
+#define PM_LITERAL(p)	((p)[0] != '\0' && \
+	strchr("?*[\\/$^", (p)[0]) == NULL && \
+	((p)[0] != '.' || (p)[1] != '/'))
+#define PM_LITERAL_W(p)	((p)[0] != L'\0' && \
+	wcschr(L"?*[\\/$^", (p)[0]) == NULL && \
+	((p)[0] != L'.' || (p)[1] != L'/'))
+
+static int pathmatch(const char *, const char *, int, struct pm_state *);
+static int pathmatch_w(const wchar_t *, const wchar_t *, int,
+    struct pm_state *);
+
 /*
  * Check whether a character 'c' is matched by a list specification [...]:
  *    * Leading '!' or '^' negates the class.
@@ -146,6 +186,24 @@ pm_list_w(const wchar_t *start, const wchar_t *end, const wchar_t c, int flags)
 	return (nomatch);
 }
 
+static const void **
+pm_star(struct pm_state *state, const void *p)
+{
+	size_t i;
+
+	for (i = 0; i < state->count; i++) {
+		if (state->stars[i].p == p)
+			return (&state->stars[i].fail);
+	}
+	/* No table; this one will be tried everywhere. */
+	if (i == state->size)
+		return (NULL);
+	state->stars[i].p = p;
+	state->stars[i].fail = NULL;
+	state->count++;
+	return (&state->stars[i].fail);
+}
+
 /*
  * If s is pointing to "./", ".//", "./././" or the like, skip it.
  */
@@ -168,9 +226,10 @@ pm_slashskip_w(const wchar_t *s) {
 }
 
 static int
-pm(const char *p, const char *s, int flags)
+pm(const char *p, const char *s, int flags, struct pm_state *state)
 {
-	const char *end;
+	const char *end, *start;
+	const void **fail;
 
 	/*
 	 * Ignore leading './', './/', '././', etc.
@@ -202,13 +261,26 @@ pm(const char *p, const char *s, int flags)
 			/* Trailing '*' always succeeds. */
 			if (*p == '\0')
 				return (1);
-			while (*s) {
-				if (archive_pathmatch(p, s, flags))
+			fail = pm_star(state, p);
+			start = s;
+			while (*s && (fail == NULL || *fail == NULL ||
+			    (const void *)s < *fail)) {
+				/* Skip to where the rest can start matching. */
+				if (PM_LITERAL(p) &&
+				    (s = strchr(s, *p)) == NULL)
+					break;
+				if (pathmatch(p, s, flags, state))
 					return (1);
 				++s;
 			}
+			if (fail != NULL &&
+			    (*fail == NULL || (const void *)start < *fail))
+				*fail = start;
 			return (0);
 		case '[':
+			/* [...] never matches the end of 's' */
+			if (*s == '\0')
+				return (0);
 			/*
 			 * Find the end of the [...] character class,
 			 * ignoring \] that might occur within the class.
@@ -273,9 +345,10 @@ pm(const char *p, const char *s, int flags)
 }
 
 static int
-pm_w(const wchar_t *p, const wchar_t *s, int flags)
+pm_w(const wchar_t *p, const wchar_t *s, int flags, struct pm_state *state)
 {
-	const wchar_t *end;
+	const wchar_t *end, *start;
+	const void **fail;
 
 	/*
 	 * Ignore leading './', './/', '././', etc.
@@ -307,13 +380,26 @@ pm_w(const wchar_t *p, const wchar_t *s, int flags)
 			/* Trailing '*' always succeeds. */
 			if (*p == L'\0')
 				return (1);
-			while (*s) {
-				if (archive_pathmatch_w(p, s, flags))
+			fail = pm_star(state, p);
+			start = s;
+			while (*s && (fail == NULL || *fail == NULL ||
+			    (const void *)s < *fail)) {
+				/* Skip to where the rest can start matching. */
+				if (PM_LITERAL_W(p) &&
+				    (s = wcschr(s, *p)) == NULL)
+					break;
+				if (pathmatch_w(p, s, flags, state))
 					return (1);
 				++s;
 			}
+			if (fail != NULL &&
+			    (*fail == NULL || (const void *)start < *fail))
+				*fail = start;
 			return (0);
 		case L'[':
+			/* [...] never matches the end of 's' */
+			if (*s == L'\0')
+				return (0);
 			/*
 			 * Find the end of the [...] character class,
 			 * ignoring \] that might occur within the class.
@@ -378,8 +464,8 @@ pm_w(const wchar_t *p, const wchar_t *s, int flags)
 }
 
 /* Main entry point. */
-int
-__archive_pathmatch(const char *p, const char *s, int flags)
+static int
+pathmatch(const char *p, const char *s, int flags, struct pm_state *state)
 {
 	/* Empty pattern only matches the empty string. */
 	if (p == NULL || *p == '\0')
@@ -400,7 +486,7 @@ __archive_pathmatch(const char *p, const char *s, int flags)
 			++p;
 		while (*s == '/')
 			++s;
-		return (pm(p, s, flags));
+		return (pm(p, s, flags, state));
 	}
 
 	/* If start is unanchored, try to match start of each path element. */
@@ -408,18 +494,43 @@ __archive_pathmatch(const char *p, const char *s, int flags)
 		for ( ; s != NULL; s = strchr(s, '/')) {
 			if (*s == '/')
 				s++;
-			if (pm(p, s, flags))
+			if (pm(p, s, flags, state))
 				return (1);
 		}
 		return (0);
 	}
 
 	/* Default: Match from beginning. */
-	return (pm(p, s, flags));
+	return (pm(p, s, flags, state));
 }
 
 int
-__archive_pathmatch_w(const wchar_t *p, const wchar_t *s, int flags)
+__archive_pathmatch(const char *p, const char *s, int flags)
+{
+	struct pm_star stars[PM_STARS];
+	struct pm_state state;
+	const char *q;
+	size_t n;
+	int r;
+
+	n = 0;
+	if (p != NULL)
+		for (q = p; (q = strchr(q, '*')) != NULL; q++)
+			n++;
+	state.count = 0;
+	state.size = n;
+	state.stars = stars;
+	if (n > PM_STARS &&
+	    (state.stars = malloc(n * sizeof(*state.stars))) == NULL)
+		state.size = 0;
+	r = pathmatch(p, s, flags, &state);
+	if (state.stars != stars)
+		free(state.stars);
+	return (r);
+}
+
+static int
+pathmatch_w(const wchar_t *p, const wchar_t *s, int flags, struct pm_state *state)
 {
 	/* Empty pattern only matches the empty string. */
 	if (p == NULL || *p == L'\0')
@@ -440,7 +551,7 @@ __archive_pathmatch_w(const wchar_t *p, const wchar_t *s, int flags)
 			++p;
 		while (*s == L'/')
 			++s;
-		return (pm_w(p, s, flags));
+		return (pm_w(p, s, flags, state));
 	}
 
 	/* If start is unanchored, try to match start of each path element. */
@@ -448,12 +559,37 @@ __archive_pathmatch_w(const wchar_t *p, const wchar_t *s, int flags)
 		for ( ; s != NULL; s = wcschr(s, L'/')) {
 			if (*s == L'/')
 				s++;
-			if (pm_w(p, s, flags))
+			if (pm_w(p, s, flags, state))
 				return (1);
 		}
 		return (0);
 	}
 
 	/* Default: Match from beginning. */
-	return (pm_w(p, s, flags));
+	return (pm_w(p, s, flags, state));
+}
+
+int
+__archive_pathmatch_w(const wchar_t *p, const wchar_t *s, int flags)
+{
+	struct pm_star stars[PM_STARS];
+	struct pm_state state;
+	const wchar_t *q;
+	size_t n;
+	int r;
+
+	n = 0;
+	if (p != NULL)
+		for (q = p; (q = wcschr(q, L'*')) != NULL; q++)
+			n++;
+	state.count = 0;
+	state.size = n;
+	state.stars = stars;
+	if (n > PM_STARS &&
+	    (state.stars = malloc(n * sizeof(*state.stars))) == NULL)
+		state.size = 0;
+	r = pathmatch_w(p, s, flags, &state);
+	if (state.stars != stars)
+		free(state.stars);
+	return (r);
 }
@@ -50,6 +50,7 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_read.c 201157 2009-12-29 05:30:2
 
 #include "archive.h"
 #include "archive_entry.h"
+#include "archive_entry_private.h"
 #include "archive_private.h"
 #include "archive_read_private.h"
 
@@ -624,7 +625,7 @@ _archive_read_next_header2(struct archive *_a, struct archive_entry *entry)
 	    ARCHIVE_STATE_HEADER | ARCHIVE_STATE_DATA,
 	    "archive_read_next_header");
 
-	archive_entry_clear(entry);
+	__archive_entry_reset(entry, _a);
 	archive_clear_error(&a->archive);
 
 	/*
@@ -960,6 +961,51 @@ archive_seek_data(struct archive *_a, int64_t offset, int whence)
 	return (a->format->seek_data)(a, offset, whence);
 }
 
+/*
+ * Position the reader so that the next call to archive_read_next_header()
+ * returns the entry named by pathname.  This is only possible for
+ * formats that keep an index of their entries (e.g. the seekable Zip
+ * reader with its central directory); other formats fail with
+ * ARCHIVE_FAILED and leave the read position untouched.
+ */
+int
+archive_read_seek_entry(struct archive *_a, const char *pathname)
+{
+	struct archive_read *a = (struct archive_read *)_a;
+	int r;
+
+	archive_check_magic(_a, ARCHIVE_READ_MAGIC,
+	    ARCHIVE_STATE_HEADER | ARCHIVE_STATE_DATA | ARCHIVE_STATE_EOF,
+	    "archive_read_seek_entry");
+
+	if (pathname == NULL) {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_PROGRAMMER,
+		    "Invalid pathname");
+		return (ARCHIVE_FAILED);
+	}
+	if (a->format->seek_entry == NULL) {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+		    "Format %s does not support seeking to an entry",
+		    a->format->name != NULL ? a->format->name : "(unknown)");
+		return (ARCHIVE_FAILED);
+	}
+
+	archive_clear_error(&a->archive);
+	r = (a->format->seek_entry)(a, pathname);
+	switch (r) {
+	case ARCHIVE_OK:
+	case ARCHIVE_WARN:
+		/* Pending entry data is abandoned, not skipped. */
+		a->archive.state = ARCHIVE_STATE_HEADER;
+		__archive_reset_read_data(&a->archive);
+		break;
+	case ARCHIVE_FATAL:
+		a->archive.state = ARCHIVE_STATE_FATAL;
+		break;
+	}
+	return (r);
+}
+
 /*
  * Read the next block of entry data from the archive.
  * This is a zero-copy interface; the client receives a pointer,
@@ -1187,7 +1233,8 @@ __archive_read_register_format(struct archive_read *a,
     int64_t (*seek_data)(struct archive_read *, int64_t, int),
     int (*cleanup)(struct archive_read *),
     int (*format_capabilities)(struct archive_read *),
-    int (*has_encrypted_entries)(struct archive_read *))
+    int (*has_encrypted_entries)(struct archive_read *),
+    int (*seek_entry)(struct archive_read *, const char *))
 {
 	int i, number_slots;
 
@@ -1212,6 +1259,7 @@ __archive_read_register_format(struct archive_read *a,
 			a->formats[i].name = name;
 			a->formats[i].format_capabilties = format_capabilities;
 			a->formats[i].has_encrypted_entries = has_encrypted_entries;
+			a->formats[i].seek_entry = seek_entry;
 			return (ARCHIVE_OK);
 		}
 	}
@@ -206,6 +206,7 @@ struct archive_read {
 		int	(*cleanup)(struct archive_read *);
 		int	(*format_capabilties)(struct archive_read *);
 		int	(*has_encrypted_entries)(struct archive_read *);
+		int	(*seek_entry)(struct archive_read *, const char *);
 	}	formats[16];
 	struct archive_format_descriptor	*format; /* Active format. */
 
@@ -238,7 +239,8 @@ int	__archive_read_register_format(struct archive_read *a,
 		int64_t (*seek_data)(struct archive_read *, int64_t, int),
 		int (*cleanup)(struct archive_read *),
 		int (*format_capabilities)(struct archive_read *),
-		int (*has_encrypted_entries)(struct archive_read *));
+		int (*has_encrypted_entries)(struct archive_read *),
+		int (*seek_entry)(struct archive_read *, const char *));
 
 int __archive_read_get_bidder(struct archive_read *a,
     struct archive_read_filter_bidder **bidder);
@@ -29,6 +29,9 @@ __FBSDID("$FreeBSD$");
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
@@ -49,6 +52,7 @@ __FBSDID("$FreeBSD$");
 #include "archive_private.h"
 #include "archive_read_private.h"
 #include "archive_endian.h"
+#include "archive_thread_pool_private.h"
 
 #ifndef HAVE_ZLIB_H
 #include "archive_crc32.h"
@@ -57,6 +61,8 @@ __FBSDID("$FreeBSD$");
 #define _7ZIP_SIGNATURE	"7z\xBC\xAF\x27\x1C"
 #define SFX_MIN_ADDR	0x27000
 #define SFX_MAX_ADDR	0x60000
+/* Default bound on packed plus decoded bytes held by folder jobs. */
+#define DEFAULT_THREADS_MEMLIMIT	(256 * 1024 * 1024)
 
 
 /*
@@ -139,8 +145,8 @@ struct _7z_folder {
 	uint32_t		 digest;
 	uint64_t		 numUnpackStreams;
 	uint32_t		 packIndex;
-	/* Unoperated bytes. */
-	uint64_t		 skipped_bytes;
+	/* Non-zero once the folder has been set up for decoding. */
+	unsigned char		 visited;
 };
 
 struct _7z_coders_info {
@@ -188,6 +194,8 @@ struct _7zip_entry {
 #endif
 	uint32_t		 folderIndex;
 	uint32_t		 ssIndex;
+	/* Offset of the contents in the output of the folder. */
+	uint64_t		 folderOffset;
 	unsigned		 flg;
 #define MTIME_IS_SET	(1<<0)
 #define ATIME_IS_SET	(1<<1)
@@ -205,6 +213,32 @@ struct _7zip_entry {
 	uint32_t		 attr;
 };
 
+/*
+ * A folder which is decoded as a whole on a worker thread.
+ * Only folders with a single pack stream and a decoder that does not
+ * need the state in struct _7zip are handled this way.
+ */
+struct _7z_folder_job {
+	struct archive_task	 task;
+	struct _7z_folder_job	*next;
+	unsigned		 folder_index;
+	const struct _7z_coder	*coder1;
+	const struct _7z_coder	*coder2;
+	unsigned char		*packed;
+	size_t			 packed_size;
+	unsigned char		*unpacked;
+	size_t			 unpacked_size;
+	/* Result of decoding. */
+	int			 error;
+	const char		*error_string;
+};
+
+/* An entry of the index used by archive_read_seek_entry(). */
+struct _7z_name_ref {
+	const char		*name;
+	size_t			 index;
+};
+
 struct _7zip {
 	/* Structural information about the archive. */
 	struct _7z_stream_info	 si;
@@ -225,6 +259,11 @@ struct _7zip {
 	struct _7zip_entry	*entries;
 	struct _7zip_entry	*entry;
 	unsigned char		*entry_names;
+	/* Set when seek_entry chose the entry read_header returns next. */
+	int			 entry_pending;
+	/* Converted names sorted for seek_entry. */
+	struct _7z_name_ref	*names_index;
+	struct archive_string	 names;
 
 	/* entry_bytes_remaining is the number of bytes we expect. */
 	int64_t			 entry_offset;
@@ -249,7 +288,10 @@ struct _7zip {
 	/*
 	 * Decompressing control data.
 	 */
-	unsigned		 folder_index;
+	/* The folder being decoded, and the offset in its output of
+	 * the next byte read_stream() returns. */
+	unsigned		 cur_folder;
+	uint64_t		 cur_folder_offset;
 	uint64_t		 folder_outbytes_remaining;
 	unsigned		 pack_stream_index;
 	unsigned		 pack_stream_remaining;
@@ -330,6 +372,24 @@ struct _7zip {
 
 	/* Custom value that is non-zero if this archive contains encrypted entries. */
 	int			 has_encrypted_entries;
+
+	/*
+	 * Parallel folder decoding.
+	 */
+	int			 opt_threads;
+	uint64_t		 opt_threads_memlimit;
+	struct archive_thread_pool *pool;
+	/* Submitted jobs in folder order. */
+	struct _7z_folder_job	*jobs;
+	struct _7z_folder_job	*jobs_tail;
+	int			 jobs_queued;
+	/* Decoded folders kept for rereading, most recently used first.
+	 * The first one is being read if it is cur_folder. */
+	struct _7z_folder_job	*decoded;
+	/* The next folder to consider for a job. */
+	unsigned		 job_next_folder;
+	/* Packed plus decoded bytes held by jobs and decoded folders. */
+	uint64_t		 job_memory;
 };
 
 /* Maximum entry size. This limitation prevents reading intentional
@@ -341,11 +401,15 @@ static int	archive_read_format_7zip_has_encrypted_entries(struct archive_read *)
 static int	archive_read_support_format_7zip_capabilities(struct archive_read *a);
 static int	archive_read_format_7zip_bid(struct archive_read *, int);
 static int	archive_read_format_7zip_cleanup(struct archive_read *);
+static int	archive_read_format_7zip_options(struct archive_read *,
+		    const char *, const char *);
 static int	archive_read_format_7zip_read_data(struct archive_read *,
 		    const void **, size_t *, int64_t *);
 static int	archive_read_format_7zip_read_data_skip(struct archive_read *);
 static int	archive_read_format_7zip_read_header(struct archive_read *,
 		    struct archive_entry *);
+static int	archive_read_format_7zip_seek_entry(struct archive_read *,
+		    const char *);
 static int	check_7zip_header_in_sfx(const char *);
 static unsigned long decode_codec_id(const unsigned char *, size_t);
 static int	decode_encoded_header_info(struct archive_read *,
@@ -370,6 +434,7 @@ static int	init_decompression(struct archive_read *, struct _7zip *,
 		    const struct _7z_coder *, const struct _7z_coder *);
 static int	parse_7zip_uint64(struct archive_read *, uint64_t *);
 static int	read_Bools(struct archive_read *, unsigned char *, size_t);
+static int	read_decoded_folder(struct archive_read *, unsigned);
 static int	read_CodersInfo(struct archive_read *,
 		    struct _7z_coders_info *);
 static int	read_Digests(struct archive_read *, struct _7z_digests *,
@@ -390,6 +455,7 @@ static ssize_t	read_stream(struct archive_read *, const void **, size_t,
 static int	seek_pack(struct archive_read *);
 static int64_t	skip_stream(struct archive_read *, size_t);
 static int	skip_sfx(struct archive_read *, ssize_t);
+static void	free_folder_jobs(struct _7zip *);
 static int	slurp_central_directory(struct archive_read *, struct _7zip *,
 		    struct _7z_header_info *);
 static int	setup_decode_folder(struct archive_read *, struct _7z_folder *,
@@ -421,26 +487,76 @@ archive_read_support_format_7zip(struct archive *_a)
 	 * any encrypted entries yet.
 	 */
 	zip->has_encrypted_entries = ARCHIVE_READ_FORMAT_ENCRYPTION_DONT_KNOW;
-
+	zip->opt_threads = 1;
+	zip->opt_threads_memlimit = DEFAULT_THREADS_MEMLIMIT;
+	zip->cur_folder = (unsigned)-1;
 
 	r = __archive_read_register_format(a,
 	    zip,
 	    "7zip",
 	    archive_read_format_7zip_bid,
-	    NULL,
+	    archive_read_format_7zip_options,
 	    archive_read_format_7zip_read_header,
 	    archive_read_format_7zip_read_data,
 	    archive_read_format_7zip_read_data_skip,
 	    NULL,
 	    archive_read_format_7zip_cleanup,
 	    archive_read_support_format_7zip_capabilities,
-	    archive_read_format_7zip_has_encrypted_entries);
+	    archive_read_format_7zip_has_encrypted_entries,
+	    archive_read_format_7zip_seek_entry);
 
 	if (r != ARCHIVE_OK)
 		free(zip);
 	return (ARCHIVE_OK);
 }
 
+static int
+archive_read_format_7zip_options(struct archive_read *a,
+    const char *key, const char *val)
+{
+	struct _7zip *zip;
+	unsigned long n;
+	char *end;
+
+	zip = (struct _7zip *)(a->format->data);
+	if (strcmp(key, "threads") == 0) {
+		if (val == NULL || val[0] == 0)
+			n = 1;
+		else {
+			n = strtoul(val, &end, 10);
+			if (*end != '\0' || n > 1024) {
+				archive_set_error(&a->archive,
+				    ARCHIVE_ERRNO_MISC,
+				    "7zip: Illegal value `%s'", val);
+				return (ARCHIVE_FAILED);
+			}
+		}
+		if (n == 0)
+			n = __archive_thread_pool_ncpus();
+		zip->opt_threads = (int)n;
+		return (ARCHIVE_OK);
+	} else if (strcmp(key, "threads-memlimit") == 0) {
+		if (val == NULL || val[0] == 0) {
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "7zip: threads-memlimit option needs a size");
+			return (ARCHIVE_FAILED);
+		}
+		n = strtoul(val, &end, 10);
+		if (n == 0 || *end != '\0') {
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "7zip: Illegal value `%s'", val);
+			return (ARCHIVE_FAILED);
+		}
+		zip->opt_threads_memlimit = n;
+		return (ARCHIVE_OK);
+	}
+
+	/* Note: The "warn" return is just to inform the options
+	 * supervisor that we didn't handle it.  It will generate
+	 * a suitable error if no one used this option. */
+	return (ARCHIVE_WARN);
+}
+
 static int
 archive_read_support_format_7zip_capabilities(struct archive_read * a)
 {
@@ -641,6 +757,8 @@ archive_read_format_7zip_read_header(struct archive_read *a,
 			return (r);
 		zip->entries_remaining = (size_t)zip->numFiles;
 		zip->entry = zip->entries;
+	} else if (zip->entry_pending) {
+		zip->entry_pending = 0;
 	} else {
 		++zip->entry;
 	}
@@ -781,6 +899,123 @@ archive_read_format_7zip_read_header(struct archive_read *a,
 	return (ret);
 }
 
+static int
+cmp_name_ref(const void *p1, const void *p2)
+{
+	const struct _7z_name_ref *r1 = (const struct _7z_name_ref *)p1;
+	const struct _7z_name_ref *r2 = (const struct _7z_name_ref *)p2;
+	int r;
+
+	r = strcmp(r1->name, r2->name);
+	if (r != 0)
+		return (r);
+	if (r1->index < r2->index)
+		return -1;
+	return (r1->index > r2->index);
+}
+
+/*
+ * Convert every entry name the way read_header does and sort them.
+ */
+static int
+build_names_index(struct archive_read *a, struct _7zip *zip)
+{
+	size_t *offsets;
+	size_t i, n = (size_t)zip->numFiles;
+
+	offsets = malloc(n * sizeof(*offsets));
+	zip->names_index = malloc(n * sizeof(*zip->names_index));
+	if (offsets == NULL || zip->names_index == NULL)
+		goto nomem;
+	for (i = 0; i < n; i++) {
+		offsets[i] = archive_strlen(&zip->names);
+		/* A name which cannot be converted is indexed as far
+		 * as it could be, which is what read_header returns. */
+		if (archive_strncat_l(&zip->names,
+		    (const char *)zip->entries[i].utf16name,
+		    zip->entries[i].name_len, zip->sconv) != 0 &&
+		    errno == ENOMEM)
+			goto nomem;
+		archive_strappend_char(&zip->names, '\0');
+	}
+	for (i = 0; i < n; i++) {
+		zip->names_index[i].name = zip->names.s + offsets[i];
+		zip->names_index[i].index = i;
+	}
+	free(offsets);
+	qsort(zip->names_index, n, sizeof(*zip->names_index), cmp_name_ref);
+	return (ARCHIVE_OK);
+nomem:
+	free(offsets);
+	free(zip->names_index);
+	zip->names_index = NULL;
+	archive_string_empty(&zip->names);
+	archive_set_error(&a->archive, ENOMEM, "Can't allocate memory");
+	return (ARCHIVE_FATAL);
+}
+
+static int
+archive_read_format_7zip_seek_entry(struct archive_read *a,
+    const char *pathname)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	size_t lo, hi, mid;
+	int r;
+
+	if (zip->entries == NULL) {
+		struct _7z_header_info header;
+
+		memset(&header, 0, sizeof(header));
+		r = slurp_central_directory(a, zip, &header);
+		free_Header(&header);
+		if (r == ARCHIVE_EOF) {
+			/* There is no entry in the archive. */
+			archive_set_error(&a->archive, ENOENT,
+			    "%s: Not found in archive", pathname);
+			return (ARCHIVE_FAILED);
+		}
+		if (r != ARCHIVE_OK)
+			return (r);
+		/* The first entry is still to be read. */
+		zip->entries_remaining = (size_t)zip->numFiles;
+		zip->entry = zip->entries;
+		zip->entry_pending = 1;
+	}
+	if (zip->sconv == NULL) {
+		zip->sconv = archive_string_conversion_from_charset(
+		    &a->archive, "UTF-16LE", 1);
+		if (zip->sconv == NULL)
+			return (ARCHIVE_FATAL);
+	}
+	if (zip->names_index == NULL && zip->numFiles > 0) {
+		r = build_names_index(a, zip);
+		if (r != ARCHIVE_OK)
+			return (r);
+	}
+
+	/* Find the first name greater than pathname; the entry just
+	 * before it is the last copy of pathname, if there is one. */
+	lo = 0;
+	hi = (size_t)zip->numFiles;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(zip->names_index[mid].name, pathname) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || strcmp(zip->names_index[lo - 1].name, pathname) != 0) {
+		archive_set_error(&a->archive, ENOENT,
+		    "%s: Not found in archive", pathname);
+		return (ARCHIVE_FAILED);
+	}
+	zip->entry = &(zip->entries[zip->names_index[lo - 1].index]);
+	zip->entries_remaining =
+	    (size_t)zip->numFiles - zip->names_index[lo - 1].index;
+	zip->entry_pending = 1;
+	return (ARCHIVE_OK);
+}
+
 static int
 archive_read_format_7zip_read_data(struct archive_read *a,
     const void **buff, size_t *size, int64_t *offset)
@@ -887,12 +1122,15 @@ archive_read_format_7zip_cleanup(struct archive_read *a)
 	free_StreamsInfo(&(zip->si));
 	free(zip->entries);
 	free(zip->entry_names);
+	free(zip->names_index);
+	archive_string_free(&zip->names);
 	free_decompression(a, zip);
 	free(zip->uncompressed_buffer);
 	free(zip->sub_stream_buff[0]);
 	free(zip->sub_stream_buff[1]);
 	free(zip->sub_stream_buff[2]);
 	free(zip->tmp_stream_buff);
+	free_folder_jobs(zip);
 	free(zip);
 	(a->format->data) = NULL;
 	return (ARCHIVE_OK);
@@ -2351,6 +2589,7 @@ read_Header(struct archive_read *a, struct _7z_header_info *h,
 	struct _7z_stream_info *si = &(zip->si);
 	struct _7zip_entry *entries;
 	uint32_t folderIndex, indexInFolder;
+	uint64_t folderOffset;
 	unsigned i;
 	int eindex, empty_streams, sindex;
 
@@ -2579,6 +2818,7 @@ read_Header(struct archive_read *a, struct _7z_header_info *h,
 	folders = si->ci.folders;
 	eindex = sindex = 0;
 	folderIndex = indexInFolder = 0;
+	folderOffset = 0;
 	for (i = 0; i < zip->numFiles; i++) {
 		if (h->emptyStreamBools == NULL || h->emptyStreamBools[i] == 0)
 			entries[i].flg |= HAS_STREAM;
@@ -2645,12 +2885,15 @@ read_Header(struct archive_read *a, struct _7z_header_info *h,
 			}
 		}
 		entries[i].folderIndex = folderIndex;
+		entries[i].folderOffset = folderOffset;
 		if ((entries[i].flg & HAS_STREAM) == 0)
 			continue;
+		folderOffset += si->ss.unpackSizes[entries[i].ssIndex];
 		indexInFolder++;
 		if (indexInFolder >= folders[folderIndex].numUnpackStreams) {
 			folderIndex++;
 			indexInFolder = 0;
+			folderOffset = 0;
 		}
 	}
 
@@ -3209,114 +3452,165 @@ seek_pack(struct archive_read *a)
 	return (ARCHIVE_OK);
 }
 
-static ssize_t
-read_stream(struct archive_read *a, const void **buff, size_t size,
-    size_t minimum)
+/*
+ * Refill the uncompressed buffer from the current pack stream, or
+ * from the next one of the current folder.
+ */
+static int
+fill_uncompressed_buffer(struct archive_read *a)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	int r;
+
+	if (zip->pack_stream_inbytes_remaining > 0 ||
+	    zip->folder_outbytes_remaining > 0)
+		return ((int)extract_pack_stream(a, 0));
+	if (zip->pack_stream_remaining > 0) {
+		/*
+		 * Switch to next pack stream.
+		 */
+		r = seek_pack(a);
+		if (r < 0)
+			return (r);
+		return ((int)extract_pack_stream(a, 0));
+	}
+	if (zip->header_is_being_read) {
+		/* Invalid sequence. This might happen when
+		 * reading a malformed archive. */
+		archive_set_error(&(a->archive),
+		    ARCHIVE_ERRNO_MISC, "Malformed 7-Zip archive");
+	} else
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+		    "Truncated 7-Zip file body");
+	return (ARCHIVE_FATAL);
+}
+
+/*
+ * Discard the next `bytes' bytes of the current folder.
+ */
+static int
+skip_folder_bytes(struct archive_read *a, uint64_t bytes)
 {
 	struct _7zip *zip = (struct _7zip *)a->format->data;
-	uint64_t skip_bytes = 0;
-	ssize_t r;
+	const void *p;
+	ssize_t skipped;
+	int r;
 
-	if (zip->uncompressed_buffer_bytes_remaining == 0) {
-		if (zip->pack_stream_inbytes_remaining > 0) {
-			r = extract_pack_stream(a, 0);
-			if (r < 0)
-				return (r);
-			return (get_uncompressed_data(a, buff, size, minimum));
-		} else if (zip->folder_outbytes_remaining > 0) {
-			/* Extract a remaining pack stream. */
-			r = extract_pack_stream(a, 0);
+	while (bytes) {
+		if (zip->uncompressed_buffer_bytes_remaining == 0) {
+			r = fill_uncompressed_buffer(a);
 			if (r < 0)
 				return (r);
-			return (get_uncompressed_data(a, buff, size, minimum));
 		}
-	} else
-		return (get_uncompressed_data(a, buff, size, minimum));
-
-	/*
-	 * Current pack stream has been consumed.
-	 */
-	if (zip->pack_stream_remaining == 0) {
-		if (zip->header_is_being_read) {
-			/* Invalid sequence. This might happen when
-			 * reading a malformed archive. */
-			archive_set_error(&(a->archive),
-			    ARCHIVE_ERRNO_MISC, "Malformed 7-Zip archive");
+		skipped = get_uncompressed_data(a, &p,
+		    (bytes > SIZE_MAX)? SIZE_MAX: (size_t)bytes, 0);
+		if (skipped < 0)
+			return ((int)skipped);
+		if (skipped == 0) {
+			archive_set_error(&a->archive,
+			    ARCHIVE_ERRNO_FILE_FORMAT,
+			    "Truncated 7-Zip file body");
 			return (ARCHIVE_FATAL);
 		}
+		bytes -= skipped;
+		zip->cur_folder_offset += skipped;
+		if (zip->pack_stream_bytes_unconsumed)
+			read_consume(a);
+	}
+	return (ARCHIVE_OK);
+}
 
-		/*
-		 * All current folder's pack streams have been
-		 * consumed. Switch to next folder.
-		 */
-		if (zip->folder_index == 0 &&
-		    (zip->si.ci.folders[zip->entry->folderIndex].skipped_bytes
-		     || zip->folder_index != zip->entry->folderIndex)) {
-			zip->folder_index = zip->entry->folderIndex;
-			skip_bytes =
-			    zip->si.ci.folders[zip->folder_index].skipped_bytes;
-		}
-
-		if (zip->folder_index >= zip->si.ci.numFolders) {
-			/*
-			 * We have consumed all folders and its pack streams.
-			 */
-			*buff = NULL;
-			return (0);
-		}
-		r = setup_decode_folder(a,
-			&(zip->si.ci.folders[zip->folder_index]), 0);
-		if (r != ARCHIVE_OK)
-			return (ARCHIVE_FATAL);
+/*
+ * Position the decoder so that the next byte read_stream() returns is
+ * the byte at `offset' in the output of folder `findex'.  Entries are
+ * only skipped here, when their data is actually wanted, so skipping
+ * entries never decodes folders nobody reads from.
+ */
+static int
+seek_folder(struct archive_read *a, unsigned findex, uint64_t offset)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	struct _7z_folder *folder;
+	struct _7z_folder_job *job;
+	int r;
 
-		zip->folder_index++;
+	if (findex >= zip->si.ci.numFolders) {
+		archive_set_error(&(a->archive),
+		    ARCHIVE_ERRNO_MISC, "Malformed 7-Zip archive");
+		return (ARCHIVE_FATAL);
+	}
+	if (zip->cur_folder == findex) {
+		if (offset == zip->cur_folder_offset)
+			return (ARCHIVE_OK);
+		job = zip->decoded;
+		if (job != NULL && job->folder_index == findex)
+			goto in_memory;
+		if (offset > zip->cur_folder_offset)
+			return (skip_folder_bytes(a,
+			    offset - zip->cur_folder_offset));
 	}
 
 	/*
-	 * Switch to next pack stream.
+	 * Switch to the folder, or go back to its beginning.
 	 */
-	r = seek_pack(a);
-	if (r < 0)
-		return (r);
-
-	/* Extract a new pack stream. */
-	r = extract_pack_stream(a, 0);
-	if (r < 0)
-		return (r);
+	folder = &(zip->si.ci.folders[findex]);
+	r = read_decoded_folder(a, findex);
+	if (r == ARCHIVE_RETRY) {
+		zip->cur_folder = (unsigned)-1;
+		r = setup_decode_folder(a, folder, 0);
+		if (r != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+		folder->visited = 1;
+		zip->cur_folder = findex;
+		zip->cur_folder_offset = 0;
+		r = seek_pack(a);
+		if (r < 0)
+			return (r);
+		r = (int)extract_pack_stream(a, 0);
+		if (r < 0)
+			return (r);
+		return (skip_folder_bytes(a, offset));
+	}
+	if (r != ARCHIVE_OK)
+		return (ARCHIVE_FATAL);
+	zip->cur_folder = findex;
+	job = zip->decoded;
+in_memory:
+	if (offset > job->unpacked_size) {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+		    "Truncated 7-Zip file body");
+		return (ARCHIVE_FATAL);
+	}
+	zip->uncompressed_buffer_pointer = job->unpacked + offset;
+	zip->uncompressed_buffer_bytes_remaining =
+	    job->unpacked_size - (size_t)offset;
+	zip->cur_folder_offset = offset;
+	return (ARCHIVE_OK);
+}
 
-	/*
-	 * Skip the bytes we alrady has skipped in skip_stream().
-	 */
-	while (skip_bytes) {
-		ssize_t skipped;
+static ssize_t
+read_stream(struct archive_read *a, const void **buff, size_t size,
+    size_t minimum)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	ssize_t bytes;
+	int r;
 
-		if (zip->uncompressed_buffer_bytes_remaining == 0) {
-			if (zip->pack_stream_inbytes_remaining > 0) {
-				r = extract_pack_stream(a, 0);
-				if (r < 0)
-					return (r);
-			} else if (zip->folder_outbytes_remaining > 0) {
-				/* Extract a remaining pack stream. */
-				r = extract_pack_stream(a, 0);
-				if (r < 0)
-					return (r);
-			} else {
-				archive_set_error(&a->archive,
-				    ARCHIVE_ERRNO_FILE_FORMAT,
-				    "Truncated 7-Zip file body");
-				return (ARCHIVE_FATAL);
-			}
-		}
-		skipped = get_uncompressed_data(
-			a, buff, (size_t)skip_bytes, 0);
-		if (skipped < 0)
-			return (skipped);
-		skip_bytes -= skipped;
-		if (zip->pack_stream_bytes_unconsumed)
-			read_consume(a);
+	if (!zip->header_is_being_read) {
+		r = seek_folder(a, zip->entry->folderIndex,
+		    zip->entry->folderOffset + zip->entry_offset);
+		if (r < 0)
+			return (r);
 	}
-
-	return (get_uncompressed_data(a, buff, size, minimum));
+	if (zip->uncompressed_buffer_bytes_remaining == 0) {
+		r = fill_uncompressed_buffer(a);
+		if (r < 0)
+			return (r);
+	}
+	bytes = get_uncompressed_data(a, buff, size, minimum);
+	if (bytes > 0)
+		zip->cur_folder_offset += bytes;
+	return (bytes);
 }
 
 static int
@@ -3580,36 +3874,500 @@ setup_decode_folder(struct archive_read *a, struct _7z_folder *folder,
 static int64_t
 skip_stream(struct archive_read *a, size_t skip_bytes)
 {
-	struct _7zip *zip = (struct _7zip *)a->format->data;
-	const void *p;
-	int64_t skipped_bytes;
-	size_t bytes = skip_bytes;
+	(void)a; /* UNUSED */
 
-	if (zip->folder_index == 0) {
-		/*
-		 * Optimization for a list mode.
-		 * Avoid unncecessary decoding operations.
-		 */
-		zip->si.ci.folders[zip->entry->folderIndex].skipped_bytes
-		    += skip_bytes;
-		return (skip_bytes);
+	/*
+	 * Nothing to do here; read_stream() seeks to the position of
+	 * the data it is asked for, decoding only what it has to.
+	 */
+	return (skip_bytes);
+}
+
+/*
+ * Parallel folder decoding.
+ *
+ * When the "threads" option is set, folders which follow the one
+ * being read are decoded as a whole on worker threads.  The main
+ * thread reads their pack streams into memory ahead of time, and
+ * read_stream() serves a folder from its decoded buffer when its
+ * turn comes, so entries are still returned in archive order.
+ * Folders which do not qualify are decoded by the usual code.
+ */
+#ifdef HAVE_LZMA_H
+static lzma_vli
+job_lzma_filter(unsigned long codec)
+{
+	switch (codec) {
+	case _7Z_X86:		return (LZMA_FILTER_X86);
+	case _7Z_POWERPC:	return (LZMA_FILTER_POWERPC);
+	case _7Z_IA64:		return (LZMA_FILTER_IA64);
+	case _7Z_ARM:		return (LZMA_FILTER_ARM);
+	case _7Z_ARMTHUMB:	return (LZMA_FILTER_ARMTHUMB);
+	case _7Z_SPARC:		return (LZMA_FILTER_SPARC);
+	case _7Z_DELTA:		return (LZMA_FILTER_DELTA);
+	default:		return (LZMA_VLI_UNKNOWN);
 	}
+}
+#endif
 
-	while (bytes) {
-		skipped_bytes = read_stream(a, &p, bytes, 0);
-		if (skipped_bytes < 0)
-			return (skipped_bytes);
-		if (skipped_bytes == 0) {
+/*
+ * Return the number of bytes a job for the folder needs, or 0 if the
+ * folder has to be decoded by the main thread.
+ */
+static uint64_t
+folder_job_size(struct _7zip *zip, struct _7z_folder *folder)
+{
+	const struct _7z_coder *coder2;
+	uint64_t packed, unpacked;
+
+	if (folder->numPackedStreams != 1 || folder->numCoders > 2)
+		return (0);
+	coder2 = (folder->numCoders == 2)? &(folder->coders[1]): NULL;
+	switch (folder->coders[0].codec) {
+#ifdef HAVE_LZMA_H
+	case _7Z_LZMA: case _7Z_LZMA2:
+		if (coder2 == NULL)
+			break;
+		/* BCJ for LZMA1 needs our own filter; see
+		 * init_decompression(). */
+		if (job_lzma_filter(coder2->codec) == LZMA_VLI_UNKNOWN ||
+		    (coder2->codec == _7Z_X86 &&
+		     folder->coders[0].codec == _7Z_LZMA))
+			return (0);
+		break;
+#endif
+#if defined(HAVE_BZLIB_H) && defined(BZ_CONFIG_ERROR)
+	case _7Z_BZ2:
+#endif
+#ifdef HAVE_ZLIB_H
+	case _7Z_DEFLATE:
+#endif
+#if defined(HAVE_ZLIB_H) || \
+    (defined(HAVE_BZLIB_H) && defined(BZ_CONFIG_ERROR))
+		if (coder2 != NULL)
+			return (0);
+		break;
+#endif
+	default:
+		return (0);
+	}
+	packed = zip->si.pi.sizes[folder->packIndex];
+	unpacked = folder_uncompressed_size(folder);
+	if (unpacked == 0 || packed > zip->opt_threads_memlimit ||
+	    unpacked > zip->opt_threads_memlimit - packed)
+		return (0);
+	return (packed + unpacked);
+}
+
+static void
+decode_folder_job(struct archive_task *task)
+{
+	struct _7z_folder_job *job = (struct _7z_folder_job *)task;
+	size_t out = 0;
+	int r;
+
+	job->error = ARCHIVE_ERRNO_MISC;
+	job->error_string = "Damaged 7-Zip archive";
+	switch (job->coder1->codec) {
+#ifdef HAVE_LZMA_H
+	case _7Z_LZMA: case _7Z_LZMA2:
+	{
+		lzma_stream strm = LZMA_STREAM_INIT;
+		lzma_options_delta delta_opt;
+		lzma_filter filters[3];
+		int fi = 0;
+
+		if (job->coder2 != NULL) {
+			filters[fi].id = job_lzma_filter(job->coder2->codec);
+			filters[fi].options = NULL;
+			if (filters[fi].id == LZMA_FILTER_DELTA) {
+				memset(&delta_opt, 0, sizeof(delta_opt));
+				delta_opt.type = LZMA_DELTA_TYPE_BYTE;
+				delta_opt.dist = 1;
+				filters[fi].options = &delta_opt;
+			}
+			fi++;
+		}
+		if (job->coder1->codec == _7Z_LZMA2)
+			filters[fi].id = LZMA_FILTER_LZMA2;
+		else
+			filters[fi].id = LZMA_FILTER_LZMA1;
+		filters[fi].options = NULL;
+		if (lzma_properties_decode(&filters[fi], NULL,
+		    job->coder1->properties,
+		    (size_t)job->coder1->propertiesSize) != LZMA_OK)
+			return;
+		filters[fi + 1].id = LZMA_VLI_UNKNOWN;
+		filters[fi + 1].options = NULL;
+		r = lzma_raw_decoder(&strm, filters);
+		free(filters[fi].options);
+		if (r != LZMA_OK) {
+			if (r == LZMA_MEM_ERROR) {
+				job->error = ENOMEM;
+				job->error_string =
+				    "No memory for 7-Zip decompression";
+			}
+			return;
+		}
+		strm.next_in = job->packed;
+		strm.avail_in = job->packed_size;
+		strm.next_out = job->unpacked;
+		strm.avail_out = job->unpacked_size;
+		/* liblzma reports LZMA_BUF_ERROR if no progress is made. */
+		do {
+			r = lzma_code(&strm, LZMA_RUN);
+		} while (r == LZMA_OK && strm.avail_out > 0);
+		out = job->unpacked_size - strm.avail_out;
+		lzma_end(&strm);
+		if (r != LZMA_OK && r != LZMA_STREAM_END)
+			return;
+		break;
+	}
+#endif
+#if defined(HAVE_BZLIB_H) && defined(BZ_CONFIG_ERROR)
+	case _7Z_BZ2:
+	{
+		bz_stream strm;
+		size_t in_left, out_left;
+		unsigned avail_in, avail_out;
+
+		memset(&strm, 0, sizeof(strm));
+		r = BZ2_bzDecompressInit(&strm, 0, 0);
+		if (r == BZ_MEM_ERROR)
+			r = BZ2_bzDecompressInit(&strm, 0, 1);
+		if (r != BZ_OK)
+			return;
+		strm.next_in = (char *)job->packed;
+		strm.next_out = (char *)job->unpacked;
+		in_left = job->packed_size;
+		out_left = job->unpacked_size;
+		/* bzlib counts in unsigned ints; hand it at most that
+		 * much at a time. */
+		do {
+			avail_in = in_left > UINT_MAX ?
+			    UINT_MAX : (unsigned)in_left;
+			avail_out = out_left > UINT_MAX ?
+			    UINT_MAX : (unsigned)out_left;
+			strm.avail_in = avail_in;
+			strm.avail_out = avail_out;
+			r = BZ2_bzDecompress(&strm);
+			in_left -= avail_in - strm.avail_in;
+			out_left -= avail_out - strm.avail_out;
+		} while (r == BZ_OK && out_left > 0 &&
+		    (strm.avail_in != avail_in || strm.avail_out != avail_out));
+		out = job->unpacked_size - out_left;
+		BZ2_bzDecompressEnd(&strm);
+		if (r != BZ_OK && r != BZ_STREAM_END)
+			return;
+		break;
+	}
+#endif
+#ifdef HAVE_ZLIB_H
+	case _7Z_DEFLATE:
+	{
+		z_stream strm;
+		size_t in_left, out_left;
+		uInt avail_in, avail_out;
+
+		memset(&strm, 0, sizeof(strm));
+		if (inflateInit2(&strm,
+		    -15 /* Don't check for zlib header */) != Z_OK)
+			return;
+		strm.next_in = job->packed;
+		strm.next_out = job->unpacked;
+		in_left = job->packed_size;
+		out_left = job->unpacked_size;
+		/* zlib counts in uInts; hand it at most that much at a
+		 * time.  It reports Z_BUF_ERROR if no progress is made. */
+		do {
+			avail_in = in_left > UINT_MAX ?
+			    UINT_MAX : (uInt)in_left;
+			avail_out = out_left > UINT_MAX ?
+			    UINT_MAX : (uInt)out_left;
+			strm.avail_in = avail_in;
+			strm.avail_out = avail_out;
+			r = inflate(&strm, 0);
+			in_left -= avail_in - strm.avail_in;
+			out_left -= avail_out - strm.avail_out;
+		} while (r == Z_OK && out_left > 0);
+		out = job->unpacked_size - out_left;
+		inflateEnd(&strm);
+		if (r != Z_OK && r != Z_STREAM_END)
+			return;
+		break;
+	}
+#endif
+	default:
+		return;
+	}
+	if (out != job->unpacked_size)
+		return;
+	job->error = 0;
+	job->error_string = NULL;
+}
+
+static void
+free_folder_job(struct _7zip *zip, struct _7z_folder_job *job)
+{
+	zip->job_memory -= job->packed_size + job->unpacked_size;
+	free(job->packed);
+	free(job->unpacked);
+	free(job);
+}
+
+static void
+free_folder_jobs(struct _7zip *zip)
+{
+	struct _7z_folder_job *job;
+
+	/* Stop the workers before releasing what they may be using. */
+	__archive_thread_pool_free(zip->pool);
+	zip->pool = NULL;
+	while ((job = zip->jobs) != NULL) {
+		zip->jobs = job->next;
+		free_folder_job(zip, job);
+	}
+	zip->jobs_tail = NULL;
+	zip->jobs_queued = 0;
+	while ((job = zip->decoded) != NULL) {
+		zip->decoded = job->next;
+		free_folder_job(zip, job);
+	}
+}
+
+/*
+ * Release the least recently used decoded folders, but never the one
+ * being read, until `reserve' more bytes fit in the memory limit.
+ */
+static void
+trim_decoded_folders(struct _7zip *zip, uint64_t reserve)
+{
+	struct _7z_folder_job *job, **last;
+
+	while (zip->job_memory + reserve > zip->opt_threads_memlimit &&
+	    zip->decoded != NULL && zip->decoded->next != NULL) {
+		last = &(zip->decoded->next);
+		while ((*last)->next != NULL)
+			last = &((*last)->next);
+		job = *last;
+		*last = NULL;
+		free_folder_job(zip, job);
+	}
+}
+
+/*
+ * Read the pack stream of a folder into memory.
+ */
+static int
+read_folder_pack_stream(struct archive_read *a, struct _7z_folder *folder,
+    unsigned char *p, size_t size)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	int64_t pack_offset;
+	const void *buff;
+	ssize_t bytes_avail;
+
+	read_consume(a);
+	pack_offset = zip->si.pi.positions[folder->packIndex];
+	if (zip->stream_offset != pack_offset) {
+		if (0 > __archive_read_seek(a, pack_offset + zip->seek_base,
+		    SEEK_SET))
+			return (ARCHIVE_FATAL);
+		zip->stream_offset = pack_offset;
+	}
+	while (size > 0) {
+		buff = __archive_read_ahead(a, 1, &bytes_avail);
+		if (bytes_avail <= 0) {
 			archive_set_error(&a->archive,
 			    ARCHIVE_ERRNO_FILE_FORMAT,
 			    "Truncated 7-Zip file body");
 			return (ARCHIVE_FATAL);
 		}
-		bytes -= (size_t)skipped_bytes;
-		if (zip->pack_stream_bytes_unconsumed)
-			read_consume(a);
+		if ((size_t)bytes_avail > size)
+			bytes_avail = (ssize_t)size;
+		memcpy(p, buff, bytes_avail);
+		__archive_read_consume(a, bytes_avail);
+		zip->stream_offset += bytes_avail;
+		p += bytes_avail;
+		size -= bytes_avail;
 	}
-	return (skip_bytes);
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Create a job for a folder and read its pack stream.
+ */
+static struct _7z_folder_job *
+new_folder_job(struct archive_read *a, unsigned findex)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	struct _7z_folder *folder = &(zip->si.ci.folders[findex]);
+	struct _7z_folder_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		goto nomem;
+	job->task.run = decode_folder_job;
+	job->folder_index = findex;
+	job->coder1 = &(folder->coders[0]);
+	if (folder->numCoders == 2)
+		job->coder2 = &(folder->coders[1]);
+	job->packed_size = (size_t)zip->si.pi.sizes[folder->packIndex];
+	job->unpacked_size = (size_t)folder_uncompressed_size(folder);
+	zip->job_memory += job->packed_size + job->unpacked_size;
+	job->packed = malloc(job->packed_size);
+	job->unpacked = malloc(job->unpacked_size);
+	if (job->packed == NULL || job->unpacked == NULL) {
+		free_folder_job(zip, job);
+		goto nomem;
+	}
+	if (read_folder_pack_stream(a, folder, job->packed,
+	    job->packed_size) != ARCHIVE_OK) {
+		free_folder_job(zip, job);
+		return (NULL);
+	}
+	return (job);
+nomem:
+	archive_set_error(&a->archive, ENOMEM,
+	    "No memory for 7-Zip decompression");
+	return (NULL);
+}
+
+/*
+ * Hand the folders following the current one to the workers while
+ * the memory limit allows.
+ */
+static int
+queue_folder_jobs(struct archive_read *a)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	struct _7z_folder_job *job;
+	uint64_t size;
+
+	while (zip->jobs_queued < zip->opt_threads * 2 &&
+	    zip->job_next_folder < zip->si.ci.numFolders) {
+		size = folder_job_size(zip,
+		    &(zip->si.ci.folders[zip->job_next_folder]));
+		if (size == 0) {
+			zip->job_next_folder++;
+			continue;
+		}
+		trim_decoded_folders(zip, size);
+		if (zip->job_memory + size > zip->opt_threads_memlimit)
+			break;
+		job = new_folder_job(a, zip->job_next_folder);
+		if (job == NULL)
+			return (ARCHIVE_FATAL);
+		if (zip->jobs_tail != NULL)
+			zip->jobs_tail->next = job;
+		else
+			zip->jobs = job;
+		zip->jobs_tail = job;
+		zip->jobs_queued++;
+		zip->job_next_folder++;
+		__archive_thread_pool_submit(zip->pool, &(job->task));
+	}
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Find the decoded output of a folder, either kept from an earlier
+ * visit or made by a worker thread, and set up the uncompressed
+ * buffer to return it.  A folder we come back to is decoded as a
+ * whole here if it fits in the memory limit, so that going back and
+ * forth in a solid folder does not decode it over and over again.
+ * Returns ARCHIVE_RETRY if the folder has to be decoded with
+ * setup_decode_folder().
+ */
+static int
+read_decoded_folder(struct archive_read *a, unsigned findex)
+{
+	struct _7zip *zip = (struct _7zip *)a->format->data;
+	struct _7z_folder *folder = &(zip->si.ci.folders[findex]);
+	struct _7z_folder_job *job, **prev;
+	uint64_t size;
+	int r;
+
+	for (prev = &(zip->decoded); (job = *prev) != NULL;
+	    prev = &(job->next)) {
+		if (job->folder_index == findex) {
+			/* Move it to the head below. */
+			*prev = job->next;
+			break;
+		}
+	}
+
+	if (job == NULL && zip->opt_threads > 1 && zip->pool == NULL) {
+		zip->pool = __archive_thread_pool_new(zip->opt_threads);
+		/* Do not try again if threads are unavailable. */
+		if (zip->pool == NULL)
+			zip->opt_threads = 1;
+	}
+	if (job == NULL && zip->pool != NULL) {
+		/* Drop jobs we have gone past. */
+		while ((job = zip->jobs) != NULL &&
+		    job->folder_index < findex) {
+			__archive_thread_pool_wait(zip->pool, &(job->task));
+			zip->jobs = job->next;
+			zip->jobs_queued--;
+			free_folder_job(zip, job);
+		}
+		if (zip->jobs == NULL)
+			zip->jobs_tail = NULL;
+		if (zip->job_next_folder < findex)
+			zip->job_next_folder = findex;
+		if ((r = queue_folder_jobs(a)) != ARCHIVE_OK)
+			return (r);
+		job = zip->jobs;
+		if (job != NULL && job->folder_index == findex) {
+			__archive_thread_pool_wait(zip->pool, &(job->task));
+			zip->jobs = job->next;
+			if (zip->jobs == NULL)
+				zip->jobs_tail = NULL;
+			zip->jobs_queued--;
+		} else
+			job = NULL;
+	}
+	if (job == NULL) {
+		if (!folder->visited ||
+		    (size = folder_job_size(zip, folder)) == 0)
+			return (ARCHIVE_RETRY);
+		trim_decoded_folders(zip, size);
+		job = new_folder_job(a, findex);
+		if (job == NULL)
+			return (ARCHIVE_FATAL);
+		/* A NULL pool runs it right now. */
+		__archive_thread_pool_submit(NULL, &(job->task));
+	}
+	folder->visited = 1;
+	if (job->error) {
+		archive_set_error(&a->archive, job->error, "%s",
+		    job->error_string);
+		free_folder_job(zip, job);
+		return (ARCHIVE_FATAL);
+	}
+	/* The packed data is not needed any more. */
+	zip->job_memory -= job->packed_size;
+	free(job->packed);
+	job->packed = NULL;
+	job->packed_size = 0;
+	job->next = zip->decoded;
+	zip->decoded = job;
+	trim_decoded_folders(zip, 0);
+
+	/* Keep the workers busy while this folder is read. */
+	if (zip->pool != NULL && (r = queue_folder_jobs(a)) != ARCHIVE_OK)
+		return (r);
+
+	zip->codec = job->coder1->codec;
+	zip->codec2 = (unsigned long)-1;
+	zip->pack_stream_remaining = 0;
+	zip->pack_stream_inbytes_remaining = 0;
+	zip->pack_stream_bytes_unconsumed = 0;
+	zip->folder_outbytes_remaining = 0;
+	zip->uncompressed_buffer_pointer = job->unpacked;
+	zip->uncompressed_buffer_bytes_remaining = job->unpacked_size;
+	return (ARCHIVE_OK);
 }
 
 /*
@@ -114,21 +114,16 @@ struct lzx_dec {
 		/*
 		 * Use a index table. It's faster than searching a huffman
 		 * coding tree, which is a binary tree. But a use of a large
-		 * index table causes L1 cache read miss many times.
+		 * index table causes L1 cache read miss many times, so
+		 * codes longer than HTBL_BITS are looked up in second-level
+		 * tables placed after the first 1 << HTBL_BITS entries.
 		 */
 #define HTBL_BITS	10
 		int		 max_bits;
 		int		 shift_bits;
 		int		 tbl_bits;
-		int		 tree_used;
-		int		 tree_avail;
 		/* Direct access table. */
 		uint16_t	*tbl;
-		/* Binary tree table for extra bits over the direct access. */
-		struct htree_t {
-			uint16_t left;
-			uint16_t right;
-		}		*tree;
 	}			 at, lt, mt, pt;
 
 	int			 loop;
@@ -352,7 +347,6 @@ static int	lzx_huffman_init(struct huffman *, size_t, int);
 static void	lzx_huffman_free(struct huffman *);
 static int	lzx_make_huffman_table(struct huffman *);
 static inline int lzx_decode_huffman(struct huffman *, unsigned);
-static int	lzx_decode_huffman_tree(struct huffman *, unsigned, int);
 
 
 int
@@ -385,6 +379,7 @@ archive_read_support_format_cab(struct archive *_a)
 	    NULL,
 	    archive_read_format_cab_cleanup,
 	    NULL,
+	    NULL,
 	    NULL);
 
 	if (r != ARCHIVE_OK)
@@ -2188,14 +2183,20 @@ lzx_decode_free(struct lzx_stream *strm)
 
 /*
  * E8 Call Translation reversal.
+ *
+ * Compressors only translate the first 32768 frames (1 GiB) of a folder,
+ * so there is nothing to reverse beyond that.
  */
+#define LZX_TRANSLATION_LIMIT	0x40000000U
+
 static void
 lzx_translation(struct lzx_stream *strm, void *p, size_t size, uint32_t offset)
 {
 	struct lzx_dec *ds = strm->ds;
 	unsigned char *b, *end;
 
-	if (!ds->translation || size <= 10)
+	if (!ds->translation || size <= 10 ||
+	    offset >= LZX_TRANSLATION_LIMIT)
 		return;
 	b = p;
 	end = b + size - 10;
@@ -2958,6 +2959,7 @@ lzx_decode_blocks(struct lzx_stream *strm, int last)
 			 */
 			for (;;) {
 				const unsigned char *s;
+				unsigned char *d;
 				int l;
 
 				l = copy_len;
@@ -2971,18 +2973,25 @@ lzx_decode_blocks(struct lzx_stream *strm, int last)
 				if (noutp + l >= endp)
 					l = (int)(endp - noutp);
 				s = w_buff + copy_pos;
-				if (l >= 8 && ((copy_pos + l < w_pos)
-				  || (w_pos + l < copy_pos))) {
-					memcpy(w_buff + w_pos, s, l);
-					memcpy(noutp, s, l);
+				d = w_buff + w_pos;
+				if (copy_pos >= w_pos || w_pos - copy_pos >= l) {
+					/* The source never reads bytes this
+					 * copy produces. */
+					memmove(d, s, l);
+				} else if (w_pos - copy_pos == 1) {
+					/* A run of the last byte. */
+					memset(d, *s, l);
 				} else {
-					unsigned char *d;
+					int dist = w_pos - copy_pos;
 					int li;
 
-					d = w_buff + w_pos;
-					for (li = 0; li < l; li++)
-						noutp[li] = d[li] = s[li];
+					/* Copy the repeating pattern a
+					 * distance-sized chunk at a time. */
+					for (li = 0; li < l; li += dist)
+						memcpy(d + li, s + li,
+						    (l - li < dist)? l - li: dist);
 				}
+				memcpy(noutp, d, l);
 				noutp += l;
 				copy_pos = (copy_pos + l) & w_mask;
 				w_pos = (w_pos + l) & w_mask;
@@ -3124,7 +3133,7 @@ getdata:
 static int
 lzx_huffman_init(struct huffman *hf, size_t len_size, int tbl_bits)
 {
-	int bits;
+	size_t tbl_size;
 
 	if (hf->bitlen == NULL || hf->len_size != (int)len_size) {
 		free(hf->bitlen);
@@ -3135,21 +3144,20 @@ lzx_huffman_init(struct huffman *hf, size_t len_size, int tbl_bits)
 	} else
 		memset(hf->bitlen, 0, len_size *  sizeof(hf->bitlen[0]));
 	if (hf->tbl == NULL) {
-		if (tbl_bits < HTBL_BITS)
-			bits = tbl_bits;
+		/*
+		 * Second-level tables never need more entries than
+		 * a full direct table for tbl_bits would have.
+		 */
+		if (tbl_bits <= HTBL_BITS)
+			tbl_size = (size_t)1 << tbl_bits;
 		else
-			bits = HTBL_BITS;
-		hf->tbl = malloc(((size_t)1 << bits) * sizeof(hf->tbl[0]));
+			tbl_size = ((size_t)1 << HTBL_BITS) +
+			    ((size_t)1 << tbl_bits);
+		hf->tbl = malloc(tbl_size * sizeof(hf->tbl[0]));
 		if (hf->tbl == NULL)
 			return (ARCHIVE_FATAL);
 		hf->tbl_bits = tbl_bits;
 	}
-	if (hf->tree == NULL && tbl_bits > HTBL_BITS) {
-		hf->tree_avail = 1 << (tbl_bits - HTBL_BITS + 4);
-		hf->tree = malloc(hf->tree_avail * sizeof(hf->tree[0]));
-		if (hf->tree == NULL)
-			return (ARCHIVE_FATAL);
-	}
 	return (ARCHIVE_OK);
 }
 
@@ -3158,7 +3166,6 @@ lzx_huffman_free(struct huffman *hf)
 {
 	free(hf->bitlen);
 	free(hf->tbl);
-	free(hf->tree);
 }
 
 /*
@@ -3169,9 +3176,9 @@ lzx_make_huffman_table(struct huffman *hf)
 {
 	uint16_t *tbl;
 	const unsigned char *bitlen;
-	int bitptn[17], weight[17];
+	int bitptn[18], weight[17];
 	int i, maxbits = 0, ptn, tbl_size, w;
-	int diffbits, len_avail;
+	int diffbits, len_avail, sub_first;
 
 	/*
 	 * Initialize bit patterns.
@@ -3185,10 +3192,18 @@ lzx_make_huffman_table(struct huffman *hf)
 			maxbits = i;
 		}
 	}
-	if ((ptn & 0xffff) != 0 || maxbits > hf->tbl_bits)
+	bitptn[17] = ptn;
+	/* The code has to be complete unless it is empty. */
+	if ((ptn != 0x10000 && maxbits != 0) || maxbits > hf->tbl_bits)
 		return (0);/* Invalid */
 
 	hf->max_bits = maxbits;
+	if (maxbits == 0) {
+		/* No codes; make sure lookups still land on a symbol. */
+		hf->shift_bits = 0;
+		hf->tbl[0] = 0;
+		return (1);
+	}
 
 	/*
 	 * Cut out extra bits which we won't house in the table.
@@ -3197,43 +3212,42 @@ lzx_make_huffman_table(struct huffman *hf)
 	 */
 	if (maxbits < 16) {
 		int ebits = 16 - maxbits;
-		for (i = 1; i <= maxbits; i++) {
+		for (i = 1; i <= maxbits + 1; i++) {
 			bitptn[i] >>= ebits;
-			weight[i] >>= ebits;
+			if (i <= maxbits)
+				weight[i] >>= ebits;
 		}
 	}
-	if (maxbits > HTBL_BITS) {
-		int htbl_max;
-		uint16_t *p;
-
+	if (maxbits > HTBL_BITS)
 		diffbits = maxbits - HTBL_BITS;
-		for (i = 1; i <= HTBL_BITS; i++) {
-			bitptn[i] >>= diffbits;
-			weight[i] >>= diffbits;
-		}
-		htbl_max = bitptn[HTBL_BITS] +
-		    weight[HTBL_BITS] * hf->freq[HTBL_BITS];
-		p = &(hf->tbl[htbl_max]);
-		while (p < &hf->tbl[1U<<HTBL_BITS])
-			*p++ = 0;
-	} else
+	else
 		diffbits = 0;
 	hf->shift_bits = diffbits;
 
-	/*
-	 * Make the table.
-	 */
 	tbl_size = 1 << HTBL_BITS;
 	tbl = hf->tbl;
 	bitlen = hf->bitlen;
 	len_avail = hf->len_size;
-	hf->tree_used = 0;
+
+	/*
+	 * Codes up to HTBL_BITS come first in canonical order, so every
+	 * first-level entry from sub_first on is the prefix of longer
+	 * codes.  Give each of those prefixes its own second-level table,
+	 * indexed by the remaining diffbits bits.
+	 */
+	if (diffbits) {
+		sub_first = bitptn[HTBL_BITS + 1] >> diffbits;
+		for (i = sub_first; i < tbl_size; i++)
+			tbl[i] = (uint16_t)(len_avail + i - sub_first);
+	} else
+		sub_first = tbl_size;
+
+	/*
+	 * Make the table.
+	 */
 	for (i = 0; i < len_avail; i++) {
 		uint16_t *p;
 		int len, cnt;
-		uint16_t bit;
-		int extlen;
-		struct htree_t *ht;
 
 		if (bitlen[i] == 0)
 			continue;
@@ -3241,110 +3255,42 @@ lzx_make_huffman_table(struct huffman *hf)
 		len = bitlen[i];
 		ptn = bitptn[len];
 		cnt = weight[len];
+		/* Calculate next bit pattern */
+		bitptn[len] = ptn + cnt;
 		if (len <= HTBL_BITS) {
-			/* Calculate next bit pattern */
-			if ((bitptn[len] = ptn + cnt) > tbl_size)
+			ptn >>= diffbits;
+			cnt >>= diffbits;
+			if (ptn + cnt > tbl_size)
 				return (0);/* Invalid */
-			/* Update the table */
 			p = &(tbl[ptn]);
-			while (--cnt >= 0)
-				p[cnt] = (uint16_t)i;
-			continue;
-		}
-
-		/*
-		 * A bit length is too big to be housed to a direct table,
-		 * so we use a tree model for its extra bits.
-		 */
-		bitptn[len] = ptn + cnt;
-		bit = 1U << (diffbits -1);
-		extlen = len - HTBL_BITS;
-		
-		p = &(tbl[ptn >> diffbits]);
-		if (*p == 0) {
-			*p = len_avail + hf->tree_used;
-			ht = &(hf->tree[hf->tree_used++]);
-			if (hf->tree_used > hf->tree_avail)
-				return (0);/* Invalid */
-			ht->left = 0;
-			ht->right = 0;
 		} else {
-			if (*p < len_avail ||
-			    *p >= (len_avail + hf->tree_used))
+			if ((ptn >> diffbits) < sub_first)
 				return (0);/* Invalid */
-			ht = &(hf->tree[*p - len_avail]);
-		}
-		while (--extlen > 0) {
-			if (ptn & bit) {
-				if (ht->left < len_avail) {
-					ht->left = len_avail + hf->tree_used;
-					ht = &(hf->tree[hf->tree_used++]);
-					if (hf->tree_used > hf->tree_avail)
-						return (0);/* Invalid */
-					ht->left = 0;
-					ht->right = 0;
-				} else {
-					ht = &(hf->tree[ht->left - len_avail]);
-				}
-			} else {
-				if (ht->right < len_avail) {
-					ht->right = len_avail + hf->tree_used;
-					ht = &(hf->tree[hf->tree_used++]);
-					if (hf->tree_used > hf->tree_avail)
-						return (0);/* Invalid */
-					ht->left = 0;
-					ht->right = 0;
-				} else {
-					ht = &(hf->tree[ht->right - len_avail]);
-				}
-			}
-			bit >>= 1;
-		}
-		if (ptn & bit) {
-			if (ht->left != 0)
-				return (0);/* Invalid */
-			ht->left = (uint16_t)i;
-		} else {
-			if (ht->right != 0)
-				return (0);/* Invalid */
-			ht->right = (uint16_t)i;
+			p = &(tbl[tbl_size +
+			    (((ptn >> diffbits) - sub_first) << diffbits) +
+			    (ptn & ((1 << diffbits) - 1))]);
 		}
+		/* Update the table */
+		while (--cnt >= 0)
+			p[cnt] = (uint16_t)i;
 	}
 	return (1);
 }
 
-static int
-lzx_decode_huffman_tree(struct huffman *hf, unsigned rbits, int c)
-{
-	struct htree_t *ht;
-	int extlen;
-
-	ht = hf->tree;
-	extlen = hf->shift_bits;
-	while (c >= hf->len_size) {
-		c -= hf->len_size;
-		if (extlen-- <= 0 || c >= hf->tree_used)
-			return (0);
-		if (rbits & (1U << extlen))
-			c = ht[c].left;
-		else
-			c = ht[c].right;
-	}
-	return (c);
-}
-
 static inline int
 lzx_decode_huffman(struct huffman *hf, unsigned rbits)
 {
 	int c;
 	/*
 	 * At first search an index table for a bit pattern.
-	 * If it fails, search a huffman tree for.
+	 * If the code is longer than HTBL_BITS, the entry points at
+	 * a second-level table for the rest of the bits.
 	 */
 	c = hf->tbl[rbits >> hf->shift_bits];
 	if (c < hf->len_size)
 		return (c);
-	/* This bit pattern needs to be found out at a huffman tree. */
-	return (lzx_decode_huffman_tree(hf, rbits, c));
+	return (hf->tbl[(1 << HTBL_BITS) +
+	    ((c - hf->len_size) << hf->shift_bits) +
+	    (rbits & ((1U << hf->shift_bits) - 1))]);
 }
 
@@ -56,6 +56,7 @@ archive_read_support_format_empty(struct archive *_a)
 	    NULL,
 	    NULL,
 	    NULL,
+	    NULL,
 	    NULL);
 
 	return (r);
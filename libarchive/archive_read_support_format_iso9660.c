@@ -263,6 +263,7 @@ struct file_info {
 	struct file_info	*parent;
 	struct file_info	*next;
 	struct file_info	*re_next;
+	struct file_info	*returned_next;
 	int		 subdirs;
 	uint64_t	 key;		/* Heap Key.			*/
 	uint64_t	 offset;	/* Offset on disk.		*/
@@ -313,6 +314,12 @@ struct heap_queue {
 	int		 used;
 };
 
+/* An entry of the index used by archive_read_seek_entry(). */
+struct iso9660_name_ref {
+	const char	*name;
+	size_t		 index;
+};
+
 struct iso9660 {
 	int	magic;
 #define ISO9660_MAGIC   0x96609660
@@ -350,6 +357,25 @@ struct iso9660 {
 		struct file_info	**last;
 	}	re_files;
 
+	/* Files read_header has returned, in that order. */
+	struct {
+		struct file_info	*first;
+		struct file_info	**last;
+	}	returned_files;
+	/*
+	 * Once archive_read_seek_entry() has read all directories,
+	 * this holds every entry in the order read_header returns
+	 * them, and read_header takes them from here.
+	 */
+	struct file_info		**entries;
+	size_t				 entries_cnt;
+	size_t				 entries_allocated;
+	size_t				 entry_index;
+	int				 entries_indexed;
+	/* Pathnames sorted for archive_read_seek_entry(). */
+	struct iso9660_name_ref		*names_index;
+	struct archive_string		 names;
+
 	uint64_t current_position;
 	ssize_t	logical_block_size;
 	uint64_t volume_size; /* Total size of volume in bytes. */
@@ -385,6 +411,8 @@ static int	archive_read_format_iso9660_cleanup(struct archive_read *);
 static int	archive_read_format_iso9660_read_data(struct archive_read *,
 		    const void **, size_t *, int64_t *);
 static int	archive_read_format_iso9660_read_data_skip(struct archive_read *);
+static int	archive_read_format_iso9660_seek_entry(struct archive_read *,
+		    const char *);
 static int	archive_read_format_iso9660_read_header(struct archive_read *,
 		    struct archive_entry *);
 static const char *build_pathname(struct archive_string *, struct file_info *, int);
@@ -464,6 +492,8 @@ archive_read_support_format_iso9660(struct archive *_a)
 	iso9660->cache_files.last = &(iso9660->cache_files.first);
 	iso9660->re_files.first = NULL;
 	iso9660->re_files.last = &(iso9660->re_files.first);
+	iso9660->returned_files.first = NULL;
+	iso9660->returned_files.last = &(iso9660->returned_files.first);
 	/* Enable to support Joliet extensions by default.	*/
 	iso9660->opt_support_joliet = 1;
 	/* Enable to support Rock Ridge extensions by default.	*/
@@ -480,7 +510,8 @@ archive_read_support_format_iso9660(struct archive *_a)
 	    NULL,
 	    archive_read_format_iso9660_cleanup,
 	    NULL,
-	    NULL);
+	    NULL,
+	    archive_read_format_iso9660_seek_entry);
 
 	if (r != ARCHIVE_OK) {
 		free(iso9660);
@@ -1162,32 +1193,14 @@ choose_volume(struct archive_read *a, struct iso9660 *iso9660)
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Set the full pathname of a file to the entry.
+ */
 static int
-archive_read_format_iso9660_read_header(struct archive_read *a,
-    struct archive_entry *entry)
+read_pathname(struct archive_read *a, struct iso9660 *iso9660,
+    struct file_info *file, struct archive_entry *entry)
 {
-	struct iso9660 *iso9660;
-	struct file_info *file;
-	int r, rd_r = ARCHIVE_OK;
-
-	iso9660 = (struct iso9660 *)(a->format->data);
-
-	if (!a->archive.archive_format) {
-		a->archive.archive_format = ARCHIVE_FORMAT_ISO9660;
-		a->archive.archive_format_name = "ISO9660";
-	}
-
-	if (iso9660->current_position == 0) {
-		r = choose_volume(a, iso9660);
-		if (r != ARCHIVE_OK)
-			return (r);
-	}
-
-	file = NULL;/* Eliminate a warning. */
-	/* Get the next entry that appears after the current offset. */
-	r = next_entry_seek(a, iso9660, &file);
-	if (r != ARCHIVE_OK)
-		return (r);
+	int r, ret = ARCHIVE_OK;
 
 	if (iso9660->seenJoliet) {
 		/*
@@ -1245,7 +1258,7 @@ archive_read_format_iso9660_read_header(struct archive_read *a,
 			    archive_string_conversion_charset_name(
 			      iso9660->sconv_utf16be));
 
-			rd_r = ARCHIVE_WARN;
+			ret = ARCHIVE_WARN;
 		}
 	} else {
 		const char *path = build_pathname(&iso9660->pathname, file, 0);
@@ -1259,6 +1272,41 @@ archive_read_format_iso9660_read_header(struct archive_read *a,
 			archive_entry_set_pathname(entry, path);
 		}
 	}
+	return (ret);
+}
+
+static int
+archive_read_format_iso9660_read_header(struct archive_read *a,
+    struct archive_entry *entry)
+{
+	struct iso9660 *iso9660;
+	struct file_info *file;
+	int r, rd_r = ARCHIVE_OK;
+
+	iso9660 = (struct iso9660 *)(a->format->data);
+
+	if (!a->archive.archive_format) {
+		a->archive.archive_format = ARCHIVE_FORMAT_ISO9660;
+		a->archive.archive_format_name = "ISO9660";
+	}
+
+	if (iso9660->current_position == 0) {
+		r = choose_volume(a, iso9660);
+		if (r != ARCHIVE_OK)
+			return (r);
+	}
+
+	file = NULL;/* Eliminate a warning. */
+	/* Get the next entry that appears after the current offset. */
+	r = next_entry_seek(a, iso9660, &file);
+	if (r != ARCHIVE_OK)
+		return (r);
+
+	r = read_pathname(a, iso9660, file, entry);
+	if (r == ARCHIVE_FATAL)
+		return (r);
+	if (r != ARCHIVE_OK)
+		rd_r = r;
 
 	iso9660->entry_bytes_remaining = file->size;
 	/* Offset for sparse-file-aware clients. */
@@ -1723,6 +1771,9 @@ archive_read_format_iso9660_cleanup(struct archive_read *a)
 	free(iso9660->read_ce_req.reqs);
 	archive_string_free(&iso9660->pathname);
 	archive_string_free(&iso9660->previous_pathname);
+	archive_string_free(&iso9660->names);
+	free(iso9660->names_index);
+	free(iso9660->entries);
 	if (iso9660->pending_files.files)
 		free(iso9660->pending_files.files);
 #ifdef HAVE_ZLIB_H
@@ -2666,6 +2717,166 @@ release_files(struct iso9660 *iso9660)
 	}
 }
 
+static int
+entries_add(struct archive_read *a, struct iso9660 *iso9660,
+    struct file_info *file)
+{
+	if (iso9660->entries_cnt >= iso9660->entries_allocated) {
+		struct file_info **p;
+		size_t new_size;
+
+		new_size = iso9660->entries_allocated * 2;
+		if (new_size < 64)
+			new_size = 64;
+		p = realloc(iso9660->entries, new_size * sizeof(*p));
+		if (p == NULL) {
+			archive_set_error(&a->archive, ENOMEM, "No memory");
+			return (ARCHIVE_FATAL);
+		}
+		iso9660->entries = p;
+		iso9660->entries_allocated = new_size;
+	}
+	iso9660->entries[iso9660->entries_cnt++] = file;
+	return (ARCHIVE_OK);
+}
+
+static int
+cmp_name_ref(const void *p1, const void *p2)
+{
+	const struct iso9660_name_ref *r1 =
+	    (const struct iso9660_name_ref *)p1;
+	const struct iso9660_name_ref *r2 =
+	    (const struct iso9660_name_ref *)p2;
+	int r;
+
+	r = strcmp(r1->name, r2->name);
+	if (r != 0)
+		return (r);
+	if (r1->index < r2->index)
+		return (-1);
+	return (r1->index > r2->index);
+}
+
+/*
+ * Read all remaining directories, without reading file bodies, so
+ * that `entries' holds every entry in the order read_header returns
+ * them, and index their pathnames.  Reading carries on after the
+ * entries already returned.
+ */
+static int
+build_entry_index(struct archive_read *a, struct iso9660 *iso9660)
+{
+	struct archive_entry *entry;
+	struct file_info *file;
+	size_t *offsets, i, returned;
+	int r;
+
+	for (file = iso9660->returned_files.first; file != NULL;
+	    file = file->returned_next) {
+		if (entries_add(a, iso9660, file) != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+	}
+	returned = iso9660->entries_cnt;
+	for (;;) {
+		r = next_cache_entry(a, iso9660, &file);
+		if (r == ARCHIVE_EOF)
+			break;
+		/* read_header skips a directory it cannot read, too. */
+		if (r == ARCHIVE_WARN)
+			continue;
+		if (r != ARCHIVE_OK)
+			return (r);
+		if (entries_add(a, iso9660, file) != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+	}
+	iso9660->entries_indexed = 1;
+	iso9660->entry_index = returned;
+
+	entry = archive_entry_new2(&a->archive);
+	offsets = malloc((iso9660->entries_cnt + 1) * sizeof(*offsets));
+	iso9660->names_index = malloc((iso9660->entries_cnt + 1) *
+	    sizeof(*iso9660->names_index));
+	if (entry == NULL || offsets == NULL ||
+	    iso9660->names_index == NULL) {
+		archive_set_error(&a->archive, ENOMEM, "No memory");
+		r = ARCHIVE_FATAL;
+		goto done;
+	}
+	for (i = 0; i < iso9660->entries_cnt; i++) {
+		const char *name;
+
+		/* A name which cannot be converted is indexed as far
+		 * as it could be, which is what read_header returns. */
+		r = read_pathname(a, iso9660, iso9660->entries[i], entry);
+		if (r == ARCHIVE_FATAL)
+			goto done;
+		name = archive_entry_pathname(entry);
+		offsets[i] = archive_strlen(&iso9660->names);
+		archive_strcat(&iso9660->names, (name != NULL)? name: "");
+		archive_strappend_char(&iso9660->names, '\0');
+	}
+	for (i = 0; i < iso9660->entries_cnt; i++) {
+		iso9660->names_index[i].name = iso9660->names.s + offsets[i];
+		iso9660->names_index[i].index = i;
+	}
+	qsort(iso9660->names_index, iso9660->entries_cnt,
+	    sizeof(*iso9660->names_index), cmp_name_ref);
+	r = ARCHIVE_OK;
+done:
+	if (r != ARCHIVE_OK) {
+		free(iso9660->names_index);
+		iso9660->names_index = NULL;
+	}
+	free(offsets);
+	archive_entry_free(entry);
+	return (r);
+}
+
+static int
+archive_read_format_iso9660_seek_entry(struct archive_read *a,
+    const char *pathname)
+{
+	struct iso9660 *iso9660 = (struct iso9660 *)(a->format->data);
+	size_t lo, hi, mid;
+	int r;
+
+	if (!iso9660->entries_indexed) {
+		if (iso9660->current_position == 0) {
+			r = choose_volume(a, iso9660);
+			if (r != ARCHIVE_OK)
+				return (r);
+		}
+		r = build_entry_index(a, iso9660);
+		if (r != ARCHIVE_OK)
+			return (r);
+	}
+
+	/* Find the first name greater than pathname; the entry just
+	 * before it is the last copy of pathname, if there is one. */
+	lo = 0;
+	hi = iso9660->entries_cnt;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(iso9660->names_index[mid].name, pathname) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 ||
+	    strcmp(iso9660->names_index[lo - 1].name, pathname) != 0) {
+		archive_set_error(&a->archive, ENOENT,
+		    "%s: Not found in archive", pathname);
+		return (ARCHIVE_FAILED);
+	}
+	iso9660->entry_index = iso9660->names_index[lo - 1].index;
+	/* The body of the entry is read again even if it is shared with
+	 * the entry returned last. */
+	iso9660->previous_number = -1;
+	iso9660->entry_bytes_remaining = 0;
+	iso9660->entry_content = NULL;
+	return (ARCHIVE_OK);
+}
+
 static int
 next_entry_seek(struct archive_read *a, struct iso9660 *iso9660,
     struct file_info **pfile)
@@ -2673,9 +2884,19 @@ next_entry_seek(struct archive_read *a, struct iso9660 *iso9660,
 	struct file_info *file;
 	int r;
 
-	r = next_cache_entry(a, iso9660, pfile);
-	if (r != ARCHIVE_OK)
-		return (r);
+	if (iso9660->entries_indexed) {
+		if (iso9660->entry_index >= iso9660->entries_cnt)
+			return (ARCHIVE_EOF);
+		*pfile = iso9660->entries[iso9660->entry_index++];
+	} else {
+		r = next_cache_entry(a, iso9660, pfile);
+		if (r != ARCHIVE_OK)
+			return (r);
+		/* Remember it in case archive_read_seek_entry() is used. */
+		(*pfile)->returned_next = NULL;
+		*iso9660->returned_files.last = *pfile;
+		iso9660->returned_files.last = &((*pfile)->returned_next);
+	}
 	file = *pfile;
 
 	/* Don't waste time seeking for zero-length bodies. */
@@ -108,21 +108,17 @@ struct lzh_dec {
 		/*
 		 * Use a index table. It's faster than searching a huffman
 		 * coding tree, which is a binary tree. But a use of a large
-		 * index table causes L1 cache read miss many times.
+		 * index table causes L1 cache read miss many times.  LHa
+		 * codes are up to 16 bits; the rare ones longer than
+		 * HTBL_BITS continue in second-level tables that follow
+		 * the first 1 << HTBL_BITS entries.
 		 */
 #define HTBL_BITS	10
 		int		 max_bits;
 		int		 shift_bits;
 		int		 tbl_bits;
-		int		 tree_used;
-		int		 tree_avail;
 		/* Direct access table. */
 		uint16_t	*tbl;
-		/* Binary tree table for extra bits over the direct access. */
-		struct htree_t {
-			uint16_t left;
-			uint16_t right;
-		}		*tree;
 	}			 lt, pt;
 
 	int			 blocks_avail;
@@ -250,7 +246,6 @@ static int	lzh_read_pt_bitlen(struct lzh_stream *, int start, int end);
 static int	lzh_make_fake_table(struct huffman *, uint16_t);
 static int	lzh_make_huffman_table(struct huffman *);
 static inline int lzh_decode_huffman(struct huffman *, unsigned);
-static int	lzh_decode_huffman_tree(struct huffman *, unsigned, int);
 
 
 int
@@ -282,6 +277,7 @@ archive_read_support_format_lha(struct archive *_a)
 	    NULL,
 	    archive_read_format_lha_cleanup,
 	    NULL,
+	    NULL,
 	    NULL);
 
 	if (r != ARCHIVE_OK)
@@ -1660,11 +1656,11 @@ lha_calcsum(unsigned char sum, const void *pp, int offset, size_t size)
 	return (sum);
 }
 
-static uint16_t crc16tbl[2][256];
+static uint16_t crc16tbl[8][256];
 static void
 lha_crc16_init(void)
 {
-	unsigned int i;
+	unsigned int i, t;
 	static int crc16init = 0;
 
 	if (crc16init)
@@ -1679,9 +1675,15 @@ lha_crc16_init(void)
 		crc16tbl[0][i] = crc;
 	}
 
-	for (i = 0; i < 256; i++) {
-		crc16tbl[1][i] = (crc16tbl[0][i] >> 8)
-			^ crc16tbl[0][crc16tbl[0][i] & 0xff];
+	/*
+	 * crc16tbl[t][i] is the CRC of the byte i followed by t zero
+	 * bytes; it lets lha_crc16() fold eight bytes at once.
+	 */
+	for (t = 1; t < 8; t++) {
+		for (i = 0; i < 256; i++) {
+			crc16tbl[t][i] = (crc16tbl[t-1][i] >> 8)
+				^ crc16tbl[0][crc16tbl[t-1][i] & 0xff];
+		}
 	}
 }
 
@@ -1689,57 +1691,22 @@ static uint16_t
 lha_crc16(uint16_t crc, const void *pp, size_t len)
 {
 	const unsigned char *p = (const unsigned char *)pp;
-	const uint16_t *buff;
-	const union {
-		uint32_t i;
-		char c[4];
-	} u = { 0x01020304 };
 
-	if (len == 0)
-		return crc;
-
-	/* Process unaligned address. */
-	if (((uintptr_t)p) & (uintptr_t)0x1) {
-		crc = (crc >> 8) ^ crc16tbl[0][(crc ^ *p++) & 0xff];
-		len--;
-	}
-	buff = (const uint16_t *)p;
 	/*
-	 * Modern C compiler such as GCC does not unroll automatically yet
-	 * without unrolling pragma, and Clang is so. So we should
-	 * unroll this loop for its performance.
+	 * Slicing-by-8: the eight table lookups of each round are
+	 * independent of each other, unlike the byte-at-a-time loop
+	 * where every step waits for the previous one.  Reading the
+	 * input a byte at a time keeps this free of alignment and
+	 * byte order concerns.
 	 */
-	for (;len >= 8; len -= 8) {
-		/* This if statement expects compiler optimization will
-		 * remove the stament which will not be executed. */
-#undef bswap16
-#if defined(_MSC_VER) && _MSC_VER >= 1400  /* Visual Studio */
-#  define bswap16(x) _byteswap_ushort(x)
-#elif defined(__GNUC__) && ((__GNUC__ == 4 && __GNUC_MINOR__ >= 8) || __GNUC__ > 4)
-/* GCC 4.8 and later has __builtin_bswap16() */
-#  define bswap16(x) __builtin_bswap16(x)
-#elif defined(__clang__)
-/* All clang versions have __builtin_bswap16() */
-#  define bswap16(x) __builtin_bswap16(x)
-#else
-#  define bswap16(x) ((((x) >> 8) & 0xff) | ((x) << 8))
-#endif
-#define CRC16W	do { 	\
-		if(u.c[0] == 1) { /* Big endian */		\
-			crc ^= bswap16(*buff); buff++;		\
-		} else						\
-			crc ^= *buff++;				\
-		crc = crc16tbl[1][crc & 0xff] ^ crc16tbl[0][crc >> 8];\
-} while (0)
-		CRC16W;
-		CRC16W;
-		CRC16W;
-		CRC16W;
-#undef CRC16W
-#undef bswap16
+	for (;len >= 8; len -= 8, p += 8) {
+		crc ^= (uint16_t)(p[0] | (p[1] << 8));
+		crc = crc16tbl[7][crc & 0xff] ^ crc16tbl[6][crc >> 8] ^
+		    crc16tbl[5][p[2]] ^ crc16tbl[4][p[3]] ^
+		    crc16tbl[3][p[4]] ^ crc16tbl[2][p[5]] ^
+		    crc16tbl[1][p[6]] ^ crc16tbl[0][p[7]];
 	}
 
-	p = (const unsigned char *)buff;
 	for (;len; len--) {
 		crc = (crc >> 8) ^ crc16tbl[0][(crc ^ *p++) & 0xff];
 	}
@@ -2383,24 +2350,31 @@ lzh_decode_blocks(struct lzh_stream *strm, int last)
 					if (l > w_size - w_pos)
 						l = w_size - w_pos;
 				}
-				if ((copy_pos + l < w_pos)
-				    || (w_pos + l < copy_pos)) {
-					/* No overlap. */
-					memcpy(w_buff + w_pos,
+				if (copy_pos >= w_pos || w_pos - copy_pos >= l) {
+					/* The match starts at least l bytes
+					 * back in the window, so source and
+					 * destination do not overlap. */
+					memmove(w_buff + w_pos,
 					    w_buff + copy_pos, l);
+				} else if (w_pos - copy_pos == 1) {
+					/* A match at position 0 repeats the
+					 * byte just decoded. */
+					memset(w_buff + w_pos,
+					    w_buff[copy_pos], l);
 				} else {
 					const unsigned char *s;
 					unsigned char *d;
+					int dist = w_pos - copy_pos;
 					int li;
 
+					/* The match overlaps the bytes it
+					 * writes; each dist bytes written are
+					 * the source of the next dist. */
 					d = w_buff + w_pos;
 					s = w_buff + copy_pos;
-					for (li = 0; li < l-1;) {
-						d[li] = s[li];li++;
-						d[li] = s[li];li++;
-					}
-					if (li < l)
-						d[li] = s[li];
+					for (li = 0; li < l; li += dist)
+						memcpy(d + li, s + li,
+						    (l - li < dist)? l - li: dist);
 				}
 				w_pos += l;
 				if (w_pos == w_size) {
@@ -2439,7 +2413,7 @@ next_data:
 static int
 lzh_huffman_init(struct huffman *hf, size_t len_size, int tbl_bits)
 {
-	int bits;
+	size_t tbl_size;
 
 	if (hf->bitlen == NULL) {
 		hf->bitlen = malloc(len_size * sizeof(hf->bitlen[0]));
@@ -2447,20 +2421,19 @@ lzh_huffman_init(struct huffman *hf, size_t len_size, int tbl_bits)
 			return (ARCHIVE_FATAL);
 	}
 	if (hf->tbl == NULL) {
-		if (tbl_bits < HTBL_BITS)
-			bits = tbl_bits;
+		/*
+		 * However many long codes there are, the second-level
+		 * tables fit in 1 << tbl_bits entries.
+		 */
+		if (tbl_bits <= HTBL_BITS)
+			tbl_size = (size_t)1 << tbl_bits;
 		else
-			bits = HTBL_BITS;
-		hf->tbl = malloc(((size_t)1 << bits) * sizeof(hf->tbl[0]));
+			tbl_size = ((size_t)1 << HTBL_BITS) +
+			    ((size_t)1 << tbl_bits);
+		hf->tbl = malloc(tbl_size * sizeof(hf->tbl[0]));
 		if (hf->tbl == NULL)
 			return (ARCHIVE_FATAL);
 	}
-	if (hf->tree == NULL && tbl_bits > HTBL_BITS) {
-		hf->tree_avail = 1 << (tbl_bits - HTBL_BITS + 4);
-		hf->tree = malloc(hf->tree_avail * sizeof(hf->tree[0]));
-		if (hf->tree == NULL)
-			return (ARCHIVE_FATAL);
-	}
 	hf->len_size = (int)len_size;
 	hf->tbl_bits = tbl_bits;
 	return (ARCHIVE_OK);
@@ -2471,7 +2444,6 @@ lzh_huffman_free(struct huffman *hf)
 {
 	free(hf->bitlen);
 	free(hf->tbl);
-	free(hf->tree);
 }
 
 static char bitlen_tbl[0x400] = {
@@ -2598,9 +2570,9 @@ lzh_make_huffman_table(struct huffman *hf)
 {
 	uint16_t *tbl;
 	const unsigned char *bitlen;
-	int bitptn[17], weight[17];
+	int bitptn[18], weight[17];
 	int i, maxbits = 0, ptn, tbl_size, w;
-	int diffbits, len_avail;
+	int diffbits, len_avail, sub_first;
 
 	/*
 	 * Initialize bit patterns.
@@ -2614,6 +2586,7 @@ lzh_make_huffman_table(struct huffman *hf)
 			maxbits = i;
 		}
 	}
+	bitptn[17] = ptn;
 	if (ptn != 0x10000 || maxbits > hf->tbl_bits)
 		return (0);/* Invalid */
 
@@ -2626,43 +2599,42 @@ lzh_make_huffman_table(struct huffman *hf)
 	 */
 	if (maxbits < 16) {
 		int ebits = 16 - maxbits;
-		for (i = 1; i <= maxbits; i++) {
+		for (i = 1; i <= maxbits + 1; i++) {
 			bitptn[i] >>= ebits;
-			weight[i] >>= ebits;
+			if (i <= maxbits)
+				weight[i] >>= ebits;
 		}
 	}
-	if (maxbits > HTBL_BITS) {
-		unsigned htbl_max;
-		uint16_t *p;
-
+	if (maxbits > HTBL_BITS)
 		diffbits = maxbits - HTBL_BITS;
-		for (i = 1; i <= HTBL_BITS; i++) {
-			bitptn[i] >>= diffbits;
-			weight[i] >>= diffbits;
-		}
-		htbl_max = bitptn[HTBL_BITS] +
-		    weight[HTBL_BITS] * hf->freq[HTBL_BITS];
-		p = &(hf->tbl[htbl_max]);
-		while (p < &hf->tbl[1U<<HTBL_BITS])
-			*p++ = 0;
-	} else
+	else
 		diffbits = 0;
 	hf->shift_bits = diffbits;
 
-	/*
-	 * Make the table.
-	 */
 	tbl_size = 1 << HTBL_BITS;
 	tbl = hf->tbl;
 	bitlen = hf->bitlen;
 	len_avail = hf->len_avail;
-	hf->tree_used = 0;
+
+	/*
+	 * In canonical order the long codes take the highest bit
+	 * patterns, so the first-level entries from sub_first to the
+	 * end are exactly their HTBL_BITS-bit prefixes.  Each of them
+	 * refers to a second-level table of 1 << diffbits entries.
+	 */
+	if (diffbits) {
+		sub_first = bitptn[HTBL_BITS + 1] >> diffbits;
+		for (i = sub_first; i < tbl_size; i++)
+			tbl[i] = (uint16_t)(len_avail + i - sub_first);
+	} else
+		sub_first = tbl_size;
+
+	/*
+	 * Make the table.
+	 */
 	for (i = 0; i < len_avail; i++) {
 		uint16_t *p;
 		int len, cnt;
-		uint16_t bit;
-		int extlen;
-		struct htree_t *ht;
 
 		if (bitlen[i] == 0)
 			continue;
@@ -2670,142 +2642,74 @@ lzh_make_huffman_table(struct huffman *hf)
 		len = bitlen[i];
 		ptn = bitptn[len];
 		cnt = weight[len];
+		/* Calculate next bit pattern */
+		bitptn[len] = ptn + cnt;
 		if (len <= HTBL_BITS) {
-			/* Calculate next bit pattern */
-			if ((bitptn[len] = ptn + cnt) > tbl_size)
+			ptn >>= diffbits;
+			cnt >>= diffbits;
+			if (ptn + cnt > tbl_size)
 				return (0);/* Invalid */
-			/* Update the table */
 			p = &(tbl[ptn]);
+		} else {
+			if ((ptn >> diffbits) < sub_first)
+				return (0);/* Invalid */
+			p = &(tbl[tbl_size +
+			    (((ptn >> diffbits) - sub_first) << diffbits) +
+			    (ptn & ((1 << diffbits) - 1))]);
+		}
+		/* Update the table */
+		if (cnt > 7) {
+			uint16_t *pc;
+
+			cnt -= 8;
+			pc = &p[cnt];
+			pc[0] = (uint16_t)i;
+			pc[1] = (uint16_t)i;
+			pc[2] = (uint16_t)i;
+			pc[3] = (uint16_t)i;
+			pc[4] = (uint16_t)i;
+			pc[5] = (uint16_t)i;
+			pc[6] = (uint16_t)i;
+			pc[7] = (uint16_t)i;
 			if (cnt > 7) {
-				uint16_t *pc;
-
 				cnt -= 8;
+				memcpy(&p[cnt], pc,
+					8 * sizeof(uint16_t));
 				pc = &p[cnt];
-				pc[0] = (uint16_t)i;
-				pc[1] = (uint16_t)i;
-				pc[2] = (uint16_t)i;
-				pc[3] = (uint16_t)i;
-				pc[4] = (uint16_t)i;
-				pc[5] = (uint16_t)i;
-				pc[6] = (uint16_t)i;
-				pc[7] = (uint16_t)i;
-				if (cnt > 7) {
-					cnt -= 8;
+				while (cnt > 15) {
+					cnt -= 16;
 					memcpy(&p[cnt], pc,
-						8 * sizeof(uint16_t));
-					pc = &p[cnt];
-					while (cnt > 15) {
-						cnt -= 16;
-						memcpy(&p[cnt], pc,
-							16 * sizeof(uint16_t));
-					}
-				}
-				if (cnt)
-					memcpy(p, pc, cnt * sizeof(uint16_t));
-			} else {
-				while (cnt > 1) {
-					p[--cnt] = (uint16_t)i;
-					p[--cnt] = (uint16_t)i;
+						16 * sizeof(uint16_t));
 				}
-				if (cnt)
-					p[--cnt] = (uint16_t)i;
 			}
-			continue;
-		}
-
-		/*
-		 * A bit length is too big to be housed to a direct table,
-		 * so we use a tree model for its extra bits.
-		 */
-		bitptn[len] = ptn + cnt;
-		bit = 1U << (diffbits -1);
-		extlen = len - HTBL_BITS;
-		
-		p = &(tbl[ptn >> diffbits]);
-		if (*p == 0) {
-			*p = len_avail + hf->tree_used;
-			ht = &(hf->tree[hf->tree_used++]);
-			if (hf->tree_used > hf->tree_avail)
-				return (0);/* Invalid */
-			ht->left = 0;
-			ht->right = 0;
+			if (cnt)
+				memcpy(p, pc, cnt * sizeof(uint16_t));
 		} else {
-			if (*p < len_avail ||
-			    *p >= (len_avail + hf->tree_used))
-				return (0);/* Invalid */
-			ht = &(hf->tree[*p - len_avail]);
-		}
-		while (--extlen > 0) {
-			if (ptn & bit) {
-				if (ht->left < len_avail) {
-					ht->left = len_avail + hf->tree_used;
-					ht = &(hf->tree[hf->tree_used++]);
-					if (hf->tree_used > hf->tree_avail)
-						return (0);/* Invalid */
-					ht->left = 0;
-					ht->right = 0;
-				} else {
-					ht = &(hf->tree[ht->left - len_avail]);
-				}
-			} else {
-				if (ht->right < len_avail) {
-					ht->right = len_avail + hf->tree_used;
-					ht = &(hf->tree[hf->tree_used++]);
-					if (hf->tree_used > hf->tree_avail)
-						return (0);/* Invalid */
-					ht->left = 0;
-					ht->right = 0;
-				} else {
-					ht = &(hf->tree[ht->right - len_avail]);
-				}
+			while (cnt > 1) {
+				p[--cnt] = (uint16_t)i;
+				p[--cnt] = (uint16_t)i;
 			}
-			bit >>= 1;
-		}
-		if (ptn & bit) {
-			if (ht->left != 0)
-				return (0);/* Invalid */
-			ht->left = (uint16_t)i;
-		} else {
-			if (ht->right != 0)
-				return (0);/* Invalid */
-			ht->right = (uint16_t)i;
+			if (cnt)
+				p[--cnt] = (uint16_t)i;
 		}
 	}
 	return (1);
 }
 
-static int
-lzh_decode_huffman_tree(struct huffman *hf, unsigned rbits, int c)
-{
-	struct htree_t *ht;
-	int extlen;
-
-	ht = hf->tree;
-	extlen = hf->shift_bits;
-	while (c >= hf->len_avail) {
-		c -= hf->len_avail;
-		if (extlen-- <= 0 || c >= hf->tree_used)
-			return (0);
-		if (rbits & (1U << extlen))
-			c = ht[c].left;
-		else
-			c = ht[c].right;
-	}
-	return (c);
-}
-
 static inline int
 lzh_decode_huffman(struct huffman *hf, unsigned rbits)
 {
 	int c;
 	/*
 	 * At first search an index table for a bit pattern.
-	 * If it fails, search a huffman tree for.
+	 * A value of len_avail or more is not a symbol but the
+	 * number of a second-level table, offset by len_avail.
 	 */
 	c = hf->tbl[rbits >> hf->shift_bits];
 	if (c < hf->len_avail || hf->len_avail == 0)
 		return (c);
-	/* This bit pattern needs to be found out at a huffman tree. */
-	return (lzh_decode_huffman_tree(hf, rbits, c));
+	return (hf->tbl[(1 << HTBL_BITS) +
+	    ((c - hf->len_avail) << hf->shift_bits) +
+	    (rbits & ((1U << hf->shift_bits) - 1))]);
 }
 
@@ -143,6 +143,16 @@
  */
 #define UNP_BUFFER_SIZE   (128 * 1024)
 
+/*
+ * Once a compressed entry has been seeked, a snapshot of the decoder
+ * is kept every CHECKPOINT_INTERVAL bytes of output so that a later
+ * seek only has to decode from the nearest one.  Each snapshot holds
+ * a copy of the window; when MAX_CHECKPOINTS are held, every other
+ * one is dropped and the interval doubles.
+ */
+#define CHECKPOINT_INTERVAL (4 * 1024 * 1024)
+#define MAX_CHECKPOINTS   16
+
 /* Define this here for non-Windows platforms */
 #if !((defined(__WIN32__) || defined(_WIN32) || defined(__WIN32)) && !defined(__CYGWIN__))
 #define FILE_ATTRIBUTE_DIRECTORY 0x10
@@ -178,7 +188,7 @@ struct huffman_tree_node
 
 struct huffman_table_entry
 {
-  unsigned int length;
+  int length;
   int value;
 };
 
@@ -207,6 +217,28 @@ struct data_block_offsets
   int64_t end_offset;
 };
 
+struct rar_checkpoint
+{
+  int64_t offset;
+  int64_t bytes_remaining;
+  int64_t bytes_uncopied;
+  int64_t lzss_position;
+  uint64_t cache_buffer;
+  int cache_avail;
+  unsigned long crc_calculated;
+  unsigned int dictionary_size;
+  unsigned char *window;
+  unsigned char lengthtable[HUFFMAN_TABLE_SIZE];
+  char start_new_block;
+  char start_new_table;
+  char output_last_match;
+  unsigned int lastlength;
+  unsigned int lastoffset;
+  unsigned int oldoffset[4];
+  unsigned int lastlowoffset;
+  unsigned int numlowoffsetrepeats;
+};
+
 struct rar
 {
   /* Entries from main RAR header */
@@ -275,6 +307,16 @@ struct rar
   int64_t filterstart;
   char start_new_table;
 
+  /* Decoder snapshots for seeking in compressed data */
+  struct rar_checkpoint *checkpoints;
+  unsigned int checkpoints_count;
+  int64_t checkpoint_interval;
+  int64_t checkpoint_next;
+  /* Where the block last returned from unp_buffer starts, and the
+   * CRC of the data before it. */
+  int64_t last_block_offset;
+  unsigned long last_block_crc;
+
   /* PPMd Variant H members */
   char ppmd_valid;
   char ppmd_eod;
@@ -339,6 +381,7 @@ static int read_data_compressed(struct archive_read *, const void **, size_t *,
                           int64_t *);
 static int rar_br_preparation(struct archive_read *, struct rar_br *);
 static int parse_codes(struct archive_read *);
+static int create_codes(struct archive_read *);
 static void free_codes(struct archive_read *);
 static int read_next_symbol(struct archive_read *, struct huffman_code *);
 static int create_code(struct archive_read *, struct huffman_code *,
@@ -349,7 +392,12 @@ static int new_node(struct huffman_code *);
 static int make_table(struct archive_read *, struct huffman_code *);
 static int make_table_recurse(struct archive_read *, struct huffman_code *, int,
                               struct huffman_table_entry *, int, int);
+static int tree_depth(struct huffman_code *, int, int);
 static int64_t expand(struct archive_read *, int64_t);
+static void save_checkpoint(struct rar *);
+static int restore_checkpoint(struct archive_read *, struct rar_checkpoint *);
+static void free_checkpoints(struct rar *);
+static int64_t seek_data_compressed(struct archive_read *, int64_t, int);
 static int copy_from_lzss_window(struct archive_read *, const void **,
                                    int64_t, int);
 static const void *rar_read_ahead(struct archive_read *, size_t, ssize_t *);
@@ -591,9 +639,23 @@ lzss_emit_match(struct rar *rar, int offset, int length)
     }
     d = &(rar->lzss.window[dstoffs]);
     s = &(rar->lzss.window[srcoffs]);
-    if ((dstoffs + l < srcoffs) || (srcoffs + l < dstoffs))
+    if ((dstoffs + l <= srcoffs) || (srcoffs + l <= dstoffs))
       memcpy(d, s, l);
-    else {
+    else if (dstoffs < srcoffs)
+      /* The source is ahead, so it is never overwritten before
+       * it is read. */
+      memmove(d, s, l);
+    else if (dstoffs - srcoffs == 1)
+      /* A run of the previous byte. */
+      memset(d, *s, l);
+    else if (dstoffs - srcoffs >= 8) {
+      /* The source trails by at least 8 bytes, so each 8-byte copy
+       * reads only bytes already written. */
+      for (li = 0; li + 8 <= l; li += 8)
+        memcpy(d + li, s + li, 8);
+      for (; li < l; li++)
+        d[li] = s[li];
+    } else {
       for (li = 0; li < l; li++)
         d[li] = s[li];
     }
@@ -672,7 +734,8 @@ archive_read_support_format_rar(struct archive *_a)
                                      archive_read_format_rar_seek_data,
                                      archive_read_format_rar_cleanup,
                                      archive_read_support_format_rar_capabilities,
-                                     archive_read_format_rar_has_encrypted_entries);
+                                     archive_read_format_rar_has_encrypted_entries,
+                                     NULL);
 
   if (r != ARCHIVE_OK)
     free(rar);
@@ -1005,6 +1068,8 @@ archive_read_format_rar_read_data(struct archive_read *a, const void **buff,
                                   size_t *size, int64_t *offset)
 {
   struct rar *rar = (struct rar *)(a->format->data);
+  int64_t start;
+  unsigned long crc;
   int ret;
 
   if (rar->has_encrypted_entries == ARCHIVE_READ_FORMAT_ENCRYPTION_DONT_KNOW) {
@@ -1037,9 +1102,16 @@ archive_read_format_rar_read_data(struct archive_read *a, const void **buff,
   case COMPRESS_METHOD_NORMAL:
   case COMPRESS_METHOD_GOOD:
   case COMPRESS_METHOD_BEST:
+    start = rar->offset - rar->unp_offset;
+    crc = rar->crc_calculated;
     ret = read_data_compressed(a, buff, size, offset);
     if (ret != ARCHIVE_OK && ret != ARCHIVE_WARN)
       __archive_ppmd7_functions.Ppmd7_Free(&rar->ppmd7_context, &g_szalloc);
+    else if (*size > 0)
+    {
+      rar->last_block_offset = start;
+      rar->last_block_crc = crc;
+    }
     break;
 
   default:
@@ -1234,6 +1306,10 @@ archive_read_format_rar_seek_data(struct archive_read *a, int64_t offset,
     rar->offset_seek = ret;
     return rar->offset_seek;
   }
+  else if (!(rar->main_flags & MHD_VOLUME) &&
+    rar->compression_method >= COMPRESS_METHOD_FASTEST &&
+    rar->compression_method <= COMPRESS_METHOD_BEST)
+    return seek_data_compressed(a, offset, whence);
   else
   {
     archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
@@ -1242,6 +1318,307 @@ archive_read_format_rar_seek_data(struct archive_read *a, int64_t offset,
   return (ARCHIVE_FAILED);
 }
 
+/*
+ * Seek within a compressed entry by decoding up to the target.
+ * Solid archives are refused at the header, so every entry starts
+ * with a fresh decoder.  Checkpoints are only taken once the entry has
+ * been seeked; at most MAX_CHECKPOINTS are kept, CHECKPOINT_INTERVAL
+ * (4 MiB) apart at first, and the spacing doubles each time they fill
+ * up.  Entries that use PPMd get no checkpoints, so they, like seeks
+ * before the first checkpoint, decode from the start of the entry
+ * unless the target lies ahead of the current position.
+ */
+static int64_t
+seek_data_compressed(struct archive_read *a, int64_t offset, int whence)
+{
+  struct rar *rar = (struct rar *)(a->format->data);
+  struct rar_checkpoint *ck;
+  const void *buff;
+  size_t size;
+  int64_t client_offset, pos, start, outoffset;
+  unsigned long crc;
+  unsigned int i;
+  int ret;
+
+  switch (whence)
+  {
+    case SEEK_CUR:
+      client_offset = rar->offset_seek + a->archive.read_data_output_offset;
+      break;
+    case SEEK_END:
+      client_offset = rar->unp_size;
+      break;
+    case SEEK_SET:
+    default:
+      client_offset = 0;
+  }
+  client_offset += offset;
+  if (client_offset < 0)
+  {
+    /* Can't seek past beginning of data block */
+    return -1;
+  }
+
+  if (rar->bytes_unconsumed > 0) {
+    /* Consume as much as the decompressor actually used. */
+    __archive_read_consume(a, rar->bytes_unconsumed);
+    rar->bytes_unconsumed = 0;
+  }
+  __archive_reset_read_data(&a->archive);
+  rar->offset_seek = client_offset;
+
+  /*
+   * Past the end, read_data() reports EOF; the decoder is left
+   * where it is.
+   */
+  if (client_offset >= rar->unp_size)
+    return client_offset;
+
+  if (rar->checkpoint_interval == 0)
+  {
+    rar->checkpoints = (struct rar_checkpoint *)calloc(MAX_CHECKPOINTS,
+      sizeof(*rar->checkpoints));
+    if (rar->checkpoints == NULL)
+    {
+      archive_set_error(&a->archive, ENOMEM,
+                        "Can't allocate memory for RAR seek data");
+      return (ARCHIVE_FATAL);
+    }
+    rar->checkpoint_interval = CHECKPOINT_INTERVAL;
+    rar->checkpoint_next = 0;
+  }
+
+  /*
+   * Decode from wherever is nearest at or before the target: the
+   * current position, the latest checkpoint, or the start of the
+   * entry.  The data between the current position and rar->offset
+   * is already in unp_buffer; so is the block last returned, until
+   * decoding resumes.
+   */
+  if (rar->unp_offset == 0 && rar->last_block_offset <= client_offset &&
+    client_offset < rar->offset)
+  {
+    rar->crc_calculated = rar->last_block_crc;
+    rar->unp_offset = (unsigned int)(rar->offset - rar->last_block_offset);
+    rar->entry_eof = 0;
+  }
+  ck = NULL;
+  for (i = 0; i < rar->checkpoints_count; i++)
+  {
+    if (rar->checkpoints[i].offset <= client_offset)
+      ck = &rar->checkpoints[i];
+  }
+  pos = rar->offset - rar->unp_offset;
+  if (!rar->valid || rar->entry_eof || pos > client_offset ||
+    (ck != NULL && ck->offset > pos))
+  {
+    if ((ret = restore_checkpoint(a, ck)) != ARCHIVE_OK)
+      return (ret);
+    pos = rar->offset;
+  }
+
+  while (rar->offset <= client_offset && pos < client_offset)
+  {
+    crc = rar->crc_calculated;
+    ret = read_data_compressed(a, &buff, &size, &outoffset);
+    if (ret != ARCHIVE_OK && ret != ARCHIVE_WARN)
+    {
+      __archive_ppmd7_functions.Ppmd7_Free(&rar->ppmd7_context, &g_szalloc);
+      if (ret == ARCHIVE_EOF)
+      {
+        archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+                          "Truncated RAR file data");
+        ret = ARCHIVE_FATAL;
+      }
+      return (ret);
+    }
+    start = pos;
+    pos += size;
+    rar->last_block_offset = start;
+    rar->last_block_crc = crc;
+    if (pos > client_offset)
+    {
+      /* Keep the part of this block from the target onwards. */
+      rar->crc_calculated = crc32(crc, buff,
+        (unsigned)(client_offset - start));
+      memmove(rar->unp_buffer,
+        (const char *)buff + (client_offset - start),
+        (size_t)(pos - client_offset));
+      rar->unp_offset = (unsigned int)(pos - client_offset);
+      pos = client_offset;
+    }
+  }
+  if (pos < client_offset)
+  {
+    /* The target is within the data already in unp_buffer. */
+    rar->crc_calculated = crc32(rar->crc_calculated, rar->unp_buffer,
+      (unsigned)(client_offset - pos));
+    memmove(rar->unp_buffer, rar->unp_buffer + (client_offset - pos),
+      (size_t)(rar->offset - client_offset));
+    rar->unp_offset = (unsigned int)(rar->offset - client_offset);
+  }
+
+  /* Data returned from here on is relative to the seek position. */
+  rar->offset_outgoing = 0;
+  return client_offset;
+}
+
+/*
+ * Snapshot the LZSS decoder between two calls of read_data_compressed().
+ * Nothing is saved once PPMd has been used in the entry, because the
+ * model is not captured.
+ */
+static void
+save_checkpoint(struct rar *rar)
+{
+  struct rar_checkpoint *ck;
+  unsigned int i;
+
+  if (rar->checkpoint_interval == 0 || rar->offset < rar->checkpoint_next ||
+    rar->unp_offset != 0 || !rar->valid || rar->ppmd_valid ||
+    rar->is_ppmd_block || rar->lzss.window == NULL ||
+    rar->dictionary_size == 0 ||
+    rar->dictionary_size != (unsigned int)lzss_size(&rar->lzss))
+    return;
+
+  if (rar->checkpoints_count == MAX_CHECKPOINTS)
+  {
+    /* Keep every other checkpoint and double the spacing. */
+    for (i = 1; i < MAX_CHECKPOINTS; i += 2)
+      free(rar->checkpoints[i].window);
+    for (i = 1; i < MAX_CHECKPOINTS / 2; i++)
+      rar->checkpoints[i] = rar->checkpoints[i * 2];
+    rar->checkpoints_count = MAX_CHECKPOINTS / 2;
+    rar->checkpoint_interval *= 2;
+  }
+
+  ck = &rar->checkpoints[rar->checkpoints_count];
+  ck->window = malloc(rar->dictionary_size);
+  if (ck->window == NULL)
+    return;
+  memcpy(ck->window, rar->lzss.window, rar->dictionary_size);
+  ck->offset = rar->offset;
+  ck->bytes_remaining = rar->bytes_remaining;
+  ck->bytes_uncopied = rar->bytes_uncopied;
+  ck->lzss_position = rar->lzss.position;
+  ck->cache_buffer = rar->br.cache_buffer;
+  ck->cache_avail = rar->br.cache_avail;
+  ck->crc_calculated = rar->crc_calculated;
+  ck->dictionary_size = rar->dictionary_size;
+  memcpy(ck->lengthtable, rar->lengthtable, sizeof(ck->lengthtable));
+  ck->start_new_block = rar->start_new_block;
+  ck->start_new_table = rar->start_new_table;
+  ck->output_last_match = rar->output_last_match;
+  ck->lastlength = rar->lastlength;
+  ck->lastoffset = rar->lastoffset;
+  memcpy(ck->oldoffset, rar->oldoffset, sizeof(ck->oldoffset));
+  ck->lastlowoffset = rar->lastlowoffset;
+  ck->numlowoffsetrepeats = rar->numlowoffsetrepeats;
+  rar->checkpoints_count++;
+  rar->checkpoint_next = rar->offset + rar->checkpoint_interval;
+}
+
+/*
+ * Put the decoder back in the state saved in ck, or at the start of
+ * the entry's data if ck is NULL.
+ */
+static int
+restore_checkpoint(struct archive_read *a, struct rar_checkpoint *ck)
+{
+  struct rar *rar = (struct rar *)(a->format->data);
+  unsigned char *new_window;
+  int64_t ret;
+
+  ret = __archive_read_seek(a, rar->dbo[0].start_offset + rar->packed_size -
+    (ck != NULL ? ck->bytes_remaining : rar->packed_size), SEEK_SET);
+  if (ret < (ARCHIVE_OK))
+    return ((int)ret);
+
+  free_codes(a);
+  __archive_ppmd7_functions.Ppmd7_Free(&rar->ppmd7_context, &g_szalloc);
+  rar->ppmd_valid = rar->ppmd_eod = 0;
+  rar->is_ppmd_block = 0;
+  rar->bytes_unconsumed = 0;
+  rar->br.next_in = NULL;
+  rar->br.avail_in = 0;
+  rar->unp_offset = 0;
+  rar->entry_eof = 0;
+  rar->valid = 1;
+  rar->filterstart = INT64_MAX;
+
+  if (ck == NULL)
+  {
+    rar->bytes_remaining = rar->packed_size;
+    rar->bytes_uncopied = 0;
+    rar->lzss.position = rar->offset = 0;
+    rar->br.cache_buffer = 0;
+    rar->br.cache_avail = 0;
+    rar->crc_calculated = 0;
+    rar->dictionary_size = 0;
+    memset(rar->lengthtable, 0, sizeof(rar->lengthtable));
+    rar->start_new_block = 0;
+    rar->start_new_table = 1;
+    rar->output_last_match = 0;
+    rar->lastlength = 0;
+    rar->lastoffset = 0;
+    memset(rar->oldoffset, 0, sizeof(rar->oldoffset));
+    rar->lastlowoffset = 0;
+    rar->numlowoffsetrepeats = 0;
+    rar->offset_outgoing = 0;
+    rar->last_block_offset = 0;
+    return (ARCHIVE_OK);
+  }
+
+  if (rar->lzss.window == NULL ||
+    (unsigned int)lzss_size(&rar->lzss) != ck->dictionary_size)
+  {
+    new_window = realloc(rar->lzss.window, ck->dictionary_size);
+    if (new_window == NULL)
+    {
+      archive_set_error(&a->archive, ENOMEM,
+                        "Unable to allocate memory for uncompressed data.");
+      return (ARCHIVE_FATAL);
+    }
+    rar->lzss.window = new_window;
+    rar->lzss.mask = ck->dictionary_size - 1;
+  }
+  memcpy(rar->lzss.window, ck->window, ck->dictionary_size);
+  rar->dictionary_size = ck->dictionary_size;
+  rar->bytes_remaining = ck->bytes_remaining;
+  rar->bytes_uncopied = ck->bytes_uncopied;
+  rar->lzss.position = ck->lzss_position;
+  rar->offset = ck->offset;
+  rar->offset_outgoing = ck->offset;
+  rar->last_block_offset = ck->offset;
+  rar->br.cache_buffer = ck->cache_buffer;
+  rar->br.cache_avail = ck->cache_avail;
+  rar->crc_calculated = ck->crc_calculated;
+  memcpy(rar->lengthtable, ck->lengthtable, sizeof(rar->lengthtable));
+  rar->start_new_block = ck->start_new_block;
+  rar->start_new_table = ck->start_new_table;
+  rar->output_last_match = ck->output_last_match;
+  rar->lastlength = ck->lastlength;
+  rar->lastoffset = ck->lastoffset;
+  memcpy(rar->oldoffset, ck->oldoffset, sizeof(rar->oldoffset));
+  rar->lastlowoffset = ck->lastlowoffset;
+  rar->numlowoffsetrepeats = ck->numlowoffsetrepeats;
+  return (create_codes(a));
+}
+
+static void
+free_checkpoints(struct rar *rar)
+{
+  unsigned int i;
+
+  for (i = 0; i < rar->checkpoints_count; i++)
+    free(rar->checkpoints[i].window);
+  free(rar->checkpoints);
+  rar->checkpoints = NULL;
+  rar->checkpoints_count = 0;
+  rar->checkpoint_interval = 0;
+  rar->checkpoint_next = 0;
+}
+
 static int
 archive_read_format_rar_cleanup(struct archive_read *a)
 {
@@ -1249,6 +1626,7 @@ archive_read_format_rar_cleanup(struct archive_read *a)
 
   rar = (struct rar *)(a->format->data);
   free_codes(a);
+  free_checkpoints(rar);
   free(rar->filename);
   free(rar->filename_save);
   free(rar->dbo);
@@ -1657,6 +2035,7 @@ read_header(struct archive_read *a, struct archive_entry *entry,
   memset(rar->lengthtable, 0, sizeof(rar->lengthtable));
   __archive_ppmd7_functions.Ppmd7_Free(&rar->ppmd7_context, &g_szalloc);
   rar->ppmd_valid = rar->ppmd_eod = 0;
+  free_checkpoints(rar);
 
   /* Don't set any archive entries for non-file header types */
   if (head_type == NEWSUB_HEAD)
@@ -1872,6 +2251,8 @@ read_data_compressed(struct archive_read *a, const void **buff, size_t *size,
 
   rar = (struct rar *)(a->format->data);
 
+  save_checkpoint(rar);
+
   do {
     if (!rar->valid)
       return (ARCHIVE_FATAL);
@@ -2279,22 +2660,7 @@ parse_codes(struct archive_read *a)
     free(precode.tree);
     free(precode.table);
 
-    r = create_code(a, &rar->maincode, &rar->lengthtable[0], MAINCODE_SIZE,
-                MAX_SYMBOL_LENGTH);
-    if (r != ARCHIVE_OK)
-      return (r);
-    r = create_code(a, &rar->offsetcode, &rar->lengthtable[MAINCODE_SIZE],
-                OFFSETCODE_SIZE, MAX_SYMBOL_LENGTH);
-    if (r != ARCHIVE_OK)
-      return (r);
-    r = create_code(a, &rar->lowoffsetcode,
-                &rar->lengthtable[MAINCODE_SIZE + OFFSETCODE_SIZE],
-                LOWOFFSETCODE_SIZE, MAX_SYMBOL_LENGTH);
-    if (r != ARCHIVE_OK)
-      return (r);
-    r = create_code(a, &rar->lengthcode,
-                &rar->lengthtable[MAINCODE_SIZE + OFFSETCODE_SIZE +
-                LOWOFFSETCODE_SIZE], LENGTHCODE_SIZE, MAX_SYMBOL_LENGTH);
+    r = create_codes(a);
     if (r != ARCHIVE_OK)
       return (r);
   }
@@ -2332,6 +2698,30 @@ truncated_data:
   return (ARCHIVE_FATAL);
 }
 
+static int
+create_codes(struct archive_read *a)
+{
+  struct rar *rar = (struct rar *)(a->format->data);
+  int r;
+
+  r = create_code(a, &rar->maincode, &rar->lengthtable[0], MAINCODE_SIZE,
+              MAX_SYMBOL_LENGTH);
+  if (r != ARCHIVE_OK)
+    return (r);
+  r = create_code(a, &rar->offsetcode, &rar->lengthtable[MAINCODE_SIZE],
+              OFFSETCODE_SIZE, MAX_SYMBOL_LENGTH);
+  if (r != ARCHIVE_OK)
+    return (r);
+  r = create_code(a, &rar->lowoffsetcode,
+              &rar->lengthtable[MAINCODE_SIZE + OFFSETCODE_SIZE],
+              LOWOFFSETCODE_SIZE, MAX_SYMBOL_LENGTH);
+  if (r != ARCHIVE_OK)
+    return (r);
+  return create_code(a, &rar->lengthcode,
+              &rar->lengthtable[MAINCODE_SIZE + OFFSETCODE_SIZE +
+              LOWOFFSETCODE_SIZE], LENGTHCODE_SIZE, MAX_SYMBOL_LENGTH);
+}
+
 static void
 free_codes(struct archive_read *a)
 {
@@ -2354,9 +2744,8 @@ free_codes(struct archive_read *a)
 static int
 read_next_symbol(struct archive_read *a, struct huffman_code *code)
 {
-  unsigned char bit;
   unsigned int bits;
-  int length, value, node;
+  int length, value, subbits;
   struct rar *rar;
   struct rar_br *br;
 
@@ -2398,29 +2787,37 @@ read_next_symbol(struct archive_read *a, struct huffman_code *code)
   /* Skip tablesize bits */
   rar_br_consume(br, code->tablesize);
 
-  node = value;
-  while (!(code->tree[node].branches[0] ==
-    code->tree[node].branches[1]))
-  {
-    if (!rar_br_read_ahead(a, br, 1)) {
-      archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
-                        "Truncated RAR file data");
-      rar->valid = 0;
-      return -1;
-    }
-    bit = rar_br_bits(br, 1);
-    rar_br_consume(br, 1);
+  /*
+   * Longer codes are looked up in the second-level table at
+   * value, which is indexed by the next (length - tablesize) bits.
+   * Near the end of the data fewer bits may remain than the widest
+   * code in that table needs, so pad with zero bits and check the
+   * code actually found.
+   */
+  subbits = length - code->tablesize;
+  if (rar_br_read_ahead(a, br, subbits))
+    bits = rar_br_bits(br, subbits);
+  else
+    bits = rar_br_bits_forced(br, subbits);
 
-    if (code->tree[node].branches[bit] < 0)
-    {
-      archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
-                        "Invalid prefix code in bitstream");
-      return -1;
-    }
-    node = code->tree[node].branches[bit];
-  }
+  length = code->table[value + bits].length;
+  value = code->table[value + bits].value;
 
-  return code->tree[node].branches[0];
+  if (length < 0)
+  {
+    archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+                      "Invalid prefix code in bitstream");
+    return -1;
+  }
+  if (!rar_br_has(br, length))
+  {
+    archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+                      "Truncated RAR file data");
+    rar->valid = 0;
+    return -1;
+  }
+  rar_br_consume(br, length);
+  return value;
 }
 
 static int
@@ -2578,16 +2975,100 @@ new_node(struct huffman_code *code)
 static int
 make_table(struct archive_read *a, struct huffman_code *code)
 {
+  struct huffman_table_entry *table;
+  size_t rootsize, size;
+  int depth, i, ret;
+
   if (code->maxlength < code->minlength || code->maxlength > 10)
     code->tablesize = 10;
   else
     code->tablesize = code->maxlength;
 
+  rootsize = (size_t)1 << code->tablesize;
   code->table =
     (struct huffman_table_entry *)calloc(1, sizeof(*code->table)
-    * ((size_t)1 << code->tablesize));
+    * rootsize);
+  if (code->table == NULL)
+  {
+    archive_set_error(&a->archive, ENOMEM,
+                      "Unable to allocate memory for Huffman table");
+    return (ARCHIVE_FATAL);
+  }
+
+  ret = make_table_recurse(a, code, 0, code->table, 0, code->tablesize);
+  if (ret != ARCHIVE_OK)
+    return (ret);
+
+  /*
+   * Codes longer than tablesize were left pointing at their subtree.
+   * Give each such subtree a second-level table as wide as its
+   * deepest code, appended after the root table, so that no code
+   * is decoded a bit at a time.
+   */
+  size = rootsize;
+  for (i = 0; i < (int)rootsize; i++)
+  {
+    if (code->table[i].length <= code->tablesize)
+      continue;
+    depth = tree_depth(code, code->table[i].value, 0);
+    if (depth < 0)
+    {
+      archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+                        "Invalid location to Huffman tree specified.");
+      return (ARCHIVE_FATAL);
+    }
+    size += (size_t)1 << depth;
+  }
+  if (size == rootsize)
+    return (ARCHIVE_OK);
+
+  table = (struct huffman_table_entry *)realloc(code->table,
+    sizeof(*code->table) * size);
+  if (table == NULL)
+  {
+    archive_set_error(&a->archive, ENOMEM,
+                      "Unable to allocate memory for Huffman table");
+    return (ARCHIVE_FATAL);
+  }
+  code->table = table;
 
-  return make_table_recurse(a, code, 0, code->table, 0, code->tablesize);
+  size = rootsize;
+  for (i = 0; i < (int)rootsize; i++)
+  {
+    if (table[i].length <= code->tablesize)
+      continue;
+    depth = tree_depth(code, table[i].value, 0);
+    ret = make_table_recurse(a, code, table[i].value, table + size, 0,
+                             depth);
+    if (ret != ARCHIVE_OK)
+      return (ret);
+    table[i].length = code->tablesize + depth;
+    table[i].value = (int)size;
+    size += (size_t)1 << depth;
+  }
+  return (ARCHIVE_OK);
+}
+
+/*
+ * Return the length of the longest code below node, or -1 if the
+ * tree is broken.  add_value() never builds codes longer than 15 bits,
+ * so the recursion is shallow; the limit guards against cycles.
+ */
+static int
+tree_depth(struct huffman_code *code, int node, int depth)
+{
+  int d0, d1;
+
+  if (node >= code->numentries || depth > 16)
+    return (-1);
+  if (node < 0 ||
+    code->tree[node].branches[0] == code->tree[node].branches[1])
+    return (depth);
+  d0 = tree_depth(code, code->tree[node].branches[0], depth + 1);
+  d1 = tree_depth(code, code->tree[node].branches[1], depth + 1);
+  if (d0 < 0 || d1 < 0)
+    return (-1);
+  return (d0 > d1 ? d0 : d1);
 }
 
 static int
@@ -2603,7 +3084,7 @@ make_table_recurse(struct archive_read *a, struct huffman_code *code, int node,
                       "Huffman tree was not created.");
     return (ARCHIVE_FATAL);
   }
-  if (node < 0 || node >= code->numentries)
+  if (node >= code->numentries)
   {
     archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
                       "Invalid location to Huffman tree specified.");
@@ -2612,7 +3093,13 @@ make_table_recurse(struct archive_read *a, struct huffman_code *code, int node,
 
   currtablesize = 1 << (maxdepth - depth);
 
-  if (code->tree[node].branches[0] ==
+  if (node < 0)
+  {
+    /* Unused branch of an incomplete code; caught when decoded. */
+    for(i = 0; i < currtablesize; i++)
+      table[i].length = -1;
+  }
+  else if (code->tree[node].branches[0] ==
     code->tree[node].branches[1])
   {
     for(i = 0; i < currtablesize; i++)
@@ -2621,11 +3108,6 @@ make_table_recurse(struct archive_read *a, struct huffman_code *code, int node,
       table[i].value = code->tree[node].branches[0];
     }
   }
-  else if (node < 0)
-  {
-    for(i = 0; i < currtablesize; i++)
-      table[i].length = -1;
-  }
   else
   {
     if(depth == maxdepth)
@@ -37,13 +37,23 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_read_support_format_tar.c 201161
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TAR_SUM_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TAR_SUM_NEON
+#endif
 
 #include "archive.h"
 #include "archive_acl_private.h" /* For ACL parsing routines. */
+#include "archive_endian.h"
 #include "archive_entry.h"
 #include "archive_entry_locale.h"
 #include "archive_private.h"
 #include "archive_read_private.h"
+#include "archive_tar_index_private.h"
 
 #define tar_min(a,b) ((a) < (b) ? (a) : (b))
 
@@ -116,6 +126,13 @@ struct sparse_block {
 	int hole;
 };
 
+/* An entry of the sidecar index used by archive_read_seek_entry(). */
+struct tar_index_entry {
+	const char	*name;
+	int64_t		 header_offset;
+	size_t		 order;
+};
+
 struct tar {
 	struct archive_string	 acl_text;
 	struct archive_string	 entry_pathname;
@@ -138,6 +155,7 @@ struct tar {
 	int64_t			 realsize;
 	struct sparse_block	*sparse_list;
 	struct sparse_block	*sparse_last;
+	struct sparse_block	*sparse_free;	/* Blocks kept for reuse. */
 	int64_t			 sparse_offset;
 	int64_t			 sparse_numbytes;
 	int			 sparse_gnu_major;
@@ -153,6 +171,14 @@ struct tar {
 	int			 compat_2x;
 	int			 process_mac_extensions;
 	int			 read_concatenated_archives;
+
+	/* Sidecar index read by the "index" option. */
+	int			 index_loaded;
+	struct tar_index_entry	*index;
+	size_t			 index_count;
+	struct archive_string	 index_names;
+	/* Index of the entries read, for the "write_index" option. */
+	struct archive_tar_index *index_out;
 };
 
 static int	archive_block_is_null(const char *p);
@@ -198,6 +224,10 @@ static int	archive_read_format_tar_cleanup(struct archive_read *);
 static int	archive_read_format_tar_read_data(struct archive_read *a,
 		    const void **buff, size_t *size, int64_t *offset);
 static int	archive_read_format_tar_skip(struct archive_read *a);
+static int	archive_read_format_tar_seek_entry(struct archive_read *,
+		    const char *);
+static int	read_index(struct archive_read *, struct tar *,
+		    const char *);
 static int	archive_read_format_tar_read_header(struct archive_read *,
 		    struct archive_entry *);
 static int	checksum(struct archive_read *, const void *);
@@ -262,7 +292,8 @@ archive_read_support_format_tar(struct archive *_a)
 	    NULL,
 	    archive_read_format_tar_cleanup,
 	    NULL,
-	    NULL);
+	    NULL,
+	    archive_read_format_tar_seek_entry);
 
 	if (r != ARCHIVE_OK)
 		free(tar);
@@ -276,6 +307,11 @@ archive_read_format_tar_cleanup(struct archive_read *a)
 
 	tar = (struct tar *)(a->format->data);
 	gnu_clear_sparse_list(tar);
+	while (tar->sparse_free != NULL) {
+		struct sparse_block *p = tar->sparse_free;
+		tar->sparse_free = p->next;
+		free(p);
+	}
 	archive_string_free(&tar->acl_text);
 	archive_string_free(&tar->entry_pathname);
 	archive_string_free(&tar->entry_pathname_override);
@@ -288,6 +324,10 @@ archive_read_format_tar_cleanup(struct archive_read *a)
 	archive_string_free(&tar->longname);
 	archive_string_free(&tar->longlink);
 	archive_string_free(&tar->localname);
+	archive_string_free(&tar->index_names);
+	free(tar->index);
+	/* If reading stopped early, keep what has been indexed. */
+	__archive_tar_index_close(&a->archive, tar->index_out);
 	free(tar);
 	(a->format->data) = NULL;
 	return (ARCHIVE_OK);
@@ -399,6 +439,22 @@ archive_read_format_tar_options(struct archive_read *a,
 	} else if (strcmp(key, "read_concatenated_archives") == 0) {
 		tar->read_concatenated_archives = (val != NULL && val[0] != 0);
 		return (ARCHIVE_OK);
+	} else if (strcmp(key, "index") == 0) {
+		if (val == NULL || val[0] == 0) {
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "tar: index option needs a filename");
+			return (ARCHIVE_FAILED);
+		}
+		return (read_index(a, tar, val));
+	} else if (strcmp(key, "write_index") == 0) {
+		if (val == NULL || val[0] == 0) {
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "tar: write_index option needs a filename");
+			return (ARCHIVE_FAILED);
+		}
+		__archive_tar_index_close(&a->archive, tar->index_out);
+		tar->index_out = __archive_tar_index_open(&a->archive, val);
+		return (tar->index_out != NULL ? ARCHIVE_OK : ARCHIVE_FATAL);
 	}
 
 	/* Note: The "warn" return is just to inform the options
@@ -457,6 +513,7 @@ archive_read_format_tar_read_header(struct archive_read *a,
 	struct tar *tar;
 	const char *p;
 	const wchar_t *wp;
+	int64_t data_offset;
 	int r;
 	size_t l, unconsumed = 0;
 
@@ -525,6 +582,22 @@ archive_read_format_tar_read_header(struct archive_read *a,
 			}
 		}
 	}
+
+	/* The entry's data follow right after its headers. */
+	if (tar->index_out != NULL) {
+		if (r >= ARCHIVE_WARN) {
+			data_offset = archive_filter_bytes(&a->archive, 0);
+			if (__archive_tar_index_add(&a->archive, tar->index_out,
+			    a->header_position, data_offset, entry) != ARCHIVE_OK)
+				return (ARCHIVE_FATAL);
+		} else if (r == ARCHIVE_EOF) {
+			r = __archive_tar_index_close(&a->archive,
+			    tar->index_out);
+			tar->index_out = NULL;
+			if (r == ARCHIVE_OK)
+				r = ARCHIVE_EOF;
+		}
+	}
 	return (r);
 }
 
@@ -544,7 +617,8 @@ archive_read_format_tar_read_data(struct archive_read *a,
 		    tar->sparse_list->remaining == 0) {
 			p = tar->sparse_list;
 			tar->sparse_list = p->next;
-			free(p);
+			p->next = tar->sparse_free;
+			tar->sparse_free = p;
 		}
 
 		if (tar->entry_bytes_unconsumed) {
@@ -629,6 +703,249 @@ archive_read_format_tar_skip(struct archive_read *a)
 	return (ARCHIVE_OK);
 }
 
+/*
+ * The sidecar index named by the "index" option has one line per
+ * entry:
+ *
+ *   <header offset> <data offset> <size> <pathname>
+ *
+ * The numbers are decimal; the header offset is that of the first
+ * header belonging to the entry (pax or GNU long-name headers
+ * included), as returned by archive_read_header_position().  In the
+ * pathname, backslash and control characters are written as a
+ * backslash and three octal digits.  Empty lines and lines starting
+ * with '#' are ignored.  Only the header offset is needed here; the
+ * data offset and size are for tools that read entry bodies directly.
+ */
+static int
+cmp_index_entry(const void *p1, const void *p2)
+{
+	const struct tar_index_entry *e1 =
+	    (const struct tar_index_entry *)p1;
+	const struct tar_index_entry *e2 =
+	    (const struct tar_index_entry *)p2;
+	int r;
+
+	r = strcmp(e1->name, e2->name);
+	if (r != 0)
+		return (r);
+	if (e1->order < e2->order)
+		return (-1);
+	return (e1->order > e2->order);
+}
+
+static int
+index_parse_number(const char **pp, int64_t *v)
+{
+	const char *p = *pp;
+	int64_t n = 0;
+
+	if (*p < '0' || *p > '9')
+		return (-1);
+	while (*p >= '0' && *p <= '9') {
+		if (n > (INT64_MAX - (*p - '0')) / 10)
+			return (-1);
+		n = n * 10 + (*p++ - '0');
+	}
+	if (*p++ != ' ')
+		return (-1);
+	*pp = p;
+	*v = n;
+	return (0);
+}
+
+/*
+ * Add one index line to tar->index, keeping the name in
+ * tar->index_names.  Until the whole index is read, the order field
+ * holds the offset of the name, since index_names may still move.
+ */
+static int
+index_add_line(struct archive_read *a, struct tar *tar, const char *line,
+    size_t *allocated)
+{
+	struct tar_index_entry *e;
+	const char *p = line;
+	int64_t header_offset, data_offset, size;
+	size_t name;
+
+	if (index_parse_number(&p, &header_offset) != 0 ||
+	    index_parse_number(&p, &data_offset) != 0 ||
+	    index_parse_number(&p, &size) != 0 || *p == '\0') {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_FILE_FORMAT,
+		    "tar: Malformed index line: %s", line);
+		return (ARCHIVE_FATAL);
+	}
+	if (tar->index_count >= *allocated) {
+		size_t new_allocated = *allocated ? *allocated * 2 : 1024;
+
+		e = realloc(tar->index, new_allocated * sizeof(*e));
+		if (e == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Can't allocate memory");
+			return (ARCHIVE_FATAL);
+		}
+		tar->index = e;
+		*allocated = new_allocated;
+	}
+	name = archive_strlen(&tar->index_names);
+	for (; *p != '\0'; p++) {
+		if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' &&
+		    p[2] >= '0' && p[2] <= '7' &&
+		    p[3] >= '0' && p[3] <= '7') {
+			archive_strappend_char(&tar->index_names,
+			    (char)(((p[1] - '0') << 6) |
+			    ((p[2] - '0') << 3) | (p[3] - '0')));
+			p += 3;
+		} else
+			archive_strappend_char(&tar->index_names, *p);
+	}
+	archive_strappend_char(&tar->index_names, '\0');
+	e = &tar->index[tar->index_count];
+	e->name = NULL;
+	e->header_offset = header_offset;
+	e->order = name;
+	tar->index_count++;
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Read the index file and sort it by pathname.  The file is read
+ * right away, so that a relative name is not affected by a later
+ * chdir() of the client.
+ */
+static int
+read_index(struct archive_read *a, struct tar *tar, const char *filename)
+{
+	struct archive *ar;
+	struct archive_entry *ae;
+	struct archive_string line;
+	const void *buff;
+	const char *b, *eol;
+	size_t size, allocated = 0, i;
+	int64_t offset;
+	int r;
+
+	free(tar->index);
+	tar->index = NULL;
+	tar->index_count = 0;
+	archive_string_empty(&tar->index_names);
+	tar->index_loaded = 0;
+
+	ar = archive_read_new();
+	if (ar == NULL) {
+		archive_set_error(&a->archive, ENOMEM, "No memory");
+		return (ARCHIVE_FATAL);
+	}
+	archive_string_init(&line);
+	archive_read_support_format_raw(ar);
+	archive_read_support_format_empty(ar);
+	r = archive_read_open_filename(ar, filename, 64 * 1024);
+	if (r == ARCHIVE_OK)
+		r = archive_read_next_header(ar, &ae);
+	if (r == ARCHIVE_EOF)
+		r = ARCHIVE_OK; /* An empty index. */
+	else if (r != ARCHIVE_OK) {
+		archive_copy_error(&a->archive, ar);
+		r = ARCHIVE_FATAL;
+	} else {
+		while ((r = archive_read_data_block(ar, &buff, &size,
+		    &offset)) == ARCHIVE_OK) {
+			b = (const char *)buff;
+			while (size > 0 &&
+			    (eol = memchr(b, '\n', size)) != NULL) {
+				archive_strncat(&line, b, eol - b);
+				if (archive_strlen(&line) > 0 &&
+				    line.s[0] != '#' &&
+				    index_add_line(a, tar, line.s, &allocated)
+				    != ARCHIVE_OK)
+					goto fail;
+				archive_string_empty(&line);
+				size -= eol + 1 - b;
+				b = eol + 1;
+			}
+			archive_strncat(&line, b, size);
+		}
+		if (r != ARCHIVE_EOF) {
+			archive_copy_error(&a->archive, ar);
+			goto fail;
+		}
+		if (archive_strlen(&line) > 0 && line.s[0] != '#' &&
+		    index_add_line(a, tar, line.s, &allocated) != ARCHIVE_OK)
+			goto fail;
+		r = ARCHIVE_OK;
+	}
+	archive_read_free(ar);
+	archive_string_free(&line);
+	if (r != ARCHIVE_OK)
+		return (r);
+
+	/* The names are final now; turn their offsets into pointers. */
+	for (i = 0; i < tar->index_count; i++) {
+		tar->index[i].name = tar->index_names.s + tar->index[i].order;
+		tar->index[i].order = i;
+	}
+	qsort(tar->index, tar->index_count, sizeof(*tar->index),
+	    cmp_index_entry);
+	tar->index_loaded = 1;
+	return (ARCHIVE_OK);
+fail:
+	archive_read_free(ar);
+	archive_string_free(&line);
+	free(tar->index);
+	tar->index = NULL;
+	tar->index_count = 0;
+	return (ARCHIVE_FATAL);
+}
+
+static int
+archive_read_format_tar_seek_entry(struct archive_read *a,
+    const char *pathname)
+{
+	struct tar *tar = (struct tar *)(a->format->data);
+	size_t lo, hi, mid;
+	int64_t r;
+
+	if (!tar->index_loaded) {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+		    "tar: Seeking to an entry requires the index option");
+		return (ARCHIVE_FAILED);
+	}
+
+	/* Find the first name greater than pathname; the entry just
+	 * before it is the last copy of pathname, if there is one. */
+	lo = 0;
+	hi = tar->index_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(tar->index[mid].name, pathname) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || strcmp(tar->index[lo - 1].name, pathname) != 0) {
+		archive_set_error(&a->archive, ENOENT,
+		    "%s: Not found in archive", pathname);
+		return (ARCHIVE_FAILED);
+	}
+
+	r = __archive_read_seek(a, tar->index[lo - 1].header_offset,
+	    SEEK_SET);
+	if (r < 0) {
+		if (r == ARCHIVE_FAILED)
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "tar: Seeking requires an uncompressed, "
+			    "seekable archive");
+		return ((int)r);
+	}
+	/* Abandon whatever was left of the current entry. */
+	tar->entry_bytes_remaining = 0;
+	tar->entry_bytes_unconsumed = 0;
+	tar->entry_padding = 0;
+	tar->sparse_gnu_pending = 0;
+	gnu_clear_sparse_list(tar);
+	return (ARCHIVE_OK);
+}
+
 /*
  * This function recursively interprets all of the headers associated
  * with a single entry.
@@ -746,7 +1063,18 @@ tar_read_header(struct archive_read *a, struct tar *tar,
 		break;
 	default:
 		gnuheader = (const struct archive_entry_header_gnutar *)h;
-		if (memcmp(gnuheader->magic, "ustar  \0", 8) == 0) {
+		/*
+		 * Check for a plain POSIX ustar header first; this is
+		 * by far the most common case.  The magic and version
+		 * fields are adjacent, so one comparison covers both.
+		 */
+		if (memcmp(header->magic, "ustar\0" "00", 8) == 0) {
+			if (a->archive.archive_format != ARCHIVE_FORMAT_TAR_PAX_INTERCHANGE) {
+				a->archive.archive_format = ARCHIVE_FORMAT_TAR_USTAR;
+				a->archive.archive_format_name = "POSIX ustar format";
+			}
+			err = header_ustar(a, tar, entry, h);
+		} else if (memcmp(gnuheader->magic, "ustar  \0", 8) == 0) {
 			a->archive.archive_format = ARCHIVE_FORMAT_TAR_GNUTAR;
 			a->archive.archive_format_name = "GNU tar format";
 			err = header_gnutar(a, tar, entry, h, unconsumed);
@@ -812,6 +1140,61 @@ tar_read_header(struct archive_read *a, struct tar *tar,
 	return (ARCHIVE_FATAL);
 }
 
+/*
+ * Sum all 512 bytes of a header block as unsigned values and count
+ * the bytes that have the high bit set.  The sum old tar programs
+ * computed with signed bytes is then sum - 256 * high, so a single
+ * pass over the block serves both checksum variants.
+ */
+static void
+header_sum(const unsigned char *bytes, int *sum, int *high)
+{
+#if defined(TAR_SUM_SSE2)
+	__m128i zero, s, hi, v;
+	int i;
+
+	zero = _mm_setzero_si128();
+	s = hi = zero;
+	for (i = 0; i < 512; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(bytes + i));
+		s = _mm_add_epi64(s, _mm_sad_epu8(v, zero));
+		/* Each lane counts at most 32 bytes; no overflow. */
+		hi = _mm_sub_epi8(hi, _mm_cmplt_epi8(v, zero));
+	}
+	hi = _mm_sad_epu8(hi, zero);
+	*sum = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+	*high = _mm_cvtsi128_si32(hi) +
+	    _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+#elif defined(TAR_SUM_NEON)
+	uint16x8_t s, hi;
+	uint64x2_t s64, hi64;
+	uint8x16_t v;
+	int i;
+
+	s = hi = vdupq_n_u16(0);
+	for (i = 0; i < 512; i += 16) {
+		v = vld1q_u8(bytes + i);
+		/* Each lane sums at most 64 bytes; no overflow. */
+		s = vpadalq_u8(s, v);
+		hi = vpadalq_u8(hi, vshrq_n_u8(v, 7));
+	}
+	s64 = vpaddlq_u32(vpaddlq_u16(s));
+	hi64 = vpaddlq_u32(vpaddlq_u16(hi));
+	*sum = (int)(vgetq_lane_u64(s64, 0) + vgetq_lane_u64(s64, 1));
+	*high = (int)(vgetq_lane_u64(hi64, 0) + vgetq_lane_u64(hi64, 1));
+#else
+	int i, s, hi;
+
+	s = hi = 0;
+	for (i = 0; i < 512; i++) {
+		s += bytes[i];
+		hi += bytes[i] >> 7;
+	}
+	*sum = s;
+	*high = hi;
+#endif
+}
+
 /*
  * Return true if block checksum is correct.
  */
@@ -820,7 +1203,7 @@ checksum(struct archive_read *a, const void *h)
 {
 	const unsigned char *bytes;
 	const struct archive_entry_header_ustar	*header;
-	int check, sum;
+	int check, high, sum;
 	size_t i;
 
 	(void)a; /* UNUSED */
@@ -836,16 +1219,15 @@ checksum(struct archive_read *a, const void *h)
 
 	/*
 	 * Test the checksum.  Note that POSIX specifies _unsigned_
-	 * bytes for this calculation.
+	 * bytes for this calculation.  The checksum field itself is
+	 * counted as eight blanks; the loop above guarantees none of
+	 * its bytes has the high bit set.
 	 */
 	sum = (int)tar_atol(header->checksum, sizeof(header->checksum));
-	check = 0;
-	for (i = 0; i < 148; i++)
-		check += (unsigned char)bytes[i];
-	for (; i < 156; i++)
-		check += 32;
-	for (; i < 512; i++)
-		check += (unsigned char)bytes[i];
+	header_sum(bytes, &check, &high);
+	for (i = 148; i < 156; i++)
+		check -= bytes[i];
+	check += 8 * 32;
 	if (sum == check)
 		return (1);
 
@@ -854,14 +1236,7 @@ checksum(struct archive_read *a, const void *h)
 	 * was created by an old BSD, Solaris, or HP-UX tar with a
 	 * broken checksum calculation.
 	 */
-	check = 0;
-	for (i = 0; i < 148; i++)
-		check += (signed char)bytes[i];
-	for (; i < 156; i++)
-		check += 32;
-	for (; i < 512; i++)
-		check += (signed char)bytes[i];
-	if (sum == check)
+	if (sum == check - 256 * high)
 		return (1);
 
 	return (0);
@@ -2116,10 +2491,17 @@ gnu_add_sparse_entry(struct archive_read *a, struct tar *tar,
 {
 	struct sparse_block *p;
 
-	p = (struct sparse_block *)malloc(sizeof(*p));
-	if (p == NULL) {
-		archive_set_error(&a->archive, ENOMEM, "Out of memory");
-		return (ARCHIVE_FATAL);
+	/* Every entry has at least one block, so recycle them. */
+	if (tar->sparse_free != NULL) {
+		p = tar->sparse_free;
+		tar->sparse_free = p->next;
+	} else {
+		p = (struct sparse_block *)malloc(sizeof(*p));
+		if (p == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Out of memory");
+			return (ARCHIVE_FATAL);
+		}
 	}
 	memset(p, 0, sizeof(*p));
 	if (tar->sparse_last != NULL)
@@ -2144,7 +2526,8 @@ gnu_clear_sparse_list(struct tar *tar)
 	while (tar->sparse_list != NULL) {
 		p = tar->sparse_list;
 		tar->sparse_list = p->next;
-		free(p);
+		p->next = tar->sparse_free;
+		tar->sparse_free = p;
 	}
 	tar->sparse_last = NULL;
 }
@@ -2505,10 +2888,46 @@ tar_atol_base_n(const char *p, size_t char_cnt, int base)
 	return (sign < 0) ? -l : l;
 }
 
+/*
+ * Octal fields in tar headers are at most 12 bytes, and 21 octal
+ * digits cannot overflow an int64_t, so the common case needs none of
+ * the range checks above.  Runs of eight digits are converted at once
+ * by treating them as a little-endian 64-bit word.
+ */
 static int64_t
 tar_atol8(const char *p, size_t char_cnt)
 {
-	return tar_atol_base_n(p, char_cnt, 8);
+	const char *end;
+	uint64_t x;
+	int64_t l;
+
+	if (char_cnt > 21)
+		return tar_atol_base_n(p, char_cnt, 8);
+	end = p + char_cnt;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p < end && *p == '-')
+		return tar_atol_base_n(p, end - p, 8);
+
+	l = 0;
+	while (end - p >= 8) {
+		x = archive_le64dec(p);
+		if ((x & ARCHIVE_LITERAL_ULL(0xf8f8f8f8f8f8f8f8)) !=
+		    ARCHIVE_LITERAL_ULL(0x3030303030303030))
+			break;
+		x &= ARCHIVE_LITERAL_ULL(0x0707070707070707);
+		/* Combine adjacent digits, then pairs, then quads. */
+		x = ((x << 3) + (x >> 8)) &
+		    ARCHIVE_LITERAL_ULL(0x00ff00ff00ff00ff);
+		x = ((x << 6) + (x >> 16)) &
+		    ARCHIVE_LITERAL_ULL(0x00000fff00000fff);
+		x = ((x << 12) + (x >> 32)) & 0xffffff;
+		l = (l << 24) | (int64_t)x;
+		p += 8;
+	}
+	while (p < end && *p >= '0' && *p <= '7')
+		l = (l << 3) + (*p++ - '0');
+	return (l);
 }
 
 static int64_t
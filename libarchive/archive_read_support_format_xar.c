@@ -102,6 +102,11 @@ archive_read_support_format_xar(struct archive *_a)
 #define HEADER_MAGIC	0x78617221
 #define HEADER_SIZE	28
 #define HEADER_VERSION	1
+/*
+ * With the streaming-toc option, up to this many parsed entries are
+ * held to return them in the order of their ids, as without it.
+ */
+#define TOC_WINDOW	1024
 #define CKSUM_NONE	0
 #define CKSUM_SHA1	1
 #define CKSUM_MD5	2
@@ -196,6 +201,13 @@ struct xar_file {
 	unsigned int		 nlink;
 	struct archive_string	 hardlink;
 	struct xattr		*xattr_list;
+
+	/* For the streaming-toc option. */
+	int			 toc_state;
+#define FILE_QUEUED		1	/* On the ready list.		*/
+#define FILE_RETURNED		2	/* Returned by read_header.	*/
+#define FILE_CLOSED		4	/* Its <file> element ended.	*/
+#define FILE_ORIGINAL		8	/* Has link="original".		*/
 };
 
 struct hdlink {
@@ -300,6 +312,14 @@ struct unknown_tag {
 	struct archive_string	 name;
 };
 
+#if !defined(HAVE_LIBXML_XMLREADER_H) && \
+    (defined(HAVE_BSDXML_H) || defined(HAVE_EXPAT_H))
+struct expat_userData {
+	int state;
+	struct archive_read *archive;
+};
+#endif
+
 struct xar {
 	uint64_t		 offset; /* Current position in the file. */
 	int64_t			 total;
@@ -321,6 +341,36 @@ struct xar {
 	uint64_t		 toc_chksum_offset;
 	uint64_t		 toc_chksum_size;
 
+	/*
+	 * With the streaming-toc option, the compressed TOC is kept in
+	 * memory and parsed as entries are read.  Only a window of
+	 * entries in file_queue, the directories being parsed and the
+	 * originals of hardlinks are kept.
+	 */
+	int			 opt_streaming_toc;
+	int			 toc_done;
+	int			 toc_checked;
+	int			 toc_chksum_alg;
+	uint64_t		 toc_size;
+	unsigned char		*toc_buff;
+	size_t			 toc_buff_size;
+	z_stream		 toc_stream;
+	int			 toc_stream_valid;
+	struct chksumwork	 toc_sumwrk;
+#ifdef HAVE_LIBXML_XMLREADER_H
+	xmlTextReaderPtr	 toc_reader;
+#elif defined(HAVE_BSDXML_H) || defined(HAVE_EXPAT_H)
+	XML_Parser		 toc_parser;
+	struct expat_userData	 toc_ud;
+#endif
+	/* Entries parsed since file_queue was filled; by 'next'. */
+	struct {
+		struct xar_file	*first;
+		struct xar_file	**last;
+	}			 ready;
+	/* Hardlinks whose original has not ended yet; by 'hdnext'. */
+	struct xar_file		*hdlink_wait;
+
 	/*
 	 * For Decoding data.
 	 */
@@ -374,6 +424,8 @@ struct xmlattr_list {
 };
 
 static int	xar_bid(struct archive_read *, int);
+static int	xar_options(struct archive_read *, const char *,
+		    const char *);
 static int	xar_read_header(struct archive_read *,
 		    struct archive_entry *);
 static int	xar_read_data(struct archive_read *,
@@ -381,6 +433,12 @@ static int	xar_read_data(struct archive_read *,
 static int	xar_read_data_skip(struct archive_read *);
 static int	xar_cleanup(struct archive_read *);
 static int	move_reading_point(struct archive_read *, uint64_t);
+static int	read_toc_buffer(struct archive_read *, uint64_t);
+static int	toc_inflate(struct archive_read *, void *, size_t);
+static int	toc_next_file(struct archive_read *, struct xar_file **);
+static void	toc_file_enqueue(struct xar *, struct xar_file *);
+static void	toc_file_closed(struct xar *, struct xar_file *);
+static void	file_release(struct xar *, struct xar_file *);
 static int	rd_contents_init(struct archive_read *,
 		    enum enctype, int, int);
 static int	rd_contents(struct archive_read *, const void **,
@@ -430,10 +488,6 @@ static void	xml2_error_hdr(void *, const char *, xmlParserSeverities,
 		    xmlTextReaderLocatorPtr);
 static int	xml2_read_toc(struct archive_read *);
 #elif defined(HAVE_BSDXML_H) || defined(HAVE_EXPAT_H)
-struct expat_userData {
-	int state;
-	struct archive_read *archive;
-};
 static int	expat_xmlattr_setup(struct archive_read *,
     struct xmlattr_list *, const XML_Char **);
 static void	expat_start_cb(void *, const XML_Char *, const XML_Char **);
@@ -463,13 +517,14 @@ archive_read_support_format_xar(struct archive *_a)
 	    xar,
 	    "xar",
 	    xar_bid,
-	    NULL,
+	    xar_options,
 	    xar_read_header,
 	    xar_read_data,
 	    xar_read_data_skip,
 	    NULL,
 	    xar_cleanup,
 	    NULL,
+	    NULL,
 	    NULL);
 	if (r != ARCHIVE_OK)
 		free(xar);
@@ -523,6 +578,23 @@ xar_bid(struct archive_read *a, int best_bid)
 	return (bid);
 }
 
+static int
+xar_options(struct archive_read *a, const char *key, const char *val)
+{
+	struct xar *xar;
+
+	xar = (struct xar *)(a->format->data);
+	if (strcmp(key, "streaming-toc") == 0) {
+		xar->opt_streaming_toc = (val != NULL && val[0] != 0);
+		return (ARCHIVE_OK);
+	}
+
+	/* Note: The "warn" return is just to inform the options
+	 * supervisor that we didn't handle it.  It will generate
+	 * a suitable error if no one used this option. */
+	return (ARCHIVE_WARN);
+}
+
 static int
 read_toc(struct archive_read *a)
 {
@@ -571,6 +643,23 @@ read_toc(struct archive_read *a)
 	xar->offset += HEADER_SIZE;
 	xar->toc_total = 0;
 
+	if (xar->opt_streaming_toc) {
+		/*
+		 * Keep the compressed TOC; the entries are parsed
+		 * from it by toc_next_file().
+		 */
+		xar->toc_size = toc_uncompressed_size;
+		xar->toc_chksum_alg = toc_chksum_alg;
+		xar->ready.last = &(xar->ready.first);
+		r = read_toc_buffer(a, toc_compressed_size);
+		if (r != ARCHIVE_OK)
+			return (r);
+		xar->h_base = xar->offset;
+		a->archive.archive_format = ARCHIVE_FORMAT_XAR;
+		a->archive.archive_format_name = "xar";
+		return (ARCHIVE_OK);
+	}
+
 	/*
 	 * Read TOC(Table of Contents).
 	 */
@@ -684,7 +773,12 @@ xar_read_header(struct archive_read *a, struct archive_entry *entry)
 	}
 
 	for (;;) {
-		file = xar->file = heap_get_entry(&(xar->file_queue));
+		if (xar->opt_streaming_toc) {
+			r = toc_next_file(a, &file);
+			if (r != ARCHIVE_OK)
+				return (r);
+		} else
+			file = xar->file = heap_get_entry(&(xar->file_queue));
 		if (file == NULL) {
 			xar->end_of_file = 1;
 			return (ARCHIVE_EOF);
@@ -697,7 +791,7 @@ xar_read_header(struct archive_read *a, struct archive_entry *entry)
 		 * If a file type is a directory and it does not have
 		 * any metadata, do not export.
 		 */
-		file_free(file);
+		file_release(xar, file);
 	}
 	archive_entry_set_atime(entry, file->atime, 0);
 	archive_entry_set_ctime(entry, file->ctime, 0);
@@ -822,7 +916,7 @@ xar_read_header(struct archive_read *a, struct archive_entry *entry)
 		xattr = xattr->next;
 	}
 	if (r != ARCHIVE_OK) {
-		file_free(file);
+		file_release(xar, file);
 		return (r);
 	}
 
@@ -833,7 +927,7 @@ xar_read_header(struct archive_read *a, struct archive_entry *entry)
 	else
 		r = ARCHIVE_OK;
 
-	file_free(file);
+	file_release(xar, file);
 	return (r);
 }
 
@@ -936,8 +1030,52 @@ xar_cleanup(struct archive_read *a)
 		free(hdlink);
 		hdlink = next;
 	}
-	for (i = 0; i < xar->file_queue.used; i++)
-		file_free(xar->file_queue.files[i]);
+	if (!xar->opt_streaming_toc) {
+		for (i = 0; i < xar->file_queue.used; i++)
+			file_free(xar->file_queue.files[i]);
+	} else {
+		struct xar_file *file, *next;
+
+		/* Free each entry once: the ones being parsed from
+		 * their parent chain and the originals of hardlinks
+		 * last. */
+		for (i = 0; i < xar->file_queue.used; i++) {
+			file = xar->file_queue.files[i];
+			if ((file->toc_state & FILE_CLOSED) &&
+			    !(file->toc_state & FILE_ORIGINAL))
+				file_free(file);
+		}
+		for (file = xar->ready.first; file != NULL; file = next) {
+			next = file->next;
+			if ((file->toc_state & FILE_CLOSED) &&
+			    !(file->toc_state & FILE_ORIGINAL))
+				file_free(file);
+		}
+		for (file = xar->file; file != NULL; file = next) {
+			next = file->parent;
+			if (!(file->toc_state & FILE_ORIGINAL))
+				file_free(file);
+		}
+		for (file = xar->hdlink_wait; file != NULL; file = next) {
+			next = file->hdnext;
+			file_free(file);
+		}
+		for (file = xar->hdlink_orgs; file != NULL; file = next) {
+			next = file->hdnext;
+			file_free(file);
+		}
+	}
+	free(xar->file_queue.files);
+	free(xar->toc_buff);
+	if (xar->toc_stream_valid)
+		inflateEnd(&(xar->toc_stream));
+#ifdef HAVE_LIBXML_XMLREADER_H
+	if (xar->toc_reader != NULL)
+		xmlFreeTextReader(xar->toc_reader);
+#elif defined(HAVE_BSDXML_H) || defined(HAVE_EXPAT_H)
+	if (xar->toc_parser != NULL)
+		XML_ParserFree(xar->toc_parser);
+#endif
 	while (xar->unknowntags != NULL) {
 		struct unknown_tag *tag;
 
@@ -1413,6 +1551,270 @@ checksum_final(struct archive_read *a, const void *a_sum_val,
 	return (r);
 }
 
+/*
+ * Read the compressed TOC into memory for the streaming-toc option.
+ */
+static int
+read_toc_buffer(struct archive_read *a, uint64_t size)
+{
+	struct xar *xar;
+	const unsigned char *b;
+	ssize_t bytes;
+	size_t alloc;
+
+	xar = (struct xar *)(a->format->data);
+	if (size > SIZE_MAX) {
+		archive_set_error(&a->archive, ENOMEM,
+		    "TOC is too large");
+		return (ARCHIVE_FATAL);
+	}
+	alloc = 0;
+	while (xar->toc_buff_size < size) {
+		b = __archive_read_ahead(a, 1, &bytes);
+		if (bytes < 0)
+			return ((int)bytes);
+		if (bytes == 0) {
+			archive_set_error(&a->archive,
+			    ARCHIVE_ERRNO_FILE_FORMAT,
+			    "Truncated archive file");
+			return (ARCHIVE_FATAL);
+		}
+		if ((uint64_t)bytes > size - xar->toc_buff_size)
+			bytes = (ssize_t)(size - xar->toc_buff_size);
+		if (xar->toc_buff_size + bytes > alloc) {
+			unsigned char *p;
+
+			/* Do not trust the size in the header before
+			 * the data is there. */
+			alloc = (alloc)? alloc * 2: 64 * 1024;
+			if (alloc < xar->toc_buff_size + bytes)
+				alloc = xar->toc_buff_size + bytes;
+			if (alloc > size)
+				alloc = (size_t)size;
+			p = realloc(xar->toc_buff, alloc);
+			if (p == NULL) {
+				archive_set_error(&a->archive, ENOMEM,
+				    "Can't allocate memory for TOC");
+				return (ARCHIVE_FATAL);
+			}
+			xar->toc_buff = p;
+		}
+		memcpy(xar->toc_buff + xar->toc_buff_size, b, bytes);
+		xar->toc_buff_size += bytes;
+		__archive_read_consume(a, bytes);
+		xar->offset += bytes;
+	}
+	_checksum_init(&(xar->toc_sumwrk), xar->toc_chksum_alg);
+	_checksum_update(&(xar->toc_sumwrk), xar->toc_buff, xar->toc_buff_size);
+
+	if (inflateInit(&(xar->toc_stream)) != Z_OK) {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+		    "Couldn't initialize zlib stream.");
+		return (ARCHIVE_FATAL);
+	}
+	xar->toc_stream_valid = 1;
+	xar->toc_stream.next_in = xar->toc_buff;
+	xar->toc_stream.avail_in = 0;
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Decompress the next part of the TOC kept by read_toc_buffer().
+ * Returns the number of bytes, which is 0 only at the end of the TOC.
+ */
+static int
+toc_inflate(struct archive_read *a, void *buff, size_t size)
+{
+	struct xar *xar;
+	size_t remaining;
+	int r;
+
+	xar = (struct xar *)(a->format->data);
+	xar->toc_stream.next_out = buff;
+	xar->toc_stream.avail_out = (uInt)size;
+	while (xar->toc_stream.avail_out == size) {
+		if (xar->toc_stream.avail_in == 0) {
+			remaining = xar->toc_buff_size -
+			    (xar->toc_stream.next_in - xar->toc_buff);
+			if (remaining > 1024 * 1024)
+				remaining = 1024 * 1024;
+			xar->toc_stream.avail_in = (uInt)remaining;
+		}
+		r = inflate(&(xar->toc_stream), 0);
+		if (r == Z_STREAM_END)
+			break;
+		if (r != Z_OK) {
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "TOC decompression failed (%d)", r);
+			return (ARCHIVE_FATAL);
+		}
+	}
+	size -= xar->toc_stream.avail_out;
+	xar->toc_total += size;
+	PRINT_TOC(buff, size);
+	return ((int)size);
+}
+
+/*
+ * Get the next entry for the streaming-toc option, parsing more of
+ * the TOC as needed.  *filep is NULL at the end of the archive.
+ */
+static int
+toc_next_file(struct archive_read *a, struct xar_file **filep)
+{
+	struct xar *xar;
+	struct xar_file *file;
+	const unsigned char *b;
+	ssize_t bytes;
+	int r;
+
+	xar = (struct xar *)(a->format->data);
+	*filep = NULL;
+	for (;;) {
+		while ((file = xar->ready.first) != NULL) {
+			if (heap_add_entry(a, &(xar->file_queue), file)
+			    != ARCHIVE_OK)
+				return (ARCHIVE_FATAL);
+			xar->ready.first = file->next;
+		}
+		xar->ready.last = &(xar->ready.first);
+		/*
+		 * The TOC checksum is verified before the first entry
+		 * is returned, so wait for the <checksum> element too.
+		 */
+		if (xar->toc_done ||
+		    (xar->file_queue.used >= TOC_WINDOW &&
+		     (xar->toc_chksum_alg == CKSUM_NONE ||
+		      xar->toc_chksum_size != 0)))
+			break;
+#ifdef HAVE_LIBXML_XMLREADER_H
+		r = xml2_read_toc(a);
+#elif defined(HAVE_BSDXML_H) || defined(HAVE_EXPAT_H)
+		r = expat_read_toc(a);
+#endif
+		if (r != ARCHIVE_OK)
+			return (r);
+		if (!xar->toc_done)
+			continue;
+		if (xar->toc_total != xar->toc_size) {
+			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+			    "TOC uncompressed size error");
+			return (ARCHIVE_FATAL);
+		}
+		/* Hardlinks whose original was not found. */
+		while ((file = xar->hdlink_wait) != NULL) {
+			xar->hdlink_wait = file->hdnext;
+			toc_file_enqueue(xar, file);
+		}
+	}
+
+	if (!xar->toc_checked && xar->toc_chksum_alg != CKSUM_NONE) {
+		xar->toc_checked = 1;
+		r = move_reading_point(a, xar->toc_chksum_offset);
+		if (r != ARCHIVE_OK)
+			return (r);
+		b = __archive_read_ahead(a,
+			(size_t)xar->toc_chksum_size, &bytes);
+		if (bytes < 0)
+			return ((int)bytes);
+		if ((uint64_t)bytes < xar->toc_chksum_size) {
+			archive_set_error(&a->archive,
+			    ARCHIVE_ERRNO_FILE_FORMAT,
+			    "Truncated archive file");
+			return (ARCHIVE_FATAL);
+		}
+		r = _checksum_final(&(xar->toc_sumwrk), b,
+			(size_t)xar->toc_chksum_size);
+		__archive_read_consume(a, xar->toc_chksum_size);
+		xar->offset += xar->toc_chksum_size;
+		if (r != ARCHIVE_OK) {
+			archive_set_error(&(a->archive), ARCHIVE_ERRNO_MISC,
+			    "Sumcheck error");
+			return (ARCHIVE_FATAL);
+		}
+	}
+
+	*filep = heap_get_entry(&(xar->file_queue));
+	return (ARCHIVE_OK);
+}
+
+static void
+toc_file_enqueue(struct xar *xar, struct xar_file *file)
+{
+	file->toc_state |= FILE_QUEUED;
+	file->next = NULL;
+	*xar->ready.last = file;
+	xar->ready.last = &(file->next);
+}
+
+static void
+toc_link_file(struct xar_file *org, struct xar_file *file)
+{
+	/* The link count only covers the links seen so far. */
+	file->nlink = ++org->nlink;
+	archive_string_copy(&(file->hardlink), &(org->pathname));
+}
+
+/*
+ * A <file> element has ended; queue the entry unless it was queued
+ * when its first child started, or it is a hardlink whose original
+ * has not ended yet.
+ */
+static void
+toc_file_closed(struct xar *xar, struct xar_file *file)
+{
+	struct xar_file *f2, **fp;
+
+	file->toc_state |= FILE_CLOSED;
+	if (file->toc_state & FILE_RETURNED) {
+		file_release(xar, file);
+		return;
+	}
+	if (file->toc_state & FILE_QUEUED)
+		return;
+	if (file->link > 0) {
+		for (f2 = xar->hdlink_orgs; f2 != NULL; f2 = f2->hdnext)
+			if (f2->id == file->link &&
+			    (f2->toc_state & FILE_CLOSED))
+				break;
+		if (f2 == NULL) {
+			file->hdnext = xar->hdlink_wait;
+			xar->hdlink_wait = file;
+			return;
+		}
+		toc_link_file(f2, file);
+	}
+	toc_file_enqueue(xar, file);
+	if (file->toc_state & FILE_ORIGINAL) {
+		fp = &(xar->hdlink_wait);
+		while ((f2 = *fp) != NULL) {
+			if (f2->link == file->id) {
+				*fp = f2->hdnext;
+				toc_link_file(file, f2);
+				toc_file_enqueue(xar, f2);
+			} else
+				fp = &(f2->hdnext);
+		}
+	}
+}
+
+/*
+ * Done with an entry returned by xar_read_header.  With the
+ * streaming-toc option, the parser may still be using it, and the
+ * originals of hardlinks are kept until the end.
+ */
+static void
+file_release(struct xar *xar, struct xar_file *file)
+{
+	if (xar->opt_streaming_toc) {
+		file->toc_state |= FILE_RETURNED;
+		if (!(file->toc_state & FILE_CLOSED) ||
+		    (file->toc_state & FILE_ORIGINAL))
+			return;
+	}
+	file_free(file);
+}
+
 static int
 decompression_init(struct archive_read *a, enum enctype encoding)
 {
@@ -1815,6 +2217,11 @@ file_new(struct archive_read *a, struct xar *xar, struct xmlattr_list *list)
 		archive_set_error(&a->archive, ENOMEM, "Out of memory");
 		return (ARCHIVE_FATAL);
 	}
+	/* The metadata of a directory precedes its files; it can be
+	 * returned before the TOC is read further. */
+	if (xar->opt_streaming_toc && xar->file != NULL &&
+	    xar->file->toc_state == 0 && xar->file->link == 0)
+		toc_file_enqueue(xar, xar->file);
 	file->parent = xar->file;
 	file->mode = 0777 | AE_IFREG;
 	file->atime = time(NULL);
@@ -1826,6 +2233,8 @@ file_new(struct archive_read *a, struct xar *xar, struct xmlattr_list *list)
 			file->id = atol10(attr->value, strlen(attr->value));
 	}
 	file->nlink = 1;
+	if (xar->opt_streaming_toc)
+		return (ARCHIVE_OK);
 	if (heap_add_entry(a, &(xar->file_queue), file) != ARCHIVE_OK)
 		return (ARCHIVE_FATAL);
 	return (ARCHIVE_OK);
@@ -2077,10 +2486,12 @@ xml_start(struct archive_read *a, const char *name, struct xmlattr_list *list)
 				if (strcmp(attr->value, "original") == 0) {
 					xar->file->hdnext = xar->hdlink_orgs;
 					xar->hdlink_orgs = xar->file;
+					xar->file->toc_state |= FILE_ORIGINAL;
 				} else {
 					xar->file->link = (unsigned)atol10(attr->value,
 					    strlen(attr->value));
-					if (xar->file->link > 0)
+					if (xar->file->link > 0 &&
+					    !xar->opt_streaming_toc)
 						if (add_link(a, xar, xar->file) != ARCHIVE_OK) {
 							return (ARCHIVE_FATAL);
 						};
@@ -2301,10 +2712,14 @@ xml_end(void *userData, const char *name)
 		break;
 	case TOC_FILE:
 		if (strcmp(name, "file") == 0) {
-			if (xar->file->parent != NULL &&
-			    ((xar->file->mode & AE_IFMT) == AE_IFDIR))
-				xar->file->parent->subdirs++;
-			xar->file = xar->file->parent;
+			struct xar_file *file = xar->file;
+
+			if (file->parent != NULL &&
+			    ((file->mode & AE_IFMT) == AE_IFDIR))
+				file->parent->subdirs++;
+			xar->file = file->parent;
+			if (xar->opt_streaming_toc)
+				toc_file_closed(xar, file);
 			if (xar->file == NULL)
 				xar->xmlsts = TOC;
 		}
@@ -3122,6 +3537,8 @@ xml2_read_cb(void *context, char *buffer, int len)
 	a = (struct archive_read *)context;
 	xar = (struct xar *)(a->format->data);
 
+	if (xar->opt_streaming_toc)
+		return (toc_inflate(a, buffer, len));
 	if (xar->toc_remaining <= 0)
 		return (0);
 	d = buffer;
@@ -3168,20 +3585,31 @@ xml2_error_hdr(void *arg, const char *msg, xmlParserSeverities severity,
 	}
 }
 
+/*
+ * Parse the TOC.  With the streaming-toc option, return as soon as
+ * an entry is ready and continue from there on the next call.
+ */
 static int
 xml2_read_toc(struct archive_read *a)
 {
+	struct xar *xar;
 	xmlTextReaderPtr reader;
 	struct xmlattr_list list;
 	int r;
 
-	reader = xmlReaderForIO(xml2_read_cb, xml2_close_cb, a, NULL, NULL, 0);
+	xar = (struct xar *)(a->format->data);
+	reader = xar->toc_reader;
 	if (reader == NULL) {
-		archive_set_error(&a->archive, ENOMEM,
-		    "Couldn't allocate memory for xml parser");
-		return (ARCHIVE_FATAL);
+		reader = xmlReaderForIO(xml2_read_cb, xml2_close_cb, a,
+		    NULL, NULL, 0);
+		if (reader == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Couldn't allocate memory for xml parser");
+			return (ARCHIVE_FATAL);
+		}
+		xmlTextReaderSetErrorHandler(reader, xml2_error_hdr, a);
+		xar->toc_reader = reader;
 	}
-	xmlTextReaderSetErrorHandler(reader, xml2_error_hdr, a);
 
 	while ((r = xmlTextReaderRead(reader)) == 1) {
 		const char *name, *value;
@@ -3197,7 +3625,7 @@ xml2_read_toc(struct archive_read *a)
 				r = xml_start(a, name, &list);
 			xmlattr_cleanup(&list);
 			if (r != ARCHIVE_OK)
-				return (r);
+				break;
 			if (empty)
 				xml_end(a, name);
 			break;
@@ -3214,9 +3642,13 @@ xml2_read_toc(struct archive_read *a)
 		}
 		if (r < 0)
 			break;
+		if (xar->opt_streaming_toc && xar->ready.first != NULL)
+			return (ARCHIVE_OK);
 	}
 	xmlFreeTextReader(reader);
+	xar->toc_reader = NULL;
 	xmlCleanupParser();
+	xar->toc_done = 1;
 
 	return ((r == 0)?ARCHIVE_OK:ARCHIVE_FATAL);
 }
@@ -3283,57 +3715,87 @@ expat_data_cb(void *userData, const XML_Char *s, int len)
 	xml_data(ud->archive, s, len);
 }
 
+/*
+ * Parse the TOC.  With the streaming-toc option, return as soon as
+ * an entry is ready and continue from there on the next call.
+ */
 static int
 expat_read_toc(struct archive_read *a)
 {
 	struct xar *xar;
 	XML_Parser parser;
-	struct expat_userData ud;
-
-	ud.state = ARCHIVE_OK;
-	ud.archive = a;
+	struct expat_userData *ud;
 
 	xar = (struct xar *)(a->format->data);
+	ud = &(xar->toc_ud);
 
-	/* Initialize XML Parser library. */
-	parser = XML_ParserCreate(NULL);
+	parser = xar->toc_parser;
 	if (parser == NULL) {
-		archive_set_error(&a->archive, ENOMEM,
-		    "Couldn't allocate memory for xml parser");
-		return (ARCHIVE_FATAL);
+		ud->state = ARCHIVE_OK;
+		ud->archive = a;
+
+		/* Initialize XML Parser library. */
+		parser = XML_ParserCreate(NULL);
+		if (parser == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Couldn't allocate memory for xml parser");
+			return (ARCHIVE_FATAL);
+		}
+		XML_SetUserData(parser, ud);
+		XML_SetElementHandler(parser, expat_start_cb, expat_end_cb);
+		XML_SetCharacterDataHandler(parser, expat_data_cb);
+		xar->xmlsts = INIT;
+		xar->toc_parser = parser;
 	}
-	XML_SetUserData(parser, &ud);
-	XML_SetElementHandler(parser, expat_start_cb, expat_end_cb);
-	XML_SetCharacterDataHandler(parser, expat_data_cb);
-	xar->xmlsts = INIT;
 
-	while (xar->toc_remaining && ud.state == ARCHIVE_OK) {
+	for (;;) {
 		enum XML_Status xr;
+		char buff[8192];
 		const void *d;
 		size_t outbytes;
 		size_t used;
-		int r;
+		int final, r;
 
-		d = NULL;
-		r = rd_contents(a, &d, &outbytes, &used, xar->toc_remaining);
-		if (r != ARCHIVE_OK)
-			return (r);
-		xar->toc_remaining -= used;
-		xar->offset += used;
-		xar->toc_total += outbytes;
-		PRINT_TOC(d, outbytes);
+		if (xar->opt_streaming_toc) {
+			r = toc_inflate(a, buff, sizeof(buff));
+			if (r < 0)
+				return (r);
+			d = buff;
+			outbytes = r;
+			used = 0;
+			final = (r == 0);
+		} else {
+			if (xar->toc_remaining == 0)
+				break;
+			d = NULL;
+			r = rd_contents(a, &d, &outbytes, &used,
+			    xar->toc_remaining);
+			if (r != ARCHIVE_OK)
+				return (r);
+			xar->toc_remaining -= used;
+			xar->offset += used;
+			xar->toc_total += outbytes;
+			PRINT_TOC(d, outbytes);
+			final = (xar->toc_remaining == 0);
+		}
 
-		xr = XML_Parse(parser, d, outbytes, xar->toc_remaining == 0);
-		__archive_read_consume(a, used);
+		xr = XML_Parse(parser, d, outbytes, final);
+		if (used)
+			__archive_read_consume(a, used);
 		if (xr == XML_STATUS_ERROR) {
-			XML_ParserFree(parser);
 			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
 			    "XML Parsing failed");
 			return (ARCHIVE_FATAL);
 		}
+		if (ud->state != ARCHIVE_OK || final)
+			break;
+		if (xar->opt_streaming_toc && xar->ready.first != NULL)
+			return (ARCHIVE_OK);
 	}
 	XML_ParserFree(parser);
-	return (ud.state);
+	xar->toc_parser = NULL;
+	xar->toc_done = 1;
+	return (ud->state);
 }
 #endif /* defined(HAVE_BSDXML_H) || defined(HAVE_EXPAT_H) */
 
@@ -69,8 +69,8 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_read_support_format_zip.c 201102
 #endif
 
 struct zip_entry {
-	struct archive_rb_node	node;
-	struct zip_entry	*next;
+	struct archive_rb_node	node;	/* Only used in tree_rsrc. */
+	size_t			name_offset; /* Raw name in zip->names. */
 	int64_t			local_header_offset;
 	int64_t			compressed_size;
 	int64_t			uncompressed_size;
@@ -119,6 +119,27 @@ struct trad_enc_ctx {
 /* Bits used in flags. */
 #define LA_USED_ZIP64	(1 << 0)
 #define LA_FROM_CENTRAL_DIRECTORY (1 << 1)
+#define LA_HIDDEN_RSRC	(1 << 2) /* Kept in tree_rsrc, not listed. */
+
+/*
+ * Central directory records are allocated in blocks rather than one
+ * malloc() each; a zip with millions of members would otherwise pay
+ * for millions of small allocations before returning its first header.
+ */
+struct zip_entry_block {
+	struct zip_entry_block	*next;
+	size_t			 used;
+	size_t			 size;
+	struct zip_entry	 entries[1];
+};
+#define ZIP_ENTRY_BLOCK_MIN	64
+#define ZIP_ENTRY_BLOCK_MAX	65536
+
+/* Sorted by name for archive_read_seek_entry(). */
+struct zip_name_ref {
+	const char		*name;
+	size_t			 index; /* Into entries_by_offset. */
+};
 
 /*
  * See "WinZip - AES Encryption Information"
@@ -130,6 +151,22 @@ struct trad_enc_ctx {
 #define AUTH_CODE_SIZE	10
 /**/
 #define MAX_DERIVED_KEY_BUF_SIZE	(AES_MAX_KEY_SIZE * 2 + 2)
+#define MAX_SALT_SIZE		16
+/* Number of WinZip AES keys remembered across entries. */
+#define DERIVED_KEY_CACHE_SIZE	8
+
+/*
+ * PBKDF2 with 1000 rounds of HMAC-SHA1 costs far more than decrypting
+ * a small entry, and archivers commonly reuse a salt for many entries,
+ * so derived keys are cached by (passphrase, salt, key length).
+ */
+struct zip_derived_key {
+	char		*passphrase;
+	uint8_t		 salt[MAX_SALT_SIZE];
+	unsigned	 salt_len;
+	unsigned	 key_len;
+	uint8_t		 key[MAX_DERIVED_KEY_BUF_SIZE];
+};
 
 struct zip {
 	/* Structural information about the archive. */
@@ -139,10 +176,21 @@ struct zip {
 	size_t			central_directory_entries_on_this_disk;
 	int			has_encrypted_entries;
 
-	/* List of entries (seekable Zip only) */
+	/* Single reusable entry (streaming Zip only) */
 	struct zip_entry	*zip_entries;
-	struct archive_rb_tree	tree;
-	struct archive_rb_tree	tree_rsrc;
+
+	/* Central directory (seekable Zip only) */
+	char			 central_directory_loaded;
+	struct zip_entry_block	*entry_blocks;
+	struct archive_string	 names; /* NUL-separated raw names. */
+	struct zip_entry	**entries_by_offset;
+	size_t			 entries_count;
+	size_t			 entry_index;
+	struct archive_rb_tree	 tree_rsrc;
+	/* Name index for archive_read_seek_entry(), built on demand. */
+	struct zip_name_ref	*names_index;
+	/* zip->entry was selected by seek_entry and not yet read. */
+	char			 entry_pending;
 
 	/* Bytes read but not yet consumed via __archive_read_consume() */
 	size_t			unconsumed;
@@ -205,6 +253,8 @@ struct zip {
 	char			cctx_valid;
 	archive_hmac_sha1_ctx	hctx;
 	char			hctx_valid;
+	struct zip_derived_key	derived_keys[DERIVED_KEY_CACHE_SIZE];
+	unsigned		derived_keys_next;
 
 	/* Strong encryption's decryption header information. */
 	unsigned		iv_size;
@@ -1718,6 +1768,50 @@ init_traditional_PKWARE_decryption(struct archive_read *a)
 #undef ENC_HEADER_SIZE
 }
 
+static int
+derive_WinZip_AES_key(struct zip *zip, const char *passphrase,
+    const uint8_t *salt, unsigned salt_len, unsigned key_len,
+    uint8_t *derived_key)
+{
+	struct zip_derived_key *dk;
+	size_t pw_len = strlen(passphrase);
+	unsigned i;
+	int r;
+
+	for (i = 0; i < DERIVED_KEY_CACHE_SIZE; i++) {
+		dk = &zip->derived_keys[i];
+		if (dk->passphrase != NULL && dk->key_len == key_len &&
+		    dk->salt_len == salt_len &&
+		    memcmp(dk->salt, salt, salt_len) == 0 &&
+		    strcmp(dk->passphrase, passphrase) == 0) {
+			memcpy(derived_key, dk->key, key_len * 2 + 2);
+			return (0);
+		}
+	}
+
+	r = archive_pbkdf2_sha1(passphrase, pw_len,
+	    salt, salt_len, 1000, derived_key, key_len * 2 + 2);
+	if (r != 0)
+		return (r);
+
+	/* Replace the oldest cached key. */
+	dk = &zip->derived_keys[zip->derived_keys_next];
+	if (dk->passphrase != NULL) {
+		memset(dk->passphrase, 0, strlen(dk->passphrase));
+		free(dk->passphrase);
+	}
+	dk->passphrase = strdup(passphrase);
+	if (dk->passphrase == NULL)
+		return (0);/* Not fatal; the key just isn't cached. */
+	memcpy(dk->salt, salt, salt_len);
+	dk->salt_len = salt_len;
+	dk->key_len = key_len;
+	memcpy(dk->key, derived_key, key_len * 2 + 2);
+	zip->derived_keys_next =
+	    (zip->derived_keys_next + 1) % DERIVED_KEY_CACHE_SIZE;
+	return (0);
+}
+
 static int
 init_WinZip_AES_decryption(struct archive_read *a)
 {
@@ -1754,8 +1848,8 @@ init_WinZip_AES_decryption(struct archive_read *a)
 			return (ARCHIVE_FAILED);
 		}
 		memset(derived_key, 0, sizeof(derived_key));
-		r = archive_pbkdf2_sha1(passphrase, strlen(passphrase),
-		    p, salt_len, 1000, derived_key, key_len * 2 + 2);
+		r = derive_WinZip_AES_key(zip, passphrase, p, salt_len,
+		    key_len, derived_key);
 		if (r != 0) {
 			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
 			    "Decryption is unsupported due to lack of "
@@ -1919,7 +2013,9 @@ static int
 archive_read_format_zip_cleanup(struct archive_read *a)
 {
 	struct zip *zip;
-	struct zip_entry *zip_entry, *next_zip_entry;
+	struct zip_entry_block *blk, *next_blk;
+	struct zip_derived_key *dk;
+	size_t i;
 
 	zip = (struct zip *)(a->format->data);
 #ifdef HAVE_ZLIB_H
@@ -1927,20 +2023,29 @@ archive_read_format_zip_cleanup(struct archive_read *a)
 		inflateEnd(&zip->stream);
 	free(zip->uncompressed_buffer);
 #endif
-	if (zip->zip_entries) {
-		zip_entry = zip->zip_entries;
-		while (zip_entry != NULL) {
-			next_zip_entry = zip_entry->next;
-			archive_string_free(&zip_entry->rsrcname);
-			free(zip_entry);
-			zip_entry = next_zip_entry;
-		}
-	}
+	free(zip->zip_entries);
+	for (blk = zip->entry_blocks; blk != NULL; blk = next_blk) {
+		next_blk = blk->next;
+		for (i = 0; i < blk->used; i++)
+			archive_string_free(&blk->entries[i].rsrcname);
+		free(blk);
+	}
+	free(zip->entries_by_offset);
+	free(zip->names_index);
+	archive_string_free(&zip->names);
 	free(zip->decrypted_buffer);
 	if (zip->cctx_valid)
 		archive_decrypto_aes_ctr_release(&zip->cctx);
 	if (zip->hctx_valid)
 		archive_hmac_sha1_cleanup(&zip->hctx);
+	for (i = 0; i < DERIVED_KEY_CACHE_SIZE; i++) {
+		dk = &zip->derived_keys[i];
+		if (dk->passphrase != NULL) {
+			memset(dk->passphrase, 0, strlen(dk->passphrase));
+			free(dk->passphrase);
+		}
+	}
+	memset(zip->derived_keys, 0, sizeof(zip->derived_keys));
 	free(zip->iv);
 	free(zip->erd);
 	free(zip->v_data);
@@ -2296,7 +2401,8 @@ archive_read_support_format_zip_streamable(struct archive *_a)
 	    NULL,
 	    archive_read_format_zip_cleanup,
 	    archive_read_support_format_zip_capabilities_streamable,
-	    archive_read_format_zip_has_encrypted_entries);
+	    archive_read_format_zip_has_encrypted_entries,
+	    NULL);
 
 	if (r != ARCHIVE_OK)
 		free(zip);
@@ -2456,34 +2562,44 @@ archive_read_format_zip_seekable_bid(struct archive_read *a, int best_bid)
 	return 0;
 }
 
-/* The red-black trees are only used in seeking mode to manage
- * the in-memory copy of the central directory. */
+/*
+ * In seeking mode the in-memory copy of the central directory is an
+ * array of entries sorted by local header offset.  The red-black tree
+ * is only used to pair Mac resource forks with their files.
+ */
 
 static int
-cmp_node(const struct archive_rb_node *n1, const struct archive_rb_node *n2)
+cmp_offset(const void *p1, const void *p2)
 {
-	const struct zip_entry *e1 = (const struct zip_entry *)n1;
-	const struct zip_entry *e2 = (const struct zip_entry *)n2;
+	const struct zip_entry *e1 = *(const struct zip_entry * const *)p1;
+	const struct zip_entry *e2 = *(const struct zip_entry * const *)p2;
 
+	if (e1->local_header_offset < e2->local_header_offset)
+		return -1;
 	if (e1->local_header_offset > e2->local_header_offset)
+		return 1;
+	/* Names are pooled in central directory order. */
+	if (e1->name_offset < e2->name_offset)
 		return -1;
-	if (e1->local_header_offset < e2->local_header_offset)
+	if (e1->name_offset > e2->name_offset)
 		return 1;
 	return 0;
 }
 
 static int
-cmp_key(const struct archive_rb_node *n, const void *key)
+cmp_name_ref(const void *p1, const void *p2)
 {
-	/* This function won't be called */
-	(void)n; /* UNUSED */
-	(void)key; /* UNUSED */
-	return 1;
-}
+	const struct zip_name_ref *r1 = (const struct zip_name_ref *)p1;
+	const struct zip_name_ref *r2 = (const struct zip_name_ref *)p2;
+	int r;
 
-static const struct archive_rb_tree_ops rb_ops = {
-	&cmp_node, &cmp_key
-};
+	r = strcmp(r1->name, r2->name);
+	if (r != 0)
+		return (r);
+	if (r1->index < r2->index)
+		return -1;
+	return (r1->index > r2->index);
+}
 
 static int
 rsrc_cmp_node(const struct archive_rb_node *n1,
@@ -2506,6 +2622,27 @@ static const struct archive_rb_tree_ops rb_rsrc_ops = {
 	&rsrc_cmp_node, &rsrc_cmp_key
 };
 
+static struct zip_entry *
+new_zip_entry(struct zip *zip)
+{
+	struct zip_entry_block *blk = zip->entry_blocks;
+	size_t size;
+
+	if (blk == NULL || blk->used >= blk->size) {
+		size = (blk == NULL) ? ZIP_ENTRY_BLOCK_MIN : blk->size * 2;
+		if (size > ZIP_ENTRY_BLOCK_MAX)
+			size = ZIP_ENTRY_BLOCK_MAX;
+		blk = calloc(1, sizeof(*blk)
+		    + (size - 1) * sizeof(blk->entries[0]));
+		if (blk == NULL)
+			return (NULL);
+		blk->size = size;
+		blk->next = zip->entry_blocks;
+		zip->entry_blocks = blk;
+	}
+	return (&blk->entries[blk->used++]);
+}
+
 static const char *
 rsrc_basename(const char *name, size_t name_length)
 {
@@ -2536,18 +2673,62 @@ expose_parent_dirs(struct zip *zip, const char *name, size_t name_length)
 			break;
 		*s = '\0';
 		/* Transfer the parent directory from zip->tree_rsrc RB
-		 * tree to zip->tree RB tree to expose. */
+		 * tree to the list of regular entries to expose. */
 		dir = (struct zip_entry *)
 		    __archive_rb_tree_find_node(&zip->tree_rsrc, str.s);
 		if (dir == NULL)
 			break;
 		__archive_rb_tree_remove_node(&zip->tree_rsrc, &dir->node);
 		archive_string_free(&dir->rsrcname);
-		__archive_rb_tree_insert_node(&zip->tree, &dir->node);
+		dir->flags &= ~LA_HIDDEN_RSRC;
 	}
 	archive_string_free(&str);
 }
 
+/*
+ * Build the list of regular entries in local file header order.
+ * Entries sharing a header offset are only listed once.
+ */
+static int
+sort_central_directory(struct archive_read *a, struct zip *zip)
+{
+	struct zip_entry_block *blk;
+	struct zip_entry **list;
+	size_t i, n;
+
+	n = 0;
+	for (blk = zip->entry_blocks; blk != NULL; blk = blk->next)
+		n += blk->used;
+	list = malloc((n > 0 ? n : 1) * sizeof(*list));
+	if (list == NULL) {
+		archive_set_error(&a->archive, ENOMEM,
+		    "Can't allocate zip entry list");
+		return ARCHIVE_FATAL;
+	}
+	n = 0;
+	for (blk = zip->entry_blocks; blk != NULL; blk = blk->next) {
+		for (i = 0; i < blk->used; i++) {
+			if ((blk->entries[i].flags & LA_HIDDEN_RSRC) == 0)
+				list[n++] = &blk->entries[i];
+		}
+	}
+	qsort(list, n, sizeof(*list), cmp_offset);
+	if (n > 1) {
+		size_t j = 0;
+
+		for (i = 1; i < n; i++) {
+			if (list[i]->local_header_offset !=
+			    list[j]->local_header_offset)
+				list[++j] = list[i];
+		}
+		n = j + 1;
+	}
+	zip->entries_by_offset = list;
+	zip->entries_count = n;
+	zip->central_directory_loaded = 1;
+	return ARCHIVE_OK;
+}
+
 static int
 slurp_central_directory(struct archive_read *a, struct zip *zip)
 {
@@ -2605,7 +2786,6 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 	correction = archive_filter_bytes(&a->archive, 0)
 			- zip->central_directory_offset;
 
-	__archive_rb_tree_init(&zip->tree, &rb_ops);
 	__archive_rb_tree_init(&zip->tree_rsrc, &rb_rsrc_ops);
 
 	zip->central_directory_entries_total = 0;
@@ -2628,10 +2808,13 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 		if ((p = __archive_read_ahead(a, 46, NULL)) == NULL)
 			return ARCHIVE_FATAL;
 
-		zip_entry = calloc(1, sizeof(struct zip_entry));
-		zip_entry->next = zip->zip_entries;
+		zip_entry = new_zip_entry(zip);
+		if (zip_entry == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Can't allocate zip entry");
+			return ARCHIVE_FATAL;
+		}
 		zip_entry->flags |= LA_FROM_CENTRAL_DIRECTORY;
-		zip->zip_entries = zip_entry;
 		zip->central_directory_entries_total++;
 
 		/* version = p[4]; */
@@ -2692,6 +2875,11 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 			return ARCHIVE_FATAL;
 		}
 		process_extra(p + filename_length, extra_length, zip_entry);
+		/* Names are kept raw; they are only converted when the
+		 * local file header is read. */
+		zip_entry->name_offset = archive_strlen(&zip->names);
+		archive_strncat(&zip->names, p, filename_length);
+		archive_strappend_char(&zip->names, '\0');
 
 		/*
 		 * Mac resource fork files are stored under the
@@ -2700,8 +2888,6 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 		 */
 		if (!zip->process_mac_extensions) {
 			/* Treat every entry as a regular entry. */
-			__archive_rb_tree_insert_node(&zip->tree,
-			    &zip_entry->node);
 		} else {
 			name = p;
 			r = rsrc_basename(name, filename_length);
@@ -2712,8 +2898,6 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 				 * resource fork file to expose it. */
 				if (name[filename_length-1] != '/' &&
 				    (r - name < 3 || r[0] != '.' || r[1] != '_')) {
-					__archive_rb_tree_insert_node(
-					    &zip->tree, &zip_entry->node);
 					/* Expose its parent directories. */
 					expose_parent_dirs(zip, name,
 					    filename_length);
@@ -2722,6 +2906,7 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 					 * a directory. */
 					archive_strncpy(&(zip_entry->rsrcname),
 					     name, filename_length);
+					zip_entry->flags |= LA_HIDDEN_RSRC;
 					__archive_rb_tree_insert_node(
 					    &zip->tree_rsrc, &zip_entry->node);
 				}
@@ -2736,10 +2921,6 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 				archive_strncat(&(zip_entry->rsrcname),
 				    name + (r - name),
 				    filename_length - (r - name));
-				/* Register an entry to RB tree to sort it by
-				 * file offset. */
-				__archive_rb_tree_insert_node(&zip->tree,
-				    &zip_entry->node);
 			}
 		}
 
@@ -2748,7 +2929,7 @@ slurp_central_directory(struct archive_read *a, struct zip *zip)
 		    filename_length + extra_length + comment_length);
 	}
 
-	return ARCHIVE_OK;
+	return (sort_central_directory(a, zip));
 }
 
 static ssize_t
@@ -2947,22 +3128,26 @@ archive_read_format_zip_seekable_read_header(struct archive_read *a,
 	if (a->archive.archive_format_name == NULL)
 		a->archive.archive_format_name = "ZIP";
 
-	if (zip->zip_entries == NULL) {
+	if (zip->entry_pending) {
+		/* archive_read_seek_entry() already selected the entry. */
+		zip->entry_pending = 0;
+	} else if (!zip->central_directory_loaded) {
 		r = slurp_central_directory(a, zip);
 		if (r != ARCHIVE_OK)
 			return r;
 		/* Get first entry whose local header offset is lower than
 		 * other entries in the archive file. */
-		zip->entry =
-		    (struct zip_entry *)ARCHIVE_RB_TREE_MIN(&zip->tree);
-	} else if (zip->entry != NULL) {
+		zip->entry_index = 0;
+	} else if (zip->entry_index < zip->entries_count) {
 		/* Get next entry in local header offset order. */
-		zip->entry = (struct zip_entry *)__archive_rb_tree_iterate(
-		    &zip->tree, &zip->entry->node, ARCHIVE_RB_DIR_RIGHT);
+		zip->entry_index++;
 	}
 
-	if (zip->entry == NULL)
+	if (zip->entry_index >= zip->entries_count) {
+		zip->entry = NULL;
 		return ARCHIVE_EOF;
+	}
+	zip->entry = zip->entries_by_offset[zip->entry_index];
 
 	if (zip->entry->rsrcname.s)
 		rsrc = (struct zip_entry *)__archive_rb_tree_find_node(
@@ -3000,6 +3185,78 @@ archive_read_format_zip_seekable_read_header(struct archive_read *a,
 	return (ret);
 }
 
+/*
+ * Index the listed entries by name.  When a name occurs more than
+ * once the last copy in the file wins, matching what a full
+ * extraction would leave behind.
+ */
+static int
+build_names_index(struct archive_read *a, struct zip *zip)
+{
+	struct zip_name_ref *refs;
+	size_t i;
+
+	refs = malloc((zip->entries_count > 0 ? zip->entries_count : 1)
+	    * sizeof(*refs));
+	if (refs == NULL) {
+		archive_set_error(&a->archive, ENOMEM,
+		    "Can't allocate zip name index");
+		return (ARCHIVE_FATAL);
+	}
+	for (i = 0; i < zip->entries_count; i++) {
+		refs[i].name =
+		    zip->names.s + zip->entries_by_offset[i]->name_offset;
+		refs[i].index = i;
+	}
+	qsort(refs, zip->entries_count, sizeof(*refs), cmp_name_ref);
+	zip->names_index = refs;
+	return (ARCHIVE_OK);
+}
+
+static int
+archive_read_format_zip_seek_entry(struct archive_read *a,
+    const char *pathname)
+{
+	struct zip *zip = (struct zip *)a->format->data;
+	size_t lo, hi, mid;
+	int r;
+
+	if (!zip->central_directory_loaded) {
+		r = slurp_central_directory(a, zip);
+		if (r != ARCHIVE_OK)
+			return r;
+		/* The first entry is still to be read. */
+		zip->entry_index = 0;
+		zip->entry_pending = 1;
+	}
+	if (zip->names_index == NULL) {
+		r = build_names_index(a, zip);
+		if (r != ARCHIVE_OK)
+			return r;
+	}
+
+	/* Find the first name greater than pathname; the entry just
+	 * before it is the last copy of pathname, if there is one. */
+	lo = 0;
+	hi = zip->entries_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(zip->names_index[mid].name, pathname) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || strcmp(zip->names_index[lo - 1].name, pathname) != 0) {
+		archive_set_error(&a->archive, ENOENT,
+		    "%s: Not found in archive", pathname);
+		return (ARCHIVE_FAILED);
+	}
+	zip->entry_index = zip->names_index[lo - 1].index;
+	zip->entry_pending = 1;
+	zip->unconsumed = 0;
+	return (ARCHIVE_OK);
+}
+
 /*
  * We're going to seek for the next header anyway, so we don't
  * need to bother doing anything here.
@@ -3054,7 +3311,8 @@ archive_read_support_format_zip_seekable(struct archive *_a)
 	    NULL,
 	    archive_read_format_zip_cleanup,
 	    archive_read_support_format_zip_capabilities_seekable,
-	    archive_read_format_zip_has_encrypted_entries);
+	    archive_read_format_zip_has_encrypted_entries,
+	    archive_read_format_zip_seek_entry);
 
 	if (r != ARCHIVE_OK)
 		free(zip);
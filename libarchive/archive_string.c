@@ -45,6 +45,9 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_string.c 201095 2009-12-28 02:33
 #ifdef HAVE_LANGINFO_H
 #include <langinfo.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #ifdef HAVE_LOCALCHARSET_H
 #include <localcharset.h>
 #endif
@@ -57,10 +60,22 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_string.c 201095 2009-12-28 02:33
 #ifdef HAVE_WCHAR_H
 #include <wchar.h>
 #endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#define SCONV_CACHE
+#endif
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <windows.h>
 #include <locale.h>
 #endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ASCII_RUN_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ASCII_RUN_NEON
+#endif
 
 #include "archive_endian.h"
 #include "archive_private.h"
@@ -119,6 +134,11 @@ struct archive_string_conv {
 	int (*converter[2])(struct archive_string *, const void *, size_t,
 	    struct archive_string_conv *);
 	int				 nconverter;
+	/* The arguments this object was created with and its initial
+	 * flag, used by the cache of idle objects. */
+	unsigned			 key_cp;
+	int				 key_flag;
+	int				 init_flag;
 };
 
 #define CP_C_LOCALE	0	/* "C" locale only for this file. */
@@ -139,6 +159,9 @@ static void add_sconv_object(struct archive *, struct archive_string_conv *);
 static struct archive_string_conv *create_sconv_object(const char *,
 	const char *, unsigned, int);
 static void free_sconv_object(struct archive_string_conv *);
+static struct archive_string_conv *take_cached_sconv_object(const char *,
+	const char *, unsigned, int);
+static void release_sconv_object(struct archive_string_conv *);
 static struct archive_string_conv *get_sconv_object(struct archive *,
 	const char *, const char *, int);
 static unsigned make_codepage_from_charset(const char *);
@@ -196,6 +219,193 @@ static int archive_string_normalize_D(struct archive_string *, const void *,
     size_t, struct archive_string_conv *);
 static int archive_string_append_unicode(struct archive_string *,
     const void *, size_t, struct archive_string_conv *);
+static size_t ascii_run(const char *, size_t);
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static size_t ascii_widen(wchar_t *, const char *, size_t);
+static size_t ascii_narrow(char *, const wchar_t *, size_t);
+#endif
+
+/*
+ * Printable ASCII (0x20 - 0x7E) is encoded the same way in UTF-8 and
+ * in ASCII-compatible charsets, so a run of it can be copied as is
+ * instead of going through a conversion call per character.  Not every
+ * locale charset is ASCII-compatible: Shift_JIS maps 0x5C and 0x7E to
+ * YEN SIGN and OVERLINE, so conversions in the current locale check
+ * those two first (mbs_keeps_ascii(), wcs_keeps_ascii()).  Control
+ * characters are left to the slow path; stateful encodings such as
+ * ISO-2022 use ESC, SO and SI to switch character sets.
+ */
+#if !defined(__STDC_MB_MIGHT_NEQ_WC__)
+#if HAVE_MBRTOWC
+#define ASCII_RUN_MBRTOWC
+#endif
+#if HAVE_WCRTOMB
+#define ASCII_RUN_WCRTOMB
+#endif
+#endif
+
+/*
+ * Return the length of the run of printable ASCII at the start of s.
+ */
+static size_t
+ascii_run(const char *s, size_t n)
+{
+	size_t i = 0;
+#if defined(ASCII_RUN_SSE2)
+	const __m128i sp = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+	__m128i v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		/* Bytes with the high bit set compare less than 0x20. */
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, sp),
+		    _mm_cmpeq_epi8(v, del))) != 0)
+			break;
+	}
+#elif defined(ASCII_RUN_NEON)
+	uint64x2_t bad;
+	int8x16_t v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = vld1q_s8((const int8_t *)(s + i));
+		bad = vreinterpretq_u64_u8(vorrq_u8(
+		    vcltq_s8(v, vdupq_n_s8(0x20)),
+		    vceqq_s8(v, vdupq_n_s8(0x7f))));
+		if ((vgetq_lane_u64(bad, 0) | vgetq_lane_u64(bad, 1)) != 0)
+			break;
+	}
+#endif
+	for (; i < n; i++) {
+		unsigned char c = (unsigned char)s[i];
+		if (c < 0x20 || c > 0x7e)
+			break;
+	}
+	return (i);
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+/*
+ * Widen the run of printable ASCII at the start of s into d and
+ * return its length.
+ */
+static size_t
+ascii_widen(wchar_t *d, const char *s, size_t n)
+{
+	size_t i = 0;
+#if defined(ASCII_RUN_SSE2)
+	const __m128i sp = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+
+	if (sizeof(wchar_t) == 4) {
+		for (; i + 16 <= n; i += 16) {
+			v = _mm_loadu_si128((const __m128i *)(s + i));
+			if (_mm_movemask_epi8(_mm_or_si128(
+			    _mm_cmplt_epi8(v, sp),
+			    _mm_cmpeq_epi8(v, del))) != 0)
+				break;
+			lo = _mm_unpacklo_epi8(v, zero);
+			hi = _mm_unpackhi_epi8(v, zero);
+			_mm_storeu_si128((__m128i *)(d + i),
+			    _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 4),
+			    _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 8),
+			    _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 12),
+			    _mm_unpackhi_epi16(hi, zero));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		unsigned char c = (unsigned char)s[i];
+		if (c < 0x20 || c > 0x7e)
+			break;
+		d[i] = (wchar_t)c;
+	}
+	return (i);
+}
+
+/*
+ * Narrow the run of printable ASCII at the start of w into d and
+ * return its length.
+ */
+static size_t
+ascii_narrow(char *d, const wchar_t *w, size_t n)
+{
+	size_t i = 0;
+#if defined(ASCII_RUN_SSE2)
+	const __m128i sp = _mm_set1_epi32(0x20), tl = _mm_set1_epi32(0x7e);
+	__m128i a, b, c, e, bad;
+
+	if (sizeof(wchar_t) == 4) {
+		for (; i + 16 <= n; i += 16) {
+			a = _mm_loadu_si128((const __m128i *)(w + i));
+			b = _mm_loadu_si128((const __m128i *)(w + i + 4));
+			c = _mm_loadu_si128((const __m128i *)(w + i + 8));
+			e = _mm_loadu_si128((const __m128i *)(w + i + 12));
+			/* Values at or above 0x80000000 compare negative. */
+#define OUT_OF_RUN(x)	\
+	_mm_or_si128(_mm_cmplt_epi32(x, sp), _mm_cmpgt_epi32(x, tl))
+			bad = _mm_or_si128(
+			    _mm_or_si128(OUT_OF_RUN(a), OUT_OF_RUN(b)),
+			    _mm_or_si128(OUT_OF_RUN(c), OUT_OF_RUN(e)));
+#undef OUT_OF_RUN
+			if (_mm_movemask_epi8(bad) != 0)
+				break;
+			_mm_storeu_si128((__m128i *)(d + i),
+			    _mm_packus_epi16(_mm_packs_epi32(a, b),
+				_mm_packs_epi32(c, e)));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (w[i] < 0x20 || w[i] > 0x7e)
+			break;
+		d[i] = (char)w[i];
+	}
+	return (i);
+}
+#endif
+
+#if defined(ASCII_RUN_MBRTOWC)
+/*
+ * Return nonzero if the current locale reads '\\' and '~' as themselves.
+ */
+static int
+mbs_keeps_ascii(void)
+{
+	mbstate_t shift_state;
+	wchar_t wc;
+
+	memset(&shift_state, 0, sizeof(shift_state));
+	if (mbrtowc(&wc, "\\", 1, &shift_state) != 1 || wc != L'\\')
+		return (0);
+	if (mbrtowc(&wc, "~", 1, &shift_state) != 1 || wc != L'~')
+		return (0);
+	return (1);
+}
+#endif
+
+#if defined(ASCII_RUN_WCRTOMB)
+/*
+ * Return nonzero if the current locale writes L'\\' and L'~' as
+ * themselves.
+ */
+static int
+wcs_keeps_ascii(void)
+{
+	mbstate_t shift_state;
+	char buff[MB_LEN_MAX];
+
+	memset(&shift_state, 0, sizeof(shift_state));
+	if (wcrtomb(buff, L'\\', &shift_state) != 1 || buff[0] != '\\')
+		return (0);
+	if (wcrtomb(buff, L'~', &shift_state) != 1 || buff[0] != '~')
+		return (0);
+	return (1);
+}
+#endif
 
 static struct archive_string *
 archive_string_append(struct archive_string *as, const char *p, size_t s)
@@ -587,6 +797,9 @@ archive_wstring_append_from_mbs(struct archive_wstring *dest,
 	size_t mbs_length = len;
 	const char *mbs = p;
 	wchar_t *wcs;
+#if defined(ASCII_RUN_MBRTOWC)
+	int keep_ascii = mbs_keeps_ascii();
+#endif
 #if HAVE_MBRTOWC
 	mbstate_t shift_state;
 
@@ -610,6 +823,17 @@ archive_wstring_append_from_mbs(struct archive_wstring *dest,
 				return (-1);
 			wcs = dest->s + dest->length;
 		}
+#if defined(ASCII_RUN_MBRTOWC)
+		if (keep_ascii && mbsinit(&shift_state) &&
+		    (r = ascii_widen(wcs, mbs, mbs_length)) > 0) {
+			/* wcs_length never falls below mbs_length. */
+			wcs += r;
+			wcs_length -= r;
+			mbs += r;
+			mbs_length -= r;
+			continue;
+		}
+#endif
 #if HAVE_MBRTOWC
 		r = mbrtowc(wcs, mbs, wcs_length, &shift_state);
 #else
@@ -766,6 +990,10 @@ archive_string_append_from_wcs(struct archive_string *as,
 	int n, ret_val = 0;
 	char *p;
 	char *end;
+#if defined(ASCII_RUN_WCRTOMB)
+	size_t r;
+	int keep_ascii = wcs_keeps_ascii();
+#endif
 #if HAVE_WCRTOMB
 	mbstate_t shift_state;
 
@@ -795,6 +1023,16 @@ archive_string_append_from_wcs(struct archive_string *as,
 			p = as->s + as->length;
 			end = as->s + as->buffer_length - MB_CUR_MAX -1;
 		}
+#if defined(ASCII_RUN_WCRTOMB)
+		if (keep_ascii && mbsinit(&shift_state) &&
+		    (r = ascii_narrow(p, w,
+		    len < (size_t)(end - p) ? len : (size_t)(end - p))) > 0) {
+			p += r;
+			w += r;
+			len -= r;
+			continue;
+		}
+#endif
 #if HAVE_WCRTOMB
 		n = wcrtomb(p, *w++, &shift_state);
 #else
@@ -1126,6 +1364,8 @@ create_sconv_object(const char *fc, const char *tc,
 		return (NULL);
 	}
 	archive_string_init(&sc->utftmp);
+	sc->key_cp = current_codepage;
+	sc->key_flag = flag;
 
 	if (flag & SCONV_TO_CHARSET) {
 		/*
@@ -1277,6 +1517,7 @@ create_sconv_object(const char *fc, const char *tc,
 #endif	/* HAVE_ICONV */
 
 	sc->flag = flag;
+	sc->init_flag = flag;
 
 	/*
 	 * Set up converters.
@@ -1304,6 +1545,91 @@ free_sconv_object(struct archive_string_conv *sc)
 	free(sc);
 }
 
+/*
+ * A process-wide cache of idle string conversion objects.
+ *
+ * Creating a conversion object usually means an iconv_open(), which
+ * loads conversion tables and is far more expensive than the
+ * conversions most archive objects go on to do.  An object belongs to
+ * one archive object at a time, so its iconv state and its buffer
+ * need no locking; when the archive object is freed, the conversion
+ * object is put here for the next archive object that asks for the
+ * same conversion.
+ */
+#define SCONV_CACHE_MAX	16
+
+#ifdef SCONV_CACHE
+static pthread_mutex_t sconv_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct archive_string_conv *sconv_cache;
+static int sconv_cache_size;
+#endif
+
+/*
+ * Take an idle string conversion object out of the cache.
+ * Return NULL if not found.
+ */
+static struct archive_string_conv *
+take_cached_sconv_object(const char *fc, const char *tc,
+    unsigned current_codepage, int flag)
+{
+#ifdef SCONV_CACHE
+	struct archive_string_conv *sc, **psc;
+
+	pthread_mutex_lock(&sconv_cache_lock);
+	for (psc = &sconv_cache; (sc = *psc) != NULL; psc = &(sc->next)) {
+		if (sc->key_flag == flag &&
+		    sc->key_cp == current_codepage &&
+		    strcmp(sc->from_charset, fc) == 0 &&
+		    strcmp(sc->to_charset, tc) == 0) {
+			*psc = sc->next;
+			sconv_cache_size--;
+			sc->next = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sconv_cache_lock);
+	return (sc);
+#else
+	(void)fc; /* UNUSED */
+	(void)tc; /* UNUSED */
+	(void)current_codepage; /* UNUSED */
+	(void)flag; /* UNUSED */
+	return (NULL);
+#endif
+}
+
+/*
+ * Return a string conversion object to the cache, or free it if the
+ * cache is full or its behavior was changed with
+ * archive_string_conversion_set_opt().
+ */
+static void
+release_sconv_object(struct archive_string_conv *sc)
+{
+#ifdef SCONV_CACHE
+	if (sc->flag == sc->init_flag) {
+#if HAVE_ICONV
+		/* Put the iconv objects back in their initial state. */
+		if (sc->cd != (iconv_t)-1)
+			iconv(sc->cd, NULL, NULL, NULL, NULL);
+		if (sc->cd_w != (iconv_t)-1)
+			iconv(sc->cd_w, NULL, NULL, NULL, NULL);
+#endif
+		pthread_mutex_lock(&sconv_cache_lock);
+		if (sconv_cache_size < SCONV_CACHE_MAX) {
+			sc->next = sconv_cache;
+			sconv_cache = sc;
+			sconv_cache_size++;
+			sc = NULL;
+		}
+		pthread_mutex_unlock(&sconv_cache_lock);
+		if (sc == NULL)
+			return;
+	}
+#endif
+	free_sconv_object(sc);
+}
+
 #if defined(_WIN32) && !defined(__CYGWIN__)
 static unsigned
 my_atoi(const char *p)
@@ -1632,6 +1958,15 @@ get_sconv_object(struct archive *a, const char *fc, const char *tc, int flag)
 	else
 		current_codepage = a->current_codepage;
 
+	/* Check if another archive object has made it before. */
+	sc = take_cached_sconv_object(canonical_charset_name(fc),
+	    canonical_charset_name(tc), current_codepage, flag);
+	if (sc != NULL) {
+		if (a != NULL)
+			add_sconv_object(a, sc);
+		return (sc);
+	}
+
 	sc = create_sconv_object(canonical_charset_name(fc),
 	    canonical_charset_name(tc), current_codepage, flag);
 	if (sc == NULL) {
@@ -1797,7 +2132,7 @@ archive_string_conversion_free(struct archive *a)
 
 	for (sc = a->sconv; sc != NULL; sc = sc_next) {
 		sc_next = sc->next;
-		free_sconv_object(sc);
+		release_sconv_object(sc);
 	}
 	a->sconv = NULL;
 	free(a->current_code);
@@ -2173,6 +2508,15 @@ invalid_mbs(const void *_p, size_t n, struct archive_string_conv *sc)
 	while (n) {
 		wchar_t wc;
 
+#if defined(ASCII_RUN_MBRTOWC)
+		/* Printable ASCII is valid in every locale charset even
+		 * where it does not mean the same, so no check here. */
+		if (mbsinit(&shift_state) && (r = ascii_run(p, n)) > 0) {
+			p += r;
+			n -= r;
+			continue;
+		}
+#endif
 #if HAVE_MBRTOWC
 		r = mbrtowc(&wc, p, n, &shift_state);
 #else
@@ -2226,6 +2570,16 @@ best_effort_strncat_in_locale(struct archive_string *as, const void *_p,
 	remaining = length;
 	itp = (const uint8_t *)_p;
 	while (*itp && remaining > 0) {
+		size_t run = ascii_run((const char *)itp, remaining);
+
+		if (run > 0) {
+			if (archive_string_append(as, (const char *)itp, run)
+			    == NULL)
+				__archive_errx(1, "Out of memory");
+			itp += run;
+			remaining -= run;
+			continue;
+		}
 		if (*itp > 127) {
 			// Non-ASCII: Substitute with suitable replacement
 			if (sc->flag & SCONV_TO_UTF8) {
@@ -2240,6 +2594,7 @@ best_effort_strncat_in_locale(struct archive_string *as, const void *_p,
 			archive_strappend_char(as, *itp);
 		}
 		++itp;
+		--remaining;
 	}
 	return (return_value);
 }
@@ -2639,7 +2994,12 @@ strncat_from_utf8_to_utf8(struct archive_string *as, const void *_p,
 		/*
 		 * Forward byte sequence until a conversion of that is needed.
 		 */
-		while ((n = utf8_to_unicode(&uc, s, len)) > 0) {
+		for (;;) {
+			w = ascii_run(s, len);
+			s += w;
+			len -= w;
+			if ((n = utf8_to_unicode(&uc, s, len)) <= 0)
+				break;
 			s += n;
 			len -= n;
 		}
@@ -2744,7 +3104,35 @@ archive_string_append_unicode(struct archive_string *as, const void *_p,
 	s = (const char *)_p;
 	p = as->s + as->length;
 	endp = as->s + as->buffer_length - ts;
-	while ((n = parse(&uc, s, len)) != 0) {
+	for (;;) {
+		if (parse == cesu8_to_unicode &&
+		    (w = ascii_run(s, len)) > 0) {
+			/* Copy or widen a run of ASCII at once. */
+			if (p + w * ts > endp) {
+				as->length = p - as->s;
+				if (archive_string_ensure(as,
+				    as->buffer_length + len * tm + ts) == NULL)
+					return (-1);
+				p = as->s + as->length;
+				endp = as->s + as->buffer_length - ts;
+			}
+			if (ts == 1)
+				memcpy(p, s, w);
+			else {
+				size_t i;
+				int be = unparse == unicode_to_utf16be;
+
+				for (i = 0; i < w; i++) {
+					p[i * 2 + be] = s[i];
+					p[i * 2 + !be] = '\0';
+				}
+			}
+			p += w * ts;
+			s += w;
+			len -= w;
+		}
+		if ((n = parse(&uc, s, len)) == 0)
+			break;
 		if (n < 0) {
 			/* Use a replaced unicode character. */
 			n *= -1;
@@ -2912,7 +3300,7 @@ archive_string_normalize_C(struct archive_string *as, const void *_p,
 	char *p, *endp;
 	uint32_t uc, uc2;
 	size_t w;
-	int always_replace, n, n2, ret = 0, spair, ts, tm;
+	int always_replace, ascii_copy, n, n2, ret = 0, spair, ts, tm;
 	int (*parse)(uint32_t *, const char *, size_t);
 	size_t (*unparse)(char *, size_t, uint32_t);
 
@@ -2962,6 +3350,7 @@ archive_string_normalize_C(struct archive_string *as, const void *_p,
 		tm = ts;
 		spair = 6;/* surrogate pair size in UTF-8. */
 	}
+	ascii_copy = parse == cesu8_to_unicode && unparse == unicode_to_utf8;
 
 	if (archive_string_ensure(as, as->length + len * tm + ts) == NULL)
 		return (-1);
@@ -3011,6 +3400,27 @@ archive_string_normalize_C(struct archive_string *as, const void *_p,
 			if (!IS_DECOMPOSABLE_BLOCK(uc2)) {
 				WRITE_UC();
 				REPLACE_UC_WITH_UC2();
+				/*
+				 * An ASCII character never combines with the
+				 * one before it, so a run of ASCII can be
+				 * copied as is except for its last character,
+				 * which may be followed by a combining mark.
+				 */
+				if (ascii_copy && uc < 0x80 &&
+				    (w = ascii_run(s, len)) > 0) {
+					WRITE_UC();
+					if (p + w > endp)
+						EXPAND_BUFFER();
+					memcpy(p, s, w - 1);
+					p += w - 1;
+					s += w - 1;
+					len -= w - 1;
+					uc = (unsigned char)*s;
+					ucptr = s;
+					n = 1;
+					s++;
+					len--;
+				}
 				continue;
 			}
 
@@ -3864,7 +4274,7 @@ archive_mstring_get_utf8(struct archive *a, struct archive_mstring *aes,
 		r = archive_strncpy_l(&(aes->aes_utf8), aes->aes_mbs.s,
 		    aes->aes_mbs.length, sc);
 		if (a == NULL)
-			free_sconv_object(sc);
+			release_sconv_object(sc);
 		if (r == 0) {
 			aes->aes_set |= AES_SET_UTF8;
 			*p = aes->aes_utf8.s;
@@ -4182,7 +4592,7 @@ archive_mstring_update_utf8(struct archive *a, struct archive_mstring *aes,
 		return (-1);/* Couldn't allocate memory for sc. */
 	r = archive_strcpy_l(&(aes->aes_mbs), utf8, sc);
 	if (a == NULL)
-		free_sconv_object(sc);
+		release_sconv_object(sc);
 	if (r != 0)
 		return (-1);
 	aes->aes_set = AES_SET_UTF8 | AES_SET_MBS; /* Both UTF8 and MBS set. */
@@ -0,0 +1,146 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "archive_platform.h"
+__FBSDID("$FreeBSD$");
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "archive.h"
+#include "archive_entry.h"
+#include "archive_private.h"
+#include "archive_string.h"
+#include "archive_tar_index_private.h"
+
+/*
+ * The index is a text file with one line per entry; see the tar
+ * reader for a description.  It is written through a raw-format
+ * archive object, just as the reader reads it.
+ */
+struct archive_tar_index {
+	struct archive		*out;
+	struct archive_string	 line;
+};
+
+static void
+index_free(struct archive_tar_index *index)
+{
+	archive_write_free(index->out);
+	archive_string_free(&index->line);
+	free(index);
+}
+
+struct archive_tar_index *
+__archive_tar_index_open(struct archive *a, const char *filename)
+{
+	struct archive_tar_index *index;
+	struct archive_entry *ae;
+	static const char heading[] =
+	    "#header-offset data-offset size pathname\n";
+	int r;
+
+	index = (struct archive_tar_index *)calloc(1, sizeof(*index));
+	if (index == NULL ||
+	    (index->out = archive_write_new()) == NULL ||
+	    (ae = archive_entry_new()) == NULL) {
+		if (index != NULL)
+			index_free(index);
+		archive_set_error(a, ENOMEM, "Can't allocate index");
+		return (NULL);
+	}
+	archive_string_init(&index->line);
+	archive_entry_set_filetype(ae, AE_IFREG);
+	r = archive_write_set_format_raw(index->out);
+	if (r == ARCHIVE_OK)
+		r = archive_write_add_filter_none(index->out);
+	if (r == ARCHIVE_OK)
+		r = archive_write_set_bytes_in_last_block(index->out, 1);
+	if (r == ARCHIVE_OK)
+		r = archive_write_open_filename(index->out, filename);
+	if (r == ARCHIVE_OK)
+		r = archive_write_header(index->out, ae);
+	if (r == ARCHIVE_OK &&
+	    archive_write_data(index->out, heading, sizeof(heading) - 1) < 0)
+		r = ARCHIVE_FATAL;
+	archive_entry_free(ae);
+	if (r != ARCHIVE_OK) {
+		archive_copy_error(a, index->out);
+		index_free(index);
+		return (NULL);
+	}
+	return (index);
+}
+
+int
+__archive_tar_index_add(struct archive *a, struct archive_tar_index *index,
+    int64_t header_offset, int64_t data_offset, struct archive_entry *entry)
+{
+	const unsigned char *p;
+
+	p = (const unsigned char *)archive_entry_pathname(entry);
+	if (p == NULL || *p == '\0')
+		return (ARCHIVE_OK);
+	archive_string_empty(&index->line);
+	archive_string_sprintf(&index->line, "%jd %jd %jd ",
+	    (intmax_t)header_offset, (intmax_t)data_offset,
+	    (intmax_t)archive_entry_size(entry));
+	/* Escape what would end the line or be taken for an escape. */
+	for (; *p != '\0'; p++) {
+		if (*p == '\\' || *p < 0x20 || *p == 0x7f)
+			archive_string_sprintf(&index->line, "\\%c%c%c",
+			    '0' + (*p >> 6), '0' + ((*p >> 3) & 7),
+			    '0' + (*p & 7));
+		else
+			archive_strappend_char(&index->line, (char)*p);
+	}
+	archive_strappend_char(&index->line, '\n');
+	if (archive_write_data(index->out, index->line.s,
+	    archive_strlen(&index->line)) < 0) {
+		archive_copy_error(a, index->out);
+		return (ARCHIVE_FATAL);
+	}
+	return (ARCHIVE_OK);
+}
+
+int
+__archive_tar_index_close(struct archive *a, struct archive_tar_index *index)
+{
+	int r;
+
+	if (index == NULL)
+		return (ARCHIVE_OK);
+	r = archive_write_close(index->out);
+	if (r != ARCHIVE_OK) {
+		archive_copy_error(a, index->out);
+		r = ARCHIVE_FATAL;
+	}
+	index_free(index);
+	return (r);
+}
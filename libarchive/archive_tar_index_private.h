@@ -0,0 +1,53 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LIBARCHIVE_BUILD
+#error This header is only to be used internally to libarchive.
+#endif
+
+#ifndef ARCHIVE_TAR_INDEX_PRIVATE_H_INCLUDED
+#define ARCHIVE_TAR_INDEX_PRIVATE_H_INCLUDED
+
+struct archive;
+struct archive_entry;
+
+/*
+ * Writes the sidecar index of a tar archive, in the form read back by
+ * the tar reader's "index" option, while the archive is being written
+ * or read.  Errors are reported on the archive passed in.
+ */
+struct archive_tar_index;
+
+struct archive_tar_index *
+	__archive_tar_index_open(struct archive *, const char *filename);
+/* Record an entry whose headers start at header_offset. */
+int	__archive_tar_index_add(struct archive *, struct archive_tar_index *,
+	    int64_t header_offset, int64_t data_offset,
+	    struct archive_entry *);
+/* Finish the index file and free 'index'; NULL is accepted. */
+int	__archive_tar_index_close(struct archive *,
+	    struct archive_tar_index *);
+
+#endif /* ARCHIVE_TAR_INDEX_PRIVATE_H_INCLUDED */
@@ -0,0 +1,265 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "archive_platform.h"
+__FBSDID("$FreeBSD$");
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "archive.h"
+#include "archive_private.h"
+#include "archive_tempfile_private.h"
+
+/* In memory, the data are kept in chunks of this size. */
+#define CHUNK_SIZE	(64 * 1024)
+
+void
+__archive_tempfile_init(struct archive_tempfile *tf)
+{
+	memset(tf, 0, sizeof(*tf));
+	tf->fd = -1;
+}
+
+static void
+free_chunks(struct archive_tempfile *tf)
+{
+	size_t i;
+
+	for (i = 0; i < tf->chunks_alloc; i++)
+		free(tf->chunks[i]);
+	free(tf->chunks);
+	tf->chunks = NULL;
+	tf->chunks_alloc = 0;
+}
+
+int
+__archive_tempfile_options(struct archive *a, struct archive_tempfile *tf,
+    const char *key, const char *value)
+{
+	if (strcmp(key, "temp-memlimit") == 0) {
+		uint64_t n = 0;
+		char *end;
+
+		/* "!temp-memlimit" keeps all data in a file. */
+		if (value != NULL) {
+			errno = 0;
+			n = (uint64_t)strtoull(value, &end, 10);
+			if (value[0] < '0' || value[0] > '9' ||
+			    *end != '\0' || errno != 0 ||
+			    n > (uint64_t)(SIZE_MAX / 2)) {
+				archive_set_error(a, ARCHIVE_ERRNO_MISC,
+				    "Illegal value `%s'", value);
+				return (ARCHIVE_FAILED);
+			}
+		}
+		tf->memory_limit = (size_t)n;
+		return (ARCHIVE_OK);
+	}
+	if (strcmp(key, "temp-dir") == 0) {
+		if (value == NULL)
+			archive_string_empty(&(tf->tmpdir));
+		else
+			archive_strcpy(&(tf->tmpdir), value);
+		return (ARCHIVE_OK);
+	}
+	return (ARCHIVE_WARN);
+}
+
+int
+__archive_tempfile_open(struct archive_tempfile *tf)
+{
+	tf->size = tf->offset = 0;
+	if (tf->memory_limit == 0) {
+		tf->fd = __archive_mktemp(
+		    (tf->tmpdir.length)? tf->tmpdir.s: NULL);
+		if (tf->fd < 0)
+			return (-1);
+	}
+	tf->opened = 1;
+	return (0);
+}
+
+/*
+ * Move the data to a temporary file.
+ */
+static int
+spill(struct archive_tempfile *tf)
+{
+	int64_t remaining = tf->size;
+	size_t i, s;
+	ssize_t ws;
+	unsigned char *p;
+
+	tf->fd = __archive_mktemp((tf->tmpdir.length)? tf->tmpdir.s: NULL);
+	if (tf->fd < 0)
+		return (-1);
+	for (i = 0; remaining > 0; i++) {
+		s = (remaining > CHUNK_SIZE)? CHUNK_SIZE: (size_t)remaining;
+		remaining -= s;
+		p = tf->chunks[i];
+		if (p == NULL) {
+			/* A hole left by seeking past the end. */
+			if (lseek(tf->fd, s, SEEK_CUR) < 0)
+				return (-1);
+			continue;
+		}
+		while (s) {
+			ws = write(tf->fd, p, s);
+			if (ws < 0)
+				return (-1);
+			p += ws;
+			s -= ws;
+		}
+	}
+	free_chunks(tf);
+	if (lseek(tf->fd, tf->offset, SEEK_SET) < 0)
+		return (-1);
+	return (0);
+}
+
+ssize_t
+__archive_tempfile_write(struct archive_tempfile *tf, const void *buff,
+    size_t s)
+{
+	const unsigned char *p = buff;
+	size_t n, ci, co, done;
+
+	if (tf->fd < 0 && tf->offset + (int64_t)s > (int64_t)tf->memory_limit) {
+		if (spill(tf) != 0)
+			return (-1);
+	}
+	if (tf->fd >= 0)
+		return (write(tf->fd, buff, s));
+
+	n = (size_t)((tf->offset + s + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	if (n > tf->chunks_alloc) {
+		unsigned char **chunks;
+		size_t alloc = (tf->chunks_alloc)? tf->chunks_alloc: 16;
+
+		while (alloc < n)
+			alloc *= 2;
+		chunks = realloc(tf->chunks, alloc * sizeof(*chunks));
+		if (chunks == NULL) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		memset(chunks + tf->chunks_alloc, 0,
+		    (alloc - tf->chunks_alloc) * sizeof(*chunks));
+		tf->chunks = chunks;
+		tf->chunks_alloc = alloc;
+	}
+	for (done = 0; done < s; done += n) {
+		ci = (size_t)(tf->offset / CHUNK_SIZE);
+		co = (size_t)(tf->offset % CHUNK_SIZE);
+		n = CHUNK_SIZE - co;
+		if (n > s - done)
+			n = s - done;
+		if (tf->chunks[ci] == NULL) {
+			/* Holes read back as zeros, as in a file. */
+			tf->chunks[ci] = calloc(1, CHUNK_SIZE);
+			if (tf->chunks[ci] == NULL) {
+				errno = ENOMEM;
+				return (-1);
+			}
+		}
+		memcpy(tf->chunks[ci] + co, p + done, n);
+		tf->offset += n;
+	}
+	if (tf->offset > tf->size)
+		tf->size = tf->offset;
+	return (s);
+}
+
+ssize_t
+__archive_tempfile_read(struct archive_tempfile *tf, void *buff, size_t s)
+{
+	unsigned char *p = buff;
+	size_t n, ci, co, done;
+
+	if (tf->fd >= 0)
+		return (read(tf->fd, buff, s));
+
+	if (tf->offset >= tf->size)
+		return (0);
+	if ((int64_t)s > tf->size - tf->offset)
+		s = (size_t)(tf->size - tf->offset);
+	for (done = 0; done < s; done += n) {
+		ci = (size_t)(tf->offset / CHUNK_SIZE);
+		co = (size_t)(tf->offset % CHUNK_SIZE);
+		n = CHUNK_SIZE - co;
+		if (n > s - done)
+			n = s - done;
+		if (tf->chunks[ci] == NULL)
+			memset(p + done, 0, n);
+		else
+			memcpy(p + done, tf->chunks[ci] + co, n);
+		tf->offset += n;
+	}
+	return (s);
+}
+
+int64_t
+__archive_tempfile_seek(struct archive_tempfile *tf, int64_t offset,
+    int whence)
+{
+	if (tf->fd >= 0)
+		return (lseek(tf->fd, offset, whence));
+
+	switch (whence) {
+	case SEEK_CUR:
+		offset += tf->offset;
+		break;
+	case SEEK_END:
+		offset += tf->size;
+		break;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	tf->offset = offset;
+	return (offset);
+}
+
+void
+__archive_tempfile_close(struct archive_tempfile *tf)
+{
+	if (tf->fd >= 0)
+		close(tf->fd);
+	free_chunks(tf);
+	archive_string_free(&(tf->tmpdir));
+	__archive_tempfile_init(tf);
+}
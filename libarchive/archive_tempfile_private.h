@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LIBARCHIVE_BUILD
+#error This header is only to be used internally to libarchive.
+#endif
+
+#ifndef ARCHIVE_TEMPFILE_PRIVATE_H_INCLUDED
+#define ARCHIVE_TEMPFILE_PRIVATE_H_INCLUDED
+
+#include "archive_string.h"
+
+/*
+ * Scratch storage for writers which have to keep the file contents
+ * until the archive is closed.  Data are held in memory up to
+ * `memory_limit' bytes and moved to a temporary file in `tmpdir'
+ * (the default temporary directory if empty) once they grow beyond
+ * that; a limit of 0, the default, uses a temporary file from the
+ * start.
+ *
+ * The functions behave like write(2), read(2) and lseek(2) on a file
+ * descriptor and report errors through errno, so a format can use
+ * them in place of a descriptor returned by __archive_mktemp().
+ */
+struct archive_tempfile {
+	int			 opened;
+	int			 fd;/* -1 while the data are in memory. */
+	size_t			 memory_limit;
+	struct archive_string	 tmpdir;
+	unsigned char		**chunks;
+	size_t			 chunks_alloc;
+	int64_t			 size;
+	int64_t			 offset;
+};
+
+void	__archive_tempfile_init(struct archive_tempfile *);
+/*
+ * Handle the "temp-memlimit" and "temp-dir" format options; returns
+ * ARCHIVE_WARN for any other key.
+ */
+int	__archive_tempfile_options(struct archive *, struct archive_tempfile *,
+	    const char *, const char *);
+int	__archive_tempfile_open(struct archive_tempfile *);
+ssize_t	__archive_tempfile_write(struct archive_tempfile *, const void *,
+	    size_t);
+ssize_t	__archive_tempfile_read(struct archive_tempfile *, void *, size_t);
+int64_t	__archive_tempfile_seek(struct archive_tempfile *, int64_t, int);
+void	__archive_tempfile_close(struct archive_tempfile *);
+
+#endif /* ARCHIVE_TEMPFILE_PRIVATE_H_INCLUDED */
@@ -0,0 +1,212 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "archive_platform.h"
+__FBSDID("$FreeBSD$");
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#define ARCHIVE_HAVE_THREADS	1
+#endif
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#include <windows.h>
+#endif
+
+#include "archive_thread_pool_private.h"
+
+#ifdef ARCHIVE_HAVE_THREADS
+struct archive_thread_pool {
+	pthread_mutex_t		 lock;
+	/* Signaled when a task is queued or the pool shuts down. */
+	pthread_cond_t		 work;
+	/* Signaled when a task has been done. */
+	pthread_cond_t		 done;
+	struct archive_task	*head;
+	struct archive_task	*tail;
+	int			 shutdown;
+	int			 nthreads;
+	pthread_t		*threads;
+};
+
+static void *
+worker(void *arg)
+{
+	struct archive_thread_pool *pool = (struct archive_thread_pool *)arg;
+	struct archive_task *task;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->head == NULL && !pool->shutdown)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->shutdown)
+			break;
+		task = pool->head;
+		pool->head = task->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		task->next = NULL;
+		task->state = ARCHIVE_TASK_RUNNING;
+		pthread_mutex_unlock(&pool->lock);
+
+		task->run(task);
+
+		pthread_mutex_lock(&pool->lock);
+		task->state = ARCHIVE_TASK_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return (NULL);
+}
+#endif /* ARCHIVE_HAVE_THREADS */
+
+int
+__archive_thread_pool_ncpus(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1);
+#elif defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0 ? (int)n : 1);
+#else
+	return (1);
+#endif
+}
+
+struct archive_thread_pool *
+__archive_thread_pool_new(int threads)
+{
+#ifdef ARCHIVE_HAVE_THREADS
+	struct archive_thread_pool *pool;
+
+	if (threads <= 1)
+		return (NULL);
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return (NULL);
+	pool->threads = calloc(threads, sizeof(pool->threads[0]));
+	if (pool->threads == NULL) {
+		free(pool);
+		return (NULL);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (; pool->nthreads < threads; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+		    worker, pool) != 0)
+			break;
+	}
+	if (pool->nthreads == 0) {
+		__archive_thread_pool_free(pool);
+		return (NULL);
+	}
+	return (pool);
+#else
+	(void)threads; /* UNUSED */
+	return (NULL);
+#endif
+}
+
+void
+__archive_thread_pool_submit(struct archive_thread_pool *pool,
+    struct archive_task *task)
+{
+	task->next = NULL;
+#ifdef ARCHIVE_HAVE_THREADS
+	if (pool != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		task->state = ARCHIVE_TASK_QUEUED;
+		if (pool->tail != NULL)
+			pool->tail->next = task;
+		else
+			pool->head = task;
+		pool->tail = task;
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+#else
+	(void)pool; /* UNUSED */
+#endif
+	task->state = ARCHIVE_TASK_RUNNING;
+	task->run(task);
+	task->state = ARCHIVE_TASK_DONE;
+}
+
+void
+__archive_thread_pool_wait(struct archive_thread_pool *pool,
+    struct archive_task *task)
+{
+#ifdef ARCHIVE_HAVE_THREADS
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	while (task->state == ARCHIVE_TASK_QUEUED ||
+	    task->state == ARCHIVE_TASK_RUNNING)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+#else
+	(void)pool; /* UNUSED */
+	(void)task; /* UNUSED */
+#endif
+}
+
+void
+__archive_thread_pool_free(struct archive_thread_pool *pool)
+{
+#ifdef ARCHIVE_HAVE_THREADS
+	struct archive_task *task;
+	int i;
+
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	for (task = pool->head; task != NULL; task = task->next)
+		task->state = ARCHIVE_TASK_IDLE;
+	pool->head = pool->tail = NULL;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+#else
+	(void)pool; /* UNUSED */
+#endif
+}
@@ -0,0 +1,66 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LIBARCHIVE_BUILD
+#error This header is only to be used internally to libarchive.
+#endif
+
+#ifndef ARCHIVE_THREAD_POOL_PRIVATE_H_INCLUDED
+#define ARCHIVE_THREAD_POOL_PRIVATE_H_INCLUDED
+
+/*
+ * A small pool of worker threads used by format modules to run
+ * independent compression and decompression jobs concurrently.
+ *
+ * Callers embed a struct archive_task in their own job structure,
+ * set `run' and submit it.  A NULL pool is valid everywhere: tasks
+ * submitted to it run synchronously in the calling thread, so the
+ * callers need no separate code path for builds without threads.
+ */
+struct archive_task {
+	void			(*run)(struct archive_task *);
+	struct archive_task	*next;
+	int			 state;
+#define ARCHIVE_TASK_IDLE	0
+#define ARCHIVE_TASK_QUEUED	1
+#define ARCHIVE_TASK_RUNNING	2
+#define ARCHIVE_TASK_DONE	3
+};
+
+struct archive_thread_pool;
+
+/* Number of online processors, at least 1. */
+int	__archive_thread_pool_ncpus(void);
+/* Returns NULL if threads <= 1 or threads are not available. */
+struct archive_thread_pool *__archive_thread_pool_new(int threads);
+void	__archive_thread_pool_submit(struct archive_thread_pool *,
+	    struct archive_task *);
+/* Wait until the task has been run. */
+void	__archive_thread_pool_wait(struct archive_thread_pool *,
+	    struct archive_task *);
+/* Tasks which have not been started yet are dropped. */
+void	__archive_thread_pool_free(struct archive_thread_pool *);
+
+#endif /* ARCHIVE_THREAD_POOL_PRIVATE_H_INCLUDED */
@@ -58,6 +58,7 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_write.c 201099 2009-12-28 03:03:
 #include "archive.h"
 #include "archive_entry.h"
 #include "archive_private.h"
+#include "archive_tar_index_private.h"
 #include "archive_write_private.h"
 
 static struct archive_vtable *archive_write_vtable(void);
@@ -527,6 +528,11 @@ _archive_write_close(struct archive *_a)
 	if (r1 < r)
 		r = r1;
 
+	r1 = __archive_tar_index_close(&a->archive, a->tar_index);
+	a->tar_index = NULL;
+	if (r1 < r)
+		r = r1;
+
 	if (a->archive.state != ARCHIVE_STATE_FATAL)
 		a->archive.state = ARCHIVE_STATE_CLOSED;
 	return (r);
@@ -595,6 +601,9 @@ _archive_write_free(struct archive *_a)
 
 	__archive_write_filters_free(_a);
 
+	/* The index of an archive that was never opened. */
+	__archive_tar_index_close(&a->archive, a->tar_index);
+
 	/* Release various dynamic buffers. */
 	free((void *)(uintptr_t)(const void *)a->nulls);
 	archive_string_free(&a->archive.error_string);
@@ -616,6 +625,7 @@ static int
 _archive_write_header(struct archive *_a, struct archive_entry *entry)
 {
 	struct archive_write *a = (struct archive_write *)_a;
+	int64_t header_offset;
 	int ret, r2;
 
 	archive_check_magic(&a->archive, ARCHIVE_WRITE_MAGIC,
@@ -649,6 +659,7 @@ _archive_write_header(struct archive *_a, struct archive_entry *entry)
 	}
 
 	/* Format and write header. */
+	header_offset = archive_filter_bytes(&a->archive, 0);
 	r2 = ((a->format_write_header)(a, entry));
 	if (r2 == ARCHIVE_FAILED) {
 		return (ARCHIVE_FAILED);
@@ -660,10 +671,34 @@ _archive_write_header(struct archive *_a, struct archive_entry *entry)
 	if (r2 < ret)
 		ret = r2;
 
+	/* The entry's data follow right after its headers. */
+	if (a->tar_index != NULL &&
+	    __archive_tar_index_add(&a->archive, a->tar_index, header_offset,
+	    archive_filter_bytes(&a->archive, 0), entry) != ARCHIVE_OK) {
+		a->archive.state = ARCHIVE_STATE_FATAL;
+		return (ARCHIVE_FATAL);
+	}
+
 	a->archive.state = ARCHIVE_STATE_DATA;
 	return (ret);
 }
 
+int
+__archive_write_set_tar_index(struct archive_write *a, const char *filename)
+{
+	if (filename == NULL || filename[0] == '\0') {
+		archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
+		    "%s: index option needs a filename", a->format_name);
+		return (ARCHIVE_FAILED);
+	}
+	/* The file is created now, before the client can chdir(). */
+	__archive_tar_index_close(&a->archive, a->tar_index);
+	a->tar_index = __archive_tar_index_open(&a->archive, filename);
+	if (a->tar_index == NULL)
+		return (ARCHIVE_FATAL);
+	return (ARCHIVE_OK);
+}
+
 static int
 _archive_write_finish_entry(struct archive *_a)
 {
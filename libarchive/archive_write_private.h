@@ -126,6 +126,12 @@ struct archive_write {
 	char		*passphrase;
 	archive_passphrase_callback *passphrase_callback;
 	void		*passphrase_client_data;
+
+	/*
+	 * Sidecar index of the entries written, for the "index"
+	 * option of the tar formats.
+	 */
+	struct archive_tar_index *tar_index;
 };
 
 /*
@@ -153,6 +159,11 @@ int	__archive_write_program_close(struct archive_write_filter *,
 int	__archive_write_program_write(struct archive_write_filter *,
 	    struct archive_write_program_data *, const void *, size_t);
 
+/*
+ * Handle the "index" option of the tar formats.
+ */
+int	__archive_write_set_tar_index(struct archive_write *, const char *);
+
 /*
  * Get a encryption passphrase.
  */
@@ -51,6 +51,8 @@ __FBSDID("$FreeBSD$");
 #include "archive_private.h"
 #include "archive_rb.h"
 #include "archive_string.h"
+#include "archive_tempfile_private.h"
+#include "archive_thread_pool_private.h"
 #include "archive_write_private.h"
 
 /*
@@ -90,6 +92,13 @@ __FBSDID("$FreeBSD$");
 #define kAttributes		0x15
 #define kEncodedHeader		0x17
 
+/*
+ * With threads, folders are limited to this size unless the
+ * solid-block-size option says otherwise; a folder has to fit in
+ * memory while a worker compresses it.
+ */
+#define DEFAULT_THREADS_SOLID_BLOCK_SIZE	(32 * 1024 * 1024)
+
 enum la_zaction {
 	ARCHIVE_Z_FINISH,
 	ARCHIVE_Z_RUN
@@ -123,10 +132,11 @@ struct la_zstream {
 #define PPMD7_DEFAULT_MEM_SIZE	(1 << 24)
 
 struct ppmd_stream {
+	IByteOut		 byteout;/* Must be first; see ppmd_write(). */
+	struct la_zstream	*lastrm;
 	int			 stat;
 	CPpmd7			 ppmd7_context;
 	CPpmd7z_RangeEnc	 range_enc;
-	IByteOut		 byteout;
 	uint8_t			*buff;
 	uint8_t			*buff_ptr;
 	uint8_t			*buff_end;
@@ -167,8 +177,37 @@ struct file {
 	int			 dir:1;
 };
 
+/*
+ * A folder holds the data of one or more files compressed as a single
+ * stream, which is stored as one pack stream in the temporary file.
+ */
+struct folder {
+	struct archive_task	 task;/* Must be first. */
+	struct folder		*next;
+	struct coder		 coder;
+	uint64_t		 pack_size;
+	uint64_t		 unpack_size;
+	uint64_t		 num_files;
+
+	/*
+	 * A folder compressed on a worker thread.  Its file data is
+	 * collected in `buff', compressed into `out' and appended to
+	 * the temporary file once all the folders before it are there.
+	 */
+	int			 threaded;
+	unsigned		 codec;
+	int			 level;
+	unsigned char		*buff;
+	size_t			 buff_size;
+	size_t			 buff_alloc;
+	unsigned char		*out;
+	int			 r;
+	/* The worker cannot report errors into the shared archive. */
+	struct archive		 error;
+};
+
 struct _7zip {
-	int			 temp_fd;
+	struct archive_tempfile	 temp;
 	uint64_t		 temp_offset;
 
 	struct file		*cur_file;
@@ -190,6 +229,23 @@ struct _7zip {
 
 	unsigned		 opt_compression;
 	int			 opt_compression_level;
+	uint64_t		 opt_solid_block_size;
+	uint64_t		 opt_solid_block_files;
+	int			 opt_threads;
+
+	struct archive_thread_pool *pool;
+	/*
+	 * The folders in archive order.  `cur_folder' receives the
+	 * current file data; `pending' is the oldest folder which is
+	 * still being compressed by a worker.
+	 */
+	struct {
+		struct folder	*first;
+		struct folder	**last;
+	}			 folder_list;
+	struct folder		*cur_folder;
+	struct folder		*pending;
+	int			 pending_count;
 
 	struct la_zstream	 stream;
 	struct coder		 coder;
@@ -236,6 +292,12 @@ static void	file_init_register_empty(struct _7zip *);
 static void	file_free_register(struct _7zip *);
 static ssize_t	compress_out(struct archive_write *, const void *, size_t ,
 		    enum la_zaction);
+static int	folder_is_full(struct _7zip *, uint64_t);
+static int	folder_open(struct archive_write *, uint64_t);
+static ssize_t	folder_write(struct archive_write *, const void *, size_t);
+static int	folder_close(struct archive_write *);
+static int	write_pending_folders(struct archive_write *, int);
+static void	folder_free_register(struct _7zip *);
 static int	compression_init_encoder_copy(struct archive *,
 		    struct la_zstream *);
 static int	compression_code_copy(struct archive *,
@@ -275,11 +337,12 @@ static int	compression_code(struct archive *,
 		    struct la_zstream *, enum la_zaction);
 static int	compression_end(struct archive *,
 		    struct la_zstream *);
+static int	compression_init_encoder(struct archive *,
+		    struct la_zstream *, unsigned, int);
 static int	enc_uint64(struct archive_write *, uint64_t);
-static int	make_header(struct archive_write *, uint64_t, uint64_t,
-		    uint64_t, int, struct coder *);
-static int	make_streamsInfo(struct archive_write *, uint64_t, uint64_t,
-		    	uint64_t, int, struct coder *, int, uint32_t);
+static int	make_header(struct archive_write *, uint64_t);
+static int	make_streamsInfo(struct archive_write *, uint64_t,
+		    struct folder *, int, uint32_t);
 
 int
 archive_write_set_format_7zip(struct archive *_a)
@@ -303,10 +366,13 @@ archive_write_set_format_7zip(struct archive *_a)
 		    "Can't allocate 7-Zip data");
 		return (ARCHIVE_FATAL);
 	}
-	zip->temp_fd = -1;
+	__archive_tempfile_init(&(zip->temp));
 	__archive_rb_tree_init(&(zip->rbtree), &rb_ops);
 	file_init_register(zip);
 	file_init_register_empty(zip);
+	zip->folder_list.first = NULL;
+	zip->folder_list.last = &(zip->folder_list.first);
+	zip->opt_threads = 1;
 
 	/* Set default compression type and its level. */
 #if HAVE_LZMA_H
@@ -339,6 +405,7 @@ static int
 _7z_options(struct archive_write *a, const char *key, const char *value)
 {
 	struct _7zip *zip;
+	int r;
 
 	zip = (struct _7zip *)a->format_data;
 
@@ -412,6 +479,55 @@ _7z_options(struct archive_write *a, const char *key, const char *value)
 		zip->opt_compression_level = value[0] - '0';
 		return (ARCHIVE_OK);
 	}
+	if (strcmp(key, "solid-block-size") == 0 ||
+	    strcmp(key, "solid-block-files") == 0) {
+		uint64_t n;
+		char *end;
+
+		/* "!solid-block-size" removes the limit. */
+		if (value == NULL)
+			n = 0;
+		else {
+			n = (uint64_t)strtoull(value, &end, 10);
+			if (n == 0 || *end != '\0') {
+				archive_set_error(&(a->archive),
+				    ARCHIVE_ERRNO_MISC,
+				    "Illegal value `%s'",
+				    value);
+				return (ARCHIVE_FAILED);
+			}
+		}
+		if (strcmp(key, "solid-block-size") == 0)
+			zip->opt_solid_block_size = n;
+		else
+			zip->opt_solid_block_files = n;
+		return (ARCHIVE_OK);
+	}
+	if (strcmp(key, "threads") == 0) {
+		unsigned long n;
+		char *end;
+
+		if (value == NULL || value[0] == '\0')
+			n = 1;
+		else {
+			n = strtoul(value, &end, 10);
+			if (*end != '\0' || n > 1024) {
+				archive_set_error(&(a->archive),
+				    ARCHIVE_ERRNO_MISC,
+				    "Illegal value `%s'",
+				    value);
+				return (ARCHIVE_FAILED);
+			}
+		}
+		if (n == 0)
+			n = __archive_thread_pool_ncpus();
+		zip->opt_threads = (int)n;
+		return (ARCHIVE_OK);
+	}
+	r = __archive_tempfile_options(&(a->archive), &(zip->temp), key,
+	    value);
+	if (r != ARCHIVE_WARN)
+		return (r);
 
 	/* Note: The "warn" return is just to inform the options
 	 * supervisor that we didn't handle it.  It will generate
@@ -471,16 +587,22 @@ _7z_write_header(struct archive_write *a, struct archive_entry *entry)
 	}
 
 	/*
-	 * Init compression.
+	 * Start a new folder if the file does not fit in the current one.
 	 */
-	if ((zip->total_number_entry - zip->total_number_empty_entry) == 1) {
-		r = _7z_compression_init_encoder(a, zip->opt_compression,
-			zip->opt_compression_level);
-		if (r < 0) {
+	if (zip->cur_folder != NULL && folder_is_full(zip, file->size)) {
+		if (folder_close(a) != ARCHIVE_OK) {
 			file_free(file);
 			return (ARCHIVE_FATAL);
 		}
 	}
+	if (zip->cur_folder == NULL) {
+		if (folder_open(a, file->size) != ARCHIVE_OK) {
+			file_free(file);
+			return (ARCHIVE_FATAL);
+		}
+	}
+	zip->cur_folder->num_files++;
+	zip->cur_folder->unpack_size += file->size;
 
 	/* Register a non-empty file. */
 	file_register(zip, file);
@@ -501,7 +623,7 @@ _7z_write_header(struct archive_write *a, struct archive_entry *entry)
 	if (archive_entry_filetype(entry) == AE_IFLNK) {
 		ssize_t bytes;
 		const void *p = (const void *)archive_entry_symlink(entry);
-		bytes = compress_out(a, p, (size_t)file->size, ARCHIVE_Z_RUN);
+		bytes = folder_write(a, p, (size_t)file->size);
 		if (bytes < 0)
 			return ((int)bytes);
 		zip->entry_crc32 = crc32(zip->entry_crc32, p, (unsigned)bytes);
@@ -526,10 +648,9 @@ write_to_temp(struct archive_write *a, const void *buff, size_t s)
 	/*
 	 * Open a temporary file.
 	 */
-	if (zip->temp_fd == -1) {
+	if (!zip->temp.opened) {
 		zip->temp_offset = 0;
-		zip->temp_fd = __archive_mktemp(NULL);
-		if (zip->temp_fd < 0) {
+		if (__archive_tempfile_open(&(zip->temp)) != 0) {
 			archive_set_error(&a->archive, errno,
 			    "Couldn't create temporary file");
 			return (ARCHIVE_FATAL);
@@ -538,7 +659,7 @@ write_to_temp(struct archive_write *a, const void *buff, size_t s)
 
 	p = (const unsigned char *)buff;
 	while (s) {
-		ws = write(zip->temp_fd, p, s);
+		ws = __archive_tempfile_write(&(zip->temp), p, s);
 		if (ws < 0) {
 			archive_set_error(&(a->archive), errno,
 			    "fwrite function failed");
@@ -598,6 +719,223 @@ compress_out(struct archive_write *a, const void *buff, size_t s,
 	return (s);
 }
 
+static uint64_t
+solid_block_size(struct _7zip *zip)
+{
+	if (zip->opt_solid_block_size == 0 && zip->pool != NULL)
+		return (DEFAULT_THREADS_SOLID_BLOCK_SIZE);
+	return (zip->opt_solid_block_size);
+}
+
+/*
+ * Return non-zero if a file of `size' bytes has to go to a new folder.
+ */
+static int
+folder_is_full(struct _7zip *zip, uint64_t size)
+{
+	struct folder *folder = zip->cur_folder;
+	uint64_t limit;
+
+	/* Stored files are never solid. */
+	if (zip->opt_compression == _7Z_COPY)
+		return (1);
+	if (zip->opt_solid_block_files &&
+	    folder->num_files >= zip->opt_solid_block_files)
+		return (1);
+	limit = solid_block_size(zip);
+	return (limit && folder->unpack_size + size > limit);
+}
+
+static int
+folder_open(struct archive_write *a, uint64_t size)
+{
+	struct _7zip *zip = (struct _7zip *)a->format_data;
+	struct folder *folder;
+	uint64_t limit;
+	int r;
+
+	folder = calloc(1, sizeof(*folder));
+	if (folder == NULL) {
+		archive_set_error(&a->archive, ENOMEM,
+		    "Can't allocate memory");
+		return (ARCHIVE_FATAL);
+	}
+	if (zip->folder_list.first == NULL && zip->opt_threads > 1 &&
+	    zip->opt_compression != _7Z_COPY)
+		zip->pool = __archive_thread_pool_new(zip->opt_threads);
+
+	limit = solid_block_size(zip);
+	if (zip->pool != NULL && size <= limit) {
+		folder->threaded = 1;
+		folder->codec = zip->opt_compression;
+		folder->level = zip->opt_compression_level;
+	} else {
+		/*
+		 * Compress the folder here.  A file larger than a solid
+		 * block is not buffered; the folders before it must be
+		 * in the temporary file first.
+		 */
+		r = write_pending_folders(a, 1);
+		if (r == ARCHIVE_OK)
+			r = _7z_compression_init_encoder(a,
+			    zip->opt_compression,
+			    zip->opt_compression_level);
+		if (r != ARCHIVE_OK) {
+			free(folder);
+			return (ARCHIVE_FATAL);
+		}
+	}
+	*zip->folder_list.last = folder;
+	zip->folder_list.last = &(folder->next);
+	zip->cur_folder = folder;
+	return (ARCHIVE_OK);
+}
+
+static ssize_t
+folder_write(struct archive_write *a, const void *buff, size_t s)
+{
+	struct _7zip *zip = (struct _7zip *)a->format_data;
+	struct folder *folder = zip->cur_folder;
+
+	if (!folder->threaded)
+		return (compress_out(a, buff, s, ARCHIVE_Z_RUN));
+
+	if (folder->buff_size + s > folder->buff_alloc) {
+		unsigned char *p;
+		size_t alloc;
+
+		alloc = (folder->buff_alloc)? folder->buff_alloc: 64 * 1024;
+		while (alloc < folder->buff_size + s)
+			alloc *= 2;
+		p = realloc(folder->buff, alloc);
+		if (p == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Can't allocate memory");
+			return (ARCHIVE_FATAL);
+		}
+		folder->buff = p;
+		folder->buff_alloc = alloc;
+	}
+	memcpy(folder->buff + folder->buff_size, buff, s);
+	folder->buff_size += s;
+	return (s);
+}
+
+/*
+ * Compress a whole folder.  This runs on a worker thread.
+ */
+static void
+compress_folder(struct archive_task *task)
+{
+	struct folder *folder = (struct folder *)task;
+	struct la_zstream strm;
+	size_t alloc = 0;
+	int r;
+
+	memset(&strm, 0, sizeof(strm));
+	r = compression_init_encoder(&(folder->error), &strm, folder->codec,
+	    folder->level);
+	strm.next_in = folder->buff;
+	strm.avail_in = folder->buff_size;
+	while (r == ARCHIVE_OK) {
+		if (strm.avail_out == 0) {
+			unsigned char *p;
+
+			alloc = (alloc)? alloc * 2: folder->buff_size / 2 + 4096;
+			p = realloc(folder->out, alloc);
+			if (p == NULL) {
+				archive_set_error(&(folder->error), ENOMEM,
+				    "Can't allocate memory");
+				r = ARCHIVE_FATAL;
+				break;
+			}
+			folder->out = p;
+			strm.next_out = p + strm.total_out;
+			strm.avail_out = alloc - (size_t)strm.total_out;
+		}
+		r = compression_code(&(folder->error), &strm,
+		    ARCHIVE_Z_FINISH);
+	}
+	if (r == ARCHIVE_EOF) {
+		folder->pack_size = strm.total_out;
+		folder->coder.codec = folder->codec;
+		folder->coder.prop_size = strm.prop_size;
+		folder->coder.props = strm.props;
+		strm.prop_size = 0;
+		strm.props = NULL;
+		r = compression_end(&(folder->error), &strm);
+	} else {
+		compression_end(&(folder->error), &strm);
+		r = ARCHIVE_FATAL;
+	}
+	free(folder->buff);
+	folder->buff = NULL;
+	folder->r = r;
+}
+
+static int
+folder_close(struct archive_write *a)
+{
+	struct _7zip *zip = (struct _7zip *)a->format_data;
+	struct folder *folder = zip->cur_folder;
+	int r;
+
+	zip->cur_folder = NULL;
+	if (folder->threaded) {
+		folder->task.run = compress_folder;
+		__archive_thread_pool_submit(zip->pool, &(folder->task));
+		if (zip->pending == NULL)
+			zip->pending = folder;
+		zip->pending_count++;
+		/* Bound the memory held by buffered folders. */
+		return (write_pending_folders(a, 0));
+	}
+
+	r = (int)compress_out(a, NULL, 0, ARCHIVE_Z_FINISH);
+	if (r < 0)
+		return (r);
+	folder->pack_size = zip->stream.total_out;
+	folder->coder.codec = zip->opt_compression;
+	folder->coder.prop_size = zip->stream.prop_size;
+	folder->coder.props = zip->stream.props;
+	zip->stream.prop_size = 0;
+	zip->stream.props = NULL;
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Append the folders compressed by the workers to the temporary file,
+ * in archive order.  Unless `all' is set, only wait for enough of them
+ * to keep two folders per thread in memory.
+ */
+static int
+write_pending_folders(struct archive_write *a, int all)
+{
+	struct _7zip *zip = (struct _7zip *)a->format_data;
+	struct folder *folder;
+	int r;
+
+	while (zip->pending != NULL &&
+	    (all || zip->pending_count > 2 * zip->opt_threads)) {
+		folder = zip->pending;
+		__archive_thread_pool_wait(zip->pool, &(folder->task));
+		zip->pending = (--zip->pending_count)? folder->next: NULL;
+		if (folder->r != ARCHIVE_OK) {
+			archive_set_error(&a->archive,
+			    folder->error.archive_error_number, "%s",
+			    (folder->error.error != NULL)?
+			    folder->error.error: "7-Zip compression failed");
+			return (ARCHIVE_FATAL);
+		}
+		r = write_to_temp(a, folder->out, (size_t)folder->pack_size);
+		free(folder->out);
+		folder->out = NULL;
+		if (r != ARCHIVE_OK)
+			return (r);
+	}
+	return (ARCHIVE_OK);
+}
+
 static ssize_t
 _7z_write_data(struct archive_write *a, const void *buff, size_t s)
 {
@@ -610,7 +948,7 @@ _7z_write_data(struct archive_write *a, const void *buff, size_t s)
 		s = (size_t)zip->entry_bytes_remaining;
 	if (s == 0 || zip->cur_file == NULL)
 		return (0);
-	bytes = compress_out(a, buff, s, ARCHIVE_Z_RUN);
+	bytes = folder_write(a, buff, s);
 	if (bytes < 0)
 		return (bytes);
 	zip->entry_crc32 = crc32(zip->entry_crc32, buff, (unsigned)bytes);
@@ -669,7 +1007,7 @@ copy_out(struct archive_write *a, uint64_t offset, uint64_t length)
 
 	zip = (struct _7zip *)a->format_data;
 	if (zip->temp_offset > 0 &&
-	    lseek(zip->temp_fd, offset, SEEK_SET) < 0) {
+	    __archive_tempfile_seek(&(zip->temp), offset, SEEK_SET) < 0) {
 		archive_set_error(&(a->archive), errno, "lseek failed");
 		return (ARCHIVE_FATAL);
 	}
@@ -683,7 +1021,7 @@ copy_out(struct archive_write *a, uint64_t offset, uint64_t length)
 		else
 			rsize = (size_t)length;
 		wb = zip->wbuff + (sizeof(zip->wbuff) - zip->wbuff_remaining);
-		rs = read(zip->temp_fd, wb, rsize);
+		rs = __archive_tempfile_read(&(zip->temp), wb, rsize);
 		if (rs < 0) {
 			archive_set_error(&(a->archive), errno,
 			    "Can't read temporary file(%jd)",
@@ -720,20 +1058,20 @@ _7z_close(struct archive_write *a)
 
 	if (zip->total_number_entry > 0) {
 		struct archive_rb_node *n;
-		uint64_t data_offset, data_size, data_unpacksize;
+		struct folder header_folder;
+		uint64_t data_offset, data_size;
 		unsigned header_compression;
 
-		r = (int)compress_out(a, NULL, 0, ARCHIVE_Z_FINISH);
+		if (zip->cur_folder != NULL) {
+			r = folder_close(a);
+			if (r < 0)
+				return (r);
+		}
+		r = write_pending_folders(a, 1);
 		if (r < 0)
 			return (r);
 		data_offset = 0;
-		data_size = zip->stream.total_out;
-		data_unpacksize = zip->stream.total_in;
-		zip->coder.codec = zip->opt_compression;
-		zip->coder.prop_size = zip->stream.prop_size;
-		zip->coder.props = zip->stream.props;
-		zip->stream.prop_size = 0;
-		zip->stream.props = NULL;
+		data_size = zip->temp_offset;
 		zip->total_number_nonempty_entry =
 		    zip->total_number_entry - zip->total_number_empty_entry;
 
@@ -765,8 +1103,7 @@ _7z_close(struct archive_write *a)
 			return (r);
 		zip->crc32flg = PRECODE_CRC32;
 		zip->precode_crc32 = 0;
-		r = make_header(a, data_offset, data_size, data_unpacksize,
-			1, &(zip->coder));
+		r = make_header(a, data_offset);
 		if (r < 0)
 			return (r);
 		r = (int)compress_out(a, NULL, 0, ARCHIVE_Z_FINISH);
@@ -782,7 +1119,6 @@ _7z_close(struct archive_write *a)
 			 * Encode the header in order to reduce the size
 			 * of the archive.
 			 */
-			free(zip->coder.props);
 			zip->coder.codec = header_compression;
 			zip->coder.prop_size = zip->stream.prop_size;
 			zip->coder.props = zip->stream.props;
@@ -801,8 +1137,12 @@ _7z_close(struct archive_write *a)
 			r = enc_uint64(a, kEncodedHeader);
 			if (r < 0)
 				return (r);
-			r = make_streamsInfo(a, header_offset, header_size,
-			      header_unpacksize, 1, &(zip->coder), 0,
+			memset(&header_folder, 0, sizeof(header_folder));
+			header_folder.coder = zip->coder;
+			header_folder.pack_size = header_size;
+			header_folder.unpack_size = header_unpacksize;
+			header_folder.num_files = 1;
+			r = make_streamsInfo(a, header_offset, &header_folder, 0,
 			      header_crc32);
 			if (r < 0)
 				return (r);
@@ -871,10 +1211,13 @@ enc_uint64(struct archive_write *a, uint64_t val)
 }
 
 static int
-make_substreamsInfo(struct archive_write *a, struct coder *coders)
+make_substreamsInfo(struct archive_write *a, struct folder *folders)
 {
 	struct _7zip *zip = (struct _7zip *)a->format_data;
+	struct folder *folder;
 	struct file *file;
+	uint64_t n;
+	int solid = 0;
 	int r;
 
 	/*
@@ -884,7 +1227,11 @@ make_substreamsInfo(struct archive_write *a, struct coder *coders)
 	if (r < 0)
 		return (r);
 
-	if (zip->total_number_nonempty_entry > 1 && coders->codec != _7Z_COPY) {
+	for (folder = folders; folder != NULL; folder = folder->next) {
+		if (folder->num_files != 1)
+			solid = 1;
+	}
+	if (solid) {
 		/*
 		 * Make NumUnPackStream.
 		 */
@@ -892,25 +1239,29 @@ make_substreamsInfo(struct archive_write *a, struct coder *coders)
 		if (r < 0)
 			return (r);
 
-		/* Write numUnpackStreams */
-		r = enc_uint64(a, zip->total_number_nonempty_entry);
-		if (r < 0)
-			return (r);
+		/* Write numUnpackStreams of each folder. */
+		for (folder = folders; folder != NULL; folder = folder->next) {
+			r = enc_uint64(a, folder->num_files);
+			if (r < 0)
+				return (r);
+		}
 
 		/*
-		 * Make kSize.
+		 * Make kSize; the size of the last file in a folder
+		 * is implied.
 		 */
 		r = enc_uint64(a, kSize);
 		if (r < 0)
 			return (r);
 		file = zip->file_list.first;
-		for (;file != NULL; file = file->next) {
-			if (file->next == NULL ||
-			    file->next->size == 0)
-				break;
-			r = enc_uint64(a, file->size);
-			if (r < 0)
-				return (r);
+		for (folder = folders; folder != NULL; folder = folder->next) {
+			for (n = 1; n < folder->num_files; n++) {
+				r = enc_uint64(a, file->size);
+				if (r < 0)
+					return (r);
+				file = file->next;
+			}
+			file = file->next;
 		}
 	}
 
@@ -945,20 +1296,18 @@ make_substreamsInfo(struct archive_write *a, struct coder *coders)
 }
 
 static int
-make_streamsInfo(struct archive_write *a, uint64_t offset, uint64_t pack_size,
-    uint64_t unpack_size, int num_coder, struct coder *coders, int substrm,
-    uint32_t header_crc)
+make_streamsInfo(struct archive_write *a, uint64_t offset,
+    struct folder *folders, int substrm, uint32_t header_crc)
 {
-	struct _7zip *zip = (struct _7zip *)a->format_data;
+	struct folder *folder;
 	uint8_t codec_buff[8];
-	int numFolders, fi;
+	uint64_t numFolders;
 	int codec_size;
-	int i, r;
+	int r;
 
-	if (coders->codec == _7Z_COPY)
-		numFolders = (int)zip->total_number_nonempty_entry;
-	else
-		numFolders = 1;
+	numFolders = 0;
+	for (folder = folders; folder != NULL; folder = folder->next)
+		numFolders++;
 
 	/*
 	 * Make PackInfo.
@@ -982,18 +1331,8 @@ make_streamsInfo(struct archive_write *a, uint64_t offset, uint64_t pack_size,
 	if (r < 0)
 		return (r);
 
-	if (numFolders > 1) {
-		struct file *file = zip->file_list.first;
-		for (;file != NULL; file = file->next) {
-			if (file->size == 0)
-				break;
-			r = enc_uint64(a, file->size);
-			if (r < 0)
-				return (r);
-		}
-	} else {
-		/* Write size. */
-		r = enc_uint64(a, pack_size);
+	for (folder = folders; folder != NULL; folder = folder->next) {
+		r = enc_uint64(a, folder->pack_size);
 		if (r < 0)
 			return (r);
 	}
@@ -1026,49 +1365,47 @@ make_streamsInfo(struct archive_write *a, uint64_t offset, uint64_t pack_size,
 	if (r < 0)
 		return (r);
 
-	for (fi = 0; fi < numFolders; fi++) {
+	for (folder = folders; folder != NULL; folder = folder->next) {
+		struct coder *coder = &(folder->coder);
+
 		/* Write NumCoders. */
-		r = enc_uint64(a, num_coder);
+		r = enc_uint64(a, 1);
 		if (r < 0)
 			return (r);
 
-		for (i = 0; i < num_coder; i++) {
-			unsigned codec_id = coders[i].codec;
+		/* Write Codec flag. */
+		archive_be64enc(codec_buff, coder->codec);
+		for (codec_size = 8; codec_size > 0; codec_size--) {
+			if (codec_buff[8 - codec_size])
+				break;
+		}
+		if (codec_size == 0)
+			codec_size = 1;
+		if (coder->prop_size)
+			r = enc_uint64(a, codec_size | 0x20);
+		else
+			r = enc_uint64(a, codec_size);
+		if (r < 0)
+			return (r);
 
-			/* Write Codec flag. */
-			archive_be64enc(codec_buff, codec_id);
-			for (codec_size = 8; codec_size > 0; codec_size--) {
-				if (codec_buff[8 - codec_size])
-					break;
-			}
-			if (codec_size == 0)
-				codec_size = 1;
-			if (coders[i].prop_size)
-				r = enc_uint64(a, codec_size | 0x20);
-			else
-				r = enc_uint64(a, codec_size);
+		/* Write Codec ID. */
+		codec_size &= 0x0f;
+		r = (int)compress_out(a, &codec_buff[8-codec_size],
+			codec_size, ARCHIVE_Z_RUN);
+		if (r < 0)
+			return (r);
+
+		if (coder->prop_size) {
+			/* Write Codec property size. */
+			r = enc_uint64(a, coder->prop_size);
 			if (r < 0)
 				return (r);
 
-			/* Write Codec ID. */
-			codec_size &= 0x0f;
-			r = (int)compress_out(a, &codec_buff[8-codec_size],
-				codec_size, ARCHIVE_Z_RUN);
+			/* Write Codec properties. */
+			r = (int)compress_out(a, coder->props,
+				coder->prop_size, ARCHIVE_Z_RUN);
 			if (r < 0)
 				return (r);
-
-			if (coders[i].prop_size) {
-				/* Write Codec property size. */
-				r = enc_uint64(a, coders[i].prop_size);
-				if (r < 0)
-					return (r);
-
-				/* Write Codec properties. */
-				r = (int)compress_out(a, coders[i].props,
-					coders[i].prop_size, ARCHIVE_Z_RUN);
-				if (r < 0)
-					return (r);
-			}
 		}
 	}
 
@@ -1079,19 +1416,8 @@ make_streamsInfo(struct archive_write *a, uint64_t offset, uint64_t pack_size,
 	if (r < 0)
 		return (r);
 
-	if (numFolders > 1) {
-		struct file *file = zip->file_list.first;
-		for (;file != NULL; file = file->next) {
-			if (file->size == 0)
-				break;
-			r = enc_uint64(a, file->size);
-			if (r < 0)
-				return (r);
-		}
-
-	} else {
-		/* Write UnPackSize. */
-		r = enc_uint64(a, unpack_size);
+	for (folder = folders; folder != NULL; folder = folder->next) {
+		r = enc_uint64(a, folder->unpack_size);
 		if (r < 0)
 			return (r);
 	}
@@ -1124,7 +1450,7 @@ make_streamsInfo(struct archive_write *a, uint64_t offset, uint64_t pack_size,
 		/*
 		 * Make SubStreamsInfo.
 		 */
-		r = make_substreamsInfo(a, coders);
+		r = make_substreamsInfo(a, folders);
 		if (r < 0)
 			return (r);
 	}
@@ -1242,8 +1568,7 @@ make_time(struct archive_write *a, uint8_t type, unsigned flg, int ti)
 }
 
 static int
-make_header(struct archive_write *a, uint64_t offset, uint64_t pack_size,
-    uint64_t unpack_size, int codernum, struct coder *coders)
+make_header(struct archive_write *a, uint64_t offset)
 {
 	struct _7zip *zip = (struct _7zip *)a->format_data;
 	struct file *file;
@@ -1267,8 +1592,7 @@ make_header(struct archive_write *a, uint64_t offset, uint64_t pack_size,
 		r = enc_uint64(a, kMainStreamsInfo);
 		if (r < 0)
 			return (r);
-		r = make_streamsInfo(a, offset, pack_size, unpack_size,
-		      codernum, coders, 1, 0);
+		r = make_streamsInfo(a, offset, zip->folder_list.first, 1, 0);
 		if (r < 0)
 			return (r);
 	}
@@ -1450,11 +1774,14 @@ _7z_free(struct archive_write *a)
 {
 	struct _7zip *zip = (struct _7zip *)a->format_data;
 
+	/* Stop the workers before their folders go away. */
+	__archive_thread_pool_free(zip->pool);
+
 	/* Close the temporary file. */
-	if (zip->temp_fd >= 0)
-		close(zip->temp_fd);
+	__archive_tempfile_close(&(zip->temp));
 
 	file_free_register(zip);
+	folder_free_register(zip);
 	compression_end(&(a->archive), &(zip->stream));
 	free(zip->coder.props);
 	free(zip);
@@ -1589,6 +1916,23 @@ file_free_register(struct _7zip *zip)
 	}
 }
 
+static void
+folder_free_register(struct _7zip *zip)
+{
+	struct folder *folder, *folder_next;
+
+	folder = zip->folder_list.first;
+	while (folder != NULL) {
+		folder_next = folder->next;
+		free(folder->coder.props);
+		free(folder->buff);
+		free(folder->out);
+		archive_string_free(&(folder->error.error_string));
+		free(folder);
+		folder = folder_next;
+	}
+}
+
 static void
 file_register_empty(struct _7zip *zip, struct file *file)
 {
@@ -2111,10 +2455,8 @@ static ISzAlloc g_szalloc = { ppmd_alloc, ppmd_free };
 static void
 ppmd_write(void *p, Byte b)
 {
-	struct archive_write *a = ((IByteOut *)p)->a;
-	struct _7zip *zip = (struct _7zip *)(a->format_data);
-	struct la_zstream *lastrm = &(zip->stream);
-	struct ppmd_stream *strm;
+	struct ppmd_stream *strm = (struct ppmd_stream *)p;
+	struct la_zstream *lastrm = strm->lastrm;
 
 	if (lastrm->avail_out) {
 		*lastrm->next_out++ = b;
@@ -2122,7 +2464,6 @@ ppmd_write(void *p, Byte b)
 		lastrm->total_out++;
 		return;
 	}
-	strm = (struct ppmd_stream *)lastrm->real_stream;
 	if (strm->buff_ptr < strm->buff_end) {
 		*strm->buff_ptr++ = b;
 		strm->buff_bytes++;
@@ -2179,6 +2520,7 @@ compression_init_encoder_ppmd(struct archive *a,
 	__archive_ppmd7_functions.Ppmd7_Init(&(strm->ppmd7_context), maxOrder);
 	strm->byteout.a = (struct archive_write *)a;
 	strm->byteout.Write = ppmd_write;
+	strm->lastrm = lastrm;
 	strm->range_enc.Stream = &(strm->byteout);
 	__archive_ppmd7_functions.Ppmd7z_RangeEnc_Init(&(strm->range_enc));
 	strm->stat = 0;
@@ -2255,45 +2597,41 @@ compression_end_ppmd(struct archive *a, struct la_zstream *lastrm)
  * Universal compressor initializer.
  */
 static int
-_7z_compression_init_encoder(struct archive_write *a, unsigned compression,
-    int compression_level)
+compression_init_encoder(struct archive *a, struct la_zstream *lastrm,
+    unsigned compression, int compression_level)
 {
-	struct _7zip *zip;
-	int r;
-
-	zip = (struct _7zip *)a->format_data;
 	switch (compression) {
 	case _7Z_DEFLATE:
-		r = compression_init_encoder_deflate(
-		    &(a->archive), &(zip->stream),
-		    compression_level, 0);
-		break;
+		return (compression_init_encoder_deflate(a, lastrm,
+		    compression_level, 0));
 	case _7Z_BZIP2:
-		r = compression_init_encoder_bzip2(
-		    &(a->archive), &(zip->stream),
-		    compression_level);
-		break;
+		return (compression_init_encoder_bzip2(a, lastrm,
+		    compression_level));
 	case _7Z_LZMA1:
-		r = compression_init_encoder_lzma1(
-		    &(a->archive), &(zip->stream),
-		    compression_level);
-		break;
+		return (compression_init_encoder_lzma1(a, lastrm,
+		    compression_level));
 	case _7Z_LZMA2:
-		r = compression_init_encoder_lzma2(
-		    &(a->archive), &(zip->stream),
-		    compression_level);
-		break;
+		return (compression_init_encoder_lzma2(a, lastrm,
+		    compression_level));
 	case _7Z_PPMD:
-		r = compression_init_encoder_ppmd(
-		    &(a->archive), &(zip->stream),
-		    PPMD7_DEFAULT_ORDER, PPMD7_DEFAULT_MEM_SIZE);
-		break;
+		return (compression_init_encoder_ppmd(a, lastrm,
+		    PPMD7_DEFAULT_ORDER, PPMD7_DEFAULT_MEM_SIZE));
 	case _7Z_COPY:
 	default:
-		r = compression_init_encoder_copy(
-		    &(a->archive), &(zip->stream));
-		break;
+		return (compression_init_encoder_copy(a, lastrm));
 	}
+}
+
+static int
+_7z_compression_init_encoder(struct archive_write *a, unsigned compression,
+    int compression_level)
+{
+	struct _7zip *zip;
+	int r;
+
+	zip = (struct _7zip *)a->format_data;
+	r = compression_init_encoder(&(a->archive), &(zip->stream),
+	    compression, compression_level);
 	if (r == ARCHIVE_OK) {
 		zip->stream.total_in = 0;
 		zip->stream.next_out = zip->wbuff;
@@ -215,7 +215,8 @@ archive_write_gnutar_options(struct archive_write *a, const char *key,
 				ret = ARCHIVE_FATAL;
 		}
 		return (ret);
-	}
+	} else if (strcmp(key, "index") == 0)
+		return (__archive_write_set_tar_index(a, val));
 
 	/* Note: The "warn" return is just to inform the options
 	 * supervisor that we didn't handle it.  It will generate
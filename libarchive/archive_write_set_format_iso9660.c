@@ -34,6 +34,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
@@ -56,6 +59,8 @@
 #include "archive_entry_locale.h"
 #include "archive_private.h"
 #include "archive_rb.h"
+#include "archive_tempfile_private.h"
+#include "archive_thread_pool_private.h"
 #include "archive_write_private.h"
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
@@ -63,6 +68,13 @@
 #define getgid()			0
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY	0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC	0
+#endif
+
 /*#define DEBUG 1*/
 #ifdef DEBUG
 /* To compare to the ISO image file made by mkisofs. */
@@ -193,6 +205,9 @@ struct isofile {
 		struct content	*next;		/* next content	*/
 	} content, *cur_content;
 	int			 write_content;
+	/* The contents are not in the temporary file; offset_of_temp
+	 * of each content is an offset in the source file. */
+	int			 by_reference;
 
 	enum {
 		NO = 0,
@@ -456,6 +471,22 @@ struct iso_option {
 #define OPT_BOOT_TYPE_HARD_DISK		3	/* hard disk image	  */
 #define OPT_BOOT_TYPE_DEFAULT		OPT_BOOT_TYPE_AUTO
 
+	/*
+	 * Usage  : by-reference
+	 * Type   : boolean
+	 * Default: Disabled
+	 * COMPAT : NONE
+	 *
+	 * Do not save the contents of regular files which have
+	 * a source path into the temporary file; the data passed
+	 * to archive_write_data() is discarded and the contents
+	 * are read from the source path while writing out the
+	 * ISO image. Files which will be zisofs'ed and the boot
+	 * image are still saved into the temporary file.
+	 */
+	unsigned int	 by_reference:1;
+#define OPT_BY_REFERENCE_DEFAULT	0	/* Disabled */
+
 	/*
 	 * Usage  : compression-level=<value>
 	 * Type   : decimal
@@ -681,7 +712,7 @@ struct iso9660 {
 	time_t			 birth_time;
 	/* A file stream of a temporary file, which file contents
 	 * save to until ISO iamge can be created. */
-	int			 temp_fd;
+	struct archive_tempfile	 temp;
 
 	struct isofile		*cur_file;
 	struct isoent		*cur_dirent;
@@ -783,6 +814,20 @@ struct iso9660 {
 		int		 stream_valid;
 		int64_t		 remaining;
 		int		 compression_level;
+
+		/*
+		 * With the threads option, blocks are collected into
+		 * batches which are compressed on worker threads, and
+		 * the results are written to the temporary file in
+		 * the order of the blocks.
+		 */
+		int		 threads;
+		struct archive_thread_pool *pool;
+		struct zisofs_batch *cur_batch;
+		struct zisofs_batch *pending;
+		struct zisofs_batch **pending_last;
+		int		 pending_count;
+		struct zisofs_batch *free_batches;
 #endif
 	} zisofs;
 
@@ -969,6 +1014,10 @@ static void	isofile_add_data_file(struct iso9660 *, struct isofile *);
 static struct isofile * isofile_new(struct archive_write *,
 		    struct archive_entry *);
 static void	isofile_free(struct isofile *);
+static int	isofile_reference_contents(struct archive_write *,
+		    struct isofile *);
+static int	write_file_reference(struct archive_write *,
+		    struct isofile *, struct content *);
 static int	isofile_gen_utility_names(struct archive_write *,
 		    struct isofile *);
 static int	isofile_register_hardlink(struct archive_write *,
@@ -1067,7 +1116,7 @@ archive_write_set_format_iso9660(struct archive *_a)
 		return (ARCHIVE_FATAL);
 	}
 	iso9660->birth_time = 0;
-	iso9660->temp_fd = -1;
+	__archive_tempfile_init(&(iso9660->temp));
 	iso9660->cur_file = NULL;
 	iso9660->primary.max_depth = 0;
 	iso9660->primary.vdd_type = VDD_PRIMARY;
@@ -1126,6 +1175,8 @@ archive_write_set_format_iso9660(struct archive *_a)
 	iso9660->zisofs.block_pointers_allocated = 0;
 	iso9660->zisofs.stream_valid = 0;
 	iso9660->zisofs.compression_level = 9;
+	iso9660->zisofs.threads = 1;
+	iso9660->zisofs.pending_last = &(iso9660->zisofs.pending);
 	memset(&(iso9660->zisofs.stream), 0,
 	    sizeof(iso9660->zisofs.stream));
 #endif
@@ -1143,6 +1194,7 @@ archive_write_set_format_iso9660(struct archive *_a)
 	iso9660->opt.boot_load_seg = OPT_BOOT_LOAD_SEG_DEFAULT;
 	iso9660->opt.boot_load_size = OPT_BOOT_LOAD_SIZE_DEFAULT;
 	iso9660->opt.boot_type = OPT_BOOT_TYPE_DEFAULT;
+	iso9660->opt.by_reference = OPT_BY_REFERENCE_DEFAULT;
 	iso9660->opt.compression_level = OPT_COMPRESSION_LEVEL_DEFAULT;
 	iso9660->opt.copyright_file = OPT_COPYRIGHT_FILE_DEFAULT;
 	iso9660->opt.iso_level = OPT_ISO_LEVEL_DEFAULT;
@@ -1361,6 +1413,10 @@ iso9660_options(struct archive_write *a, const char *key, const char *value)
 				goto invalid_value;
 			return (ARCHIVE_OK);
 		}
+		if (strcmp(key, "by-reference") == 0) {
+			iso9660->opt.by_reference = value != NULL;
+			return (ARCHIVE_OK);
+		}
 		break;
 	case 'c':
 		if (strcmp(key, "compression-level") == 0) {
@@ -1479,6 +1535,36 @@ iso9660_options(struct archive_write *a, const char *key, const char *value)
 			return (ARCHIVE_OK);
 		}
 		break;
+	case 't':
+		if (strcmp(key, "threads") == 0) {
+#ifdef HAVE_ZLIB_H
+			unsigned long n;
+			char *end;
+
+			if (value == NULL || value[0] == '\0')
+				n = 1;
+			else {
+				n = strtoul(value, &end, 10);
+				if (*end != '\0' || n > 1024)
+					goto invalid_value;
+			}
+			if (n == 0)
+				n = __archive_thread_pool_ncpus();
+			iso9660->zisofs.threads = (int)n;
+			return (ARCHIVE_OK);
+#else
+			archive_set_error(&a->archive,
+			    ARCHIVE_ERRNO_MISC,
+			    "Option ``%s'' "
+			    "is not supported on this platform.", key);
+			return (ARCHIVE_FATAL);
+#endif
+		}
+		r = __archive_tempfile_options(&a->archive,
+		    &(iso9660->temp), key, value);
+		if (r != ARCHIVE_WARN)
+			return (r);
+		break;
 	case 'v':
 		if (strcmp(key, "volume-id") == 0) {
 			r = get_str_opt(a, &(iso9660->volume_identifier),
@@ -1613,12 +1699,25 @@ iso9660_write_header(struct archive_write *a, struct archive_entry *entry)
 			return (ARCHIVE_FATAL);
 	}
 
+	/*
+	 * The contents of the file will be read from its source path
+	 * while writing out the ISO image.
+	 */
+	if (iso9660->opt.by_reference &&
+	    archive_entry_sourcepath(file->entry) != NULL &&
+	    !(iso9660->opt.rr && iso9660->opt.zisofs)) {
+		r = isofile_reference_contents(a, file);
+		if (r < ret)
+			ret = r;
+		iso9660->bytes_remaining =  archive_entry_size(file->entry);
+		return (ret);
+	}
+
 	/*
 	 * Prepare to save the contents of the file.
 	 */
-	if (iso9660->temp_fd < 0) {
-		iso9660->temp_fd = __archive_mktemp(NULL);
-		if (iso9660->temp_fd < 0) {
+	if (!iso9660->temp.opened) {
+		if (__archive_tempfile_open(&(iso9660->temp)) != 0) {
 			archive_set_error(&a->archive, errno,
 			    "Couldn't create temporary file");
 			return (ARCHIVE_FATAL);
@@ -1636,6 +1735,44 @@ iso9660_write_header(struct archive_write *a, struct archive_entry *entry)
 	return (ret);
 }
 
+/*
+ * Set up the contents of a file whose data is read from its source
+ * path later; split it into extents the same way write_iso9660_data()
+ * does.
+ */
+static int
+isofile_reference_contents(struct archive_write *a, struct isofile *file)
+{
+	struct content *con;
+	int64_t offset, remaining;
+
+	file->by_reference = 1;
+	con = &(file->content);
+	offset = 0;
+	remaining = archive_entry_size(file->entry);
+	for (;;) {
+		con->offset_of_temp = offset;
+		con->size = remaining;
+		if (remaining < MULTI_EXTENT_SIZE - LOGICAL_BLOCK_SIZE)
+			break;
+		con->size = MULTI_EXTENT_SIZE - LOGICAL_BLOCK_SIZE;
+		con->blocks = (int)(con->size >> LOGICAL_BLOCK_BITS);
+		offset += con->size;
+		remaining -= con->size;
+		con->next = calloc(1, sizeof(*con));
+		if (con->next == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Can't allocate content data");
+			return (ARCHIVE_FATAL);
+		}
+		con = con->next;
+	}
+	con->blocks = (int)
+	    ((con->size + LOGICAL_BLOCK_SIZE -1) >> LOGICAL_BLOCK_BITS);
+	file->cur_content = con;
+	return (ARCHIVE_OK);
+}
+
 static int
 write_to_temp(struct archive_write *a, const void *buff, size_t s)
 {
@@ -1645,7 +1782,7 @@ write_to_temp(struct archive_write *a, const void *buff, size_t s)
 
 	b = (const unsigned char *)buff;
 	while (s) {
-		written = write(iso9660->temp_fd, b, s);
+		written = __archive_tempfile_write(&(iso9660->temp), b, s);
 		if (written < 0) {
 			archive_set_error(&a->archive, errno,
 			    "Can't write to temporary file");
@@ -1712,7 +1849,7 @@ write_iso9660_data(struct archive_write *a, const void *buff, size_t s)
 	struct iso9660 *iso9660 = a->format_data;
 	size_t ws;
 
-	if (iso9660->temp_fd < 0) {
+	if (!iso9660->temp.opened) {
 		archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
 		    "Couldn't create temporary file");
 		return (ARCHIVE_FATAL);
@@ -1800,6 +1937,11 @@ iso9660_write_data(struct archive_write *a, const void *buff, size_t s)
 	if (s == 0)
 		return (0);
 
+	if (iso9660->cur_file->by_reference) {
+		/* The contents will be read from the source path. */
+		iso9660->bytes_remaining -= s;
+		return (s);
+	}
 	r = write_iso9660_data(a, buff, s);
 	if (r > 0)
 		iso9660->bytes_remaining -= r;
@@ -1818,6 +1960,12 @@ iso9660_finish_entry(struct archive_write *a)
 	if (iso9660->cur_file->content.size == 0)
 		return (ARCHIVE_OK);
 
+	if (iso9660->cur_file->by_reference) {
+		iso9660->bytes_remaining = 0;
+		isofile_add_data_file(iso9660, iso9660->cur_file);
+		return (ARCHIVE_OK);
+	}
+
 	/* If there are unwritten data, write null data instead. */
 	while (iso9660->bytes_remaining > 0) {
 		size_t s;
@@ -2119,8 +2267,7 @@ iso9660_free(struct archive_write *a)
 	iso9660 = a->format_data;
 
 	/* Close the temporary file. */
-	if (iso9660->temp_fd >= 0)
-		close(iso9660->temp_fd);
+	__archive_tempfile_close(&(iso9660->temp));
 
 	/* Free some stuff for zisofs operations. */
 	ret = zisofs_free(a);
@@ -3682,9 +3829,28 @@ wb_set_offset(struct archive_write *a, int64_t off)
 		    write_to_temp(a, iso9660->wbuff, (size_t)used) != ARCHIVE_OK)
 			return (ARCHIVE_FATAL);
 		iso9660->wbuff_offset = iso9660->wbuff_written;
-		lseek(iso9660->temp_fd, iso9660->wbuff_offset, SEEK_SET);
+		__archive_tempfile_seek(&(iso9660->temp),
+		    iso9660->wbuff_offset, SEEK_SET);
 		iso9660->wbuff_remaining = sizeof(iso9660->wbuff);
 		used = 0;
+		/*
+		 * Read back the last partial block, which was saved
+		 * below, so that the write buffer holds it again.
+		 */
+		if (off >= iso9660->wbuff_offset &&
+		    iso9660->wbuff_tail > iso9660->wbuff_offset) {
+			size_t rsize = (size_t)
+			    (iso9660->wbuff_tail - iso9660->wbuff_offset);
+
+			if (__archive_tempfile_read(&(iso9660->temp),
+			    iso9660->wbuff, rsize) != (ssize_t)rsize) {
+				archive_set_error(&a->archive, errno,
+				    "Can't read temporary file");
+				return (ARCHIVE_FATAL);
+			}
+			__archive_tempfile_seek(&(iso9660->temp),
+			    iso9660->wbuff_offset, SEEK_SET);
+		}
 	}
 	if (off < iso9660->wbuff_offset) {
 		/*
@@ -3693,8 +3859,16 @@ wb_set_offset(struct archive_write *a, int64_t off)
 		if (used > 0) {
 			if (wb_write_out(a) != ARCHIVE_OK)
 				return (ARCHIVE_FATAL);
+			/* wb_write_out() keeps the last partial block
+			 * in the buffer; save it as well, since we may
+			 * come back to the current position. */
+			used = sizeof(iso9660->wbuff) -
+			    iso9660->wbuff_remaining;
+			if (used > 0 && write_to_temp(a, iso9660->wbuff,
+			    (size_t)used) != ARCHIVE_OK)
+				return (ARCHIVE_FATAL);
 		}
-		lseek(iso9660->temp_fd, off, SEEK_SET);
+		__archive_tempfile_seek(&(iso9660->temp), off, SEEK_SET);
 		iso9660->wbuff_offset = off;
 		iso9660->wbuff_remaining = sizeof(iso9660->wbuff);
 	} else if (off <= iso9660->wbuff_tail) {
@@ -4478,7 +4652,7 @@ write_file_contents(struct archive_write *a, int64_t offset, int64_t size)
 	struct iso9660 *iso9660 = a->format_data;
 	int r;
 
-	lseek(iso9660->temp_fd, offset, SEEK_SET);
+	__archive_tempfile_seek(&(iso9660->temp), offset, SEEK_SET);
 
 	while (size) {
 		size_t rsize;
@@ -4489,7 +4663,7 @@ write_file_contents(struct archive_write *a, int64_t offset, int64_t size)
 		rsize = wb_remaining(a);
 		if (rsize > (size_t)size)
 			rsize = (size_t)size;
-		rs = read(iso9660->temp_fd, wb, rsize);
+		rs = __archive_tempfile_read(&(iso9660->temp), wb, rsize);
 		if (rs <= 0) {
 			archive_set_error(&a->archive, errno,
 			    "Can't read temporary file(%jd)", (intmax_t)rs);
@@ -4503,6 +4677,67 @@ write_file_contents(struct archive_write *a, int64_t offset, int64_t size)
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Read the contents of a file from its source path, and write it.
+ */
+static int
+write_file_reference(struct archive_write *a, struct isofile *file,
+    struct content *con)
+{
+	const char *path;
+	int64_t size;
+	int fd, r;
+
+	path = archive_entry_sourcepath(file->entry);
+	fd = open(path, O_RDONLY | O_BINARY | O_CLOEXEC);
+	if (fd < 0) {
+		archive_set_error(&a->archive, errno,
+		    "Can't open ``%s''", path);
+		return (ARCHIVE_FATAL);
+	}
+	__archive_ensure_cloexec_flag(fd);
+	if (con->offset_of_temp != 0 &&
+	    lseek(fd, con->offset_of_temp, SEEK_SET) < 0) {
+		archive_set_error(&a->archive, errno,
+		    "Can't seek ``%s''", path);
+		close(fd);
+		return (ARCHIVE_FATAL);
+	}
+
+	size = con->size;
+	while (size) {
+		size_t rsize;
+		ssize_t rs;
+
+		rsize = wb_remaining(a);
+		if (rsize > (size_t)size)
+			rsize = (size_t)size;
+		rs = read(fd, wb_buffptr(a), rsize);
+		if (rs <= 0) {
+			if (rs == 0)
+				archive_set_error(&a->archive,
+				    ARCHIVE_ERRNO_FILE_FORMAT,
+				    "``%s'' is shorter than its entry size",
+				    path);
+			else
+				archive_set_error(&a->archive, errno,
+				    "Can't read ``%s''", path);
+			close(fd);
+			return (ARCHIVE_FATAL);
+		}
+		size -= rs;
+		r = wb_consume(a, rs);
+		if (r < 0) {
+			close(fd);
+			return (r);
+		}
+	}
+	close(fd);
+
+	/* Fill the rest of the last logical block. */
+	return (wb_write_padding_to_temp(a, con->size));
+}
+
 static int
 write_file_descriptors(struct archive_write *a)
 {
@@ -4543,6 +4778,28 @@ write_file_descriptors(struct archive_write *a)
 		if (!file->write_content)
 			continue;
 
+		if (file->by_reference) {
+			/* Flush out waiting blocks of the temporary file
+			 * before the contents from the source path. */
+			if (blocks > 0) {
+				r = write_file_contents(a, offset,
+				    blocks << LOGICAL_BLOCK_BITS);
+				if (r < 0)
+					return (r);
+			}
+			blocks = 0;
+			offset = 0;
+			file->cur_content = &(file->content);
+			do {
+				r = write_file_reference(a, file,
+				    file->cur_content);
+				if (r < 0)
+					return (r);
+				file->cur_content = file->cur_content->next;
+			} while (file->cur_content != NULL);
+			continue;
+		}
+
 		if ((offset + (blocks << LOGICAL_BLOCK_BITS)) <
 		     file->content.offset_of_temp) {
 			if (blocks > 0) {
@@ -7084,6 +7341,8 @@ static int
 isoent_find_out_boot_file(struct archive_write *a, struct isoent *rootent)
 {
 	struct iso9660 *iso9660 = a->format_data;
+	struct isofile *file;
+	int64_t offset;
 
 	/* Find a isoent of the boot file. */
 	iso9660->el_torito.boot = isoent_find_entry(rootent,
@@ -7095,6 +7354,27 @@ isoent_find_out_boot_file(struct archive_write *a, struct isoent *rootent)
 		return (ARCHIVE_FATAL);
 	}
 	iso9660->el_torito.boot->file->boot = BOOT_IMAGE;
+
+	/*
+	 * The boot file might be rewritten by setup_boot_information(),
+	 * so its contents have to be in the temporary file.
+	 */
+	file = iso9660->el_torito.boot->file;
+	if (file->by_reference) {
+		if (!iso9660->temp.opened) {
+			if (__archive_tempfile_open(&(iso9660->temp)) != 0) {
+				archive_set_error(&a->archive, errno,
+				    "Couldn't create temporary file");
+				return (ARCHIVE_FATAL);
+			}
+		}
+		offset = wb_offset(a);
+		if (write_file_reference(a, file, &(file->content))
+		    != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+		file->content.offset_of_temp = offset;
+		file->by_reference = 0;
+	}
 	return (ARCHIVE_OK);
 }
 
@@ -7315,7 +7595,7 @@ setup_boot_information(struct archive_write *a)
 	unsigned char buff[4096];
 
 	np = iso9660->el_torito.boot;
-	lseek(iso9660->temp_fd,
+	__archive_tempfile_seek(&(iso9660->temp),
 	    np->file->content.offset_of_temp + 64, SEEK_SET);
 	size = archive_entry_size(np->file->entry) - 64;
 	if (size <= 0) {
@@ -7333,7 +7613,7 @@ setup_boot_information(struct archive_write *a)
 		else
 			rsize = (size_t)size;
 
-		rs = read(iso9660->temp_fd, buff, rsize);
+		rs = __archive_tempfile_read(&(iso9660->temp), buff, rsize);
 		if (rs <= 0) {
 			archive_set_error(&a->archive, errno,
 			    "Can't read temporary file(%jd)",
@@ -7359,7 +7639,7 @@ setup_boot_information(struct archive_write *a)
 	memset(buff+16, 0, 40);
 
 	/* Overwrite the boot file. */
-	lseek(iso9660->temp_fd,
+	__archive_tempfile_seek(&(iso9660->temp),
 	    np->file->content.offset_of_temp + 8, SEEK_SET);
 	return (write_to_temp(a, buff, 56));
 }
@@ -7445,6 +7725,9 @@ zisofs_init(struct archive_write *a,  struct isofile *file)
 	r = zisofs_init_zstream(a);
 	if (r != ARCHIVE_OK)
 		return (ARCHIVE_FATAL);
+	if (iso9660->zisofs.pool == NULL && iso9660->zisofs.threads > 1)
+		iso9660->zisofs.pool =
+		    __archive_thread_pool_new(iso9660->zisofs.threads);
 
 	/* Mark file->zisofs to create RRIP 'ZF' Use Entry. */
 	file->zisofs.header_size = ZF_HEADER_SIZE >> 2;
@@ -7586,6 +7869,195 @@ zisofs_detect_magic(struct archive_write *a, const void *buff, size_t s)
 
 #ifdef HAVE_ZLIB_H
 
+/*
+ * A run of zisofs blocks which is compressed on a worker thread.
+ * Every block is compressed independently, so the result is the
+ * same as zisofs_write_to_temp() makes.
+ */
+#define ZF_BATCH_BLOCKS		16
+
+struct zisofs_batch {
+	/* Must be the first member. */
+	struct archive_task	 task;
+	struct zisofs_batch	*next;
+	int			 level;
+	/* Status of deflate(); Z_STREAM_END on success. */
+	int			 status;
+	int			 nblocks;
+	size_t			 in_size;
+	size_t			 out_size;
+	/* Compressed size of each block; 0 means an all-zero block. */
+	uint32_t		 csize[ZF_BATCH_BLOCKS];
+	unsigned char		*out;
+	unsigned char		 in[ZF_BATCH_BLOCKS * ZF_BLOCK_SIZE];
+};
+
+static void
+zisofs_compress_batch(struct archive_task *task)
+{
+	struct zisofs_batch *batch = (struct zisofs_batch *)task;
+	z_stream strm;
+	size_t len, off, out_max;
+	int i;
+
+	memset(&strm, 0, sizeof(strm));
+	batch->status = deflateInit(&strm, batch->level);
+	batch->out_size = 0;
+	batch->nblocks = 0;
+	if (batch->status != Z_OK)
+		return;
+	out_max = compressBound(ZF_BLOCK_SIZE) * ZF_BATCH_BLOCKS;
+	batch->status = Z_STREAM_END;
+	for (i = 0, off = 0; off < batch->in_size; i++, off += len) {
+		const unsigned char *p, *endp;
+
+		len = batch->in_size - off;
+		if (len > ZF_BLOCK_SIZE)
+			len = ZF_BLOCK_SIZE;
+		batch->csize[i] = 0;
+
+		/* We do not use compressed data for an all-zero block. */
+		p = batch->in + off;
+		endp = p + len;
+		if (len == ZF_BLOCK_SIZE) {
+			while (p < endp && *p == 0)
+				p++;
+			if (p == endp)
+				continue;
+		}
+
+		deflateReset(&strm);
+		strm.next_in = batch->in + off;
+		strm.avail_in = (uInt)len;
+		strm.next_out = batch->out + batch->out_size;
+		strm.avail_out = (uInt)(out_max - batch->out_size);
+		batch->status = deflate(&strm, Z_FINISH);
+		if (batch->status != Z_STREAM_END)
+			break;
+		batch->csize[i] = (uint32_t)strm.total_out;
+		batch->out_size += strm.total_out;
+	}
+	batch->nblocks = i;
+	deflateEnd(&strm);
+}
+
+/*
+ * Write compressed batches to the temporary file in order, and record
+ * their Block Pointers.  Unless `all' is set, keep as many batches
+ * in flight as the worker threads can take.
+ */
+static int
+zisofs_write_batches(struct archive_write *a, int all)
+{
+	struct iso9660 *iso9660 = a->format_data;
+	struct isofile *file = iso9660->cur_file;
+	struct zisofs_batch *batch;
+	int i;
+
+	while (iso9660->zisofs.pending != NULL &&
+	    (all || iso9660->zisofs.pending_count >
+	     2 * iso9660->zisofs.threads)) {
+		batch = iso9660->zisofs.pending;
+		__archive_thread_pool_wait(iso9660->zisofs.pool,
+		    &(batch->task));
+		iso9660->zisofs.pending = batch->next;
+		if (iso9660->zisofs.pending == NULL)
+			iso9660->zisofs.pending_last =
+			    &(iso9660->zisofs.pending);
+		iso9660->zisofs.pending_count--;
+		batch->next = iso9660->zisofs.free_batches;
+		iso9660->zisofs.free_batches = batch;
+
+		if (batch->status != Z_STREAM_END) {
+			archive_set_error(&a->archive,
+			    ARCHIVE_ERRNO_MISC,
+			    "Compression failed:"
+			    " deflate() call returned status %d",
+			    batch->status);
+			return (ARCHIVE_FATAL);
+		}
+		if (wb_write_to_temp(a, batch->out, batch->out_size)
+		    != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+		file->cur_content->size += batch->out_size;
+		for (i = 0; i < batch->nblocks; i++) {
+			iso9660->zisofs.total_size += batch->csize[i];
+			iso9660->zisofs.block_pointers_idx ++;
+			archive_le32enc(&(iso9660->zisofs.block_pointers[
+			    iso9660->zisofs.block_pointers_idx]),
+				(uint32_t)iso9660->zisofs.total_size);
+		}
+	}
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Collect data into batches and pass them to worker threads.
+ */
+static int
+zisofs_write_to_batch(struct archive_write *a, const void *buff, size_t s)
+{
+	struct iso9660 *iso9660 = a->format_data;
+	struct zisofs_batch *batch;
+	const unsigned char *b;
+	size_t l;
+
+	b = (const unsigned char *)buff;
+	while (s) {
+		batch = iso9660->zisofs.cur_batch;
+		if (batch == NULL) {
+			batch = iso9660->zisofs.free_batches;
+			if (batch != NULL)
+				iso9660->zisofs.free_batches = batch->next;
+			else {
+				batch = malloc(sizeof(*batch));
+				if (batch != NULL) {
+					batch->out = malloc(
+					    compressBound(ZF_BLOCK_SIZE) *
+					    ZF_BATCH_BLOCKS);
+					if (batch->out == NULL) {
+						free(batch);
+						batch = NULL;
+					}
+				}
+				if (batch == NULL) {
+					archive_set_error(&a->archive, ENOMEM,
+					    "Can't allocate memory");
+					return (ARCHIVE_FATAL);
+				}
+			}
+			batch->in_size = 0;
+			batch->next = NULL;
+			iso9660->zisofs.cur_batch = batch;
+		}
+
+		l = sizeof(batch->in) - batch->in_size;
+		if (l > s)
+			l = s;
+		memcpy(batch->in + batch->in_size, b, l);
+		batch->in_size += l;
+		b += l;
+		s -= l;
+		iso9660->zisofs.remaining -= l;
+		if (batch->in_size < sizeof(batch->in) &&
+		    iso9660->zisofs.remaining > 0)
+			continue;
+
+		/* The batch is full, or this is the last one of a file. */
+		iso9660->zisofs.cur_batch = NULL;
+		batch->level = iso9660->zisofs.compression_level;
+		batch->task.run = zisofs_compress_batch;
+		*iso9660->zisofs.pending_last = batch;
+		iso9660->zisofs.pending_last = &(batch->next);
+		iso9660->zisofs.pending_count++;
+		__archive_thread_pool_submit(iso9660->zisofs.pool,
+		    &(batch->task));
+		if (zisofs_write_batches(a, 0) != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+	}
+	return (ARCHIVE_OK);
+}
+
 /*
  * Compress data and write it to a temporary file.
  */
@@ -7597,7 +8069,10 @@ zisofs_write_to_temp(struct archive_write *a, const void *buff, size_t s)
 	const unsigned char *b;
 	z_stream *zstrm;
 	size_t avail, csize;
-	int flush, r;
+	int flush, skip, r;
+
+	if (iso9660->zisofs.pool != NULL)
+		return (zisofs_write_to_batch(a, buff, s));
 
 	zstrm = &(iso9660->zisofs.stream);
 	zstrm->next_out = wb_buffptr(a);
@@ -7637,6 +8112,7 @@ zisofs_write_to_temp(struct archive_write *a, const void *buff, size_t s)
 		 * If current data block are all zero, we do not use
 		 * compressed data.
 		 */
+		skip = 0;
 		if (flush == Z_FINISH && iso9660->zisofs.allzero &&
 		    avail + zstrm->total_in == ZF_BLOCK_SIZE) {
 			if (iso9660->zisofs.block_offset !=
@@ -7654,12 +8130,17 @@ zisofs_write_to_temp(struct archive_write *a, const void *buff, size_t s)
 				iso9660->zisofs.total_size -= diff;
 			}
 			zstrm->avail_in = 0;
+			skip = 1;
 		}
 
 		/*
-		 * Compress file data.
+		 * Compress file data.  At the end of a block, keep calling
+		 * deflate() until it has flushed out all compressed data;
+		 * the write buffer may be too small to take it at once.
 		 */
-		while (zstrm->avail_in > 0) {
+		r = Z_OK;
+		while (zstrm->avail_in > 0 ||
+		    (flush == Z_FINISH && !skip && r != Z_STREAM_END)) {
 			csize = zstrm->total_out;
 			r = deflate(zstrm, flush);
 			switch (r) {
@@ -7711,6 +8192,10 @@ zisofs_finish_entry(struct archive_write *a)
 	size_t s;
 	int64_t tail;
 
+	/* Write out all blocks compressed on worker threads. */
+	if (zisofs_write_batches(a, 1) != ARCHIVE_OK)
+		return (ARCHIVE_FATAL);
+
 	/* Direct temp file stream to zisofs temp file stream. */
 	archive_entry_set_size(file->entry, iso9660->zisofs.total_size);
 
@@ -7774,12 +8259,35 @@ zisofs_finish_entry(struct archive_write *a)
 	return (ARCHIVE_OK);
 }
 
+static void
+zisofs_free_batches(struct zisofs_batch *batch)
+{
+	while (batch != NULL) {
+		struct zisofs_batch *next = batch->next;
+
+		free(batch->out);
+		free(batch);
+		batch = next;
+	}
+}
+
 static int
 zisofs_free(struct archive_write *a)
 {
 	struct iso9660 *iso9660 = a->format_data;
 	int ret = ARCHIVE_OK;
 
+	__archive_thread_pool_free(iso9660->zisofs.pool);
+	iso9660->zisofs.pool = NULL;
+	zisofs_free_batches(iso9660->zisofs.cur_batch);
+	zisofs_free_batches(iso9660->zisofs.pending);
+	zisofs_free_batches(iso9660->zisofs.free_batches);
+	iso9660->zisofs.cur_batch = NULL;
+	iso9660->zisofs.pending = NULL;
+	iso9660->zisofs.pending_last = &(iso9660->zisofs.pending);
+	iso9660->zisofs.pending_count = 0;
+	iso9660->zisofs.free_batches = NULL;
+
 	free(iso9660->zisofs.block_pointers);
 	if (iso9660->zisofs.stream_valid &&
 	    deflateEnd(&(iso9660->zisofs.stream)) != Z_OK) {
@@ -8022,7 +8530,8 @@ zisofs_rewind_boot_file(struct archive_write *a)
 	size_t remaining, rbuff_size;
 	struct zisofs_extract zext;
 	int64_t read_offset, write_offset, new_offset;
-	int fd, ret = ARCHIVE_OK;
+	struct archive_tempfile *temp;
+	int ret = ARCHIVE_OK;
 
 	file = iso9660->el_torito.boot->file;
 	/*
@@ -8039,7 +8548,7 @@ zisofs_rewind_boot_file(struct archive_write *a)
 	zext.pz_uncompressed_size = file->zisofs.uncompressed_size;
 	zext.pz_log2_bs = file->zisofs.log2_bs;
 
-	fd = iso9660->temp_fd;
+	temp = &(iso9660->temp);
 	new_offset = wb_offset(a);
 	read_offset = file->content.offset_of_temp;
 	remaining = (size_t)file->content.size;
@@ -8058,15 +8567,15 @@ zisofs_rewind_boot_file(struct archive_write *a)
 		ssize_t rs;
 
 		/* Get the current file pointer. */
-		write_offset = lseek(fd, 0, SEEK_CUR);
+		write_offset = __archive_tempfile_seek(temp, 0, SEEK_CUR);
 
 		/* Change the file pointer to read. */
-		lseek(fd, read_offset, SEEK_SET);
+		__archive_tempfile_seek(temp, read_offset, SEEK_SET);
 
 		rsize = rbuff_size;
 		if (rsize > remaining)
 			rsize = remaining;
-		rs = read(iso9660->temp_fd, rbuff, rsize);
+		rs = __archive_tempfile_read(temp, rbuff, rsize);
 		if (rs <= 0) {
 			archive_set_error(&a->archive, errno,
 			    "Can't read temporary file(%jd)", (intmax_t)rs);
@@ -8077,7 +8586,7 @@ zisofs_rewind_boot_file(struct archive_write *a)
 		read_offset += rs;
 
 		/* Put the file pointer back to write. */
-		lseek(fd, write_offset, SEEK_SET);
+		__archive_tempfile_seek(temp, write_offset, SEEK_SET);
 
 		r = zisofs_extract(a, &zext, rbuff, rs);
 		if (r < 0) {
@@ -40,6 +40,7 @@ __FBSDID("$FreeBSD: head/lib/libarchive/archive_write_set_format_pax.c 201162 20
 #include "archive.h"
 #include "archive_entry.h"
 #include "archive_entry_locale.h"
+#include "archive_entry_private.h"
 #include "archive_private.h"
 #include "archive_write_private.h"
 
@@ -59,12 +60,25 @@ struct pax {
 	size_t			sparse_map_padding;
 	struct sparse_block	*sparse_list;
 	struct sparse_block	*sparse_tail;
+	struct sparse_block	*sparse_free;
 	struct archive_string_conv *sconv_utf8;
 	int			 opt_binary;
+	/*
+	 * Work areas reused for every header, so that writing an
+	 * ordinary entry does not need to touch the heap.
+	 */
+	struct archive_entry	*entry_main;
+	struct archive_entry	*pax_attr_entry;
+	struct archive_string	 entry_name;
+	struct archive_string	 xattr_name;
+	struct archive_string	 xattr_value;
 };
 
 static void		 add_pax_attr(struct archive_string *, const char *key,
 			     const char *value);
+static void		 add_pax_attr_binary(struct archive_string *,
+			     const char *key, const char *value,
+			     size_t value_len);
 static void		 add_pax_attr_int(struct archive_string *,
 			     const char *key, int64_t value);
 static void		 add_pax_attr_time(struct archive_string *,
@@ -79,16 +93,18 @@ static int		 archive_write_pax_header(struct archive_write *,
 			     struct archive_entry *);
 static int		 archive_write_pax_options(struct archive_write *,
 			     const char *, const char *);
-static char		*base64_encode(const char *src, size_t len);
+static char		*base64_encode(struct archive_string *,
+			     const char *src, size_t len);
 static char		*build_gnu_sparse_name(char *dest, const char *src);
 static char		*build_pax_attribute_name(char *dest, const char *src);
 static char		*build_ustar_entry_name(char *dest, const char *src,
 			     size_t src_length, const char *insert);
 static char		*format_int(char *dest, int64_t);
 static int		 has_non_ASCII(const char *);
+static void		 sparse_block_release(struct pax *, struct sparse_block *);
 static void		 sparse_list_clear(struct pax *);
 static int		 sparse_list_add(struct pax *, int64_t, int64_t);
-static char		*url_encode(const char *in);
+static char		*url_encode(struct archive_string *, const char *in);
 
 /*
  * Set output format to 'restricted pax' format.
@@ -188,7 +204,8 @@ archive_write_pax_options(struct archive_write *a, const char *key,
 			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
 			    "pax: invalid charset name");
 		return (ret);
-	}
+	} else if (strcmp(key, "index") == 0)
+		return (__archive_write_set_tar_index(a, val));
 
 	/* Note: The "warn" return is just to inform the options
 	 * supervisor that we didn't handle it.  It will generate
@@ -272,15 +289,30 @@ add_pax_attr_int(struct archive_string *as, const char *key, int64_t value)
  */
 static void
 add_pax_attr(struct archive_string *as, const char *key, const char *value)
+{
+	add_pax_attr_binary(as, key, value, strlen(value));
+}
+
+/*
+ * As above, but the value has an explicit length.  The record is
+ * built in place at the end of 'as' with a single buffer check, so
+ * no allocation happens once 'as' has grown to its working size.
+ */
+static void
+add_pax_attr_binary(struct archive_string *as, const char *key,
+    const char *value, size_t value_len)
 {
 	int digits, i, len, next_ten;
+	size_t key_len;
+	char *p, *t;
 	char tmp[1 + 3 * sizeof(int)];	/* < 3 base-10 digits per byte */
 
 	/*-
 	 * PAX attributes have the following layout:
 	 *     <len> <space> <key> <=> <value> <nl>
 	 */
-	len = 1 + (int)strlen(key) + 1 + (int)strlen(value) + 1;
+	key_len = strlen(key);
+	len = 1 + (int)key_len + 1 + (int)value_len + 1;
 
 	/*
 	 * The <len> field includes the length of the <len> field, so
@@ -306,20 +338,28 @@ add_pax_attr(struct archive_string *as, const char *key, const char *value)
 		digits++;
 
 	/* Now, we have the right length so we can build the line. */
-	tmp[sizeof(tmp) - 1] = 0;	/* Null-terminate the work area. */
-	archive_strcat(as, format_int(tmp + sizeof(tmp) - 1, len + digits));
-	archive_strappend_char(as, ' ');
-	archive_strcat(as, key);
-	archive_strappend_char(as, '=');
-	archive_strcat(as, value);
-	archive_strappend_char(as, '\n');
+	len += digits;
+	if (archive_string_ensure(as, archive_strlen(as) + len + 1) == NULL)
+		__archive_errx(1, "Out of memory");
+	t = format_int(tmp + sizeof(tmp), len);
+	p = as->s + archive_strlen(as);
+	memcpy(p, t, digits);
+	p += digits;
+	*p++ = ' ';
+	memcpy(p, key, key_len);
+	p += key_len;
+	*p++ = '=';
+	memcpy(p, value, value_len);
+	p += value_len;
+	*p++ = '\n';
+	*p = '\0';
+	as->length += len;
 }
 
 static int
 archive_write_pax_header_xattrs(struct archive_write *a,
     struct pax *pax, struct archive_entry *entry)
 {
-	struct archive_string s;
 	int i = archive_entry_xattr_reset(entry);
 
 	while (i--) {
@@ -331,12 +371,15 @@ archive_write_pax_header_xattrs(struct archive_write *a,
 		int r;
 
 		archive_entry_xattr_next(entry, &name, &value, &size);
-		url_encoded_name = url_encode(name);
+		url_encoded_name = url_encode(&(pax->xattr_name), name);
 		if (url_encoded_name != NULL) {
-			/* Convert narrow-character to UTF-8. */
-			r = archive_strcpy_l(&(pax->l_url_encoded_name),
-			    url_encoded_name, pax->sconv_utf8);
-			free(url_encoded_name); /* Done with this. */
+			/* Convert narrow-character to UTF-8 and build
+			 * the key in place. */
+			archive_strcpy(&(pax->l_url_encoded_name),
+			    "LIBARCHIVE.xattr.");
+			r = archive_strncat_l(&(pax->l_url_encoded_name),
+			    url_encoded_name, archive_strlen(&(pax->xattr_name)),
+			    pax->sconv_utf8);
 			if (r == 0)
 				encoded_name = pax->l_url_encoded_name.s;
 			else if (errno == ENOMEM) {
@@ -346,16 +389,12 @@ archive_write_pax_header_xattrs(struct archive_write *a,
 			}
 		}
 
-		encoded_value = base64_encode((const char *)value, size);
+		encoded_value = base64_encode(&(pax->xattr_value),
+		    (const char *)value, size);
 
-		if (encoded_name != NULL && encoded_value != NULL) {
-			archive_string_init(&s);
-			archive_strcpy(&s, "LIBARCHIVE.xattr.");
-			archive_strcat(&s, encoded_name);
-			add_pax_attr(&(pax->pax_header), s.s, encoded_value);
-			archive_string_free(&s);
-		}
-		free(encoded_value);
+		if (encoded_name != NULL && encoded_value != NULL)
+			add_pax_attr_binary(&(pax->pax_header), encoded_name,
+			    encoded_value, archive_strlen(&(pax->xattr_value)));
 	}
 	return (ARCHIVE_OK);
 }
@@ -483,7 +522,6 @@ archive_write_pax_header(struct archive_write *a,
 	char ustar_entry_name[256];
 	char pax_entry_name[256];
 	char gnu_sparse_name[256];
-	struct archive_string entry_name;
 
 	ret = ARCHIVE_OK;
 	need_extension = 0;
@@ -580,15 +618,14 @@ archive_write_pax_header(struct archive_write *a,
 			 * normal operation.
 			 */
 			if (p != NULL && p[strlen(p) - 1] != '/') {
-				struct archive_string as;
+				/* The entry name work area is free here. */
+				struct archive_string *as = &(pax->entry_name);
 
-				archive_string_init(&as);
 				path_length = strlen(p);
-				if (archive_string_ensure(&as,
+				if (archive_string_ensure(as,
 				    path_length + 2) == NULL) {
 					archive_set_error(&a->archive, ENOMEM,
 					    "Can't allocate pax data");
-					archive_string_free(&as);
 					return(ARCHIVE_FATAL);
 				}
 #if defined(_WIN32) && !defined(__CYGWIN__)
@@ -600,11 +637,10 @@ archive_write_pax_header(struct archive_write *a,
 					path_length--;
 				else
 #endif
-				archive_strncpy(&as, p, path_length);
-				archive_strappend_char(&as, '/');
+				archive_strncpy(as, p, path_length);
+				archive_strappend_char(as, '/');
 				archive_entry_copy_pathname(
-				    entry_original, as.s);
-				archive_string_free(&as);
+				    entry_original, as->s);
 			}
 			break;
 		}
@@ -707,21 +743,32 @@ archive_write_pax_header(struct archive_write *a,
 			ret = r;
 	}
 
-	/* Copy entry so we can modify it as needed. */
+	/* Copy entry so we can modify it as needed.  The copy goes into
+	 * an entry kept with the writer, which keeps its buffers from
+	 * one header to the next. */
 #if defined(_WIN32) && !defined(__CYGWIN__)
 	/* Make sure the path separators in pahtname, hardlink and symlink
 	 * are all slash '/', not the Windows path separator '\'. */
 	entry_main = __la_win_entry_in_posix_pathseparator(entry_original);
-	if (entry_main == entry_original)
-		entry_main = archive_entry_clone(entry_original);
+	if (entry_main == NULL) {
+		archive_set_error(&a->archive, ENOMEM,
+		    "Can't allocate pax data");
+		return(ARCHIVE_FATAL);
+	}
 #else
-	entry_main = archive_entry_clone(entry_original);
+	entry_main = entry_original;
 #endif
-	if (entry_main == NULL) {
+	if (pax->entry_main == NULL)
+		pax->entry_main = archive_entry_new2(&a->archive);
+	if (pax->entry_main == NULL) {
 		archive_set_error(&a->archive, ENOMEM,
 		    "Can't allocate pax data");
 		return(ARCHIVE_FATAL);
 	}
+	__archive_entry_copy(pax->entry_main, entry_main);
+	if (entry_main != entry_original)
+		archive_entry_free(entry_main);
+	entry_main = pax->entry_main;
 	archive_string_empty(&(pax->pax_header)); /* Blank our work area. */
 	archive_string_empty(&(pax->sparse_map));
 	sparse_total = 0;
@@ -907,8 +954,7 @@ archive_write_pax_header(struct archive_write *a,
 	}
 	/* Save a pathname since it will be renamed if `entry_main` has
 	 * sparse blocks. */
-	archive_string_init(&entry_name);
-	archive_strcpy(&entry_name, archive_entry_pathname(entry_main));
+	archive_strcpy(&(pax->entry_name), archive_entry_pathname(entry_main));
 
 	/* If file size is too large, add 'size' to pax extended attrs. */
 	if (archive_entry_size(entry_main) >= (((int64_t)1) << 33)) {
@@ -1134,7 +1180,7 @@ archive_write_pax_header(struct archive_write *a,
 			add_pax_attr_int(&(pax->pax_header),
 			    "GNU.sparse.minor", 0);
 			add_pax_attr(&(pax->pax_header),
-			    "GNU.sparse.name", entry_name.s);
+			    "GNU.sparse.name", pax->entry_name.s);
 			add_pax_attr_int(&(pax->pax_header),
 			    "GNU.sparse.realsize",
 			    archive_entry_size(entry_main));
@@ -1144,7 +1190,7 @@ archive_write_pax_header(struct archive_write *a,
 			 * PAX Format 1.0 requires */
 			archive_entry_set_pathname(entry_main,
 			    build_gnu_sparse_name(gnu_sparse_name,
-			        entry_name.s));
+			        pax->entry_name.s));
 
 			/*
 			 * - Make a sparse map, which will precede a file data.
@@ -1164,8 +1210,6 @@ archive_write_pax_header(struct archive_write *a,
 					archive_set_error(&a->archive,
 					    ENOMEM,
 					    "Can't allocate memory");
-					archive_entry_free(entry_main);
-					archive_string_free(&entry_name);
 					return (ARCHIVE_FATAL);
 				}
 			}
@@ -1174,8 +1218,6 @@ archive_write_pax_header(struct archive_write *a,
 		/* Store extended attributes */
 		if (archive_write_pax_header_xattrs(a, pax, entry_original)
 		    == ARCHIVE_FATAL) {
-			archive_entry_free(entry_main);
-			archive_string_free(&entry_name);
 			return (ARCHIVE_FATAL);
 		}
 	}
@@ -1256,8 +1298,17 @@ archive_write_pax_header(struct archive_write *a,
 		int64_t uid, gid;
 		int mode;
 
-		pax_attr_entry = archive_entry_new2(&a->archive);
-		p = entry_name.s;
+		/* Every field the 'x' header uses is set below, so the
+		 * same entry serves for all of them. */
+		if (pax->pax_attr_entry == NULL)
+			pax->pax_attr_entry = archive_entry_new2(&a->archive);
+		pax_attr_entry = pax->pax_attr_entry;
+		if (pax_attr_entry == NULL) {
+			archive_set_error(&a->archive, ENOMEM,
+			    "Can't allocate pax data");
+			return (ARCHIVE_FATAL);
+		}
+		p = pax->entry_name.s;
 		archive_entry_set_pathname(pax_attr_entry,
 		    build_pax_attribute_name(pax_entry_name, p));
 		archive_entry_set_size(pax_attr_entry,
@@ -1305,8 +1356,6 @@ archive_write_pax_header(struct archive_write *a,
 		r = __archive_write_format_header_ustar(a, paxbuff,
 		    pax_attr_entry, 'x', 1, NULL);
 
-		archive_entry_free(pax_attr_entry);
-
 		/* Note that the 'x' header shouldn't ever fail to format */
 		if (r < ARCHIVE_WARN) {
 			archive_set_error(&a->archive, ARCHIVE_ERRNO_MISC,
@@ -1360,8 +1409,6 @@ archive_write_pax_header(struct archive_write *a,
 		sparse_total = real_size;
 	}
 	pax->entry_padding = 0x1ff & (-(int64_t)sparse_total);
-	archive_entry_free(entry_main);
-	archive_string_free(&entry_name);
 
 	return (ret);
 }
@@ -1651,7 +1698,17 @@ archive_write_pax_free(struct archive_write *a)
 	archive_string_free(&pax->pax_header);
 	archive_string_free(&pax->sparse_map);
 	archive_string_free(&pax->l_url_encoded_name);
+	archive_string_free(&pax->entry_name);
+	archive_string_free(&pax->xattr_name);
+	archive_string_free(&pax->xattr_value);
+	archive_entry_free(pax->entry_main);
+	archive_entry_free(pax->pax_attr_entry);
 	sparse_list_clear(pax);
+	while (pax->sparse_free != NULL) {
+		struct sparse_block *sb = pax->sparse_free;
+		pax->sparse_free = sb->next;
+		free(sb);
+	}
 	free(pax);
 	a->format_data = NULL;
 	return (ARCHIVE_OK);
@@ -1672,7 +1729,7 @@ archive_write_pax_finish_entry(struct archive_write *a)
 			if (!pax->sparse_list->is_hole)
 				remaining += pax->sparse_list->remaining;
 			sb = pax->sparse_list->next;
-			free(pax->sparse_list);
+			sparse_block_release(pax, pax->sparse_list);
 			pax->sparse_list = sb;
 		}
 	}
@@ -1713,7 +1770,7 @@ archive_write_pax_data(struct archive_write *a, const void *buff, size_t s)
 		while (pax->sparse_list != NULL &&
 		    pax->sparse_list->remaining == 0) {
 			struct sparse_block *sb = pax->sparse_list->next;
-			free(pax->sparse_list);
+			sparse_block_release(pax, pax->sparse_list);
 			pax->sparse_list = sb;
 		}
 
@@ -1757,13 +1814,14 @@ has_non_ASCII(const char *_p)
 /*
  * Used by extended attribute support; encodes the name
  * so that there will be no '=' characters in the result.
+ * The result is stored in 'as', which is returned as a C string.
  */
 static char *
-url_encode(const char *in)
+url_encode(struct archive_string *as, const char *in)
 {
 	const char *s;
 	char *d;
-	int out_len = 0;
+	size_t out_len = 0;
 	char *out;
 
 	for (s = in; *s != '\0'; s++) {
@@ -1773,9 +1831,10 @@ url_encode(const char *in)
 			out_len++;
 	}
 
-	out = (char *)malloc(out_len + 1);
-	if (out == NULL)
+	if (archive_string_ensure(as, out_len + 1) == NULL)
 		return (NULL);
+	out = as->s;
+	as->length = out_len;
 
 	for (s = in, d = out; *s != '\0'; s++) {
 		/* encode any non-printable ASCII character or '%' or '=' */
@@ -1795,11 +1854,11 @@ url_encode(const char *in)
 /*
  * Encode a sequence of bytes into a C string using base-64 encoding.
  *
- * Returns a null-terminated C string allocated with malloc(); caller
- * is responsible for freeing the result.
+ * The result is stored in 'as', whose buffer is returned as a
+ * null-terminated C string; NULL is returned if 'as' can't grow.
  */
 static char *
-base64_encode(const char *s, size_t len)
+base64_encode(struct archive_string *as, const char *s, size_t len)
 {
 	static const char digits[64] =
 	    { 'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O',
@@ -1811,10 +1870,10 @@ base64_encode(const char *s, size_t len)
 	char *d, *out;
 
 	/* 3 bytes becomes 4 chars, but round up and allow for trailing NUL */
-	out = (char *)malloc((len * 4 + 2) / 3 + 1);
-	if (out == NULL)
+	if (archive_string_ensure(as, (len * 4 + 2) / 3 + 1) == NULL)
 		return (NULL);
-	d = out;
+	as->length = (len * 4 + 2) / 3;
+	d = out = as->s;
 
 	/* Convert each group of 3 bytes into 4 characters. */
 	while (len >= 3) {
@@ -1849,13 +1908,24 @@ base64_encode(const char *s, size_t len)
 	return (out);
 }
 
+/*
+ * Finished sparse blocks are kept on a free list; nearly every entry
+ * uses one block for its data, which is then recycled.
+ */
+static void
+sparse_block_release(struct pax *pax, struct sparse_block *sb)
+{
+	sb->next = pax->sparse_free;
+	pax->sparse_free = sb;
+}
+
 static void
 sparse_list_clear(struct pax *pax)
 {
 	while (pax->sparse_list != NULL) {
 		struct sparse_block *sb = pax->sparse_list;
 		pax->sparse_list = sb->next;
-		free(sb);
+		sparse_block_release(pax, sb);
 	}
 	pax->sparse_tail = NULL;
 }
@@ -1866,9 +1936,14 @@ _sparse_list_add_block(struct pax *pax, int64_t offset, int64_t length,
 {
 	struct sparse_block *sb;
 
-	sb = (struct sparse_block *)malloc(sizeof(*sb));
-	if (sb == NULL)
-		return (ARCHIVE_FATAL);
+	if (pax->sparse_free != NULL) {
+		sb = pax->sparse_free;
+		pax->sparse_free = sb->next;
+	} else {
+		sb = (struct sparse_block *)malloc(sizeof(*sb));
+		if (sb == NULL)
+			return (ARCHIVE_FATAL);
+	}
 	sb->next = NULL;
 	sb->is_hole = is_hole;
 	sb->offset = offset;
@@ -32,6 +32,7 @@ __FBSDID("$FreeBSD$");
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#include <stdarg.h>
 #include <stdlib.h>
 #if HAVE_LIBXML_XMLWRITER_H
 #include <libxml/xmlwriter.h>
@@ -54,6 +55,8 @@ __FBSDID("$FreeBSD$");
 #include "archive_private.h"
 #include "archive_rb.h"
 #include "archive_string.h"
+#include "archive_tempfile_private.h"
+#include "archive_thread_pool_private.h"
 #include "archive_write_private.h"
 
 /*
@@ -103,6 +106,13 @@ archive_write_set_format_xar(struct archive *_a)
 #define HEADER_SIZE	28
 #define HEADER_VERSION	1
 
+/*
+ * With the threads option, the contents of a file up to this size are
+ * kept in memory and compressed by a worker thread.  Larger files are
+ * compressed in the calling thread.
+ */
+#define THREADS_FILE_SIZE	(32 * 1024 * 1024)
+
 enum sumalg {
 	CKSUM_NONE = 0,
 	CKSUM_SHA1 = 1,
@@ -157,6 +167,10 @@ struct la_zstream {
 				    enum la_zaction action);
 	int			 (*end)(struct archive *a,
 				    struct la_zstream *lastrm);
+	/* Where errors go when there is no archive to report them
+	 * to, as on a worker thread. */
+	int			 error;
+	struct archive_string	*error_string;
 };
 
 struct chksumval {
@@ -216,6 +230,28 @@ struct file {
 	int			 dir:1;
 };
 
+/*
+ * The contents of a file which are compressed and checksummed by
+ * a worker thread.
+ */
+struct xar_job {
+	struct archive_task	 task;	/* Must be first. */
+	struct xar_job		*next;
+	struct file		*file;
+	int			 error;
+	struct archive_string	 error_string;
+	enum enctype		 codec;
+	int			 level;
+	enum sumalg		 sumalg;
+	unsigned char		*buff;
+	size_t			 buff_size;
+	unsigned char		*out;
+	size_t			 out_size;
+	struct chksumval	 a_sum;
+	struct chksumval	 e_sum;
+	int			 r;
+};
+
 struct hardlink {
 	struct archive_rb_node	 rbnode;
 	int			 nlink;
@@ -226,7 +262,7 @@ struct hardlink {
 };
 
 struct xar {
-	int			 temp_fd;
+	struct archive_tempfile	 temp;
 	uint64_t		 temp_offset;
 
 	int			 file_idx;
@@ -248,6 +284,17 @@ struct xar {
 	struct chksumwork	 e_sumwrk;	/* extracted checksum.	*/
 	struct la_zstream	 stream;
 	struct archive_string_conv *sconv;
+	/*
+	 * Files compressed by worker threads.  They are appended to
+	 * the temporary file in archive order.
+	 */
+	struct archive_thread_pool *pool;
+	struct xar_job		*cur_job;
+	struct {
+		struct xar_job	*first;
+		struct xar_job	**last;
+	}			 pending;
+	int			 pending_count;
 	/*
 	 * Compressed data buffer.
 	 */
@@ -303,6 +350,8 @@ static void	file_free_hardlinks(struct xar *);
 static void	checksum_init(struct chksumwork *, enum sumalg);
 static void	checksum_update(struct chksumwork *, const void *, size_t);
 static void	checksum_final(struct chksumwork *, struct chksumval *);
+static void	compression_error(struct archive *, struct la_zstream *,
+		    int, const char *, ...);
 static int	compression_init_encoder_gzip(struct archive *,
 		    struct la_zstream *, int, int);
 static int	compression_code_gzip(struct archive *,
@@ -324,6 +373,11 @@ static int	compression_code_lzma(struct archive *,
 		    struct la_zstream *, enum la_zaction);
 static int	compression_end_lzma(struct archive *, struct la_zstream *);
 #endif
+static int	job_new(struct archive_write *, struct file *);
+static int	write_pending_jobs(struct archive_write *, int);
+static int	write_to_temp(struct archive_write *, const void *, size_t);
+static int	compression_init_encoder(struct archive *,
+		    struct la_zstream *, enum enctype, int, int);
 static int	xar_compression_init_encoder(struct archive_write *);
 static int	compression_code(struct archive *,
 		    struct la_zstream *, enum la_zaction);
@@ -352,11 +406,12 @@ archive_write_set_format_xar(struct archive *_a)
 		    "Can't allocate xar data");
 		return (ARCHIVE_FATAL);
 	}
-	xar->temp_fd = -1;
+	__archive_tempfile_init(&(xar->temp));
 	file_init_register(xar);
 	file_init_hardlinks(xar);
 	archive_string_init(&(xar->tstr));
 	archive_string_init(&(xar->vstr));
+	xar->pending.last = &(xar->pending.first);
 
 	/*
 	 * Create the root directory.
@@ -405,6 +460,7 @@ static int
 xar_options(struct archive_write *a, const char *key, const char *value)
 {
 	struct xar *xar;
+	int r;
 
 	xar = (struct xar *)a->format_data;
 
@@ -496,25 +552,30 @@ xar_options(struct archive_write *a, const char *key, const char *value)
 		return (ARCHIVE_OK);
 	}
 	if (strcmp(key, "threads") == 0) {
-		if (value == NULL)
-			return (ARCHIVE_FAILED);
-		xar->opt_threads = (int)strtoul(value, NULL, 10);
-		if (xar->opt_threads == 0 && errno != 0) {
-			xar->opt_threads = 1;
-			archive_set_error(&(a->archive),
-			    ARCHIVE_ERRNO_MISC,
-			    "Illegal value `%s'",
-			    value);
-			return (ARCHIVE_FAILED);
-		}
-		if (xar->opt_threads == 0) {
-#ifdef HAVE_LZMA_STREAM_ENCODER_MT
-			xar->opt_threads = lzma_cputhreads();
-#else
-			xar->opt_threads = 1;
-#endif
+		unsigned long n;
+		char *end;
+
+		if (value == NULL || value[0] == '\0')
+			n = 1;
+		else {
+			n = strtoul(value, &end, 10);
+			if (*end != '\0' || n > 1024) {
+				archive_set_error(&(a->archive),
+				    ARCHIVE_ERRNO_MISC,
+				    "Illegal value `%s'",
+				    value);
+				return (ARCHIVE_FAILED);
+			}
 		}
+		if (n == 0)
+			n = __archive_thread_pool_ncpus();
+		xar->opt_threads = (uint32_t)n;
+		return (ARCHIVE_OK);
 	}
+	r = __archive_tempfile_options(&(a->archive), &(xar->temp), key,
+	    value);
+	if (r != ARCHIVE_WARN)
+		return (r);
 
 	/* Note: The "warn" return is just to inform the options
 	 * supervisor that we didn't handle it.  It will generate
@@ -532,6 +593,7 @@ xar_write_header(struct archive_write *a, struct archive_entry *entry)
 
 	xar = (struct xar *)a->format_data;
 	xar->cur_file = NULL;
+	xar->cur_job = NULL;
 	xar->bytes_remaining = 0;
 
 	if (xar->sconv == NULL) {
@@ -583,18 +645,18 @@ xar_write_header(struct archive_write *a, struct archive_entry *entry)
 	/*
 	 * Prepare to save the contents of the file.
 	 */
-	if (xar->temp_fd == -1) {
+	if (!xar->temp.opened) {
 		int algsize;
 		xar->temp_offset = 0;
-		xar->temp_fd = __archive_mktemp(NULL);
-		if (xar->temp_fd < 0) {
+		if (__archive_tempfile_open(&(xar->temp)) != 0) {
 			archive_set_error(&a->archive, errno,
 			    "Couldn't create temporary file");
 			return (ARCHIVE_FATAL);
 		}
 		algsize = getalgsize(xar->opt_toc_sumalg);
 		if (algsize > 0) {
-			if (lseek(xar->temp_fd, algsize, SEEK_SET) < 0) {
+			if (__archive_tempfile_seek(&(xar->temp), algsize,
+			    SEEK_SET) < 0) {
 				archive_set_error(&(a->archive), errno,
 				    "lseek failed");
 				return (ARCHIVE_FATAL);
@@ -634,6 +696,9 @@ xar_write_header(struct archive_write *a, struct archive_entry *entry)
 	file->data.size = archive_entry_size(file->entry);
 	file->data.compression = xar->opt_compression;
 	xar->bytes_remaining = archive_entry_size(file->entry);
+	if (xar->opt_threads > 1 && xar->bytes_remaining > 0 &&
+	    xar->bytes_remaining <= THREADS_FILE_SIZE)
+		return (job_new(a, file) == ARCHIVE_OK? r2: ARCHIVE_FATAL);
 	checksum_init(&(xar->a_sumwrk), xar->opt_sumalg);
 	checksum_init(&(xar->e_sumwrk), xar->opt_sumalg);
 	r = xar_compression_init_encoder(a);
@@ -644,6 +709,161 @@ xar_write_header(struct archive_write *a, struct archive_entry *entry)
 		return (r2);
 }
 
+/*
+ * Start buffering the contents of a file for a worker thread.
+ */
+static int
+job_new(struct archive_write *a, struct file *file)
+{
+	struct xar *xar = (struct xar *)a->format_data;
+	struct xar_job *job;
+
+	if (xar->pool == NULL) {
+		xar->pool = __archive_thread_pool_new(xar->opt_threads);
+		if (xar->pool == NULL)
+			/* Without thread support, the calling thread
+			 * runs the jobs; no more than one is pending. */
+			xar->opt_threads = 1;
+	}
+	job = calloc(1, sizeof(*job));
+	if (job != NULL)
+		job->buff = malloc((size_t)xar->bytes_remaining);
+	if (job == NULL || job->buff == NULL) {
+		free(job);
+		archive_set_error(&a->archive, ENOMEM,
+		    "Can't allocate memory");
+		return (ARCHIVE_FATAL);
+	}
+	job->file = file;
+	job->codec = xar->opt_compression;
+	job->level = xar->opt_compression_level;
+	job->sumalg = xar->opt_sumalg;
+	xar->cur_job = job;
+	return (ARCHIVE_OK);
+}
+
+static void
+job_free(struct xar_job *job)
+{
+	free(job->buff);
+	free(job->out);
+	archive_string_free(&(job->error_string));
+	free(job);
+}
+
+/*
+ * Checksum and compress the contents of a file.  This runs on
+ * a worker thread.
+ */
+static void
+compress_job(struct archive_task *task)
+{
+	struct xar_job *job = (struct xar_job *)task;
+	struct chksumwork sumwrk;
+	struct la_zstream strm;
+	size_t alloc = 0;
+	int r;
+
+	checksum_init(&sumwrk, job->sumalg);
+	checksum_update(&sumwrk, job->buff, job->buff_size);
+	checksum_final(&sumwrk, &(job->e_sum));
+
+	if (job->codec == NONE) {
+		job->out = job->buff;
+		job->out_size = job->buff_size;
+		job->buff = NULL;
+		r = ARCHIVE_EOF;
+	} else {
+		memset(&strm, 0, sizeof(strm));
+		/* There is no archive to report to on this thread;
+		 * errors are kept in the job until it is collected. */
+		strm.error_string = &(job->error_string);
+		r = compression_init_encoder(NULL, &strm,
+		    job->codec, job->level, 1);
+		strm.next_in = job->buff;
+		strm.avail_in = job->buff_size;
+		while (r == ARCHIVE_OK) {
+			if (strm.avail_out == 0) {
+				unsigned char *p;
+
+				alloc = (alloc)? alloc * 2:
+				    job->buff_size / 2 + 4096;
+				p = realloc(job->out, alloc);
+				if (p == NULL) {
+					compression_error(NULL, &strm,
+					    ENOMEM, "Can't allocate memory");
+					r = ARCHIVE_FATAL;
+					break;
+				}
+				job->out = p;
+				strm.next_out = p + strm.total_out;
+				strm.avail_out = alloc - (size_t)strm.total_out;
+			}
+			r = compression_code(NULL, &strm,
+			    ARCHIVE_Z_FINISH);
+		}
+		job->out_size = (size_t)strm.total_out;
+		if (compression_end(NULL, &strm) != ARCHIVE_OK)
+			r = ARCHIVE_FATAL;
+		job->error = strm.error;
+		free(job->buff);
+		job->buff = NULL;
+	}
+	if (r == ARCHIVE_EOF) {
+		checksum_init(&sumwrk, job->sumalg);
+		checksum_update(&sumwrk, job->out, job->out_size);
+		checksum_final(&sumwrk, &(job->a_sum));
+		r = ARCHIVE_OK;
+	} else
+		r = ARCHIVE_FATAL;
+	job->r = r;
+}
+
+/*
+ * Append the files compressed by the workers to the temporary file,
+ * in archive order, and record where their heap data is.  Unless `all'
+ * is set, only wait for enough of them to keep two files per thread
+ * in memory.
+ */
+static int
+write_pending_jobs(struct archive_write *a, int all)
+{
+	struct xar *xar = (struct xar *)a->format_data;
+	struct xar_job *job;
+	struct file *file;
+	int r;
+
+	while ((job = xar->pending.first) != NULL &&
+	    (all || xar->pending_count > 2 * (int)xar->opt_threads)) {
+		__archive_thread_pool_wait(xar->pool, &(job->task));
+		xar->pending.first = job->next;
+		if (xar->pending.first == NULL)
+			xar->pending.last = &(xar->pending.first);
+		xar->pending_count--;
+		if (job->r != ARCHIVE_OK) {
+			if (archive_strlen(&(job->error_string)) > 0)
+				archive_set_error(&a->archive, job->error,
+				    "%s", job->error_string.s);
+			else
+				archive_set_error(&a->archive,
+				    ARCHIVE_ERRNO_MISC,
+				    "Xar compression failed");
+			job_free(job);
+			return (ARCHIVE_FATAL);
+		}
+		file = job->file;
+		file->data.temp_offset = xar->temp_offset;
+		file->data.length = job->out_size;
+		file->data.a_sum = job->a_sum;
+		file->data.e_sum = job->e_sum;
+		r = write_to_temp(a, job->out, job->out_size);
+		job_free(job);
+		if (r != ARCHIVE_OK)
+			return (r);
+	}
+	return (ARCHIVE_OK);
+}
+
 static int
 write_to_temp(struct archive_write *a, const void *buff, size_t s)
 {
@@ -654,7 +874,7 @@ write_to_temp(struct archive_write *a, const void *buff, size_t s)
 	xar = (struct xar *)a->format_data;
 	p = (const unsigned char *)buff;
 	while (s) {
-		ws = write(xar->temp_fd, p, s);
+		ws = __archive_tempfile_write(&(xar->temp), p, s);
 		if (ws < 0) {
 			archive_set_error(&(a->archive), errno,
 			    "fwrite function failed");
@@ -681,10 +901,18 @@ xar_write_data(struct archive_write *a, const void *buff, size_t s)
 		s = (size_t)xar->bytes_remaining;
 	if (s == 0 || xar->cur_file == NULL)
 		return (0);
-	if (xar->cur_file->data.compression == NONE) {
+	if (xar->cur_job != NULL) {
+		/* Buffer the file data for a worker thread. */
+		memcpy(xar->cur_job->buff + xar->cur_job->buff_size, buff, s);
+		xar->cur_job->buff_size += s;
+		rsize = s;
+	} else if (xar->cur_file->data.compression == NONE) {
 		checksum_update(&(xar->e_sumwrk), buff, s);
 		checksum_update(&(xar->a_sumwrk), buff, s);
-		size = rsize = s;
+		if (write_to_temp(a, buff, s) != ARCHIVE_OK)
+			return (ARCHIVE_FATAL);
+		xar->cur_file->data.length += s;
+		rsize = s;
 	} else {
 		xar->stream.next_in = (const unsigned char *)buff;
 		xar->stream.avail_in = s;
@@ -692,14 +920,30 @@ xar_write_data(struct archive_write *a, const void *buff, size_t s)
 			run = ARCHIVE_Z_RUN;
 		else
 			run = ARCHIVE_Z_FINISH;
-		/* Compress file data. */
-		r = compression_code(&(a->archive), &(xar->stream), run);
-		if (r != ARCHIVE_OK && r != ARCHIVE_EOF)
-			return (ARCHIVE_FATAL);
+		/* Compress file data.  Drain the output buffer until the
+		 * compressor wants more input or, at the end of the file,
+		 * until it has flushed everything. */
+		for (;;) {
+			r = compression_code(&(a->archive), &(xar->stream),
+			    run);
+			if (r != ARCHIVE_OK && r != ARCHIVE_EOF)
+				return (ARCHIVE_FATAL);
+			if (xar->stream.avail_out != 0 &&
+			    run != ARCHIVE_Z_FINISH)
+				break;
+			size = sizeof(xar->wbuff) - xar->stream.avail_out;
+			checksum_update(&(xar->a_sumwrk), xar->wbuff, size);
+			if (write_to_temp(a, xar->wbuff, size) != ARCHIVE_OK)
+				return (ARCHIVE_FATAL);
+			xar->cur_file->data.length += size;
+			xar->stream.next_out = xar->wbuff;
+			xar->stream.avail_out = sizeof(xar->wbuff);
+			if (r == ARCHIVE_EOF || (run != ARCHIVE_Z_FINISH &&
+			    xar->stream.avail_in == 0))
+				break;
+		}
 		rsize = s - xar->stream.avail_in;
 		checksum_update(&(xar->e_sumwrk), buff, rsize);
-		size = sizeof(xar->wbuff) - xar->stream.avail_out;
-		checksum_update(&(xar->a_sumwrk), xar->wbuff, size);
 	}
 #if !defined(_WIN32) || defined(__CYGWIN__)
 	if (xar->bytes_remaining ==
@@ -733,15 +977,7 @@ xar_write_data(struct archive_write *a, const void *buff, size_t s)
 	}
 #endif
 
-	if (xar->cur_file->data.compression == NONE) {
-		if (write_to_temp(a, buff, size) != ARCHIVE_OK)
-			return (ARCHIVE_FATAL);
-	} else {
-		if (write_to_temp(a, xar->wbuff, size) != ARCHIVE_OK)
-			return (ARCHIVE_FATAL);
-	}
 	xar->bytes_remaining -= rsize;
-	xar->cur_file->data.length += size;
 
 	return (rsize);
 }
@@ -762,16 +998,25 @@ xar_finish_entry(struct archive_write *a)
 		s = (size_t)xar->bytes_remaining;
 		if (s > a->null_length)
 			s = a->null_length;
+		/* xar_write_data() counts down bytes_remaining. */
 		w = xar_write_data(a, a->nulls, s);
-		if (w > 0)
-			xar->bytes_remaining -= w;
-		else
+		if (w <= 0)
 			return (w);
 	}
 	file = xar->cur_file;
+	xar->cur_file = NULL;
+	if (xar->cur_job != NULL) {
+		xar->cur_job->task.run = compress_job;
+		__archive_thread_pool_submit(xar->pool, &(xar->cur_job->task));
+		*xar->pending.last = xar->cur_job;
+		xar->pending.last = &(xar->cur_job->next);
+		xar->pending_count++;
+		xar->cur_job = NULL;
+		/* Bound the memory held by buffered files. */
+		return (write_pending_jobs(a, 0));
+	}
 	checksum_final(&(xar->e_sumwrk), &(file->data.e_sum));
 	checksum_final(&(xar->a_sumwrk), &(file->data.a_sum));
-	xar->cur_file = NULL;
 
 	return (ARCHIVE_OK);
 }
@@ -1768,7 +2013,7 @@ copy_out(struct archive_write *a, uint64_t offset, uint64_t length)
 	int r;
 
 	xar = (struct xar *)a->format_data;
-	if (lseek(xar->temp_fd, offset, SEEK_SET) < 0) {
+	if (__archive_tempfile_seek(&(xar->temp), offset, SEEK_SET) < 0) {
 		archive_set_error(&(a->archive), errno, "lseek failed");
 		return (ARCHIVE_FATAL);
 	}
@@ -1782,7 +2027,7 @@ copy_out(struct archive_write *a, uint64_t offset, uint64_t length)
 		else
 			rsize = (size_t)length;
 		wb = xar->wbuff + (sizeof(xar->wbuff) - xar->wbuff_remaining);
-		rs = read(xar->temp_fd, wb, rsize);
+		rs = __archive_tempfile_read(&(xar->temp), wb, rsize);
 		if (rs < 0) {
 			archive_set_error(&(a->archive), errno,
 			    "Can't read temporary file(%jd)",
@@ -1819,6 +2064,11 @@ xar_close(struct archive_write *a)
 	if (xar->root->children.first == NULL)
 		return (ARCHIVE_OK);
 
+	/* Wait for the files compressed by worker threads. */
+	r = write_pending_jobs(a, 1);
+	if (r != ARCHIVE_OK)
+		return (r);
+
 	/* Save the length of all file extended attributes and contents. */
 	length = xar->temp_offset;
 
@@ -1875,12 +2125,21 @@ static int
 xar_free(struct archive_write *a)
 {
 	struct xar *xar;
+	struct xar_job *job;
 
 	xar = (struct xar *)a->format_data;
 
+	/* Stop the workers before freeing their jobs. */
+	__archive_thread_pool_free(xar->pool);
+	while ((job = xar->pending.first) != NULL) {
+		xar->pending.first = job->next;
+		job_free(job);
+	}
+	if (xar->cur_job != NULL)
+		job_free(xar->cur_job);
+
 	/* Close the temporary file. */
-	if (xar->temp_fd >= 0)
-		close(xar->temp_fd);
+	__archive_tempfile_close(&(xar->temp));
 
 	archive_string_free(&(xar->cur_dirstr));
 	archive_string_free(&(xar->tstr));
@@ -1961,6 +2220,7 @@ file_free(struct file *file)
 	archive_string_free(&(file->basename));
 	archive_string_free(&(file->symlink));
 	archive_string_free(&(file->script));
+	archive_entry_free(file->entry);
 	free(file);
 }
 
@@ -2528,13 +2788,13 @@ file_init_hardlinks(struct xar *xar)
 static void
 file_free_hardlinks(struct xar *xar)
 {
-	struct archive_rb_node *n, *next;
+	struct archive_rb_node *n;
 
-	for (n = ARCHIVE_RB_TREE_MIN(&(xar->hardlink_rbtree)); n;) {
-		next = __archive_rb_tree_iterate(&(xar->hardlink_rbtree),
-		    n, ARCHIVE_RB_DIR_RIGHT);
+	/* Unlink each node before freeing it; iterating would walk
+	 * back up through nodes already freed. */
+	while ((n = ARCHIVE_RB_TREE_MIN(&(xar->hardlink_rbtree))) != NULL) {
+		__archive_rb_tree_remove_node(&(xar->hardlink_rbtree), n);
 		free(n);
-		n = next;
 	}
 }
 
@@ -2590,13 +2850,40 @@ checksum_final(struct chksumwork *sumwrk, struct chksumval *sumval)
 	sumval->alg = sumwrk->alg;
 }
 
+/*
+ * Report a compression error to `a', or, if that is NULL, record it
+ * in the stream for the caller to pick up.
+ */
+static void
+compression_error(struct archive *a, struct la_zstream *lastrm,
+    int error, const char *fmt, ...)
+{
+	struct archive_string str;
+	va_list ap;
+
+	if (a == NULL) {
+		lastrm->error = error;
+		archive_string_empty(lastrm->error_string);
+		va_start(ap, fmt);
+		archive_string_vsprintf(lastrm->error_string, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	archive_string_init(&str);
+	va_start(ap, fmt);
+	archive_string_vsprintf(&str, fmt, ap);
+	va_end(ap);
+	archive_set_error(a, error, "%s", str.s);
+	archive_string_free(&str);
+}
+
 #if !defined(HAVE_BZLIB_H) || !defined(BZ_CONFIG_ERROR) || !defined(HAVE_LZMA_H)
 static int
 compression_unsupported_encoder(struct archive *a,
     struct la_zstream *lastrm, const char *name)
 {
 
-	archive_set_error(a, ARCHIVE_ERRNO_MISC,
+	compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 	    "%s compression not supported on this platform", name);
 	lastrm->valid = 0;
 	lastrm->real_stream = NULL;
@@ -2614,7 +2901,7 @@ compression_init_encoder_gzip(struct archive *a,
 		compression_end(a, lastrm);
 	strm = calloc(1, sizeof(*strm));
 	if (strm == NULL) {
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Can't allocate memory for gzip stream");
 		return (ARCHIVE_FATAL);
 	}
@@ -2632,7 +2919,7 @@ compression_init_encoder_gzip(struct archive *a,
 	    8, Z_DEFAULT_STRATEGY) != Z_OK) {
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Internal error initializing compression library");
 		return (ARCHIVE_FATAL);
 	}
@@ -2674,7 +2961,7 @@ compression_code_gzip(struct archive *a,
 	case Z_STREAM_END:
 		return (ARCHIVE_EOF);
 	default:
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "GZip compression failed:"
 		    " deflate() call returned status %d", r);
 		return (ARCHIVE_FATAL);
@@ -2693,7 +2980,7 @@ compression_end_gzip(struct archive *a, struct la_zstream *lastrm)
 	lastrm->real_stream = NULL;
 	lastrm->valid = 0;
 	if (r != Z_OK) {
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Failed to clean up compressor");
 		return (ARCHIVE_FATAL);
 	}
@@ -2711,7 +2998,7 @@ compression_init_encoder_bzip2(struct archive *a,
 		compression_end(a, lastrm);
 	strm = calloc(1, sizeof(*strm));
 	if (strm == NULL) {
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Can't allocate memory for bzip2 stream");
 		return (ARCHIVE_FATAL);
 	}
@@ -2729,7 +3016,7 @@ compression_init_encoder_bzip2(struct archive *a,
 	if (BZ2_bzCompressInit(strm, level, 0, 30) != BZ_OK) {
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Internal error initializing compression library");
 		return (ARCHIVE_FATAL);
 	}
@@ -2780,7 +3067,7 @@ compression_code_bzip2(struct archive *a,
 		return (ARCHIVE_EOF);
 	default:
 		/* Any other return value indicates an error */
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Bzip2 compression failed:"
 		    " BZ2_bzCompress() call returned status %d", r);
 		return (ARCHIVE_FATAL);
@@ -2799,7 +3086,7 @@ compression_end_bzip2(struct archive *a, struct la_zstream *lastrm)
 	lastrm->real_stream = NULL;
 	lastrm->valid = 0;
 	if (r != BZ_OK) {
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Failed to clean up compressor");
 		return (ARCHIVE_FATAL);
 	}
@@ -2833,13 +3120,13 @@ compression_init_encoder_lzma(struct archive *a,
 		compression_end(a, lastrm);
 	if (lzma_lzma_preset(&lzma_opt, level)) {
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Internal error initializing compression library");
 		return (ARCHIVE_FATAL);
 	}
 	strm = calloc(1, sizeof(*strm));
 	if (strm == NULL) {
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Can't allocate memory for lzma stream");
 		return (ARCHIVE_FATAL);
 	}
@@ -2856,7 +3143,7 @@ compression_init_encoder_lzma(struct archive *a,
 	case LZMA_MEM_ERROR:
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Internal error initializing compression library: "
 		    "Cannot allocate memory");
 		r =  ARCHIVE_FATAL;
@@ -2864,7 +3151,7 @@ compression_init_encoder_lzma(struct archive *a,
         default:
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Internal error initializing compression library: "
 		    "It's a bug in liblzma");
 		r =  ARCHIVE_FATAL;
@@ -2892,7 +3179,7 @@ compression_init_encoder_xz(struct archive *a,
 		compression_end(a, lastrm);
 	strm = calloc(1, sizeof(*strm) + sizeof(*lzmafilters) * 2);
 	if (strm == NULL) {
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Can't allocate memory for xz stream");
 		return (ARCHIVE_FATAL);
 	}
@@ -2902,7 +3189,7 @@ compression_init_encoder_xz(struct archive *a,
 	if (lzma_lzma_preset(&lzma_opt, level)) {
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Internal error initializing compression library");
 		return (ARCHIVE_FATAL);
 	}
@@ -2933,7 +3220,7 @@ compression_init_encoder_xz(struct archive *a,
 	case LZMA_MEM_ERROR:
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "Internal error initializing compression library: "
 		    "Cannot allocate memory");
 		r =  ARCHIVE_FATAL;
@@ -2941,7 +3228,7 @@ compression_init_encoder_xz(struct archive *a,
         default:
 		free(strm);
 		lastrm->real_stream = NULL;
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "Internal error initializing compression library: "
 		    "It's a bug in liblzma");
 		r =  ARCHIVE_FATAL;
@@ -2980,7 +3267,7 @@ compression_code_lzma(struct archive *a,
 		/* This return can only occur in finishing case. */
 		return (ARCHIVE_EOF);
 	case LZMA_MEMLIMIT_ERROR:
-		archive_set_error(a, ENOMEM,
+		compression_error(a, lastrm, ENOMEM,
 		    "lzma compression error:"
 		    " %ju MiB would have been needed",
 		    (uintmax_t)((lzma_memusage(strm) + 1024 * 1024 -1)
@@ -2988,7 +3275,7 @@ compression_code_lzma(struct archive *a,
 		return (ARCHIVE_FATAL);
 	default:
 		/* Any other return value indicates an error */
-		archive_set_error(a, ARCHIVE_ERRNO_MISC,
+		compression_error(a, lastrm, ARCHIVE_ERRNO_MISC,
 		    "lzma compression failed:"
 		    " lzma_code() call returned status %d", r);
 		return (ARCHIVE_FATAL);
@@ -3033,37 +3320,41 @@ compression_init_encoder_xz(struct archive *a,
 #endif
 
 static int
-xar_compression_init_encoder(struct archive_write *a)
+compression_init_encoder(struct archive *a, struct la_zstream *lastrm,
+    enum enctype codec, int level, int threads)
 {
-	struct xar *xar;
 	int r;
 
-	xar = (struct xar *)a->format_data;
-	switch (xar->opt_compression) {
+	switch (codec) {
 	case GZIP:
-		r = compression_init_encoder_gzip(
-		    &(a->archive), &(xar->stream),
-		    xar->opt_compression_level, 1);
+		r = compression_init_encoder_gzip(a, lastrm, level, 1);
 		break;
 	case BZIP2:
-		r = compression_init_encoder_bzip2(
-		    &(a->archive), &(xar->stream),
-		    xar->opt_compression_level);
+		r = compression_init_encoder_bzip2(a, lastrm, level);
 		break;
 	case LZMA:
-		r = compression_init_encoder_lzma(
-		    &(a->archive), &(xar->stream),
-		    xar->opt_compression_level);
+		r = compression_init_encoder_lzma(a, lastrm, level);
 		break;
 	case XZ:
-		r = compression_init_encoder_xz(
-		    &(a->archive), &(xar->stream),
-		    xar->opt_compression_level, xar->opt_threads);
+		r = compression_init_encoder_xz(a, lastrm, level, threads);
 		break;
 	default:
 		r = ARCHIVE_OK;
 		break;
 	}
+	return (r);
+}
+
+static int
+xar_compression_init_encoder(struct archive_write *a)
+{
+	struct xar *xar;
+	int r;
+
+	xar = (struct xar *)a->format_data;
+	r = compression_init_encoder(&(a->archive), &(xar->stream),
+	    xar->opt_compression, xar->opt_compression_level,
+	    xar->opt_threads);
 	if (r == ARCHIVE_OK) {
 		xar->stream.total_in = 0;
 		xar->stream.next_out = xar->wbuff;
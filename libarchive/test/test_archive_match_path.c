@@ -26,6 +26,9 @@
 #include "test.h"
 __FBSDID("$FreeBSD$");
 
+#define __LIBARCHIVE_TEST
+#include "archive_pathmatch.h"
+
 static void
 test_exclusion_mbs(void)
 {
@@ -429,6 +432,120 @@ test_exclusion_and_inclusion(void)
 	archive_match_free(m);
 }
 
+/*
+ * Exclusion patterns are sorted out by what they look like before
+ * a pathname is tested against them; verify that this gives the same
+ * answer as testing each pattern with archive_pathmatch().
+ */
+static void
+random_string(char *buff, int maxlen, const char *chars, unsigned *seed)
+{
+	int i, len;
+
+	*seed = *seed * 1103515245 + 12345;
+	len = (*seed >> 16) % maxlen;
+	for (i = 0; i < len; i++) {
+		*seed = *seed * 1103515245 + 12345;
+		buff[i] = chars[(*seed >> 16) % strlen(chars)];
+	}
+	buff[len] = '\0';
+}
+
+static void
+test_exclusion_many(void)
+{
+	const int flag = PATHMATCH_NO_ANCHOR_START | PATHMATCH_NO_ANCHOR_END;
+	static const char *patterns[] = {
+		"foo", "*.o", "*~", "**.bak", "CVS", "a?c", "[ab]x", "b*c",
+		"^anchored", "dir/sub", "./dot", ".", "*.", "..", "end$",
+		"\\q", "*", NULL
+	};
+	static const struct {
+		const char *pathname;
+		int excluded;
+	} paths[] = {
+		{ "foo", 1 }, { "a/foo/b", 1 }, { "afoo", 0 }, { "foob", 0 },
+		{ "x.o", 1 }, { "x/y.o", 1 }, { "x.o/y", 1 }, { "x/CVS", 1 },
+		{ "x/abc", 1 }, { "aa/bx/c", 1 }, { "anchored/x", 1 },
+		{ "x/anchored", 0 }, { "x/dir/sub/y", 1 }, { "a.bak", 1 },
+		{ "x/end", 1 }, { "x/end/y", 0 }, { "zz", 0 }, { "z/./z", 0 },
+		{ NULL, 0 }
+	};
+	struct archive_entry *ae;
+	struct archive *m;
+	char pattern[4][8], pathname[16];
+	unsigned seed = 7;
+	int i, j, k, n, excluded;
+
+	if (!assert((ae = archive_entry_new()) != NULL))
+		return;
+
+	/* Up to all but the last pattern, which matches everything. */
+	if (!assert((m = archive_match_new()) != NULL)) {
+		archive_entry_free(ae);
+		return;
+	}
+	for (i = 0; patterns[i + 1] != NULL; i++) {
+		assertEqualIntA(m, 0,
+		    archive_match_exclude_pattern(m, patterns[i]));
+		for (j = 0; paths[j].pathname != NULL; j++) {
+			excluded = 0;
+			for (k = 0; k <= i; k++)
+				excluded |= archive_pathmatch(patterns[k],
+				    paths[j].pathname, flag);
+			archive_entry_copy_pathname(ae, paths[j].pathname);
+			assertEqualInt(excluded,
+			    archive_match_path_excluded(m, ae));
+		}
+	}
+	for (j = 0; paths[j].pathname != NULL; j++) {
+		archive_entry_copy_pathname(ae, paths[j].pathname);
+		assertEqualInt(paths[j].excluded,
+		    archive_match_path_excluded(m, ae));
+	}
+	assertEqualIntA(m, 0, archive_match_exclude_pattern(m, patterns[i]));
+	for (j = 0; paths[j].pathname != NULL; j++) {
+		archive_entry_copy_pathname(ae, paths[j].pathname);
+		assertEqualInt(1, archive_match_path_excluded(m, ae));
+	}
+	archive_match_free(m);
+
+	/* Random patterns against random pathnames. */
+	for (i = 0; i < 2000; i++) {
+		if (!assert((m = archive_match_new()) != NULL))
+			break;
+		n = 1 + i % 4;
+		for (k = 0; k < n; k++) {
+			do {
+				random_string(pattern[k], 7, "ab.//**?$^[]\\",
+				    &seed);
+			} while (pattern[k][0] == '\0');
+			assertEqualIntA(m, 0,
+			    archive_match_exclude_pattern(m, pattern[k]));
+			/* Like the exclusion, ignore a trailing '/'. */
+			j = (int)strlen(pattern[k]);
+			if (pattern[k][j - 1] == '/')
+				pattern[k][j - 1] = '\0';
+		}
+		for (j = 0; j < 20; j++) {
+			random_string(pathname, 12, "aab..///", &seed);
+			excluded = 0;
+			for (k = 0; k < n; k++)
+				excluded |= archive_pathmatch(pattern[k],
+				    pathname, flag);
+			failure("pathname \"%s\", patterns \"%s\" \"%s\" "
+			    "\"%s\" \"%s\"", pathname, pattern[0],
+			    n > 1 ? pattern[1] : "", n > 2 ? pattern[2] : "",
+			    n > 3 ? pattern[3] : "");
+			archive_entry_copy_pathname(ae, pathname);
+			assertEqualInt(excluded,
+			    archive_match_path_excluded(m, ae));
+		}
+		archive_match_free(m);
+	}
+	archive_entry_free(ae);
+}
+
 DEFINE_TEST(test_archive_match_path)
 {
 	/* Make exclusion sample files which contain exclusion patterns. */
@@ -447,4 +564,5 @@ DEFINE_TEST(test_archive_match_path)
 	test_inclusion_from_file_mbs();
 	test_inclusion_from_file_wcs();
 	test_exclusion_and_inclusion();
+	test_exclusion_many();
 }
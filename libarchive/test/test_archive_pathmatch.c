@@ -81,6 +81,17 @@ DEFINE_TEST(test_archive_pathmatch)
 	assertEqualInt(1, archive_pathmatch("*a*", "defaaaaaaa", 0));
 	assertEqualInt(0, archive_pathmatch("a*", "defghi", 0));
 	assertEqualInt(0, archive_pathmatch("*a*", "defghi", 0));
+	/* Many '*' should not make a failing match take forever. */
+	assertEqualInt(0, archive_pathmatch("*a*a*a*a*a*a*a*a*a*a*b",
+	    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0));
+	assertEqualInt(1, archive_pathmatch("*a*a*a*a*a*a*a*a*a*a*b",
+	    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab", 0));
+	assertEqualInt(0, archive_pathmatch(
+	    "*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b",
+	    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0));
+	assertEqualInt(1, archive_pathmatch(
+	    "*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b",
+	    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab", 0));
 
 	/* Character classes */
 	assertEqualInt(1, archive_pathmatch("abc[def", "abc[def", 0));
@@ -118,6 +129,11 @@ DEFINE_TEST(test_archive_pathmatch)
 	assertEqualInt(1, archive_pathmatch("abc[!]efg", "abcdefg", 0));
 	assertEqualInt(1, archive_pathmatch("abc[!]efg", "abcqefg", 0));
 	assertEqualInt(0, archive_pathmatch("abc[!]efg", "abcefg", 0));
+	/* Not even the end of the string. */
+	assertEqualInt(0, archive_pathmatch("abc[!]", "abc", 0));
+	assertEqualInt(0, archive_pathmatch("abc[!d]", "abc", 0));
+	assertEqualInt(0, archive_pathmatch("abc[!d]*", "abc",
+	    PATHMATCH_NO_ANCHOR_END));
 
 	/* I assume: Trailing '-' is non-special. */
 	assertEqualInt(0, archive_pathmatch("abc[d-fh-]", "abcl", 0));
@@ -0,0 +1,179 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * The reader resets and refills the same entry for every header,
+ * keeping the buffers it already has.  Check that nothing from one
+ * header shows through in the next.
+ */
+
+static void
+check_entries(struct archive *a, struct archive_entry *ae,
+    int (*next)(struct archive *, struct archive_entry **,
+    struct archive_entry *))
+{
+	const char *name;
+	const void *value;
+	size_t size;
+	char buff[8];
+
+	/* "dir/symlink" has most of the optional fields. */
+	assertEqualIntA(a, ARCHIVE_OK, next(a, &ae, ae));
+	assertEqualString("dir/symlink", archive_entry_pathname(ae));
+	assertEqualWString(L"dir/symlink", archive_entry_pathname_w(ae));
+	assertEqualInt(AE_IFLNK, archive_entry_filetype(ae));
+	assertEqualString("target/of/the/symlink", archive_entry_symlink(ae));
+	assertEqualString("alice", archive_entry_uname(ae));
+	assertEqualString("staff", archive_entry_gname(ae));
+	assertEqualString("nodump", archive_entry_fflags_text(ae));
+	assert(archive_entry_birthtime_is_set(ae));
+	assertEqualInt(1, archive_entry_xattr_reset(ae));
+	assertEqualInt(ARCHIVE_OK,
+	    archive_entry_xattr_next(ae, &name, &value, &size));
+	assertEqualString("user.attr", name);
+	assertEqualInt(5, size);
+	assertEqualMem("value", value, 5);
+
+	/* "file" has none of them. */
+	assertEqualIntA(a, ARCHIVE_OK, next(a, &ae, ae));
+	assertEqualString("file", archive_entry_pathname(ae));
+	assertEqualWString(L"file", archive_entry_pathname_w(ae));
+	assertEqualUTF8String("file", archive_entry_pathname_utf8(ae));
+	assertEqualInt(AE_IFREG, archive_entry_filetype(ae));
+	assertEqualString(NULL, archive_entry_symlink(ae));
+	assertEqualString(NULL, archive_entry_hardlink(ae));
+	assertEqualString("", archive_entry_uname(ae));
+	assertEqualString("", archive_entry_gname(ae));
+	assertEqualString(NULL, archive_entry_fflags_text(ae));
+	assert(!archive_entry_birthtime_is_set(ae));
+	assertEqualInt(0, archive_entry_xattr_reset(ae));
+	assertEqualInt(3, archive_entry_size(ae));
+	assertEqualIntA(a, 3, archive_read_data(a, buff, sizeof(buff)));
+	assertEqualMem("abc", buff, 3);
+
+	/* "hardlink" points back to "file". */
+	assertEqualIntA(a, ARCHIVE_OK, next(a, &ae, ae));
+	assertEqualString("hardlink", archive_entry_pathname(ae));
+	assertEqualWString(L"hardlink", archive_entry_pathname_w(ae));
+	assertEqualString("file", archive_entry_hardlink(ae));
+	assertEqualString(NULL, archive_entry_symlink(ae));
+	assertEqualInt(0, archive_entry_size(ae));
+
+	assertEqualIntA(a, ARCHIVE_EOF, next(a, &ae, ae));
+}
+
+static int
+next_header(struct archive *a, struct archive_entry **aep,
+    struct archive_entry *ae)
+{
+	(void)ae; /* UNUSED */
+	return (archive_read_next_header(a, aep));
+}
+
+static int
+next_header2(struct archive *a, struct archive_entry **aep,
+    struct archive_entry *ae)
+{
+	*aep = ae;
+	return (archive_read_next_header2(a, ae));
+}
+
+DEFINE_TEST(test_archive_read_next_header_reuse)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char buff[4096];
+	size_t used;
+
+	/* Write the archive. */
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_pax(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_open_memory(a, buff, sizeof(buff), &used));
+
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_copy_pathname(ae, "dir/symlink");
+	archive_entry_set_mode(ae, AE_IFLNK | 0755);
+	archive_entry_copy_symlink(ae, "target/of/the/symlink");
+	archive_entry_copy_uname(ae, "alice");
+	archive_entry_copy_gname(ae, "staff");
+	archive_entry_copy_fflags_text(ae, "nodump");
+	archive_entry_set_birthtime(ae, 3, 0);
+	archive_entry_set_mtime(ae, 5, 0);
+	archive_entry_xattr_add_entry(ae, "user.attr", "value", 5);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_copy_pathname(ae, "file");
+	archive_entry_set_mode(ae, AE_IFREG | 0644);
+	archive_entry_set_size(ae, 3);
+	archive_entry_set_mtime(ae, 5, 0);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	assertEqualIntA(a, 3, archive_write_data(a, "abc", 3));
+
+	archive_entry_copy_pathname(ae, "hardlink");
+	archive_entry_copy_hardlink(ae, "file");
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+
+	/* Read it back through the reader's own entry. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_open_memory(a, buff, used));
+	check_entries(a, NULL, next_header);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+
+	/* And through a caller's entry that starts out filled in. */
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_copy_pathname(ae, "stale");
+	archive_entry_copy_symlink(ae, "stale");
+	archive_entry_sparse_add_entry(ae, 0, 1);
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_open_memory(a, buff, used));
+	check_entries(a, ae, next_header2);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+	archive_entry_free(ae);
+
+	/*
+	 * And through an entry made for an archive that has since been
+	 * freed; converting its names must not use that archive.
+	 */
+	assert((a = archive_read_new()) != NULL);
+	assert((ae = archive_entry_new2(a)) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_open_memory(a, buff, used));
+	check_entries(a, ae, next_header2);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+	archive_entry_free(ae);
+}
@@ -777,6 +777,188 @@ test_archive_string_canonicalization(void)
 
 }
 
+/*
+ * Runs of ASCII are copied in bulk; check runs of every length up to
+ * a few vector widths, next to multibyte characters, a combining mark
+ * and a control character.
+ */
+static void
+test_archive_string_ascii_runs(void)
+{
+	struct archive *a, *a2;
+	struct archive_string_conv *f_sconv8, *t_sconv8;
+	struct archive_string_conv *t_sconv16be, *t_sconv16le;
+	struct archive_string as;
+	struct archive_wstring ws;
+	char src[128], nfc[128], u16be[256], u16le[256];
+	wchar_t wsrc[128];
+	size_t i, len, nlen, ulen, wlen, run;
+
+	if (NULL == setlocale(LC_ALL, "en_US.UTF-8")) {
+		skipping("en_US.UTF-8 locale not available on this system.");
+		return;
+	}
+
+	assert((a = archive_read_new()) != NULL);
+	assertA(NULL != (f_sconv8 =
+	    archive_string_conversion_from_charset(a, "UTF-8", 0)));
+	assert((a2 = archive_write_new()) != NULL);
+	assertA(NULL != (t_sconv8 =
+	    archive_string_conversion_to_charset(a2, "UTF-8", 0)));
+	assertA(NULL != (t_sconv16be =
+	    archive_string_conversion_to_charset(a2, "UTF-16BE", 0)));
+	assertA(NULL != (t_sconv16le =
+	    archive_string_conversion_to_charset(a2, "UTF-16LE", 0)));
+	if (f_sconv8 == NULL || t_sconv8 == NULL || t_sconv16be == NULL ||
+	    t_sconv16le == NULL) {
+		assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+		assertEqualInt(ARCHIVE_OK, archive_write_free(a2));
+		return;
+	}
+	archive_string_init(&as);
+	memset(&ws, 0, sizeof(ws));
+
+	for (run = 0; run <= 40; run++) {
+		/*
+		 * Build "<run>e<U+0301><run>\xC3\xA9\t~" along with its
+		 * NFC, UTF-16 and wide character forms.
+		 */
+		len = nlen = ulen = wlen = 0;
+#define PUT(c, nc, uc)	do {					\
+	if (c >= 0) src[len++] = (char)c;			\
+	if (nc >= 0) nfc[nlen++] = (char)nc;			\
+	if (uc >= 0) {						\
+		u16be[ulen] = (char)(uc >> 8);			\
+		u16be[ulen + 1] = (char)(uc & 0xff);		\
+		u16le[ulen] = (char)(uc & 0xff);		\
+		u16le[ulen + 1] = (char)(uc >> 8);		\
+		ulen += 2;					\
+		wsrc[wlen++] = (wchar_t)uc;			\
+	}							\
+} while (0)
+		for (i = 0; i < run; i++) {
+			int c = 0x20 + (int)((i * 7) % 95);
+			PUT(c, c, c);
+		}
+		PUT('e', -1, 'e');
+		PUT(0xCC, -1, 0x301);
+		PUT(0x81, 0xC3, -1);
+		nfc[nlen++] = (char)0xA9;
+		for (i = 0; i < run; i++) {
+			int c = 0x7e - (int)((i * 5) % 95);
+			PUT(c, c, c);
+		}
+		PUT(0xC3, 0xC3, 0xE9);
+		PUT(0xA9, 0xA9, -1);
+		PUT('\t', '\t', '\t');
+		PUT('~', '~', '~');
+#undef PUT
+		wsrc[wlen] = L'\0';
+
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_strncpy_l(&as, src, len, t_sconv8));
+		assertEqualInt(len, archive_strlen(&as));
+		assertEqualMem(as.s, src, len);
+
+		/* Only the requested length must be copied. */
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_strncpy_l(&as, src, run, t_sconv8));
+		assertEqualInt(run, archive_strlen(&as));
+		assertEqualMem(as.s, src, run);
+
+#if !defined(__APPLE__)
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_strncpy_l(&as, src, len, f_sconv8));
+		assertEqualInt(nlen, archive_strlen(&as));
+		assertEqualMem(as.s, nfc, nlen);
+#endif
+
+		failure("run = %d", (int)run);
+		assertEqualInt(0,
+		    archive_strncpy_l(&as, src, len, t_sconv16be));
+		assertEqualInt(ulen, archive_strlen(&as));
+		assertEqualMem(as.s, u16be, ulen);
+		failure("run = %d", (int)run);
+		assertEqualInt(0,
+		    archive_strncpy_l(&as, src, len, t_sconv16le));
+		assertEqualInt(ulen, archive_strlen(&as));
+		assertEqualMem(as.s, u16le, ulen);
+
+#if defined(__STDC_ISO_10646__)
+		archive_wstring_empty(&ws);
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_wstring_append_from_mbs(&ws, src, len));
+		assertEqualWString(wsrc, ws.s);
+		archive_wstring_empty(&ws);
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_wstring_append_from_mbs(&ws, src, run));
+		assertEqualInt(run, ws.length);
+
+		archive_string_empty(&as);
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_string_append_from_wcs(&as, wsrc, wlen));
+		assertEqualInt(len, archive_strlen(&as));
+		assertEqualMem(as.s, src, len);
+		archive_string_empty(&as);
+		failure("run = %d", (int)run);
+		assertEqualInt(0, archive_string_append_from_wcs(&as, wsrc, run));
+		assertEqualInt(run, archive_strlen(&as));
+#endif
+	}
+
+	archive_string_free(&as);
+	archive_wstring_free(&ws);
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a2));
+}
+
+/*
+ * Conversion objects are handed to the next archive object once the
+ * archive object using them is freed; make sure one whose behavior
+ * was changed is not handed out again.
+ */
+static void
+test_archive_string_conversion_reuse(void)
+{
+	struct archive *a;
+	struct archive_string_conv *sconv;
+	struct archive_string as;
+	int i;
+
+	if (NULL == setlocale(LC_ALL, "en_US.UTF-8")) {
+		skipping("en_US.UTF-8 locale not available on this system.");
+		return;
+	}
+#if defined(__APPLE__)
+	skipping("Form D is the default on Mac OS X.");
+	return;
+#endif
+
+	archive_string_init(&as);
+	for (i = 0; i < 4; i++) {
+		assert((a = archive_read_new()) != NULL);
+		assertA(NULL != (sconv =
+		    archive_string_conversion_from_charset(a, "UTF-8", 0)));
+		if (sconv == NULL) {
+			assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+			break;
+		}
+		failure("i = %d", i);
+		assertEqualInt(0, archive_strcpy_l(&as, "e\xCC\x81", sconv));
+		assertEqualUTF8String("\xC3\xA9", as.s);
+		if (i & 1) {
+			archive_string_conversion_set_opt(sconv,
+			    SCONV_SET_OPT_NORMALIZATION_D);
+			failure("i = %d", i);
+			assertEqualInt(0,
+			    archive_strcpy_l(&as, "\xC3\xA9", sconv));
+			assertEqualUTF8String("e\xCC\x81", as.s);
+		}
+		assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	}
+	archive_string_free(&as);
+}
+
 DEFINE_TEST(test_archive_string_conversion)
 {
 	static const char reffile[] = "test_archive_string_conversion.txt.Z";
@@ -807,4 +989,6 @@ DEFINE_TEST(test_archive_string_conversion)
 	test_archive_string_normalization_nfc(testdata);
 	test_archive_string_normalization_mac_nfd(testdata);
 	test_archive_string_canonicalization();
+	test_archive_string_ascii_runs();
+	test_archive_string_conversion_reuse();
 }
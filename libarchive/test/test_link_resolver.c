@@ -197,9 +197,110 @@ static void test_linkify_new_cpio(void)
 	archive_entry_linkresolver_free(resolver);
 }
 
+/*
+ * Enough entries that the links cache has to grow, and then shrink
+ * again as the link sets are completed.
+ */
+static void test_linkify_many(void)
+{
+	struct archive_entry *entry, *e2;
+	struct archive_entry_linkresolver *resolver;
+	char name[64];
+	unsigned int links;
+	int i, n, pass;
+	const int count = 20000;
+
+	/* Initialize the resolver. */
+	assert(NULL != (resolver = archive_entry_linkresolver_new()));
+	archive_entry_linkresolver_set_strategy(resolver,
+	    ARCHIVE_FORMAT_TAR_USTAR);
+
+	/* Every tenth file has a link that is never seen. */
+	for (pass = 0; pass < 3; pass++) {
+		for (i = 0; i < count; i++) {
+			assert(NULL != (entry = archive_entry_new()));
+			sprintf(name, "file%d_%d", i, pass);
+			archive_entry_copy_pathname(entry, name);
+			archive_entry_set_ino(entry, i / 3);
+			archive_entry_set_dev(entry, i % 3);
+			archive_entry_set_nlink(entry, i % 10 ? 3 : 4);
+			archive_entry_set_size(entry, 10);
+			archive_entry_linkify(resolver, &entry, &e2);
+			assert(e2 == NULL);
+			if (pass == 0)
+				assertEqualString(NULL,
+				    archive_entry_hardlink(entry));
+			else {
+				sprintf(name, "file%d_0", i);
+				failure("pass %d", pass);
+				assertEqualString(name,
+				    archive_entry_hardlink(entry));
+			}
+			archive_entry_free(entry);
+		}
+	}
+	n = 0;
+	while ((entry = archive_entry_partial_links(resolver, &links))
+	    != NULL) {
+		assertEqualInt(0, (archive_entry_ino64(entry) * 3 +
+		    archive_entry_dev(entry)) % 10);
+		assertEqualInt(1, links);
+		archive_entry_free(entry);
+		n++;
+	}
+	assertEqualInt(count / 10, n);
+	archive_entry_linkresolver_free(resolver);
+
+	/* Initialize the resolver. */
+	assert(NULL != (resolver = archive_entry_linkresolver_new()));
+	archive_entry_linkresolver_set_strategy(resolver,
+	    ARCHIVE_FORMAT_CPIO_SVR4_NOCRC);
+
+	/* Only the second link of every other file is seen. */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = pass; i < count; i += pass + 1) {
+			assert(NULL != (entry = archive_entry_new()));
+			sprintf(name, "file%d_%d", i, pass);
+			archive_entry_copy_pathname(entry, name);
+			archive_entry_set_ino(entry, i);
+			archive_entry_set_dev(entry, 2);
+			archive_entry_set_nlink(entry, 2);
+			archive_entry_set_size(entry, 10);
+			archive_entry_linkify(resolver, &entry, &e2);
+			if (pass == 0) {
+				assert(entry == NULL);
+				assert(e2 == NULL);
+				continue;
+			}
+			sprintf(name, "file%d_0", i);
+			assertEqualString(name, archive_entry_pathname(entry));
+			assertEqualInt(0, archive_entry_size(entry));
+			sprintf(name, "file%d_1", i);
+			assertEqualString(name, archive_entry_pathname(e2));
+			assertEqualInt(10, archive_entry_size(e2));
+			archive_entry_free(entry);
+			archive_entry_free(e2);
+		}
+	}
+	n = 0;
+	for (;;) {
+		entry = NULL;
+		archive_entry_linkify(resolver, &entry, &e2);
+		if (entry == NULL)
+			break;
+		assertEqualInt(0, archive_entry_ino64(entry) % 2);
+		assertEqualString(NULL, archive_entry_hardlink(entry));
+		archive_entry_free(entry);
+		n++;
+	}
+	assertEqualInt(count / 2, n);
+	archive_entry_linkresolver_free(resolver);
+}
+
 DEFINE_TEST(test_link_resolver)
 {
 	test_linkify_tar();
 	test_linkify_old_cpio();
 	test_linkify_new_cpio();
+	test_linkify_many();
 }
@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * test_read_format_7zip_lzma1_lzma2.7z has two solid folders:
+ *  LZMA: dir1/file1, file2, file3, file4
+ *  LZMA2: dir1/zfile1, zfile2, zfile3, zfile4
+ * The n-th file holds n lines of twelve 'a's, 'b's, ...
+ */
+static const char *refname = "test_read_format_7zip_lzma1_lzma2.7z";
+
+static void
+verify_data(struct archive *a, int lines)
+{
+	char expected[64], buff[128];
+	int i;
+
+	for (i = 0; i < lines; i++) {
+		memset(expected + i * 13, 'a' + i, 12);
+		expected[i * 13 + 12] = '\n';
+	}
+	assertEqualInt(lines * 13, archive_read_data(a, buff, sizeof(buff)));
+	assertEqualMem(buff, expected, lines * 13);
+}
+
+static void
+seek_and_verify(struct archive *a, const char *name, int lines)
+{
+	struct archive_entry *ae;
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, name));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString(name, archive_entry_pathname(ae));
+	verify_data(a, lines);
+}
+
+static void
+test_seek(const char *options)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_7zip(a));
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_set_options(a, options));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, refname, 10240));
+
+	/* Before the first header. */
+	seek_and_verify(a, "file3", 3);
+	/* The following entry is returned next. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString("file4", archive_entry_pathname(ae));
+	verify_data(a, 4);
+
+	/* Back and forth in a solid folder. */
+	seek_and_verify(a, "file2", 2);
+	seek_and_verify(a, "file4", 4);
+	seek_and_verify(a, "dir1/file1", 1);
+
+	/* Across folders. */
+	seek_and_verify(a, "zfile3", 3);
+	seek_and_verify(a, "file2", 2);
+	seek_and_verify(a, "zfile2", 2);
+	seek_and_verify(a, "dir1/zfile1", 1);
+
+	/* Leave the data of an entry partly read. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "zfile4"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	{
+		char buff[5];
+		assertEqualInt(5, archive_read_data(a, buff, sizeof(buff)));
+		assertEqualMem(buff, "aaaaa", 5);
+	}
+	seek_and_verify(a, "zfile3", 3);
+
+	/* Not found. */
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "nonexistent"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "dir1"));
+
+	/* Directory entries. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "dir1/"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString("dir1/", archive_entry_pathname(ae));
+	assertEqualInt(AE_IFDIR, archive_entry_filetype(ae));
+
+	/* After the end of the archive. */
+	assertEqualIntA(a, ARCHIVE_EOF, archive_read_next_header(a, &ae));
+	seek_and_verify(a, "file4", 4);
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+}
+
+/*
+ * Skipping entries must not decode anything nobody reads.
+ */
+static void
+test_skip(const char *options)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_7zip(a));
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_set_options(a, options));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, refname, 10240));
+
+	/* Read file2 and zfile4 only. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString("file2", archive_entry_pathname(ae));
+	verify_data(a, 2);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString("zfile4", archive_entry_pathname(ae));
+	verify_data(a, 4);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString("dir1/", archive_entry_pathname(ae));
+	assertEqualIntA(a, ARCHIVE_EOF, archive_read_next_header(a, &ae));
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+}
+
+DEFINE_TEST(test_read_format_7zip_seek_entry)
+{
+	extract_reference_file(refname);
+
+	/* Rereading a folder decodes it once into memory. */
+	test_seek(NULL);
+	test_skip(NULL);
+	/* Too little memory for that; rereading restarts the folder. */
+	test_seek("7zip:threads-memlimit=64");
+	test_skip("7zip:threads-memlimit=64");
+	/* Folders decoded by worker threads. */
+	test_seek("7zip:threads=2");
+	test_skip("7zip:threads=2");
+}
@@ -0,0 +1,137 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Read every entry of a 7-Zip archive and return the names and
+ * contents concatenated, so that the output of the serial reader
+ * can be compared with the output of the multi-threaded one.
+ * If `skip' is set, the data of every other entry is skipped.
+ */
+static char *
+read_all(const char *refname, const char *options, int skip, size_t *len)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char *out = NULL;
+	size_t used = 0;
+	const void *buff;
+	size_t size;
+	int64_t offset;
+	int r, n = 0;
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_filter_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_7zip(a));
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_set_options(a, options));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, refname, 10240));
+	while ((r = archive_read_next_header(a, &ae)) == ARCHIVE_OK) {
+		const char *name = archive_entry_pathname(ae);
+
+		out = realloc(out, used + strlen(name) + 1);
+		assert(out != NULL);
+		memcpy(out + used, name, strlen(name) + 1);
+		used += strlen(name) + 1;
+		if (skip && (n++ & 1))
+			continue;
+		while ((r = archive_read_data_block(a, &buff, &size,
+		    &offset)) == ARCHIVE_OK) {
+			out = realloc(out, used + size);
+			assert(out != NULL);
+			memcpy(out + used, buff, size);
+			used += size;
+		}
+		assertEqualIntA(a, ARCHIVE_EOF, r);
+	}
+	assertEqualIntA(a, ARCHIVE_EOF, r);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	*len = used;
+	return (out);
+}
+
+static void
+test_threads(const char *refname)
+{
+	static const char *options[] = {
+		"7zip:threads=4",
+		"7zip:threads=2,7zip:threads-memlimit=64",
+		"7zip:threads=0",
+	};
+	char *expected, *actual;
+	size_t expected_len, actual_len;
+	unsigned i;
+	int skip;
+
+	extract_reference_file(refname);
+	for (skip = 0; skip <= 1; skip++) {
+		expected = read_all(refname, NULL, skip, &expected_len);
+		for (i = 0; i < sizeof(options)/sizeof(options[0]); i++) {
+			failure("%s with %s", refname, options[i]);
+			actual = read_all(refname, options[i], skip,
+			    &actual_len);
+			assertEqualInt(expected_len, actual_len);
+			assertEqualMem(expected, actual, expected_len);
+			free(actual);
+		}
+		free(expected);
+	}
+}
+
+DEFINE_TEST(test_read_format_7zip_threads)
+{
+	struct archive *a;
+
+	/* Check the option values. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_7zip(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_set_options(a, "7zip:threads=3"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_set_options(a, "7zip:!threads"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_set_options(a, "7zip:threads=x"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_set_options(a, "7zip:threads-memlimit=1048576"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_set_options(a, "7zip:threads-memlimit=0"));
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+
+	/* LZMA and LZMA2 folders. */
+	test_threads("test_read_format_7zip_lzma1_lzma2.7z");
+	test_threads("test_read_format_7zip_lzma2.7z");
+	test_threads("test_read_format_7zip_bzip2.7z");
+	test_threads("test_read_format_7zip_deflate.7z");
+	test_threads("test_read_format_7zip_delta_lzma2.7z");
+	test_threads("test_read_format_7zip_bcj_lzma2.7z");
+	/* Folders which are always decoded by the main thread. */
+	test_threads("test_read_format_7zip_bcj_lzma1.7z");
+	test_threads("test_read_format_7zip_bcj2_lzma2_1.7z");
+	test_threads("test_read_format_7zip_ppmd.7z");
+}
@@ -408,3 +408,119 @@ DEFINE_TEST(test_read_format_cab)
 	verify3("test_read_format_cab_3.cab", LZX);
 }
 
+
+/*
+ * test_read_format_cab_lzx.cab holds one 100000-byte file, lzx.bin, whose
+ * contents come from make_lzx_contents() below.  It was compressed with a
+ * 64KiB LZX window, alternating verbatim and aligned offset blocks that
+ * straddle the 32KiB CFDATA frames, and E8 call translation enabled.  The
+ * statistics of every third block were skewed so that the main and length
+ * trees use codes of up to 16 bits, which the cabinet made by makecab
+ * above never reaches.
+ */
+static unsigned
+lzx_rand(uint32_t *x)
+{
+	*x = *x * 1103515245U + 12345U;
+	return ((*x >> 16) & 0x7fff);
+}
+
+static void
+make_lzx_contents(unsigned char *buff, size_t size)
+{
+	static const char *words[16] = {
+		"archive", "entry", "header", "lzx", "cabinet", "folder",
+		"data", "window", "huffman", "table", "the", "of", "and",
+		"decode", "stream", "block"
+	};
+	unsigned char *p, *end;
+	uint32_t x = 1;
+	unsigned i, k, r, v;
+	int t;
+
+	p = buff;
+	end = buff + size;
+	while (p < end) {
+		r = lzx_rand(&x) % 4;
+		if (r < 2) {
+			/* A line of text. */
+			k = lzx_rand(&x) % 12 + 1;
+			for (i = 0; i < k; i++) {
+				const char *w;
+
+				if (i)
+					*p++ = ' ';
+				w = words[lzx_rand(&x) % 16];
+				memcpy(p, w, strlen(w));
+				p += strlen(w);
+			}
+			*p++ = '\n';
+		} else if (r == 2) {
+			/* An x86 CALL instruction followed by NOPs. */
+			int32_t d = (int32_t)(lzx_rand(&x) % 4096) - 2048;
+
+			*p++ = 0xE8;
+			for (i = 0; i < 4; i++)
+				*p++ = (unsigned char)((uint32_t)d >> (i * 8));
+			k = lzx_rand(&x) % 4;
+			for (i = 0; i < k; i++)
+				*p++ = 0x90;
+		} else {
+			/* Bytes with a steep distribution. */
+			k = lzx_rand(&x) % 32 + 1;
+			for (i = 0; i < k; i++) {
+				v = lzx_rand(&x) | 0x4000;
+				for (t = 0; !((v >> t) & 1); t++)
+					;
+				*p++ = (unsigned char)(t * 17 + lzx_rand(&x) % 3);
+			}
+		}
+	}
+}
+
+DEFINE_TEST(test_read_format_cab_lzx)
+{
+	static const size_t block_sizes[] = { 10240, 7 };
+	const char *refname = "test_read_format_cab_lzx.cab";
+	const size_t size = 100000;
+	struct archive_entry *ae;
+	struct archive *a;
+	unsigned char *expected, *buff;
+	size_t i, used;
+	ssize_t bytes;
+
+	/* Leave room for the last chunk the generator writes. */
+	expected = malloc(size + 256);
+	buff = malloc(size);
+	if (!assert(expected != NULL && buff != NULL)) {
+		free(expected);
+		free(buff);
+		return;
+	}
+	make_lzx_contents(expected, size);
+	extract_reference_file(refname);
+
+	for (i = 0; i < sizeof(block_sizes)/sizeof(block_sizes[0]); i++) {
+		assert((a = archive_read_new()) != NULL);
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_support_format_all(a));
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_open_filename(a, refname, block_sizes[i]));
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_next_header(a, &ae));
+		assertEqualString("lzx.bin", archive_entry_pathname(ae));
+		assertEqualInt(size, archive_entry_size(ae));
+		used = 0;
+		while (used < size &&
+		    (bytes = archive_read_data(a, buff + used,
+		    size - used)) > 0)
+			used += bytes;
+		assertEqualInt(size, used);
+		assertEqualMem(buff, expected, size);
+		assertEqualIntA(a, ARCHIVE_EOF,
+		    archive_read_next_header(a, &ae));
+		assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	}
+	free(expected);
+	free(buff);
+}
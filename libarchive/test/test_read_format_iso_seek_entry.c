@@ -0,0 +1,246 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Jump to entries of an ISO image with archive_read_seek_entry().
+ */
+
+#define NFILES	6
+static const char *names[NFILES] = {
+	"file1", "file2", "dir1/file3", "dir1/dir2/file4", "file5", "empty"
+};
+
+static size_t
+file_size(int i)
+{
+	return (i == NFILES - 1)? 0: 3000 * (size_t)(i + 1);
+}
+
+static void
+make_image(const char *options)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char *buff;
+	int i;
+
+	buff = malloc(file_size(NFILES - 2));
+	assert(buff != NULL);
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, 0, archive_write_set_format_iso9660(a));
+	assertEqualIntA(a, 0, archive_write_add_filter_none(a));
+	if (options != NULL)
+		assertEqualIntA(a, 0, archive_write_set_options(a, options));
+	assertEqualIntA(a, 0, archive_write_open_filename(a, "test.iso"));
+	for (i = 0; i < NFILES; i++) {
+		assert((ae = archive_entry_new()) != NULL);
+		archive_entry_copy_pathname(ae, names[i]);
+		archive_entry_set_mode(ae, AE_IFREG | 0644);
+		archive_entry_set_size(ae, file_size(i));
+		archive_entry_set_mtime(ae, 1, 0);
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+		archive_entry_free(ae);
+		memset(buff, 'a' + i, file_size(i));
+		assertEqualIntA(a, (int)file_size(i),
+		    (int)archive_write_data(a, buff, file_size(i)));
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+	free(buff);
+}
+
+static void
+verify_data(struct archive *a, int i)
+{
+	char buff[20000], expected[20000];
+	size_t total = 0;
+	ssize_t r;
+
+	while ((r = archive_read_data(a, buff + total,
+	    sizeof(buff) - total)) > 0)
+		total += r;
+	assertEqualInt(0, r);
+	assertEqualInt(file_size(i), total);
+	memset(expected, 'a' + i, file_size(i));
+	assertEqualMem(buff, expected, file_size(i));
+}
+
+static void
+seek_and_verify(struct archive *a, int i)
+{
+	struct archive_entry *ae;
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, names[i]));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString(names[i], archive_entry_pathname(ae));
+	assertEqualInt(file_size(i), archive_entry_size(ae));
+	verify_data(a, i);
+}
+
+static void
+test_seek(const char *options)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	int i, n, seen;
+
+	make_image(options);
+
+	/* Jump around before reading any header. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_iso9660(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.iso", 10240));
+	seek_and_verify(a, 3);
+	seek_and_verify(a, 0);
+	seek_and_verify(a, 4);
+	seek_and_verify(a, 2);
+	seek_and_verify(a, 5);
+	seek_and_verify(a, 1);
+
+	/* Leave the data of an entry partly read. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, names[4]));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	{
+		char buff[5];
+		assertEqualInt(5, archive_read_data(a, buff, sizeof(buff)));
+		assertEqualMem(buff, "eeeee", 5);
+	}
+	seek_and_verify(a, 3);
+
+	/* Directories. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "dir1/dir2"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString("dir1/dir2", archive_entry_pathname(ae));
+	assertEqualInt(AE_IFDIR, archive_entry_filetype(ae));
+
+	/* Not found. */
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "nonexistent"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "dir1/file"));
+
+	/* Reading continues in the usual order after the entry; every
+	 * entry after the root directory is returned once. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "."));
+	n = seen = 0;
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		n++;
+		for (i = 0; i < NFILES; i++) {
+			if (strcmp(names[i], archive_entry_pathname(ae)))
+				continue;
+			seen |= 1 << i;
+			verify_data(a, i);
+		}
+	}
+	assertEqualInt((1 << NFILES) - 1, seen);
+	assertEqualInt(NFILES + 3, n);
+	/* After the end of the archive. */
+	seek_and_verify(a, 2);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+
+	/* A failed seek leaves the read position alone, before the
+	 * first header and after it. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_iso9660(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.iso", 10240));
+	assertEqualIntA(a, ARCHIVE_FAILED, archive_read_seek_entry(a, "nope"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString(".", archive_entry_pathname(ae));
+	assertEqualIntA(a, ARCHIVE_FAILED, archive_read_seek_entry(a, "nope"));
+	n = seen = 0;
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		n++;
+		for (i = 0; i < NFILES; i++) {
+			if (strcmp(names[i], archive_entry_pathname(ae)) == 0)
+				seen |= 1 << i;
+		}
+	}
+	assertEqualInt((1 << NFILES) - 1, seen);
+	assertEqualInt(NFILES + 2, n);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+
+	/* Jump after reading some headers sequentially. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_iso9660(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.iso", 10240));
+	for (i = 0; i < 4; i++)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_next_header(a, &ae));
+	seek_and_verify(a, 0);
+	seek_and_verify(a, 3);
+	seek_and_verify(a, 1);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+}
+
+/*
+ * Directories relocated by Rockridge "rr_moved" are found by their
+ * real pathnames.
+ */
+static void
+test_rr_moved(void)
+{
+	const char *refname = "test_read_format_iso_rockridge_rr_moved.iso.Z";
+	const char *deep = "dir1/dir2/dir3/dir4/dir5/dir6/dir7"
+	    "/dir8/dir9/dir10/deep";
+	struct archive_entry *ae;
+	struct archive *a;
+	const void *p;
+	size_t size;
+	int64_t offset;
+
+	extract_reference_file(refname);
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_filter_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_all(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, refname, 10240));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, deep));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString(deep, archive_entry_pathname(ae));
+	assertEqualInt(0, archive_read_data_block(a, &p, &size, &offset));
+	assertEqualMem(p, "hello\n", 6);
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_seek_entry(a, "dir1/dir2/dir3/dir4/dir5/dir6/dir7"
+	    "/dir8"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualInt(AE_IFDIR, archive_entry_filetype(ae));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "rr_moved"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+}
+
+DEFINE_TEST(test_read_format_iso_seek_entry)
+{
+	/* Rockridge names. */
+	test_seek(NULL);
+	/* Joliet names. */
+	test_seek("iso9660:!rockridge");
+	test_rr_moved();
+}
@@ -292,3 +292,128 @@ DEFINE_TEST(test_read_format_lha)
 	verify("test_read_format_lha_withjunk.lzh", 1);
 }
 
+
+/*
+ * test_read_format_lha_lh5.lzh holds one 100000-byte -lh5- file, lh5.bin,
+ * whose contents come from make_lh5_contents() below.  Literals are
+ * spread over most byte values, and matches run up to the 256-byte
+ * limit, some of them from the far end of the 8 KiB window, so the
+ * literal/length and position codes exceed the first-level table.
+ * The statistics of every third block were also skewed when it was
+ * compressed, which gives codes of up to 16 bits.
+ */
+static unsigned
+lh5_rand(uint32_t *x)
+{
+	*x = *x * 1103515245U + 12345U;
+	return ((*x >> 16) & 0x7fff);
+}
+
+static void
+make_lh5_contents(unsigned char *buff, size_t size)
+{
+	static const char *words[16] = {
+		"lha", "lzh", "method", "header", "level", "crc",
+		"dicbit", "position", "literal", "length", "block",
+		"huffman", "window", "the", "of", "and"
+	};
+	unsigned char *p, *end;
+	uint32_t x = 1;
+	unsigned i, k, r, d, v;
+	int t;
+
+	p = buff;
+	end = buff + size;
+	while (p < end) {
+		r = lh5_rand(&x) % 4;
+		if (r == 0) {
+			/* A line of text. */
+			k = lh5_rand(&x) % 12 + 1;
+			for (i = 0; i < k; i++) {
+				const char *w;
+
+				if (i)
+					*p++ = ' ';
+				w = words[lh5_rand(&x) % 16];
+				memcpy(p, w, strlen(w));
+				p += strlen(w);
+			}
+			*p++ = '\n';
+		} else if (r == 1) {
+			/* Bytes of most values, the higher ones rare. */
+			k = lh5_rand(&x) % 64 + 1;
+			for (i = 0; i < k; i++) {
+				v = lh5_rand(&x) | 0x4000;
+				for (t = 0; !((v >> t) & 1); t++)
+					;
+				*p++ = (unsigned char)(t * 16 + lh5_rand(&x) % 16);
+			}
+		} else if (r == 2) {
+			/* A copy from near the far end of the window. */
+			if (p - buff > 8192) {
+				d = 8192 - lh5_rand(&x) % 32;
+				k = 3 + ((lh5_rand(&x) % 4 == 0)?
+				    lh5_rand(&x) % 254: lh5_rand(&x) % 16);
+				for (i = 0; i < k; i++, p++)
+					*p = p[-(int)d];
+			}
+		} else {
+			/* A long run of a short pattern. */
+			if (p - buff >= 4) {
+				d = lh5_rand(&x) % 4 + 1;
+				k = lh5_rand(&x) % 254 + 3;
+				for (i = 0; i < k; i++, p++)
+					*p = p[-(int)d];
+			}
+		}
+	}
+}
+
+DEFINE_TEST(test_read_format_lha_lh5)
+{
+	static const size_t block_sizes[] = { 10240, 7 };
+	const char *refname = "test_read_format_lha_lh5.lzh";
+	const size_t size = 100000;
+	struct archive_entry *ae;
+	struct archive *a;
+	unsigned char *expected, *buff;
+	size_t i, used;
+	ssize_t bytes;
+
+	/* Leave room for the last chunk the generator writes. */
+	expected = malloc(size + 256);
+	buff = malloc(size);
+	if (!assert(expected != NULL && buff != NULL)) {
+		free(expected);
+		free(buff);
+		return;
+	}
+	make_lh5_contents(expected, size);
+	extract_reference_file(refname);
+
+	for (i = 0; i < sizeof(block_sizes)/sizeof(block_sizes[0]); i++) {
+		assert((a = archive_read_new()) != NULL);
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_support_format_all(a));
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_open_filename(a, refname, block_sizes[i]));
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_next_header(a, &ae));
+		assertEqualString("lh5.bin", archive_entry_pathname(ae));
+		assertEqualInt(size, archive_entry_size(ae));
+		used = 0;
+		while (used < size &&
+		    (bytes = archive_read_data(a, buff + used,
+		    size - used)) > 0)
+			used += bytes;
+		assertEqualInt(size, used);
+		assertEqualMem(buff, expected, size);
+		/* The final read checks the CRC-16 of the data. */
+		assertEqualIntA(a, 0, archive_read_data(a, buff, 1));
+		assertEqualIntA(a, ARCHIVE_EOF,
+		    archive_read_next_header(a, &ae));
+		assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	}
+	free(expected);
+	free(buff);
+}
@@ -3740,3 +3740,289 @@ DEFINE_TEST(test_read_format_rar_multivolume_uncompressed_files)
   assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
   assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
 }
+
+static void
+test_read_format_rar_seek_data_compressed_file(const char *reffile)
+{
+  char buff[64];
+  char *data;
+  int64_t size, used, offsets[12];
+  size_t i;
+  struct archive_entry *ae;
+  struct archive *a;
+
+  extract_reference_file(reffile);
+  assert((a = archive_read_new()) != NULL);
+  assertA(0 == archive_read_support_filter_all(a));
+  assertA(0 == archive_read_support_format_all(a));
+  assertA(0 == archive_read_open_filename(a, reffile, 10240));
+  assertA(0 == archive_read_next_header(a, &ae));
+  size = archive_entry_size(ae);
+  assert(size > (int64_t)sizeof(buff) * 4);
+  if (!assert((data = malloc((size_t)size)) != NULL))
+    return;
+
+  /* Read the whole entry, then seek around in it. */
+  assertEqualInt(size, archive_read_data(a, data, (size_t)size));
+  assertEqualInt(0, archive_read_data(a, buff, sizeof(buff)));
+
+  offsets[0] = size - sizeof(buff);
+  offsets[1] = 0;
+  offsets[2] = size / 2;
+  offsets[3] = size / 3;
+  offsets[4] = size / 2 + 1;
+  offsets[5] = size - size / 3;
+  offsets[6] = size / 5;
+  offsets[7] = 1;
+  offsets[8] = size - size / 7;
+  offsets[9] = size / 4 + 12345;
+  offsets[10] = size / 4;
+  offsets[11] = size - sizeof(buff) - 1;
+  for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+  {
+    assertEqualInt(offsets[i], archive_seek_data(a, offsets[i], SEEK_SET));
+    assertEqualInt(sizeof(buff), archive_read_data(a, buff, sizeof(buff)));
+    assertEqualMem(buff, data + offsets[i], sizeof(buff));
+    assertEqualInt(offsets[i] + sizeof(buff),
+      archive_seek_data(a, 0, SEEK_CUR));
+  }
+
+  /* Relative seeks, and seeks past the end. */
+  assertEqualInt(size / 3, archive_seek_data(a, size / 3, SEEK_SET));
+  assertEqualInt(size / 3 - 100, archive_seek_data(a, -100, SEEK_CUR));
+  assertEqualInt(sizeof(buff), archive_read_data(a, buff, sizeof(buff)));
+  assertEqualMem(buff, data + size / 3 - 100, sizeof(buff));
+  assertEqualInt(size - 10, archive_seek_data(a, -10, SEEK_END));
+  assertEqualInt(10, archive_read_data(a, buff, sizeof(buff)));
+  assertEqualMem(buff, data + size - 10, 10);
+  assertEqualInt(size + 40, archive_seek_data(a, 40, SEEK_END));
+  assertEqualInt(0, archive_read_data(a, buff, sizeof(buff)));
+  assertEqualInt(-1, archive_seek_data(a, -1, SEEK_SET));
+
+  /* Reading on from a seek to the end still passes the CRC check. */
+  assertEqualInt(size / 2, archive_seek_data(a, size / 2, SEEK_SET));
+  used = 0;
+  while (used < size - size / 2)
+  {
+    ssize_t bytes = archive_read_data(a, buff, sizeof(buff));
+    if (!assert(bytes > 0))
+      break;
+    assertEqualMem(buff, data + size / 2 + used, bytes);
+    used += bytes;
+  }
+  assertEqualInt(0, archive_read_data(a, buff, sizeof(buff)));
+
+  free(data);
+  assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+  assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+}
+
+DEFINE_TEST(test_read_format_rar_seek_data_compressed)
+{
+  /* LZSS, with several checkpoints. */
+  test_read_format_rar_seek_data_compressed_file(
+    "test_read_format_rar_multi_lzss_blocks.rar");
+  /* PPMd, which is always decoded again from the start. */
+  test_read_format_rar_seek_data_compressed_file(
+    "test_read_format_rar_compress_best.rar");
+  test_read_format_rar_seek_data_compressed_file(
+    "test_read_format_rar_compress_normal.rar");
+}
+
+/*
+ * test_read_format_rar_long_codes.rar holds one 100000-byte LZSS file,
+ * rar.bin, whose contents come from make_rar_contents() below.  New
+ * tables start every 5000 codes, and the statistics of every third set
+ * were skewed when it was compressed, so the main and offset codes are
+ * up to 15 bits long, past the 10-bit first-level lookup table.
+ */
+static unsigned
+rar_rand(uint32_t *x)
+{
+  *x = *x * 1103515245U + 12345U;
+  return ((*x >> 16) & 0x7fff);
+}
+
+static void
+make_rar_contents(unsigned char *buff, size_t size)
+{
+  static const char *words[16] = {
+    "rar", "volume", "solid", "lzss", "ppmd", "filter", "header", "crc",
+    "archive", "unpack", "symbol", "offset", "length", "table", "block",
+    "window"
+  };
+  unsigned char *p, *end;
+  uint32_t x = 1;
+  unsigned i, k, r, d, t;
+
+  p = buff;
+  end = buff + size;
+  while (p < end)
+  {
+    r = rar_rand(&x) % 4;
+    if (r == 0)
+    {
+      /* A line of text. */
+      k = rar_rand(&x) % 12 + 1;
+      for (i = 0; i < k; i++)
+      {
+        const char *w;
+
+        if (i)
+          *p++ = ' ';
+        w = words[rar_rand(&x) % 16];
+        memcpy(p, w, strlen(w));
+        p += strlen(w);
+      }
+      *p++ = '\n';
+    }
+    else if (r == 1)
+    {
+      /* Bytes of every value, the higher ones rare. */
+      k = rar_rand(&x) % 48 + 1;
+      for (i = 0; i < k; i++)
+      {
+        t = rar_rand(&x);
+        *p++ = (unsigned char)((t * t) >> 22);
+      }
+    }
+    else if (r == 2)
+    {
+      /* A copy from anywhere before, some of it far enough back
+       * to need the low offset code. */
+      if (p > buff)
+      {
+        d = rar_rand(&x) % (unsigned)(p - buff) + 1;
+        k = rar_rand(&x) % 60 + 4;
+        for (i = 0; i < k; i++, p++)
+          *p = p[-(int)d];
+      }
+    }
+    else
+    {
+      /* A long run of a short pattern. */
+      if (p - buff >= 8)
+      {
+        d = rar_rand(&x) % 8 + 1;
+        k = rar_rand(&x) % 200 + 3;
+        for (i = 0; i < k; i++, p++)
+          *p = p[-(int)d];
+      }
+    }
+  }
+}
+
+DEFINE_TEST(test_read_format_rar_long_codes)
+{
+  static const size_t block_sizes[] = { 10240, 7 };
+  const char reffile[] = "test_read_format_rar_long_codes.rar";
+  const size_t size = 100000;
+  struct archive_entry *ae;
+  struct archive *a;
+  unsigned char *expected, *buff;
+  size_t i, used;
+  ssize_t bytes;
+
+  /* Leave room for the last chunk the generator writes. */
+  expected = malloc(size + 256);
+  buff = malloc(size);
+  if (!assert(expected != NULL && buff != NULL))
+  {
+    free(expected);
+    free(buff);
+    return;
+  }
+  make_rar_contents(expected, size);
+  extract_reference_file(reffile);
+
+  for (i = 0; i < sizeof(block_sizes)/sizeof(block_sizes[0]); i++)
+  {
+    assert((a = archive_read_new()) != NULL);
+    assertA(0 == archive_read_support_filter_all(a));
+    assertA(0 == archive_read_support_format_all(a));
+    assertA(0 == archive_read_open_filename(a, reffile, block_sizes[i]));
+    assertA(0 == archive_read_next_header(a, &ae));
+    assertEqualString("rar.bin", archive_entry_pathname(ae));
+    assertEqualInt(size, archive_entry_size(ae));
+    used = 0;
+    while (used < size &&
+      (bytes = archive_read_data(a, buff + used, size - used)) > 0)
+      used += bytes;
+    assertEqualInt(size, used);
+    assertEqualMem(buff, expected, size);
+    /* The final read checks the CRC of the data. */
+    assertEqualIntA(a, 0, archive_read_data(a, buff, 1));
+    assertA(1 == archive_read_next_header(a, &ae));
+    assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+  }
+  free(expected);
+  free(buff);
+}
+
+/*
+ * Cut the same archive short at several points in the compressed
+ * data; reading must fail instead of making up the missing bits.
+ */
+DEFINE_TEST(test_read_format_rar_long_codes_truncated)
+{
+  const char reffile[] = "test_read_format_rar_long_codes.rar";
+  /* The compressed data runs from 59 to 23543. */
+  static const size_t cuts[] = { 60, 100, 5000, 11800, 17000, 23000,
+    23530, 23540 };
+  struct archive_entry *ae;
+  struct archive *a;
+  char *p, buff[4096];
+  size_t i, s;
+  ssize_t bytes;
+
+  extract_reference_file(reffile);
+  p = slurpfile(&s, reffile);
+  if (!assert(p != NULL))
+    return;
+  assertEqualInt(23550, s);
+
+  for (i = 0; i < sizeof(cuts)/sizeof(cuts[0]); i++)
+  {
+    assert((a = archive_read_new()) != NULL);
+    assertA(0 == archive_read_support_filter_all(a));
+    assertA(0 == archive_read_support_format_all(a));
+    assertA(0 == archive_read_open_memory(a, p, cuts[i]));
+    assertA(0 == archive_read_next_header(a, &ae));
+    while ((bytes = archive_read_data(a, buff, sizeof(buff))) > 0)
+      continue;
+    failure("Cut at %d bytes", (int)cuts[i]);
+    assertEqualInt(ARCHIVE_FATAL, bytes);
+    assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+  }
+  free(p);
+}
+
+/*
+ * test_read_format_rar_incomplete_code.rar holds the first 2000 bytes
+ * from make_rar_contents(), but its main code leaves one 15-bit pattern
+ * unused, and that pattern appears after the 100th code.  The pattern
+ * shares its first ten bits with other codes, so it is only found to be
+ * invalid in a second-level table.
+ */
+DEFINE_TEST(test_read_format_rar_incomplete_code)
+{
+  const char reffile[] = "test_read_format_rar_incomplete_code.rar";
+  struct archive_entry *ae;
+  struct archive *a;
+  char buff[4096];
+  ssize_t bytes;
+
+  extract_reference_file(reffile);
+  assert((a = archive_read_new()) != NULL);
+  assertA(0 == archive_read_support_filter_all(a));
+  assertA(0 == archive_read_support_format_all(a));
+  assertA(0 == archive_read_open_filename(a, reffile, 10240));
+  assertA(0 == archive_read_next_header(a, &ae));
+  assertEqualInt(2000, archive_entry_size(ae));
+  while ((bytes = archive_read_data(a, buff, sizeof(buff))) > 0)
+    continue;
+  assertEqualInt(ARCHIVE_FATAL, bytes);
+  assertEqualString("Invalid prefix code in bitstream",
+    archive_error_string(a));
+  assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+}
@@ -0,0 +1,111 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Build ustar headers in memory and check that both the POSIX
+ * (unsigned) checksum and the signed checksum written by some old tar
+ * implementations are accepted, that a bad checksum is rejected, and
+ * that the octal numeric fields are decoded.
+ */
+
+#define CKSUM_UNSIGNED	0
+#define CKSUM_SIGNED	1
+#define CKSUM_BAD	2
+
+static void
+make_header(char *h, int how)
+{
+	int i, sum;
+
+	memset(h, 0, 1536);
+	/* Bytes with the high bit set make the two checksums differ. */
+	strcpy(h, "caf\xc3\xa9-\xe6\x97\xa5.txt");
+	memcpy(h + 100, "0000644 ", 8);
+	memcpy(h + 108, "  1750 \0", 8);
+	memcpy(h + 116, "0001750\0", 8);
+	memcpy(h + 124, "00000001234 ", 12);
+	memcpy(h + 136, "12345670123\0", 12);
+	h[156] = '0';
+	memcpy(h + 257, "ustar\0" "00", 8);
+	memcpy(h + 265, "user", 4);
+	memcpy(h + 297, "group", 5);
+
+	memset(h + 148, ' ', 8);
+	sum = 0;
+	for (i = 0; i < 512; i++) {
+		if (how == CKSUM_SIGNED)
+			sum += (signed char)h[i];
+		else
+			sum += (unsigned char)h[i];
+	}
+	if (how == CKSUM_BAD)
+		sum++;
+	sprintf(h + 148, "%06o", sum);
+	h[155] = ' ';
+}
+
+static void
+read_header(int how)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char *buff;
+
+	assert((buff = malloc(1536)) != NULL);
+	make_header(buff, how);
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_tar(a));
+	if (how == CKSUM_BAD) {
+		/* The tar bidder rejects the damaged header. */
+		assertEqualIntA(a, ARCHIVE_FATAL,
+		    archive_read_open_memory(a, buff, 1536));
+	} else {
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_open_memory(a, buff, 1536));
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_next_header(a, &ae));
+		assertEqualInt(ARCHIVE_FORMAT_TAR_USTAR, archive_format(a));
+		assertEqualInt(AE_IFREG | 0644, archive_entry_mode(ae));
+		assertEqualInt(1000, archive_entry_uid(ae));
+		assertEqualInt(1000, archive_entry_gid(ae));
+		assertEqualInt(668, archive_entry_size(ae));
+		assertEqualInt(1402433619, archive_entry_mtime(ae));
+		assertEqualString("user", archive_entry_uname(ae));
+		assertEqualString("group", archive_entry_gname(ae));
+		assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	}
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	free(buff);
+}
+
+DEFINE_TEST(test_read_format_tar_checksum)
+{
+	read_header(CKSUM_UNSIGNED);
+	read_header(CKSUM_SIGNED);
+	read_header(CKSUM_BAD);
+}
@@ -0,0 +1,194 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Write a pax archive together with a sidecar index of its entries,
+ * then use the index to read entries in an arbitrary order with
+ * archive_read_seek_entry().  The index is built here by hand and
+ * checked against those the writer and the reader produce.
+ */
+
+#define NENTRIES	40
+
+static void
+entry_name(char *buff, size_t size, int i)
+{
+	if (i == 7)
+		/* Needs a pax header. */
+		snprintf(buff, size, "dir/%0150d", i);
+	else if (i == 8)
+		/* Needs escaping in the index. */
+		snprintf(buff, size, "back\\slash\nnewline");
+	else if (i == NENTRIES - 1)
+		/* A second copy of entry 3. */
+		snprintf(buff, size, "file%03d", 3);
+	else
+		snprintf(buff, size, "file%03d", i);
+}
+
+static void
+write_index_line(FILE *f, int64_t header_offset, int64_t data_offset,
+    int64_t size, const char *name)
+{
+	fprintf(f, "%jd %jd %jd ", (intmax_t)header_offset,
+	    (intmax_t)data_offset, (intmax_t)size);
+	for (; *name != '\0'; name++) {
+		if (*name == '\\' || *name == '\n')
+			fprintf(f, "\\%03o", (unsigned char)*name);
+		else
+			putc(*name, f);
+	}
+	putc('\n', f);
+}
+
+static void
+make_archive(void)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	FILE *f, *expected;
+	char name[256], data[64];
+	int64_t header_offset;
+	int i;
+
+	assert((f = fopen("test.idx", "w")) != NULL);
+	fprintf(f, "# test index\n\n");
+	assert((expected = fopen("expected.idx", "w")) != NULL);
+	fprintf(expected, "#header-offset data-offset size pathname\n");
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_pax(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_add_filter_none(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_set_format_option(a, "pax", "index", "write.idx"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_open_filename(a, "test.tar"));
+	for (i = 0; i < NENTRIES; i++) {
+		entry_name(name, sizeof(name), i);
+		snprintf(data, sizeof(data), "contents of entry %d", i);
+		assert((ae = archive_entry_new()) != NULL);
+		archive_entry_copy_pathname(ae, name);
+		archive_entry_set_mode(ae, AE_IFREG | 0644);
+		archive_entry_set_size(ae, strlen(data));
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_finish_entry(a));
+		header_offset = archive_filter_bytes(a, 0);
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+		write_index_line(f, header_offset, archive_filter_bytes(a, 0),
+		    strlen(data), name);
+		write_index_line(expected, header_offset,
+		    archive_filter_bytes(a, 0), strlen(data), name);
+		assertEqualInt((int)strlen(data),
+		    archive_write_data(a, data, strlen(data)));
+		archive_entry_free(ae);
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+	assertEqualInt(0, fclose(f));
+	assertEqualInt(0, fclose(expected));
+	assertEqualFile("write.idx", "expected.idx");
+}
+
+static void
+verify_entry(struct archive *a, int i)
+{
+	struct archive_entry *ae;
+	char name[256], data[64], buff[64];
+
+	entry_name(name, sizeof(name), i);
+	snprintf(data, sizeof(data), "contents of entry %d", i);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString(name, archive_entry_pathname(ae));
+	assertEqualInt(strlen(data), archive_entry_size(ae));
+	assertEqualInt(strlen(data), archive_read_data(a, buff, sizeof(buff)));
+	assertEqualMem(data, buff, strlen(data));
+}
+
+DEFINE_TEST(test_read_format_tar_index)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char name[256];
+	int i;
+
+	make_archive();
+
+	/* Without an index, seeking is not possible. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_tar(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.tar", 10240));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "file005"));
+	verify_entry(a, 0);
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+
+	/* Reading the whole archive writes the same index. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_tar(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_set_format_option(a, "tar", "write_index", "read.idx"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.tar", 10240));
+	for (i = 0; i < NENTRIES; i++)
+		verify_entry(a, i);
+	assertEqualIntA(a, ARCHIVE_EOF, archive_read_next_header(a, &ae));
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	assertEqualFile("read.idx", "expected.idx");
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_tar(a));
+	assertEqualIntA(a, ARCHIVE_FATAL,
+	    archive_read_set_format_option(a, "tar", "index", "missing.idx"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_set_format_option(a, "tar", "index", "test.idx"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.tar", 10240));
+
+	/* Backwards, skipping the first copy of entry 3. */
+	for (i = NENTRIES - 2; i >= 0; i--) {
+		if (i == 3)
+			continue;
+		entry_name(name, sizeof(name), i);
+		assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, name));
+		verify_entry(a, i);
+	}
+
+	/* The last copy of a name wins. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "file003"));
+	verify_entry(a, NENTRIES - 1);
+
+	/* A missing name leaves the position alone. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "file020"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "file999"));
+	assertEqualInt(ENOENT, archive_errno(a));
+	verify_entry(a, 20);
+	/* Reading continues in archive order. */
+	verify_entry(a, 21);
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+}
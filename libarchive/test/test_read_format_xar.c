@@ -619,10 +619,10 @@ enum enc {
     BZIP2
 };
 
-static void verify(unsigned char *d, size_t s,
+static void verify_options(unsigned char *d, size_t s,
     void (*f1)(struct archive *, struct archive_entry *),
     void (*f2)(struct archive *, struct archive_entry *),
-    enum enc etype)
+    enum enc etype, const char *options)
 {
 	struct archive_entry *ae;
 	struct archive *a;
@@ -659,6 +659,9 @@ static void verify(unsigned char *d, size_t s,
 	memset(buff + s, 0, 2048);
 
 	assertA(0 == archive_read_support_format_all(a));
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_set_options(a, options));
 	assertA(0 == archive_read_open_memory(a, buff, s + 1024));
 	assertA(0 == archive_read_next_header(a, &ae));
 	assertEqualInt(archive_filter_code(a, 0), ARCHIVE_FILTER_NONE);
@@ -685,6 +688,16 @@ static void verify(unsigned char *d, size_t s,
 	free(buff);
 }
 
+static void verify(unsigned char *d, size_t s,
+    void (*f1)(struct archive *, struct archive_entry *),
+    void (*f2)(struct archive *, struct archive_entry *),
+    enum enc etype)
+{
+	verify_options(d, s, f1, f2, etype, NULL);
+	/* Parse the TOC while reading entries. */
+	verify_options(d, s, f1, f2, etype, "xar:streaming-toc");
+}
+
 DEFINE_TEST(test_read_format_xar)
 {
 	verify(archive1, sizeof(archive1), verify0, verify1, GZIP);
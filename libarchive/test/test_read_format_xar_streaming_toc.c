@@ -0,0 +1,171 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Read an archive with more entries than the streaming-toc option
+ * holds at once, and check that it returns the same entries as
+ * reading the whole TOC first.
+ */
+
+#define NDIRS	20
+#define NFILES	150
+
+static void
+make_archive(const char *name)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char path[64], data[128];
+	int d, f;
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_xar(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_add_filter_none(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_open_filename(a, name));
+	for (d = 0; d < NDIRS; d++) {
+		assert((ae = archive_entry_new()) != NULL);
+		sprintf(path, "dir%d", d);
+		archive_entry_copy_pathname(ae, path);
+		archive_entry_set_mode(ae, AE_IFDIR | 0755);
+		archive_entry_set_mtime(ae, d, 0);
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+		archive_entry_free(ae);
+		for (f = 0; f < NFILES; f++) {
+			assert((ae = archive_entry_new()) != NULL);
+			sprintf(path, "dir%d/sub%d/file%d", d, f % 3, f);
+			sprintf(data, "contents of %s", path);
+			archive_entry_copy_pathname(ae, path);
+			archive_entry_set_mode(ae, AE_IFREG | 0644);
+			archive_entry_set_size(ae, strlen(data));
+			/* Every tenth file has a hardlink. */
+			archive_entry_set_nlink(ae, (f % 10 == 0)? 2: 1);
+			archive_entry_set_ino(ae, d * NFILES + f + 1);
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_write_header(a, ae));
+			assertEqualIntA(a, (int)strlen(data),
+			    (int)archive_write_data(a, data, strlen(data)));
+			if (f % 10 == 0) {
+				archive_entry_copy_hardlink(ae, path);
+				sprintf(path, "dir%d/link%d", d, f);
+				archive_entry_copy_pathname(ae, path);
+				archive_entry_set_size(ae, 0);
+				assertEqualIntA(a, ARCHIVE_OK,
+				    archive_write_header(a, ae));
+			}
+			archive_entry_free(ae);
+		}
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+}
+
+static int
+cmp_str(const void *p1, const void *p2)
+{
+	return (strcmp(*(char * const *)p1, *(char * const *)p2));
+}
+
+/*
+ * List the entries as "pathname hardlink size data", sorted.
+ */
+static char **
+list_entries(const char *name, const char *options, int *count)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char **list, data[128];
+	const char *hardlink;
+	ssize_t size;
+	int n = 0, r;
+
+	list = malloc(sizeof(*list) * NDIRS * (NFILES * 2 + 4));
+	assert(list != NULL);
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_xar(a));
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_set_options(a, options));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, name, 10240));
+	while ((r = archive_read_next_header(a, &ae)) == ARCHIVE_OK) {
+		size = archive_read_data(a, data, sizeof(data) - 1);
+		assert(size >= 0);
+		if (size < 0)
+			break;
+		data[size] = '\0';
+		hardlink = archive_entry_hardlink(ae);
+		list[n] = malloc(strlen(archive_entry_pathname(ae)) +
+		    (hardlink? strlen(hardlink): 0) + size + 32);
+		sprintf(list[n], "%s %s %d %s", archive_entry_pathname(ae),
+		    hardlink? hardlink: "-", (int)archive_entry_size(ae),
+		    data);
+		n++;
+	}
+	assertEqualIntA(a, ARCHIVE_EOF, r);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+	qsort(list, n, sizeof(*list), cmp_str);
+	*count = n;
+	return (list);
+}
+
+DEFINE_TEST(test_read_format_xar_streaming_toc)
+{
+	struct archive *a;
+	char **list1, **list2;
+	int i, n1, n2;
+
+	assert((a = archive_write_new()) != NULL);
+	if (archive_write_set_format_xar(a) != ARCHIVE_OK) {
+		skipping("xar is not supported on this platform");
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+		return;
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+
+	make_archive("test.xar");
+	list1 = list_entries("test.xar", NULL, &n1);
+	list2 = list_entries("test.xar", "xar:streaming-toc", &n2);
+	/* Directories, files and hardlinks; the subdirectories have
+	 * no metadata and are not returned. */
+	assertEqualInt(NDIRS * (1 + NFILES + NFILES / 10), n1);
+	assertEqualInt(n1, n2);
+	for (i = 0; i < n1 && i < n2; i++)
+		assertEqualString(list1[i], list2[i]);
+	for (i = 0; i < n2; i++)
+		if (strncmp(list2[i], "dir3/link20 ", 12) == 0)
+			break;
+	assert(i < n2);
+	if (i < n2)
+		assertEqualString("dir3/link20 dir3/sub2/file20 0 ",
+		    list2[i]);
+	for (i = 0; i < n1; i++)
+		free(list1[i]);
+	for (i = 0; i < n2; i++)
+		free(list2[i]);
+	free(list1);
+	free(list2);
+}
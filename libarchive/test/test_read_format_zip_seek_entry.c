@@ -0,0 +1,135 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+static void
+add_file(struct archive *a, const char *name, const char *body)
+{
+	struct archive_entry *ae;
+
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_copy_pathname(ae, name);
+	if (body == NULL) {
+		archive_entry_set_mode(ae, AE_IFDIR | 0755);
+		archive_entry_set_size(ae, 0);
+	} else {
+		archive_entry_set_mode(ae, AE_IFREG | 0644);
+		archive_entry_set_size(ae, strlen(body));
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+	if (body != NULL)
+		assertEqualIntA(a, (int)strlen(body),
+		    (int)archive_write_data(a, body, strlen(body)));
+}
+
+static void
+verify_entry(struct archive *a, const char *name, const char *body)
+{
+	struct archive_entry *ae;
+	char buff[64];
+
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualString(name, archive_entry_pathname(ae));
+	if (body != NULL) {
+		assertEqualInt((int)strlen(body),
+		    archive_read_data(a, buff, sizeof(buff)));
+		assertEqualMem(body, buff, strlen(body));
+	}
+}
+
+DEFINE_TEST(test_read_format_zip_seek_entry)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	size_t used;
+	size_t buffsize = 100000;
+	char *buff;
+	char data[4];
+
+	buff = malloc(buffsize);
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_zip(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_add_filter_none(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_open_memory(a, buff, buffsize, &used));
+	add_file(a, "a.txt", "contents of a");
+	add_file(a, "dir/", NULL);
+	add_file(a, "dir/b.txt", "contents of b");
+	add_file(a, "c.txt", "contents of c");
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+
+	/* Seekable reader: jump straight to entries by name. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_zip(a));
+	assertEqualIntA(a, ARCHIVE_OK, read_open_memory_seek(a, buff, used, 7));
+
+	/* Before the first header has been read. */
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "missing.txt"));
+	verify_entry(a, "a.txt", "contents of a");
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "dir/b.txt"));
+	verify_entry(a, "dir/b.txt", "contents of b");
+	/* Reading continues in archive order. */
+	verify_entry(a, "c.txt", "contents of c");
+
+	/* Backwards, abandoning partially-read data. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "c.txt"));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualInt(4, archive_read_data(a, data, 4));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "a.txt"));
+	verify_entry(a, "a.txt", "contents of a");
+	verify_entry(a, "dir/", NULL);
+
+	/* Unknown names fail without disturbing the read position. */
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "missing.txt"));
+	assertEqualIntA(a, ARCHIVE_FAILED, archive_read_seek_entry(a, "dir"));
+	verify_entry(a, "dir/b.txt", "contents of b");
+	verify_entry(a, "c.txt", "contents of c");
+	assertEqualIntA(a, ARCHIVE_EOF, archive_read_next_header(a, &ae));
+
+	/* Still usable after reaching the end. */
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_seek_entry(a, "dir/"));
+	verify_entry(a, "dir/", NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+
+	/* The streaming reader has no index to consult. */
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_zip(a));
+	assertEqualIntA(a, ARCHIVE_OK, read_open_memory(a, buff, used, 7));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_read_seek_entry(a, "c.txt"));
+	verify_entry(a, "dir/", NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_close(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+
+	free(buff);
+}
@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+#define NFILES		24
+#define BIG_FILE_SIZE	100000
+#define BUFF_SIZE	(2 * 1024 * 1024)
+
+static size_t
+file_size(int i)
+{
+	if (i == NFILES - 1)
+		return (BIG_FILE_SIZE);
+	return (1000 + (i * 7919) % 20000);
+}
+
+static void
+fill_data(char *p, size_t size, int i)
+{
+	size_t j;
+
+	for (j = 0; j < size; j++)
+		p[j] = "abcdefgh 0123456789\n"[(j * (i + 1) + (j >> 7)) % 20];
+}
+
+/*
+ * Write a set of files, a directory, a symbolic link and an empty file
+ * with the given options.  Returns the size of the archive, or 0 if the
+ * compression is not supported on this platform.
+ */
+static size_t
+make_archive(const char *compression, const char *options, char *buff)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char *data;
+	char name[32];
+	size_t used;
+	int i;
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_7zip(a));
+	if (ARCHIVE_OK != archive_write_set_format_option(a, "7zip",
+	    "compression", compression)) {
+		assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+		return (0);
+	}
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_write_set_options(a, options));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_add_filter_none(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_open_memory(a, buff, BUFF_SIZE, &used));
+
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_set_mtime(ae, 1, 0);
+	archive_entry_copy_pathname(ae, "dir");
+	archive_entry_set_mode(ae, AE_IFDIR | 0755);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+
+	data = malloc(BIG_FILE_SIZE);
+	for (i = 0; i < NFILES; i++) {
+		sprintf(name, "dir/file%d", i);
+		fill_data(data, file_size(i), i);
+		assert((ae = archive_entry_new()) != NULL);
+		archive_entry_set_mtime(ae, 1, 0);
+		archive_entry_copy_pathname(ae, name);
+		archive_entry_set_mode(ae, AE_IFREG | 0644);
+		archive_entry_set_size(ae, file_size(i));
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+		archive_entry_free(ae);
+		assertEqualIntA(a, file_size(i),
+		    archive_write_data(a, data, file_size(i)));
+
+		if (i == NFILES / 2) {
+			assert((ae = archive_entry_new()) != NULL);
+			archive_entry_set_mtime(ae, 1, 0);
+			archive_entry_copy_pathname(ae, "symlink");
+			archive_entry_set_mode(ae, AE_IFLNK | 0755);
+			archive_entry_copy_symlink(ae, "dir/file0");
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_write_header(a, ae));
+			archive_entry_free(ae);
+
+			assert((ae = archive_entry_new()) != NULL);
+			archive_entry_set_mtime(ae, 1, 0);
+			archive_entry_copy_pathname(ae, "empty");
+			archive_entry_set_mode(ae, AE_IFREG | 0644);
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_write_header(a, ae));
+			archive_entry_free(ae);
+		}
+	}
+	free(data);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+	return (used);
+}
+
+static void
+verify_archive(const char *buff, size_t used)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char *data, *expected;
+	char name[32];
+	int i, files = 0;
+
+	data = malloc(BIG_FILE_SIZE);
+	expected = malloc(BIG_FILE_SIZE);
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_filter_all(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_memory(a, buff, used));
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		const char *p = archive_entry_pathname(ae);
+
+		if (strcmp(p, "dir/") == 0) {
+			assertEqualInt(AE_IFDIR, archive_entry_filetype(ae));
+			continue;
+		}
+		if (strcmp(p, "symlink") == 0) {
+			assertEqualString("dir/file0",
+			    archive_entry_symlink(ae));
+			continue;
+		}
+		if (strcmp(p, "empty") == 0) {
+			assertEqualInt(0, archive_entry_size(ae));
+			continue;
+		}
+		for (i = 0; i < NFILES; i++) {
+			sprintf(name, "dir/file%d", i);
+			if (strcmp(p, name) == 0)
+				break;
+		}
+		if (!assert(i < NFILES))
+			continue;
+		files++;
+		fill_data(expected, file_size(i), i);
+		assertEqualInt(file_size(i), archive_entry_size(ae));
+		assertEqualIntA(a, file_size(i),
+		    archive_read_data(a, data, BIG_FILE_SIZE));
+		assertEqualMem(expected, data, file_size(i));
+	}
+	assertEqualInt(NFILES, files);
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	free(data);
+	free(expected);
+}
+
+static void
+test_solid(const char *compression)
+{
+	char *solid, *serial, *threaded;
+	size_t solid_used, serial_used, threaded_used;
+
+	solid = malloc(BUFF_SIZE);
+	serial = malloc(BUFF_SIZE);
+	threaded = malloc(BUFF_SIZE);
+
+	solid_used = make_archive(compression, NULL, solid);
+	if (solid_used == 0) {
+		skipping("%s writing not fully supported on this platform",
+		   compression);
+		goto cleanup;
+	}
+	verify_archive(solid, solid_used);
+
+	/*
+	 * Split into folders by size.  The last file is larger than a
+	 * block and gets a folder of its own.  Compressing the folders
+	 * on worker threads must produce the same archive.
+	 */
+	serial_used = make_archive(compression,
+	    "7zip:solid-block-size=40000", serial);
+	verify_archive(serial, serial_used);
+	if (strcmp(compression, "copy") != 0)
+		assert(serial_used != solid_used ||
+		    memcmp(serial, solid, solid_used) != 0);
+	threaded_used = make_archive(compression,
+	    "7zip:threads=4,7zip:solid-block-size=40000", threaded);
+	assertEqualInt(serial_used, threaded_used);
+	assertEqualMem(serial, threaded, serial_used);
+
+	/* Split into folders by the number of files. */
+	serial_used = make_archive(compression,
+	    "7zip:solid-block-files=3", serial);
+	verify_archive(serial, serial_used);
+	threaded_used = make_archive(compression,
+	    "7zip:threads=3,7zip:solid-block-files=3", threaded);
+	assertEqualInt(serial_used, threaded_used);
+	assertEqualMem(serial, threaded, serial_used);
+
+	/* Without a limit, threads use a default solid block size. */
+	threaded_used = make_archive(compression, "7zip:threads=2", threaded);
+	verify_archive(threaded, threaded_used);
+
+cleanup:
+	free(solid);
+	free(serial);
+	free(threaded);
+}
+
+DEFINE_TEST(test_write_format_7zip_solid)
+{
+	struct archive *a;
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_7zip(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_set_options(a, "7zip:solid-block-size=1048576"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_set_options(a, "7zip:!solid-block-size"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_set_options(a, "7zip:solid-block-files=100"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_set_options(a, "7zip:threads=0"));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_set_options(a, "7zip:!threads"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_options(a, "7zip:solid-block-size=0"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_options(a, "7zip:solid-block-files=ten"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_options(a, "7zip:threads=100000"));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+
+	test_solid("lzma1");
+	test_solid("lzma2");
+	test_solid("bzip2");
+	test_solid("deflate");
+	test_solid("ppmd");
+	test_solid("copy");
+}
@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Check that the iso9660 writer reads the contents of regular files
+ * from their source paths when the by-reference option is given.
+ */
+
+#define SIZE1	10000
+#define SIZE2	5000
+#define BOOTSIZE	(1024 * 32)
+
+static void
+make_source(const char *path, size_t size, int seed)
+{
+	char *p;
+	size_t i;
+	FILE *f;
+
+	p = malloc(size);
+	assert(p != NULL);
+	for (i = 0; i < size; i++)
+		p[i] = (char)(i * seed + (i >> 8));
+	assert((f = fopen(path, "wb")) != NULL);
+	assertEqualInt(size, fwrite(p, 1, size, f));
+	fclose(f);
+	free(p);
+}
+
+static void
+add_file(struct archive *a, const char *pathname, const char *sourcepath,
+    size_t size, const void *data, size_t datasize)
+{
+	struct archive_entry *ae;
+
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_set_mtime(ae, 1, 0);
+	archive_entry_copy_pathname(ae, pathname);
+	if (sourcepath != NULL)
+		archive_entry_copy_sourcepath(ae, sourcepath);
+	archive_entry_set_mode(ae, AE_IFREG | 0644);
+	archive_entry_set_size(ae, size);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+	if (datasize > 0)
+		assertEqualIntA(a, (int)datasize,
+		    (int)archive_write_data(a, data, datasize));
+}
+
+static void
+verify_file(struct archive *a, const char *sourcepath, size_t size)
+{
+	char *expected, *p;
+	FILE *f;
+
+	expected = malloc(size);
+	p = malloc(size + 1);
+	assert(expected != NULL && p != NULL);
+	assert((f = fopen(sourcepath, "rb")) != NULL);
+	assertEqualInt(size, fread(expected, 1, size, f));
+	fclose(f);
+	assertEqualInt((int)size, (int)archive_read_data(a, p, size + 1));
+	assertEqualMem(p, expected, size);
+	free(p);
+	free(expected);
+}
+
+static void
+test_reference(const char *boot)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	char nulls[SIZE2];
+	unsigned char *buff;
+	size_t buffsize = 2 * 1024 * 1024;
+	size_t used;
+	int seen;
+
+	buff = malloc(buffsize);
+	assert(buff != NULL);
+	memset(nulls, 0, sizeof(nulls));
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, 0, archive_write_set_format_iso9660(a));
+	assertEqualIntA(a, 0, archive_write_add_filter_none(a));
+	assertEqualIntA(a, 0,
+	    archive_write_set_format_option(a, "iso9660", "by-reference", "1"));
+	if (boot != NULL)
+		assertEqualIntA(a, 0,
+		    archive_write_set_format_option(a, "iso9660", "boot", boot));
+	assertEqualIntA(a, 0, archive_write_open_memory(a, buff, buffsize,
+	    &used));
+
+	/* Contents are not written; they come from the source path. */
+	add_file(a, "file1", "src1", SIZE1, NULL, 0);
+	/* Contents without a source path are staged as before. */
+	add_file(a, "file2", NULL, SIZE2, nulls, SIZE2);
+	/* Written data is ignored in favor of the source path. */
+	add_file(a, "file3", "src2", SIZE2, nulls, SIZE2);
+	add_file(a, "boot.img", "srcboot", BOOTSIZE, NULL, 0);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, 0, archive_read_support_format_all(a));
+	assertEqualIntA(a, 0, archive_read_support_filter_all(a));
+	assertEqualIntA(a, 0, archive_read_open_memory(a, buff, used));
+	seen = 0;
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		const char *name = archive_entry_pathname(ae);
+
+		if (strcmp(name, "file1") == 0) {
+			verify_file(a, "src1", SIZE1);
+			seen |= 1;
+		} else if (strcmp(name, "file2") == 0) {
+			char p[SIZE2 + 1];
+
+			assertEqualInt(SIZE2,
+			    (int)archive_read_data(a, p, sizeof(p)));
+			assertEqualMem(p, nulls, SIZE2);
+			seen |= 2;
+		} else if (strcmp(name, "file3") == 0) {
+			verify_file(a, "src2", SIZE2);
+			seen |= 4;
+		} else if (strcmp(name, "boot.img") == 0) {
+			verify_file(a, "srcboot", BOOTSIZE);
+			seen |= 8;
+		}
+	}
+	assertEqualInt(15, seen);
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	free(buff);
+}
+
+static void
+test_reference_missing(void)
+{
+	struct archive *a;
+	unsigned char *buff;
+	size_t buffsize = 1024 * 1024;
+	size_t used;
+
+	buff = malloc(buffsize);
+	assert(buff != NULL);
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, 0, archive_write_set_format_iso9660(a));
+	assertEqualIntA(a, 0, archive_write_add_filter_none(a));
+	assertEqualIntA(a, 0,
+	    archive_write_set_format_option(a, "iso9660", "by-reference", "1"));
+	assertEqualIntA(a, 0, archive_write_open_memory(a, buff, buffsize,
+	    &used));
+	add_file(a, "file1", "nonexistent", SIZE1, NULL, 0);
+	assertEqualIntA(a, ARCHIVE_FATAL, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+
+	/* A source file shorter than its entry size is an error. */
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, 0, archive_write_set_format_iso9660(a));
+	assertEqualIntA(a, 0, archive_write_add_filter_none(a));
+	assertEqualIntA(a, 0,
+	    archive_write_set_format_option(a, "iso9660", "by-reference", "1"));
+	assertEqualIntA(a, 0, archive_write_open_memory(a, buff, buffsize,
+	    &used));
+	add_file(a, "file1", "src2", SIZE1, NULL, 0);
+	assertEqualIntA(a, ARCHIVE_FATAL, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+	free(buff);
+}
+
+DEFINE_TEST(test_write_format_iso9660_reference)
+{
+	make_source("src1", SIZE1, 7);
+	make_source("src2", SIZE2, 13);
+	make_source("srcboot", BOOTSIZE, 3);
+
+	test_reference(NULL);
+	test_reference("boot.img");
+	test_reference_missing();
+}
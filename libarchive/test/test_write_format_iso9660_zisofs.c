@@ -820,9 +820,118 @@ test_write_format_iso9660_zisofs_3(void)
 	free(buff);
 }
 
+/*
+ * Make files which have a partial last block and all-zero blocks,
+ * and check that they are read back the same with any number of
+ * compression threads.
+ */
+static void
+make_zisofs_data(unsigned char *p, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		p[i] = "abcdefgh"[(i / 7 + i * i / 1000) % 8];
+	if (size > 4 * 32768)
+		memset(p + 2 * 32768, 0, 2 * 32768);
+}
+
+static void
+test_write_format_iso9660_zisofs_4(const char *threads)
+{
+	static const size_t sizes[] = { 1000000, 600000, 3000 };
+	struct archive *a;
+	struct archive_entry *ae;
+	unsigned char *buff, *data, *rbuff;
+	size_t buffsize = 2 * 1024 * 1024;
+	size_t datasize = 1000000;
+	size_t used, off, l;
+	char name[16];
+	unsigned int i;
+	int r, seen;
+
+	buff = malloc(buffsize);
+	data = malloc(datasize);
+	rbuff = malloc(datasize + 1);
+	assert(buff != NULL && data != NULL && rbuff != NULL);
+	make_zisofs_data(data, datasize);
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, 0, archive_write_set_format_iso9660(a));
+	assertEqualIntA(a, 0, archive_write_add_filter_none(a));
+	r = archive_write_set_option(a, NULL, "zisofs", "1");
+	if (r == ARCHIVE_FATAL) {
+		skipping("zisofs option not supported on this platform");
+		assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+		free(rbuff);
+		free(data);
+		free(buff);
+		return;
+	}
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_option(a, "iso9660", "threads", "x"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_option(a, "iso9660", "threads", "100000"));
+	assertEqualIntA(a, 0,
+	    archive_write_set_option(a, "iso9660", "threads", threads));
+	assertEqualIntA(a, 0, archive_write_open_memory(a, buff, buffsize, &used));
+
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		make_zisofs_data(data, sizes[i]);
+		assert((ae = archive_entry_new()) != NULL);
+		sprintf(name, "file%u", i);
+		archive_entry_copy_pathname(ae, name);
+		archive_entry_set_mode(ae, S_IFREG | 0644);
+		archive_entry_set_size(ae, sizes[i]);
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+		archive_entry_free(ae);
+		/* Write data in pieces which do not match zisofs blocks. */
+		for (off = 0; off < sizes[i]; off += l) {
+			l = sizes[i] - off;
+			if (l > 10000)
+				l = 10000;
+			assertEqualIntA(a, (int)l,
+			    (int)archive_write_data(a, data + off, l));
+		}
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+	/* The files have to be compressed. */
+	assert(used < 1000000);
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, 0, archive_read_support_format_all(a));
+	assertEqualIntA(a, 0, archive_read_support_filter_all(a));
+	assertEqualIntA(a, 0, archive_read_open_memory(a, buff, used));
+	seen = 0;
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		if (archive_entry_filetype(ae) != AE_IFREG)
+			continue;
+		i = atoi(archive_entry_pathname(ae) + 4);
+		assert(i < sizeof(sizes)/sizeof(sizes[0]));
+		assertEqualInt(sizes[i], archive_entry_size(ae));
+		make_zisofs_data(data, sizes[i]);
+		off = 0;
+		while ((r = (int)archive_read_data(a, rbuff + off,
+		    datasize + 1 - off)) > 0)
+			off += r;
+		assertEqualIntA(a, 0, r);
+		assertEqualInt(sizes[i], off);
+		assertEqualMem(rbuff, data, sizes[i]);
+		seen++;
+	}
+	assertEqualInt(3, seen);
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+	free(rbuff);
+	free(data);
+	free(buff);
+}
+
 DEFINE_TEST(test_write_format_iso9660_zisofs)
 {
 	test_write_format_iso9660_zisofs_1();
 	test_write_format_iso9660_zisofs_2();
 	test_write_format_iso9660_zisofs_3();
+	test_write_format_iso9660_zisofs_4("1");
+	test_write_format_iso9660_zisofs_4("4");
 }
@@ -36,7 +36,11 @@ DEFINE_TEST(test_write_format_pax)
 	size_t used;
 	int i;
 	char nulls[1024];
+	char longname[201];
 	int64_t offset, length;
+	const char *xname;
+	const void *xval;
+	size_t xsize;
 
 	buff = malloc(buffsize); /* million bytes of work area */
 	assert(buff != NULL);
@@ -98,6 +102,36 @@ DEFINE_TEST(test_write_format_pax)
 		assertEqualIntA(a, 1024, archive_write_data(a, nulls, 1024));
 	assertEqualIntA(a, 8, archive_write_data(a, "12345678", 9));
 
+	/*
+	 * "dir/ddd...ddd" has a long name and an extended attribute.
+	 */
+	strcpy(longname, "dir/");
+	memset(longname + 4, 'd', 196);
+	longname[200] = '\0';
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_set_mtime(ae, 6, 60);
+	archive_entry_copy_pathname(ae, longname);
+	archive_entry_copy_uname(ae, "user");
+	archive_entry_set_mode(ae, S_IFREG | 0644);
+	archive_entry_set_size(ae, 8);
+	archive_entry_xattr_add_entry(ae, "user.key=1", "\001\002\003\004", 4);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+	assertEqualIntA(a, 8, archive_write_data(a, "abcdefgh", 9));
+
+	/*
+	 * "file4" follows the entries above and must not pick up any of
+	 * their attributes.
+	 */
+	assert((ae = archive_entry_new()) != NULL);
+	archive_entry_set_mtime(ae, 7, 70);
+	archive_entry_copy_pathname(ae, "file4");
+	archive_entry_set_mode(ae, S_IFREG | 0600);
+	archive_entry_set_size(ae, 4);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+	archive_entry_free(ae);
+	assertEqualIntA(a, 4, archive_write_data(a, "ijkl", 4));
+
 	/*
 	 * XXX TODO XXX Archive directory, other file types.
 	 * Archive extended attributes, ACLs, other metadata.
@@ -188,6 +222,43 @@ DEFINE_TEST(test_write_format_pax)
 	assertEqualIntA(a, 8, archive_read_data(a, buff2, 10));
 	assertEqualMem(buff2, "12345678", 8);
 
+	/*
+	 * Read "dir/ddd...ddd"
+	 */
+	assertEqualIntA(a, 0, archive_read_next_header(a, &ae));
+	assertEqualString(longname, archive_entry_pathname(ae));
+	assertEqualString("user", archive_entry_uname(ae));
+	assertEqualInt(6, archive_entry_mtime(ae));
+	assertEqualInt(60, archive_entry_mtime_nsec(ae));
+	assert((S_IFREG | 0644) == archive_entry_mode(ae));
+	assertEqualInt(0, archive_entry_sparse_reset(ae));
+	assertEqualInt(1, archive_entry_xattr_reset(ae));
+	assertEqualInt(ARCHIVE_OK,
+	    archive_entry_xattr_next(ae, &xname, &xval, &xsize));
+	assertEqualString("user.key=1", xname);
+	assertEqualInt(4, xsize);
+	assertEqualMem(xval, "\001\002\003\004", 4);
+	assertEqualInt(8, archive_entry_size(ae));
+	assertEqualIntA(a, 8, archive_read_data(a, buff2, 10));
+	assertEqualMem(buff2, "abcdefgh", 8);
+
+	/*
+	 * Read "file4"
+	 */
+	assertEqualIntA(a, 0, archive_read_next_header(a, &ae));
+	assertEqualString("file4", archive_entry_pathname(ae));
+	assertEqualString("", archive_entry_uname(ae));
+	assert(!archive_entry_atime_is_set(ae));
+	assert(!archive_entry_birthtime_is_set(ae));
+	assertEqualInt(7, archive_entry_mtime(ae));
+	assertEqualInt(70, archive_entry_mtime_nsec(ae));
+	assert((S_IFREG | 0600) == archive_entry_mode(ae));
+	assertEqualInt(0, archive_entry_sparse_reset(ae));
+	assertEqualInt(0, archive_entry_xattr_reset(ae));
+	assertEqualInt(4, archive_entry_size(ae));
+	assertEqualIntA(a, 4, archive_read_data(a, buff2, 10));
+	assertEqualMem(buff2, "ijkl", 4);
+
 	/*
 	 * Verify the end of the archive.
 	 */
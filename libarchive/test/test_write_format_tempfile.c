@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+#define NFILES		5
+#define FILE_SIZE	60000
+#define BUFF_SIZE	(4 * 1024 * 1024)
+
+static void
+fill_data(char *p, int i)
+{
+	int j;
+
+	for (j = 0; j < FILE_SIZE; j++)
+		p[j] = (char)((j * (i + 3)) ^ (j >> 9));
+}
+
+/*
+ * Write NFILES files with the given format and options.  Returns
+ * the status of the first call which failed, so that failures to
+ * create a temporary file can be checked.
+ */
+static int
+write_archive(int (*set_format)(struct archive *), const char *options,
+    char *buff, size_t *used)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char data[FILE_SIZE];
+	char name[16];
+	int i, r;
+
+	assert((a = archive_write_new()) != NULL);
+	r = set_format(a);
+	if (r != ARCHIVE_OK) {
+		archive_write_free(a);
+		return (r);
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_add_filter_none(a));
+	if (options != NULL)
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_write_set_options(a, options));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_open_memory(a, buff, BUFF_SIZE, used));
+	for (i = 0; i < NFILES; i++) {
+		sprintf(name, "file%d", i);
+		fill_data(data, i);
+		assert((ae = archive_entry_new()) != NULL);
+		archive_entry_set_mtime(ae, 2, 0);
+		archive_entry_copy_pathname(ae, name);
+		archive_entry_set_mode(ae, AE_IFREG | 0644);
+		archive_entry_set_size(ae, FILE_SIZE);
+		r = archive_write_header(a, ae);
+		archive_entry_free(ae);
+		if (r != ARCHIVE_OK)
+			break;
+		if (archive_write_data(a, data, FILE_SIZE) != FILE_SIZE) {
+			r = ARCHIVE_FATAL;
+			break;
+		}
+	}
+	if (r == ARCHIVE_OK)
+		r = archive_write_close(a);
+	archive_write_free(a);
+	return (r);
+}
+
+static void
+verify_archive(const char *buff, size_t used)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	char data[FILE_SIZE + 1], expected[FILE_SIZE];
+	size_t size;
+	ssize_t bytes;
+	int i, files = 0;
+
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_all(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_filter_all(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_memory(a, buff, used));
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		if (archive_entry_filetype(ae) != AE_IFREG)
+			continue;
+		/* The entries need not come back in the order written. */
+		if (!assertEqualInt(1, sscanf(archive_entry_pathname(ae),
+		    "file%d", &i)) || !assert(i >= 0 && i < NFILES))
+			continue;
+		fill_data(expected, i);
+		size = 0;
+		while ((bytes = archive_read_data(a, data + size,
+		    sizeof(data) - size)) > 0)
+			size += bytes;
+		assertEqualInt(0, bytes);
+		assertEqualInt(FILE_SIZE, size);
+		assertEqualMem(expected, data, FILE_SIZE);
+		files++;
+	}
+	assertEqualInt(NFILES, files);
+	assertEqualInt(ARCHIVE_OK, archive_read_free(a));
+}
+
+static void
+test_format(const char *name, int (*set_format)(struct archive *),
+    const char *format_options)
+{
+	/* Data all in a file, all in memory, and moved to a file. */
+	static const char *memlimits[] = {
+		"!temp-memlimit", "temp-memlimit=10000000",
+		"temp-memlimit=1000", NULL
+	};
+	char options[256];
+	char *buff;
+	size_t used;
+	int i;
+
+	buff = malloc(BUFF_SIZE);
+	if (write_archive(set_format, NULL, buff, &used) != ARCHIVE_OK) {
+		skipping("%s writing is not supported on this platform", name);
+		free(buff);
+		return;
+	}
+	for (i = 0; memlimits[i] != NULL; i++) {
+		snprintf(options, sizeof(options), "%s%s%s", memlimits[i],
+		    (format_options != NULL)? ",": "",
+		    (format_options != NULL)? format_options: "");
+		failure("%s: %s", name, options);
+		assertEqualInt(ARCHIVE_OK,
+		    write_archive(set_format, options, buff, &used));
+		verify_archive(buff, used);
+	}
+
+	/* The temporary file goes to temp-dir. */
+	assertEqualInt(ARCHIVE_OK, write_archive(set_format,
+	    "temp-dir=tmp", buff, &used));
+	verify_archive(buff, used);
+	assertEqualInt(ARCHIVE_OK, write_archive(set_format,
+	    "temp-dir=tmp,temp-memlimit=1000", buff, &used));
+	verify_archive(buff, used);
+
+	/* A directory which does not exist is only used when the
+	 * data do not fit in memory. */
+	assertEqualInt(ARCHIVE_OK, write_archive(set_format,
+	    "temp-dir=nonexistent,temp-memlimit=10000000", buff, &used));
+	verify_archive(buff, used);
+	assert(ARCHIVE_OK != write_archive(set_format,
+	    "temp-dir=nonexistent,temp-memlimit=1000", buff, &used));
+	assert(ARCHIVE_OK != write_archive(set_format,
+	    "temp-dir=nonexistent", buff, &used));
+
+	free(buff);
+}
+
+DEFINE_TEST(test_write_format_tempfile)
+{
+	struct archive *a;
+
+	assert((a = archive_write_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_set_format_7zip(a));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_options(a, "temp-memlimit=-1"));
+	assertEqualIntA(a, ARCHIVE_FAILED,
+	    archive_write_set_options(a, "temp-memlimit=1k"));
+	assertEqualInt(ARCHIVE_OK, archive_write_free(a));
+
+	assertMakeDir("tmp", 0755);
+	test_format("7zip", archive_write_set_format_7zip, NULL);
+	test_format("7zip", archive_write_set_format_7zip,
+	    "compression=copy");
+	test_format("xar", archive_write_set_format_xar, NULL);
+	test_format("iso9660", archive_write_set_format_iso9660, NULL);
+}
@@ -0,0 +1,171 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+/*
+ * Write files of various sizes, in chunks of various sizes, and read
+ * them back.  With the threads option the files are compressed by
+ * worker threads.
+ */
+
+#define NFILES	6
+static const size_t sizes[NFILES] = {
+	0, 1, 5000, 300000, 1000000, 70000
+};
+
+static unsigned char *
+make_data(int i)
+{
+	unsigned char *p;
+	size_t n;
+
+	p = malloc(sizes[i] + 1);
+	assert(p != NULL);
+	for (n = 0; n < sizes[i]; n++) {
+		/* Odd files are hard to compress. */
+		if (i & 1)
+			p[n] = (unsigned char)rand();
+		else
+			p[n] = (unsigned char)("abcdefgh"[n % 8] + (n / 997) % 7);
+	}
+	return (p);
+}
+
+static void
+test_threads(const char *option)
+{
+	struct archive_entry *ae;
+	struct archive *a;
+	unsigned char *data[NFILES], *buff;
+	char name[16];
+	size_t n, chunk;
+	int i;
+
+	for (i = 0; i < NFILES; i++)
+		data[i] = make_data(i);
+
+	assert((a = archive_write_new()) != NULL);
+	if (archive_write_set_format_xar(a) != ARCHIVE_OK) {
+		skipping("xar is not supported on this platform");
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+		goto done;
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_add_filter_none(a));
+	if (archive_write_set_options(a, option) != ARCHIVE_OK) {
+		skipping("option `%s` is not supported on this platform",
+		    option);
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+		goto done;
+	}
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_write_open_filename(a, "test.xar"));
+	for (i = 0; i < NFILES; i++) {
+		assert((ae = archive_entry_new()) != NULL);
+		sprintf(name, "file%d", i);
+		archive_entry_copy_pathname(ae, name);
+		archive_entry_set_mode(ae, AE_IFREG | 0644);
+		archive_entry_set_size(ae, sizes[i]);
+		archive_entry_set_nlink(ae, (i == 3)? 2: 1);
+		assertEqualIntA(a, ARCHIVE_OK, archive_write_header(a, ae));
+		archive_entry_free(ae);
+		for (n = 0, chunk = 1; n < sizes[i]; n += chunk) {
+			chunk = chunk * 3 + 7;
+			if (chunk > sizes[i] - n)
+				chunk = sizes[i] - n;
+			assertEqualIntA(a, (int)chunk,
+			    (int)archive_write_data(a, data[i] + n, chunk));
+		}
+		/* A hardlink to the file and a directory in between. */
+		if (i == 3) {
+			assert((ae = archive_entry_new()) != NULL);
+			archive_entry_copy_pathname(ae, "link3");
+			archive_entry_copy_hardlink(ae, "file3");
+			archive_entry_set_mode(ae, AE_IFREG | 0644);
+			archive_entry_set_nlink(ae, 2);
+			archive_entry_set_size(ae, 0);
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_write_header(a, ae));
+			archive_entry_free(ae);
+			assert((ae = archive_entry_new()) != NULL);
+			archive_entry_copy_pathname(ae, "dir");
+			archive_entry_set_mode(ae, AE_IFDIR | 0755);
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_write_header(a, ae));
+			archive_entry_free(ae);
+		}
+	}
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_close(a));
+	assertEqualIntA(a, ARCHIVE_OK, archive_write_free(a));
+
+	/* Read the archive back. */
+	buff = malloc(sizes[4] + 1);
+	assert(buff != NULL);
+	assert((a = archive_read_new()) != NULL);
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_support_format_xar(a));
+	assertEqualIntA(a, ARCHIVE_OK,
+	    archive_read_open_filename(a, "test.xar", 10240));
+	for (i = 0; i < NFILES; i++) {
+		assertEqualIntA(a, ARCHIVE_OK,
+		    archive_read_next_header(a, &ae));
+		sprintf(name, "file%d", i);
+		assertEqualString(name, archive_entry_pathname(ae));
+		assertEqualInt(sizes[i], archive_entry_size(ae));
+		assertEqualInt((int)sizes[i],
+		    (int)archive_read_data(a, buff, sizes[4] + 1));
+		assertEqualMem(buff, data[i], sizes[i]);
+		if (i == 3) {
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_read_next_header(a, &ae));
+			assertEqualString("link3",
+			    archive_entry_pathname(ae));
+			assertEqualString("file3",
+			    archive_entry_hardlink(ae));
+			assertEqualIntA(a, ARCHIVE_OK,
+			    archive_read_next_header(a, &ae));
+			assertEqualString("dir", archive_entry_pathname(ae));
+		}
+	}
+	assertEqualIntA(a, ARCHIVE_EOF, archive_read_next_header(a, &ae));
+	assertEqualIntA(a, ARCHIVE_OK, archive_read_free(a));
+	free(buff);
+done:
+	for (i = 0; i < NFILES; i++)
+		free(data[i]);
+}
+
+DEFINE_TEST(test_write_format_xar_threads)
+{
+	test_threads("threads=1");
+	test_threads("threads=4");
+	test_threads("!compression,threads=1");
+	test_threads("!compression,threads=4");
+	test_threads("compression=bzip2,threads=4");
+	test_threads("compression=lzma,threads=4");
+	test_threads("compression=xz,threads=1");
+	test_threads("compression=xz,threads=4");
+	test_threads("!checksum,threads=4");
+	test_threads("checksum=md5,threads=4");
+}
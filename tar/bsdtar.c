@@ -371,6 +371,9 @@ main(int argc, char **argv)
 				    "Failed to add %s to inclusion list",
 				    bsdtar->argument);
 			break;
+		case OPTION_INDEX:
+			bsdtar->option_index = bsdtar->argument;
+			break;
 		case 'j': /* GNU tar */
 			if (compression != '\0')
 				lafe_errc(1, 0,
@@ -645,6 +648,9 @@ main(int argc, char **argv)
 		case 'w': /* SUSv2 */
 			bsdtar->option_interactive = 1;
 			break;
+		case OPTION_WRITE_INDEX:
+			bsdtar->option_write_index = bsdtar->argument;
+			break;
 		case 'X': /* GNU tar */
 			if (archive_match_exclude_pattern_from_file(
 			    bsdtar->matching, bsdtar->argument, 0)
@@ -709,6 +715,10 @@ main(int argc, char **argv)
 		only_mode(bsdtar, "--one-file-system", "cru");
 	if (bsdtar->option_fast_read)
 		only_mode(bsdtar, "--fast-read", "xt");
+	if (bsdtar->option_index)
+		only_mode(bsdtar, "--index", "xt");
+	if (bsdtar->option_write_index)
+		only_mode(bsdtar, "--write-index", "cxt");
 	if (bsdtar->extract_flags & ARCHIVE_EXTRACT_HFS_COMPRESSION_FORCED)
 		only_mode(bsdtar, "--hfsCompression", "x");
 	if (bsdtar->extract_flags & ARCHIVE_EXTRACT_NO_HFS_COMPRESSION)
@@ -64,6 +64,8 @@ struct bsdtar {
 	char		  option_chroot; /* --chroot */
 	char		  option_fast_read; /* --fast-read */
 	const char	 *option_options; /* --options */
+	const char	 *option_index; /* --index */
+	const char	 *option_write_index; /* --write-index */
 	char		  option_ignore_zeros; /* --ignore-zeros */
 	char		  option_interactive; /* -w */
 	char		  option_no_owner; /* -o */
@@ -130,6 +132,7 @@ enum {
 	OPTION_HFS_COMPRESSION,
 	OPTION_IGNORE_ZEROS,
 	OPTION_INCLUDE,
+	OPTION_INDEX,
 	OPTION_KEEP_NEWER_FILES,
 	OPTION_LRZIP,
 	OPTION_LZ4,
@@ -162,7 +165,8 @@ enum {
 	OPTION_UNAME,
 	OPTION_USE_COMPRESS_PROGRAM,
 	OPTION_UUENCODE,
-	OPTION_VERSION
+	OPTION_VERSION,
+	OPTION_WRITE_INDEX
 };
 
 int	bsdtar_getopt(struct bsdtar *);
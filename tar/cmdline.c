@@ -98,6 +98,7 @@ static const struct bsdtar_option {
 	{ "hfsCompression",       0, OPTION_HFS_COMPRESSION },
 	{ "ignore-zeros",         0, OPTION_IGNORE_ZEROS },
 	{ "include",              1, OPTION_INCLUDE },
+	{ "index",                1, OPTION_INDEX },
 	{ "insecure",             0, 'P' },
 	{ "interactive",          0, 'w' },
 	{ "keep-newer-files",     0, OPTION_KEEP_NEWER_FILES },
@@ -151,6 +152,7 @@ static const struct bsdtar_option {
 	{ "uuencode",             0, OPTION_UUENCODE },
 	{ "verbose",              0, 'v' },
 	{ "version",              0, OPTION_VERSION },
+	{ "write-index",          1, OPTION_WRITE_INDEX },
 	{ "xz",                   0, 'J' },
 	{ NULL, 0, 0 }
 };
@@ -84,7 +84,10 @@ struct progress_data {
 	struct archive_entry *entry;
 };
 
+static char	**index_names(struct bsdtar *);
+static int	name_unmatched(struct bsdtar *, const char *);
 static void	read_archive(struct bsdtar *bsdtar, char mode, struct archive *);
+static int	seek_entry(struct archive *, const char *);
 static int unmatched_inclusions_warn(struct archive *matching, const char *);
 
 
@@ -153,6 +156,74 @@ progress_func(void *cookie)
 	}
 }
 
+/*
+ * With --index, return the operands to look up in the index, or NULL
+ * if the whole archive must be read to match them: wildcards and
+ * names read with -T cannot be looked up.
+ */
+static char **
+index_names(struct bsdtar *bsdtar)
+{
+	char **p;
+
+	if (bsdtar->option_index == NULL || bsdtar->names_from_file != NULL ||
+	    *bsdtar->argv == NULL)
+		return (NULL);
+	for (p = bsdtar->argv; *p != NULL; p++)
+		if (strpbrk(*p, "*?[\\") != NULL)
+			return (NULL);
+	return (bsdtar->argv);
+}
+
+/*
+ * Return true if no entry has matched the operand name so far.
+ */
+static int
+name_unmatched(struct bsdtar *bsdtar, const char *name)
+{
+	const char *p;
+	int found = 0, r;
+
+	/* Walk the whole list so the next walk starts over. */
+	while ((r = archive_match_path_unmatched_inclusions_next(
+	    bsdtar->matching, &p)) == ARCHIVE_OK)
+		if (strcmp(p, name) == 0)
+			found = 1;
+	if (r == ARCHIVE_FATAL)
+		lafe_errc(1, errno, "Out of memory");
+	return (found);
+}
+
+/*
+ * Position the archive at the named entry.  Returns -1 if the index
+ * has no such entry; that is reported with the other unmatched names.
+ */
+static int
+seek_entry(struct archive *a, const char *name)
+{
+	char *dir;
+	size_t len;
+	int r;
+
+	r = archive_read_seek_entry(a, name);
+	len = strlen(name);
+	if (r == ARCHIVE_FAILED && archive_errno(a) == ENOENT &&
+	    len > 0 && name[len - 1] != '/') {
+		/* Directories are stored with a trailing slash. */
+		if ((dir = malloc(len + 2)) == NULL)
+			lafe_errc(1, errno, "Out of memory");
+		memcpy(dir, name, len);
+		strcpy(dir + len, "/");
+		r = archive_read_seek_entry(a, dir);
+		free(dir);
+	}
+	if (r == ARCHIVE_FAILED && archive_errno(a) == ENOENT)
+		return (-1);
+	if (r != ARCHIVE_OK)
+		lafe_errc(1, 0, "%s", archive_error_string(a));
+	return (0);
+}
+
 /*
  * Handle 'x' and 't' modes.
  */
@@ -164,8 +235,12 @@ read_archive(struct bsdtar *bsdtar, char mode, struct archive *writer)
 	struct archive		 *a;
 	struct archive_entry	 *entry;
 	const char		 *reader_options;
+	char			**names;	/* Left to look up with --index */
+	int			  following;	/* 1: one entry, 2: to the end */
 	int			  r;
 
+	names = index_names(bsdtar);
+	following = 0;
 	while (*bsdtar->argv) {
 		if (archive_match_include_pattern(bsdtar->matching,
 		    *bsdtar->argv) != ARCHIVE_OK)
@@ -213,6 +288,14 @@ read_archive(struct bsdtar *bsdtar, char mode, struct archive *writer)
 		if (archive_read_set_options(a,
 		    "read_concatenated_archives") != ARCHIVE_OK)
 			lafe_errc(1, 0, "%s", archive_error_string(a));
+	if (bsdtar->option_index != NULL)
+		if (archive_read_set_format_option(a, "tar", "index",
+		    bsdtar->option_index) != ARCHIVE_OK)
+			lafe_errc(1, 0, "%s", archive_error_string(a));
+	if (bsdtar->option_write_index != NULL)
+		if (archive_read_set_format_option(a, "tar", "write_index",
+		    bsdtar->option_write_index) != ARCHIVE_OK)
+			lafe_errc(1, 0, "%s", archive_error_string(a));
 	if (bsdtar->passphrase != NULL)
 		r = archive_read_add_passphrase(a, bsdtar->passphrase);
 	else
@@ -258,10 +341,33 @@ read_archive(struct bsdtar *bsdtar, char mode, struct archive *writer)
 		    archive_match_path_unmatched_inclusions(bsdtar->matching) == 0)
 			break;
 
+		/*
+		 * With --index, seek to each named entry in turn.  The
+		 * contents of a directory may be stored anywhere after
+		 * it, so once a directory is found, read on to the end.
+		 * Names matched along the way are not looked up again.
+		 */
+		if (names != NULL && !following) {
+			if (*names == NULL)
+				break;
+			if (!name_unmatched(bsdtar, *names) ||
+			    seek_entry(a, *names) != 0) {
+				names++;
+				continue;
+			}
+			names++;
+			following = 1;
+		}
+
 		r = archive_read_next_header(a, &entry);
 		progress_data.entry = entry;
-		if (r == ARCHIVE_EOF)
+		if (r == ARCHIVE_EOF) {
+			if (names != NULL) {
+				following = 0;
+				continue;
+			}
 			break;
+		}
 		if (r < ARCHIVE_OK)
 			lafe_warnc(0, "%s", archive_error_string(a));
 		if (r <= ARCHIVE_WARN)
@@ -302,8 +408,14 @@ read_archive(struct bsdtar *bsdtar, char mode, struct archive *writer)
 		 * rewrite, there would be no way to exclude foo1/bar
 		 * while allowing foo2/bar.)
 		 */
-		if (archive_match_excluded(bsdtar->matching, entry))
+		if (archive_match_excluded(bsdtar->matching, entry)) {
+			if (following == 1)
+				following = 0;
 			continue; /* Excluded by a pattern test. */
+		}
+		if (following == 1)
+			following =
+			    archive_entry_filetype(entry) == AE_IFDIR ? 2 : 0;
 
 		if (mode == 't') {
 			/* Perversely, gtar uses -O to mean "send to stderr"
@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2016 The libarchive Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "test.h"
+__FBSDID("$FreeBSD$");
+
+DEFINE_TEST(test_option_index)
+{
+	assertMakeDir("d1", 0755);
+	assertMakeFile("d1/file1", 0644, "d1/file1");
+	assertMakeFile("f2", 0644, "f2");
+	assertMakeDir("d3", 0755);
+	assertMakeDir("d3/sub", 0755);
+	assertMakeFile("d3/sub/file3", 0644, "d3/sub/file3");
+
+	/* The index written while creating the archive is the same
+	 * as the one written while listing it. */
+	assertEqualInt(0,
+	    systemf("%s -cf archive.tar --write-index c.idx d1 f2 d3 "
+		">c.out 2>c.err", testprog));
+	assertEmptyFile("c.out");
+	assertEmptyFile("c.err");
+	assertEqualInt(0,
+	    systemf("%s -tf archive.tar --write-index t.idx >t.out 2>t.err",
+		testprog));
+	assertEmptyFile("t.err");
+	assertEqualFile("c.idx", "t.idx");
+
+	/* Look entries up; a directory brings its contents along. */
+	assertEqualInt(0,
+	    systemf("%s -tf archive.tar --index c.idx f2 d3 d1/file1 "
+		">t2.out 2>t2.err", testprog));
+	assertEmptyFile("t2.err");
+	assertTextFileContents("f2\nd3/\nd3/sub/\nd3/sub/file3\nd1/file1\n",
+	    "t2.out");
+
+	assertMakeDir("x", 0755);
+	assertEqualInt(0,
+	    systemf("%s -xf archive.tar --index c.idx -C x d1/file1 "
+		">x.out 2>x.err", testprog));
+	assertEmptyFile("x.out");
+	assertEmptyFile("x.err");
+	assertFileContents("d1/file1", 8, "x/d1/file1");
+	assertFileNotExists("x/f2");
+
+	/* Names that are not in the index are reported. */
+	assert(0 != systemf("%s -tf archive.tar --index c.idx nothere "
+		">t3.out 2>t3.err", testprog));
+	assertEmptyFile("t3.out");
+	assertNonEmptyFile("t3.err");
+
+	/* Only the tar formats can write an index. */
+	assert(0 != systemf("%s -cf a.zip --format zip --write-index z.idx f2 "
+	    ">z.out 2>z.err", testprog));
+	assertNonEmptyFile("z.err");
+
+	/* --index is only for reading. */
+	assert(0 != systemf("%s -cf a2.tar --index c.idx f2 >c2.out 2>c2.err",
+	    testprog));
+	assertNonEmptyFile("c2.err");
+}
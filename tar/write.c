@@ -166,6 +166,10 @@ set_writer_options(struct bsdtar *bsdtar, struct archive *a)
 	}
 	if (ARCHIVE_OK != archive_write_set_options(a, bsdtar->option_options))
 		lafe_errc(1, 0, "%s", archive_error_string(a));
+	if (bsdtar->option_write_index != NULL)
+		if (archive_write_set_format_option(a, NULL, "index",
+		    bsdtar->option_write_index) != ARCHIVE_OK)
+			lafe_errc(1, 0, "%s", archive_error_string(a));
 }
 
 static void